@@ -19,18 +19,28 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "./utils.h"
 
 #define N 1000
 #define MEGEXTRA 1000000
+#define IO_BUF_SIZE 4096
+#define CRC_BLOCK 4096  // bytes of a file covered by one checksum
+#define CODEC_THRESHOLD 256  // default size from which a compressing session compresses a response
+#define LINK_BUF_SIZE 65536
+#define PROXY_POOL 16  // idle connections kept per replica for proxied reads
 
 extern int lockfile;  // server's log file (to be locked)
 
 extern int DEBUG_MODE;
 extern int DELAY_MODE;
 extern int VERBOSE_MODE;
+extern int AFFINITY_MODE;  // 0 = none, 1 = pin to cpus, 2 = pin to numa nodes
 
 extern int ssock;  // shell master socket
 extern int fsock;  // file master socket
@@ -39,6 +49,9 @@ extern int fsock_tmp;  // store fsock's old value when it's temporarily down for
 extern char* s_port;  // shell port number
 extern char* f_port;  // file port number
 
+extern int s_timeout;  // idle timeout of the admin session in milliseconds
+extern int f_timeout;  // idle timeout of a file session in milliseconds
+
 extern char* peers[64];  // an array of [host:port] pairs for the replication servers
 
 extern pthread_attr_t attr;
@@ -51,6 +64,19 @@ struct thread_t {
     int idle;  // 1 = idle, 0 = busy
 };
 
+struct group_t {              // an acceptor/worker group bound to a cpu or numa node
+    int sock;                 // group's own listener (SO_REUSEPORT), steered by incoming cpu
+    int cpu;                  // home cpu, the one that receives packets for this group
+    int node;                 // numa node of the home cpu
+    cpu_set_t mask;           // cpus the group's threads are pinned to
+    pthread_mutex_t g_mtx;    // per-group wake mutex, serializes accept within the group
+};
+
+extern int n_groups;
+extern struct group_t* groups;  // NULL unless AFFINITY_MODE is set
+
+extern __thread char* io_buf;  // per-thread i/o buffer, node-local when pinned
+
 extern int thread_pool_size;
 extern struct thread_t* thread_pool;  // pointer to global thread pool
 
@@ -63,12 +89,117 @@ struct monitor_t {  // for dynamic threads management based on network traffic
     pthread_cond_t m_cond;
 } extern monitor;
 
+struct pending_t {          // a client waiting for a free thread
+    int sock;               // client socket
+    int resumed;            // 1 if the session was handed over mid-way by an upgrading process
+};
+
+struct admit_t {            // for admission control and load shedding when the pool is saturated
+    struct pending_t* queue;  // bounded queue of clients accepted while every thread was busy
+    int q_head;             // index of the oldest pending client
+    int q_len;              // number of pending clients
+    int q_max;              // queue capacity, clients beyond it are shed
+    int w_act;              // cost of the requests currently in progress
+    int w_max;              // cost budget, requests beyond it are shed (0 = unlimited)
+    long shed_conn;         // number of connections turned away
+    long shed_req;          // number of requests turned away
+    pthread_mutex_t a_mtx;
+} extern admit;
+
+extern int pending_fd;  // eventfd signalling a client in admit.queue
+extern int halt_fd;     // eventfd telling idle threads to quit, readable until the server is reset
+
+extern int upgrade_fd;  // unix socket to the other process during a binary upgrade, -1 otherwise
+extern int upgrading;   // 0 = no, 1 = listeners handed over, 2 = idle sessions are handed over as well
+extern char exe_path[4096];  // absolute path of our binary, re-executed on upgrade
+extern char** saved_argv;    // our command line, passed on to the new binary
+
+#define PEER_DOWN 0       // not connected, the shipper keeps retrying
+#define PEER_STREAMING 1  // connected, records are shipped as they are appended
+#define PEER_STALE 2      // fell behind the replication log, needs a full resync
+#define PEER_SYNCING 3    // being resynced file by file, streams again once it is done
+
+struct record_t {           // one effect of a write request in the replication log
+    long seq;               // position in the log, starts at 1
+    char op;                // O(pen) / W(rite) / S(eek) / C(lose) / T(runcate) / A(llocate) / (cop)Y
+    off_t offset;           // where the data was written, or the new seek position
+    int len;                // length of data
+    char* data;             // bytes written, NULL if none
+    char name[256];         // file name (path)
+    struct timespec t;      // when it was appended, for lag metrics
+};
+
+struct rlog_t {             // in-memory replication log, a ring of the latest r_max records
+    struct record_t* ring;
+    int r_max;              // ring capacity
+    long head;              // oldest record still in the ring
+    long next;              // sequence number of the next record (on a replica: 1 + last record applied)
+    int r_batch;            // max records per batch
+    int r_wait;             // milliseconds a writer waits for a slow peer before cutting it loose
+    int r_sync;             // files resynced in parallel to a stale peer
+    int r_rate;             // resync bandwidth cap in KB/s per node, 0 if unlimited
+    pthread_mutex_t r_mtx;
+    pthread_cond_t r_cond;  // signalled when peers acknowledge records
+} extern rlog;
+
+struct peer_t {             // a replica we ship the log to
+    char* host;
+    char* port;
+    int sock;               // persistent connection, -1 when down
+    int state;              // PEER_DOWN / PEER_STREAMING / PEER_STALE / PEER_SYNCING
+    int efd;                // eventfd signalled when records are appended
+    long sent;              // last record sent
+    long acked;             // last record the peer confirmed it applied
+    long batches;           // batches shipped
+    long bytes;             // bytes shipped
+    int load;               // busy threads on the peer, as it last reported
+    int proxied;            // reads we are currently proxying to it
+    int n_pool;             // idle connections in pool
+    struct link_t* pool[PROXY_POOL];
+    struct timespec sent_t; // when we last sent something
+    struct timespec acked_t;// when the peer last acknowledged something
+};
+
+struct link_t {             // a buffered reader on a connection between two nodes
+    int sock;
+    int halt;               // an eventfd that aborts a blocked read when it becomes readable, -1 if none
+    int pos;
+    int len;
+    int broken;             // 1 once a reply could not be read to its end, the link is out of step and not to be reused
+    char buf[LINK_BUF_SIZE];
+};
+
+extern int REPLICA_MODE;  // 1 if this node applies the log of a primary and refuses writes
+extern int RAFT_MODE;     // 1 if this node and its -p peers replicate writes through raft
+extern int ROUTER_MODE;   // 1 if this node routes file commands over its -p shards and keeps no files
+extern int CHECKSUM_MODE; // 1 if every block of a file has a crc32c, verified when it is read
+extern int DEDUP_MODE;    // 1 if closed files are stored as lists of shared chunks
+extern int LOG_MODE;      // 1 if file data is appended to the segments of the log-structured store
+extern int KV_MAX;        // memory budget of the key-value store in MB
+extern int KV_PERSIST;    // 1 if key-value changes are logged to the run directory and replayed at startup
+extern int READAHEAD;     // largest window in KB hinted ahead of a sequential reader, 0 for no hints
+extern int PREFETCH;      // largest window in KB a sequential session reads into memory between requests, 0 for none
+extern int TRACE;         // trace one request in TRACE, 0 for none
+extern char* raft_self;   // our own host:port as the other members know us
+extern int n_peers;
+extern struct peer_t* replicas;  // one entry per -p peer, on the primary only
+
 struct echo_t {     // for server response
     char* status;   // OK / FAIL / ERR
     int code;       // server side error code
     char* message;  // client-friendly message
 };
 
+struct codec_t {            // wire compression of a file session, negotiated with COMPRESS
+    int on;
+    int threshold;          // responses shorter than this go out as they are
+    long raw_out;           // response bytes before compression
+    long wire_out;          // and on the wire
+    long raw_in;            // request bytes after decompression
+    long wire_in;           // and on the wire
+    long cpu_ns;            // thread cpu time spent compressing and decompressing
+};
+
 struct lock_t {               // for CREW file access control
     pthread_mutex_t f_mtx;    // file access mutex
     pthread_cond_t f_cond;    // file access condition variable
@@ -76,6 +207,66 @@ struct lock_t {               // for CREW file access control
     int fd;                   // file descriptor (identifier)
     unsigned short n_reader;  // number of readers
     unsigned short n_writer;  // number of writers, 0 or 1, at most 1
+    int crc_fd;               // per-block checksums of the file, -1 if we keep none
+    struct recipe_t* recipe;  // chunk list of a frozen file, NULL if the data is in the file itself
+    int dirty;                // written since it was opened, so it is frozen again when it is closed
+    struct lfile_t* lfile;    // the file in the log-structured store, NULL if it is an OS file
+    long gen;                 // renewed by every change to the data, a window prefetched before one is stale
+    struct heat_t* heat;      // how often the file is taken and waited for, NULL if it is not followed
+};
+
+#define SESSION_IDLE 0        // waiting for a request
+#define SESSION_RUNNING 1     // serving one
+#define SESSION_WAIT_READ 2   // waiting for a reader's share of a file
+#define SESSION_WAIT_WRITE 3  // waiting for a file to itself
+
+#define RA_RANDOM 0
+#define RA_SEQUENTIAL 1   // each read starts where the previous one ended
+#define RA_STRIDED 2      // each read starts as far from the previous one as that from the one before
+
+struct readahead_t {        // access pattern of a file session, over the file it last read
+    struct lock_t* lock;
+    int fd;
+    int pattern;
+    int run;                // consecutive reads of that pattern
+    off_t last;             // where the last read started
+    off_t next;             // and ended
+    off_t stride;
+    off_t window;           // hinted ahead of a sequential run, doubled up to READAHEAD
+    off_t hinted;           // hinted up to here
+    int len;                // length of the last read
+    int want;               // 1 if the next window should be prefetched once the reply is out
+    char* buf;              // the prefetched window
+    int w_size;             // its capacity
+    off_t w_off;
+    int w_len;
+    int w_used;             // bytes read from it
+    int w_eof;              // 1 if it ends at the end of the file
+    long w_gen;             // gen of the file when it was read
+};
+
+struct store_t {              // a storage backend, where the data of the open files lives
+    char* name;
+    int (*open)(const char* name, int create, struct lock_t* lock);  // fills in its part of lock, returns the identifier, EBUSY if held
+    ssize_t (*pread)(struct lock_t* lock, char* buf, size_t len, off_t offset);
+    ssize_t (*pwrite)(struct lock_t* lock, const char* buf, size_t len, off_t offset);
+    int (*stat)(struct lock_t* lock, struct stat* st);
+    int (*truncate)(struct lock_t* lock, off_t length);
+    int (*allocate)(struct lock_t* lock, off_t offset, off_t len);
+    int (*close)(struct lock_t* lock);
+    ssize_t (*read_name)(const char* name, char* buf, size_t len, off_t offset);  // a file that is not open
+};
+
+extern struct store_t file_store;  // one OS file per name
+extern struct store_t log_store;   // segments, see lstore.c
+extern struct store_t* store;      // the one in use
+
+struct timer_node_t {               // an idle deadline tracked by the timer wheel
+    struct timer_node_t* prev;
+    struct timer_node_t* next;
+    unsigned long expires;          // absolute wheel tick of expiry
+    int sock;                       // session socket, its read side is shut down on expiry
+    int expired;                    // set by the wheel, checked by the session
 };
 
 extern struct lock_t locks[65535];  // each file is associated with a unique lock entry
@@ -91,12 +282,324 @@ int reset_server(void);
 
 void serve_admin(int asock);
 
+int serve_client(int csock, int resumed);
+
+int upgrade_server(int with_sessions);
+
+int inherit_listeners(void);
+
+int resume_upgrade(void);
+
+int handoff_session(int csock, int resumed);
+
 void reset_lock(int lock_id);
 
 void* file_thread(void* fsock);
 
+int init_groups(const int* socks, int n_socks);
+
+int bind_group(int id);
+
+int group_sock(int id);
+
+pthread_mutex_t* group_mutex(int id);
+
+void* group_alloc(int id, size_t size);
+
+void group_free(void* buf, size_t size);
+
 void* signal_thread(void* set);
 
 void* monitor_thread(void* omitted);
 
+int init_admission(void);
+
+int enqueue_client(int csock, int resumed);
+
+int dequeue_client(int* resumed);
+
+int admit_request(const char* cmd);
+
+void release_request(const char* cmd);
+
+void shed_request(struct echo_t* echo);
+
+void* admit_thread(void* omitted);
+
+int set_params(int argc, char** argv, int startup, struct echo_t* echo);
+
+int show_params(char* buf, size_t size);
+
+int load_config(const char* path);
+
+int init_replication(void);
+
+void replicate(char op, const char* name, off_t offset, const char* data, int len);
+
+int serve_replica(int csock, int argc, char** argv);
+
+int show_peers(char* buf, size_t size);
+
+int check_stale(int bound, struct echo_t* echo);
+
+int read_replica(const char* name, off_t offset, int len, int bound, char* buf);
+
+int serve_pread(int csock, int argc, char** argv, struct echo_t* echo);
+
+int force_resync(void);
+
+long resync_peer(struct peer_t* peer, long epoch);
+
+int serve_resync(int csock, int argc, char** argv);
+
+int list_files(char*** files);
+
+int push_file(const char* host, const char* port, const char* name);
+
+int init_raft(void);
+
+int serve_raft(int csock, int argc, char** argv);
+
+int raft_redirect(struct echo_t* echo);
+
+int raft_commit(char op, const char* name, off_t offset, const char* data, int len);
+
+int raft_read(void);
+
+int show_raft(char* buf, size_t size);
+
+struct link_t* link_open(const char* host, const char* port, int timeout);
+
+void link_close(struct link_t* link);
+
+char* link_request(struct link_t* link, const char* req, char* line, int size);
+
+int from_peer(int csock);
+
+int multi_reader(int argc, char** argv, struct echo_t* echo);
+
+int vector_reader(int argc, char** argv, struct echo_t* echo, int lock_id);
+
+int vector_writer(int argc, char** argv, struct echo_t* echo, int lock_id);
+
+int streamer(int argc, char** argv, struct echo_t* echo, int lock_id, int csock, int with_sums);
+
+int copy_contents(int in, int out);
+
+int copier(int argc, char** argv, struct echo_t* echo, int lock_id);
+
+int appender(int argc, char** argv, struct echo_t* echo, int lock_id);
+
+int truncater(int argc, char** argv, struct echo_t* echo, int lock_id);
+
+int allocator(int argc, char** argv, struct echo_t* echo, int lock_id);
+
+int stater(int argc, char** argv, struct echo_t* echo, int lock_id);
+
+void init_checksum(void);
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+int crc_open(const char* name, int fd);
+
+void crc_close(int cfd, int fd);
+
+void crc_remove(const char* name);
+
+int crc_update(int cfd, int fd, off_t offset, off_t len);
+
+ssize_t crc_pread(int cfd, int fd, char* buf, size_t len, off_t offset);
+
+int crc_verify(int cfd, int fd, off_t offset, size_t len);
+
+int set_checksum(int argc, char** argv, struct echo_t* echo, int* on);
+
+int bench_checksum(int mb, char* out, int size);
+
+int init_dedup(void);
+
+struct recipe_t* load_recipe(int fd);
+
+void free_recipe(struct recipe_t* r);
+
+off_t recipe_size(struct recipe_t* r);
+
+ssize_t recipe_pread(struct recipe_t* r, char* buf, size_t len, off_t offset);
+
+int recipe_copy(struct recipe_t* r, int out);
+
+int thaw_file(const char* name, int fd, struct recipe_t* r, int ofd_lock);
+
+int thaw_lock(struct lock_t* lock);
+
+ssize_t lock_pread(struct lock_t* lock, char* buf, size_t len, off_t offset);
+
+ssize_t read_contents(const char* name, char* buf, size_t len, off_t offset);
+
+int open_contents(const char* name);
+
+int freeze_file(const char* name, int fd);
+
+int sweep_chunks(void);
+
+int show_dedup(char* buf, size_t size);
+
+int init_lstore(void);
+
+int compact_segments(void);
+
+int show_lstore(char* buf, size_t size);
+
+int init_kv(void);
+
+int kv_get(int argc, char** argv, struct echo_t* echo);
+
+int kv_put(int argc, char** argv, struct echo_t* echo);
+
+int kv_del(int argc, char** argv, struct echo_t* echo);
+
+int show_kv(char* buf, size_t size);
+
+pid_t dump_kv(const char* dir, long* keys);
+
+void hold_chunks(int hold);
+
+long link_chunks(const char* dir);
+
+int snap_segments(const char* dir, int* in, int* out, off_t* len);
+
+int snap_link(const char* from, const char* to);
+
+void snap_enter(const char* name);
+
+void snap_leave(void);
+
+int take_snapshot(int asock, const char* name);
+
+int run_job(int asock, char** argv, int background, struct echo_t* echo);
+
+int print_job(int asock, int id, struct echo_t* echo);
+
+int show_jobs(char* buf, size_t size);
+
+int kill_job(int id);
+
+void each_lfile(void (*fn)(const char* name));
+
+int init_names(void);
+
+int normal_name(char* name);
+
+void name_added(const char* name);
+
+void name_removed(const char* name);
+
+void name_opened(const char* name, int lock_id);
+
+int name_lock(const char* name);
+
+int list_names(const char* prefix, const char* after, int max, char* out, int size);
+
+int lister(int argc, char** argv, struct echo_t* echo);
+
+void touch_lock(struct lock_t* lock);
+
+void touch_name(const char* name);
+
+int read_ahead(struct readahead_t* ra, struct lock_t* lock, char* buf, int len, off_t offset);
+
+void prefetch_window(struct readahead_t* ra);
+
+void end_readahead(struct readahead_t* ra);
+
+int show_readahead(char* buf, size_t size);
+
+void join_session(int csock);
+
+void leave_session(void);
+
+void session_begin(const char* cmd, int lock_id, int n_bytes);
+
+void session_end(int n_bytes, int n_opened);
+
+void session_sent(long n_bytes);
+
+void wait_file(struct lock_t* lock, int writer);
+
+int valid_column(const char* column);
+
+char* show_sessions(const char* column, int* len);
+
+int kill_session(long id);
+
+void open_heat(struct lock_t* lock, const char* name);
+
+void close_heat(struct lock_t* lock);
+
+void heat_waited(struct lock_t* lock, int writer, long since);
+
+void take_file(struct lock_t* lock, int writer);
+
+void drop_file(struct lock_t* lock, int writer);
+
+char* show_heat(int n, int* len);
+
+long trace_now(void);
+
+long trace_begin(void);
+
+long trace_clock(void);
+
+void trace_event(const char* name, const char* arg, long since);
+
+void trace_span(const char* name, long since, long until);
+
+void trace_io(const char* name, long n, long since);
+
+void trace_end(const char* cmd, const char* arg, long since);
+
+long dump_trace(const char* name);
+
+int lz_compress(const char* in, int n, char* out, int cap);
+
+int lz_decompress(const char* in, int n, char* out, int cap);
+
+int set_codec(int argc, char** argv, struct echo_t* echo, struct codec_t* codec);
+
+int inflate_request(int csock, char* req, int size, int n_bytes, struct codec_t* codec);
+
+int send_response(int csock, const char* res, int* len, struct codec_t* codec);
+
+int init_router(void);
+
+int route_request(int argc, char** argv, struct echo_t* echo);
+
+int route_mget(int argc, char** argv, struct echo_t* echo);
+
+int route_key(int argc, char** argv, struct echo_t* echo);
+
+int route_list(int argc, char** argv, struct echo_t* echo);
+
+int add_shard(const char* addr, struct echo_t* echo);
+
+int show_shards(char* buf, size_t size);
+
+int serve_names(int argc, char** argv, struct echo_t* echo);
+
+int serve_migrate(int argc, char** argv, struct echo_t* echo);
+
+int link_line(struct link_t* link, char* line, int size);
+
+int link_bytes(struct link_t* link, char* data, int len);
+
+int apply_record(char op, const char* name, off_t offset, const char* data, int len);
+
+void init_wheel(void);
+
+void* timer_thread(void* omitted);
+
+void arm_timer(struct timer_node_t* t, int sock, int timeout);
+
+int disarm_timer(struct timer_node_t* t);
+
 #endif
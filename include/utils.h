@@ -53,6 +53,15 @@ char* convertPort(unsigned short port);
 // extract sin_addr from struct sockaddr, works for both IPv4 and IPv6
 void* extractAddr(struct sockaddr* sa);
 
+/*
+** check whether the other end of a connected socket is one of the addresses of a host
+**
+** @param:    a connected socket descriptor, a host name or address
+** @return:   1 if it is, 0 if not or if either cannot be resolved
+** @remark:   only addresses are compared, the remote port is whatever the other end was given
+*/
+int socketFrom(int sock, const char* host);
+
 /*
 ** open a connection to a host on the specified port
 **
@@ -78,6 +87,14 @@ int socketConnect(const char* host, const char* port);
 */
 int setListener(const char* host, const char* port, int backlog);
 
+/*
+** same as setListener(), but sets SO_REUSEPORT so that several listeners can bind the same port
+**
+** @return:   a listener socket descriptor or err_code
+** @remark:   the kernel load balances incoming connections among all listeners of the port
+*/
+int setSharedListener(const char* host, const char* port, int backlog);
+
 /*
 ** send string pointed by buf to the file descriptor fd, to a maximum bytes of len
 **
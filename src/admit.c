@@ -0,0 +1,150 @@
+/*
+** admit.c -- admission control and load shedding when the thread pool is saturated
+*/
+
+#include "define.h"
+#include <sys/eventfd.h>
+
+int pending_fd = -1;  // eventfd counting the clients in admit.queue, polled by idle file threads
+
+// relative cost of each command, a write keeps the disk (and the file's writer lock) much longer than a read
+static int command_cost(const char* cmd) {
+    if (strcasecmp(cmd, "FWRITE") == 0 || strcasecmp(cmd, "FWRITEV") == 0 || strcasecmp(cmd, "FAPPEND") == 0 || strcasecmp(cmd, "FCOPY") == 0) return 4;
+    if (strcasecmp(cmd, "FREAD") == 0 || strcasecmp(cmd, "PREAD") == 0 || strcasecmp(cmd, "FREADV") == 0 || strcasecmp(cmd, "MGET") == 0 ||
+        strcasecmp(cmd, "FLIST") == 0 || strcasecmp(cmd, "FSTREAM") == 0) return 2;
+    return 1;
+}
+
+static int retry_after(void) {
+    // a rough guess: every pending client ahead in the queue holds a thread for about one request
+    return 1 + admit.q_len / (monitor.t_max > 0 ? monitor.t_max : 1);
+}
+
+// tell a client we cannot serve it now, so it can go to another node instead of hanging in the backlog
+static void shed_client(int csock) {
+    char res[128];
+    memset(res, 0, sizeof(res));
+    sprintf(res, "FAIL %d server busy, retry after %d seconds\n", -EAGAIN, retry_after());
+    int len = strlen(res);
+    sendAll(csock, res, &len);
+    shutdown(csock, SHUT_WR);
+    close(csock);
+}
+
+int init_admission(void) {
+    admit.queue = (struct pending_t*)malloc(sizeof(struct pending_t) * (admit.q_max > 0 ? admit.q_max : 1));
+    admit.q_len = admit.q_head = 0;
+    pthread_mutex_init(&admit.a_mtx, NULL);
+    pending_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (admit.queue == NULL || pending_fd == -1) {
+        return -1;
+    }
+
+    // listeners become non-blocking, file threads and the admission thread poll them before accept()
+    for (int g = 0; g < (groups == NULL ? 1 : n_groups); g++) {
+        int sock = group_sock(g);
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    }
+    return 0;
+}
+
+int enqueue_client(int csock, int resumed) {
+    pthread_mutex_lock(&admit.a_mtx);
+    if (admit.q_len >= admit.q_max) {
+        pthread_mutex_unlock(&admit.a_mtx);
+        return -1;
+    }
+    admit.queue[(admit.q_head + admit.q_len) % admit.q_max].sock = csock;
+    admit.queue[(admit.q_head + admit.q_len) % admit.q_max].resumed = resumed;
+    admit.q_len++;
+    pthread_mutex_unlock(&admit.a_mtx);
+
+    eventfd_write(pending_fd, 1);  // wake up the next file thread that becomes idle
+    return 0;
+}
+
+int dequeue_client(int* resumed) {
+    eventfd_t one;
+    if (eventfd_read(pending_fd, &one) == -1) {
+        return -1;  // someone else got it first
+    }
+
+    pthread_mutex_lock(&admit.a_mtx);
+    int csock = admit.queue[admit.q_head].sock;
+    *resumed = admit.queue[admit.q_head].resumed;
+    admit.q_head = (admit.q_head + 1) % admit.q_max;
+    admit.q_len--;
+    pthread_mutex_unlock(&admit.a_mtx);
+    return csock;
+}
+
+int admit_request(const char* cmd) {
+    int cost = command_cost(cmd);
+    pthread_mutex_lock(&admit.a_mtx);
+    if (admit.w_max > 0 && admit.w_act + cost > admit.w_max) {
+        admit.shed_req++;
+        pthread_mutex_unlock(&admit.a_mtx);
+        return -1;
+    }
+    admit.w_act += cost;
+    pthread_mutex_unlock(&admit.a_mtx);
+    return 0;
+}
+
+void release_request(const char* cmd) {
+    pthread_mutex_lock(&admit.a_mtx);
+    admit.w_act -= command_cost(cmd);
+    pthread_mutex_unlock(&admit.a_mtx);
+}
+
+void shed_request(struct echo_t* echo) {
+    static __thread char message[64];
+    memset(message, 0, sizeof(message));
+    sprintf(message, "server busy, retry after %d seconds", retry_after());
+    echo->status = "FAIL";
+    echo->code = -EAGAIN;
+    echo->message = message;
+}
+
+void* admit_thread(void* omitted) {
+    int n_socks = groups == NULL ? 1 : n_groups;
+    struct pollfd pfds[n_socks];
+    for (int g = 0; g < n_socks; g++) {
+        pfds[g].fd = group_sock(g);
+        pfds[g].events = POLLIN;
+    }
+
+    while (1) {
+        // sleep until every thread we are allowed to have is busy serving a client
+        pthread_mutex_lock(&monitor.m_mtx);
+        while (monitor.t_act < monitor.t_max || fsock == -1) {
+            pthread_cond_wait(&monitor.m_cond, &monitor.m_mtx);
+        }
+        pthread_mutex_unlock(&monitor.m_mtx);
+
+        // saturated: take new clients off the backlog ourselves, re-check occupancy every 100 ms
+        while (monitor.t_act >= monitor.t_max && fsock != -1) {
+            if (poll(pfds, n_socks, 100) <= 0) continue;
+
+            for (int g = 0; g < n_socks; g++) {
+                if (!(pfds[g].revents & POLLIN)) continue;
+                int csock = accept(pfds[g].fd, NULL, NULL);
+                if (csock == -1) continue;  // EAGAIN, a freed file thread took it
+
+                if (enqueue_client(csock, 0) != 0) {
+                    pthread_mutex_lock(&admit.a_mtx);
+                    admit.shed_conn++;
+                    pthread_mutex_unlock(&admit.a_mtx);
+
+                    shed_client(csock);
+                    if (VERBOSE_MODE) {
+                        char msg[128];
+                        memset(msg, 0, sizeof(msg));
+                        sprintf(msg, "thread pool saturated, shed connection on socket %d", csock);
+                        logger(msg);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,192 @@
+/*
+** affinity.c -- cpu and numa aware placement of acceptor/worker groups
+*/
+
+#include "define.h"
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+__thread char* io_buf = NULL;
+
+static int cpu_node[CPU_SETSIZE];   // numa node of each cpu, 0 if the kernel has no numa info
+static int cpu_group[CPU_SETSIZE];  // group index of each allowed cpu, -1 if not allowed
+
+// parse a sysfs cpu list such as "0-3,8-11" into a cpu set
+static void parse_cpulist(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = list;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if (end == p) break;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, set);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+
+// map every cpu to its numa node by reading /sys/devices/system/node/node*/cpulist
+static void scan_nodes(void) {
+    memset(cpu_node, 0, sizeof(cpu_node));
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) return;  // no numa support, treat the machine as a single node
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+
+        char path[300];
+        memset(path, 0, sizeof(path));
+        sprintf(path, "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+
+        char list[1024];
+        memset(list, 0, sizeof(list));
+        int n = read(fd, list, sizeof(list) - 1);
+        close(fd);
+        if (n <= 0) continue;
+
+        cpu_set_t set;
+        parse_cpulist(list, &set);
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) cpu_node[c] = node;
+        }
+    }
+    closedir(dir);
+}
+
+// attach a classic bpf program to the reuseport group: return the group index of the receiving cpu
+static int attach_steering(int sock) {
+    struct sock_filter code[2 * CPU_SETSIZE + 2];
+    int len = 0;
+
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (__u32)(SKF_AD_OFF + SKF_AD_CPU));
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (cpu_group[c] < 0) continue;
+        code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (__u32)c, 0, 1);
+        code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (__u32)cpu_group[c]);
+    }
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);  // out of range, kernel falls back to hashing
+
+    struct sock_fprog prog;
+    prog.len = len;
+    prog.filter = code;
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int init_groups(const int* socks, int n_socks) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        fflush(stderr);
+        return -1;
+    }
+    scan_nodes();
+
+    // one group per allowed cpu, or one group per numa node that has an allowed cpu
+    groups = (struct group_t*)calloc(CPU_SETSIZE, sizeof(struct group_t));
+    n_groups = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        cpu_group[c] = -1;
+        if (!CPU_ISSET(c, &allowed)) continue;
+
+        int g = n_groups;
+        if (AFFINITY_MODE == 2) {
+            for (int i = 0; i < n_groups; i++) {
+                if (groups[i].node == cpu_node[c]) { g = i; break; }
+            }
+        }
+        if (g == n_groups) {  // open a new group homed on this cpu
+            groups[g].cpu = c;
+            groups[g].node = cpu_node[c];
+            CPU_ZERO(&groups[g].mask);
+            pthread_mutex_init(&groups[g].g_mtx, NULL);
+            n_groups++;
+        }
+        CPU_SET(c, &groups[g].mask);
+        cpu_group[c] = g;
+    }
+
+    // every group gets its own listener on the file port, in group order, so that the
+    // reuseport index returned by the steering program is exactly the group index
+    // (after an upgrade we reuse the listeners inherited from the old process, in the same order)
+    for (int g = 0; g < n_groups; g++) {
+        groups[g].sock = g < n_socks ? socks[g] : setSharedListener(NULL, f_port, 1024);
+        if (groups[g].sock < 0) {
+            while (g-- > 0) close(groups[g].sock);  // don't leave the earlier groups listening
+            return -1;
+        }
+        int cpu = groups[g].cpu;
+        if (setsockopt(groups[g].sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+            perror("setsockopt");  // not fatal, the bpf program below does the steering
+            fflush(stderr);
+        }
+    }
+    if (attach_steering(groups[0].sock) == -1) {
+        perror("attach_steering");  // connections are then spread by hash, threads are still pinned
+        fflush(stderr);
+    }
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "placement: %d %s groups, steering by incoming cpu", n_groups, AFFINITY_MODE == 2 ? "node" : "cpu");
+    logger(msg);
+    return groups[0].sock;
+}
+
+int bind_group(int id) {
+    if (groups == NULL) return -1;
+    int g = id % n_groups;
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &groups[g].mask) != 0) {
+        perror("pthread_setaffinity_np");
+        fflush(stderr);
+    }
+    return g;
+}
+
+int group_sock(int id) {
+    return groups == NULL ? fsock : groups[id % n_groups].sock;
+}
+
+pthread_mutex_t* group_mutex(int id) {
+    return groups == NULL ? &wake_mutex : &groups[id % n_groups].g_mtx;
+}
+
+void* group_alloc(int id, size_t size) {
+    void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+
+    // prefer the group's node, the first touch below then faults the pages in there
+    if (groups != NULL) {
+        unsigned long nodemask[16];
+        memset(nodemask, 0, sizeof(nodemask));
+        int node = groups[id % n_groups].node;
+        nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, buf, size, MPOL_PREFERRED, nodemask, 8 * sizeof(nodemask), 0);  // best effort
+    }
+    memset(buf, 0, size);
+    return buf;
+}
+
+void group_free(void* buf, size_t size) {
+    if (buf != NULL) {
+        munmap(buf, size);
+    }
+}
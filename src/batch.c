@@ -0,0 +1,366 @@
+/*
+** batch.c -- batched reads across files and vectored reads/writes at several offsets of one file
+*/
+
+#include "define.h"
+#include <sys/uio.h>
+
+#define MAX_BATCH 128  // items in one batched request
+#define ITEM_HEAD 12   // room for the length in front of each item of a response
+
+struct range_t {       // one item of a vectored request
+    off_t offset;
+    int len;
+    int index;         // position in the request, results go back in this order
+    char* data;        // bytes to write, or where the read lands in the scratch buffer
+};
+
+static __thread char scratch[IO_BUF_SIZE];  // reads land here before they are framed into io_buf
+
+static int compare_ranges(const void* a, const void* b) {
+    off_t x = ((const struct range_t*)a)->offset;
+    off_t y = ((const struct range_t*)b)->offset;
+    return x < y ? -1 : (x > y ? 1 : ((const struct range_t*)a)->index - ((const struct range_t*)b)->index);
+}
+
+static int compare_ints(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// frame the results as "length bytes" per item, a negative length is the errno of an item that failed,
+// the response is a line of text, so like the data of an fread an item ends at its first null byte
+static char* frame_results(const int* lens, char* const* data, int n) {
+    char* buf = io_buf;
+    memset(buf, 0, IO_BUF_SIZE);
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        int len = lens[i] > 0 ? strnlen(data[i], lens[i]) : lens[i];
+        pos += sprintf(buf + pos, i > 0 ? " %d" : "%d", len);
+        if (len > 0) {
+            buf[pos++] = ' ';
+            memcpy(buf + pos, data[i], len);
+            pos += len;
+        }
+    }
+    return buf;
+}
+
+// share the response among the items in request order, each item gets what is left of the buffer at most
+static int fit_length(int wanted, int used) {
+    int left = IO_BUF_SIZE - 128 - used - ITEM_HEAD;
+    return wanted < left ? wanted : (left > 0 ? left : 0);
+}
+
+// parse "offset:length" or "offset:bytes" items of a vectored request, 0 if they are all well formed
+static int parse_ranges(int argc, char** argv, struct range_t* ranges, int writing) {
+    for (int i = 2; i < argc; i++) {
+        char* colon = strchr(argv[i], ':');
+        if (colon == NULL || colon == argv[i]) return -1;
+        *colon = '\0';
+        if (checkDigit(argv[i]) == 0 || atol(argv[i]) < 0) return -1;
+        if (!writing && (checkDigit(colon + 1) == 0 || atoi(colon + 1) < 0)) return -1;
+
+        struct range_t* r = &ranges[i - 2];
+        r->offset = atol(argv[i]);
+        r->index = i - 2;
+        r->data = writing ? colon + 1 : NULL;
+        r->len = writing ? strlen(colon + 1) : atoi(colon + 1);
+    }
+    return 0;
+}
+
+// MGET length filename [filename ...]: the first length bytes of every file, one round trip for all of them
+int multi_reader(int argc, char** argv, struct echo_t* echo) {
+    if (argc < 3 || argc - 2 > MAX_BATCH) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: MGET length filename [filename ...], up to 128 files";
+        return 0;
+    }
+    if (checkDigit(argv[1]) == 0 || atoi(argv[1]) < 0) {
+        echo->status = "FAIL";
+        echo->code = -5;
+        echo->message = "invalid argument(s)";
+        return 0;
+    }
+    if (RAFT_MODE && raft_read() != 0) {
+        echo->status = "ERR";
+        echo->code = EREMOTE;
+        echo->message = "leader lease expired, retry later";
+        return 0;
+    }
+
+    int n = argc - 2;
+    int wanted = atoi(argv[1]);
+    int ids[MAX_BATCH];     // lock entry of each file that is open, -1 if it is not
+    int order[MAX_BATCH];   // the distinct entries, in the order we take them
+    int n_order = 0;
+
+    pthread_mutex_lock(&lock_mutex);
+    for (int i = 0; i < n; i++) {
+        ids[i] = -1;
+        for (int j = 0; j < n_lock; j++) {
+            if (locks[j].fd > 0 && strcmp(locks[j].f_name, argv[i + 2]) == 0) {
+                ids[i] = j;
+                break;
+            }
+        }
+        int seen = 0;
+        for (int k = 0; k < n_order && ids[i] >= 0; k++) seen |= order[k] == ids[i];
+        if (ids[i] >= 0 && !seen) order[n_order++] = ids[i];
+    }
+    pthread_mutex_unlock(&lock_mutex);
+
+    // take the reader side of every open file in lock table order, so that two batches over the same
+    // files can never each hold one and wait for the other, then read them all as of the same moment
+    qsort(order, n_order, sizeof(int), compare_ints);
+    for (int k = 0; k < n_order; k++) {
+        struct lock_t* lock = &locks[order[k]];
+        pthread_mutex_lock(&lock->f_mtx);
+        while (lock->n_writer > 0) {
+            wait_file(lock, 0);
+        }
+        take_file(lock, 0);
+        pthread_mutex_unlock(&lock->f_mtx);
+    }
+
+    int lens[MAX_BATCH];
+    char* data[MAX_BATCH];
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        int len = fit_length(wanted, pos + ITEM_HEAD * i);
+        data[i] = scratch + pos;
+        if (ids[i] >= 0 && strcmp(locks[ids[i]].f_name, argv[i + 2]) == 0) {
+            lens[i] = store->pread(&locks[ids[i]], data[i], len, 0);  // the shared seek pointer stays where it is
+        }
+        else {
+            lens[i] = store->read_name(argv[i + 2], data[i], len, 0);
+        }
+        if (lens[i] < 0) lens[i] = -errno;
+        else pos += lens[i];
+    }
+
+    for (int k = n_order - 1; k >= 0; k--) {
+        struct lock_t* lock = &locks[order[k]];
+        pthread_mutex_lock(&lock->f_mtx);
+        drop_file(lock, 0);
+        pthread_cond_broadcast(&lock->f_cond);
+        pthread_mutex_unlock(&lock->f_mtx);
+    }
+
+    echo->status = "OK";
+    echo->code = n;
+    echo->message = frame_results(lens, data, n);
+    return 0;
+}
+
+// FREADV identifier offset:length [offset:length ...]: several ranges of one file in one request,
+// ranges that follow each other on disk are read with a single preadv()
+int vector_reader(int argc, char** argv, struct echo_t* echo, int lock_id) {
+    if (argc < 3 || argc - 2 > MAX_BATCH) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: FREADV identifier offset:length [offset:length ...], up to 128 ranges";
+        return 0;
+    }
+    struct range_t ranges[MAX_BATCH];
+    if (checkDigit(argv[1]) == 0 || parse_ranges(argc, argv, ranges, 0) != 0) {
+        echo->status = "FAIL";
+        echo->code = -5;
+        echo->message = "invalid argument(s)";
+        return 0;
+    }
+
+    int identifier = atoi(argv[1]);
+    struct lock_t* lock = &locks[lock_id];
+    if (identifier != lock->fd || lock->fd <= 0) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "invalid identifier, no such file or directory";
+        return 0;
+    }
+    if (RAFT_MODE && raft_read() != 0) {
+        echo->status = "ERR";
+        echo->code = EREMOTE;
+        echo->message = "leader lease expired, retry later";
+        return 0;
+    }
+
+    // every range gets its slot of the scratch buffer in request order, then we read them in disk order
+    int n = argc - 2;
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        ranges[i].len = fit_length(ranges[i].len, pos + ITEM_HEAD * i);
+        ranges[i].data = scratch + pos;
+        pos += ranges[i].len;
+    }
+    qsort(ranges, n, sizeof(struct range_t), compare_ranges);
+
+    pthread_mutex_lock(&lock->f_mtx);
+    while (lock->n_writer > 0) {
+        wait_file(lock, 0);
+    }
+    take_file(lock, 0);
+    pthread_mutex_unlock(&lock->f_mtx);
+
+    int lens[MAX_BATCH];
+    char* data[MAX_BATCH];
+    for (int i = 0; i < n;) {
+        int j = i + 1;  // ranges i..j-1 are contiguous on disk
+        while (j < n && ranges[j].offset == ranges[j - 1].offset + ranges[j - 1].len) j++;
+
+        struct iovec iov[MAX_BATCH];
+        for (int k = i; k < j; k++) {
+            iov[k - i].iov_base = ranges[k].data;
+            iov[k - i].iov_len = ranges[k].len;
+        }
+        ssize_t got;
+        if (lock->recipe != NULL || lock->lfile != NULL) {  // a frozen or log-structured file, each range from its chunks or segments
+            got = 0;
+            for (int k = i; k < j && got >= 0; k++) {
+                ssize_t n = store->pread(lock, ranges[k].data, ranges[k].len, ranges[k].offset);
+                got = n < 0 ? -1 : got + n;
+                if (n < ranges[k].len) break;
+            }
+        }
+        else {
+            long began = trace_clock();
+            got = preadv(lock->fd, iov, j - i, ranges[i].offset);
+            if (got > 0 && crc_verify(lock->crc_fd, lock->fd, ranges[i].offset, got) != 0) {
+                got = -1;  // EIO, the whole run is reported as damaged
+            }
+            trace_io("read", got, began);
+        }
+        for (int k = i; k < j; k++) {  // a short read at the end of the file fills the first ranges only
+            int idx = ranges[k].index;
+            data[idx] = ranges[k].data;
+            if (got < 0) {
+                lens[idx] = -errno;
+                continue;
+            }
+            lens[idx] = got < ranges[k].len ? (int)got : ranges[k].len;
+            got -= lens[idx];
+        }
+        i = j;
+    }
+
+    pthread_mutex_lock(&lock->f_mtx);
+    drop_file(lock, 0);
+    pthread_cond_broadcast(&lock->f_cond);
+    pthread_mutex_unlock(&lock->f_mtx);
+
+    echo->status = "OK";
+    echo->code = n;
+    echo->message = frame_results(lens, data, n);
+    return 0;
+}
+
+// FWRITEV identifier offset:bytes [offset:bytes ...]: several ranges of one file under one writer lock,
+// ranges that follow each other on disk are written with a single pwritev(), the seek pointer does not move
+int vector_writer(int argc, char** argv, struct echo_t* echo, int lock_id) {
+    if (argc < 3 || argc - 2 > MAX_BATCH) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: FWRITEV identifier offset:bytes [offset:bytes ...], up to 128 ranges";
+        return 0;
+    }
+    struct range_t ranges[MAX_BATCH];
+    if (checkDigit(argv[1]) == 0 || parse_ranges(argc, argv, ranges, 1) != 0) {
+        echo->status = "FAIL";
+        echo->code = -5;
+        echo->message = "invalid argument(s)";
+        return 0;
+    }
+
+    // in disk order, which is also the order replicas apply them in, so ranges must not overlap
+    int n = argc - 2;
+    qsort(ranges, n, sizeof(struct range_t), compare_ranges);
+    for (int i = 1; i < n; i++) {
+        if (ranges[i].offset < ranges[i - 1].offset + ranges[i - 1].len) {
+            echo->status = "FAIL";
+            echo->code = -5;
+            echo->message = "ranges overlap";
+            return 0;
+        }
+    }
+
+    int identifier = atoi(argv[1]);
+    struct lock_t* lock = &locks[lock_id];
+    if (identifier != lock->fd || lock->fd <= 0) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "invalid identifier, no such file or directory";
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock->f_mtx);
+    while (lock->n_reader > 0 || lock->n_writer > 0) {
+        wait_file(lock, 1);
+    }
+    take_file(lock, 1);
+    pthread_mutex_unlock(&lock->f_mtx);
+
+    int written = 0, failed = thaw_lock(lock) != 0;  // a frozen file gets its data back in place first
+    for (int i = 0; i < n && !failed;) {
+        int j = i + 1;
+        while (j < n && ranges[j].offset == ranges[j - 1].offset + ranges[j - 1].len) j++;
+
+        if (RAFT_MODE) {
+            // each range is its own log entry, applied on every member once a majority has it
+            for (int k = i; k < j && !failed; k++) {
+                failed = raft_commit('W', lock->f_name, ranges[k].offset, ranges[k].data, ranges[k].len) != 0;
+                written += failed ? 0 : 1;
+            }
+        }
+        else if (lock->lfile != NULL) {
+            // each range is a record of its own, appended one after the other anyway
+            for (int k = i; k < j && !failed; k++) {
+                failed = store->pwrite(lock, ranges[k].data, ranges[k].len, ranges[k].offset) != ranges[k].len;
+                if (!failed) {
+                    replicate('W', lock->f_name, ranges[k].offset, ranges[k].data, ranges[k].len);
+                    written++;
+                }
+            }
+        }
+        else {
+            struct iovec iov[MAX_BATCH];
+            ssize_t total = 0;
+            for (int k = i; k < j; k++) {
+                iov[k - i].iov_base = ranges[k].data;
+                iov[k - i].iov_len = ranges[k].len;
+                total += ranges[k].len;
+            }
+            long began = trace_clock();
+            snap_enter(lock->f_name);
+            failed = pwritev(lock->fd, iov, j - i, ranges[i].offset) != total;
+            snap_leave();
+            trace_io("write", failed ? -1 : total, began);
+            touch_lock(lock);
+            if (!failed) {
+                crc_update(lock->crc_fd, lock->fd, ranges[i].offset, total);
+            }
+            for (int k = i; k < j && !failed; k++) {
+                replicate('W', lock->f_name, ranges[k].offset, ranges[k].data, ranges[k].len);
+                written++;
+            }
+        }
+        i = j;
+    }
+
+    pthread_mutex_lock(&lock->f_mtx);
+    drop_file(lock, 1);
+    pthread_cond_broadcast(&lock->f_cond);
+    pthread_mutex_unlock(&lock->f_mtx);
+
+    if (failed) {
+        echo->status = (char*)(RAFT_MODE ? "ERR" : "FAIL");
+        echo->code = RAFT_MODE ? EREMOTE : errno;
+        echo->message = (char*)(RAFT_MODE ? "leadership lost, the ranges from the first unanswered one on may or may not have been committed"
+                                          : "system call pwritev() failed, some ranges may not have been written");
+        return 0;
+    }
+    echo->status = "OK";
+    echo->code = written;
+    echo->message = "ranges written to the file";
+    return 0;
+}
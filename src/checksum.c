@@ -0,0 +1,397 @@
+/*
+** checksum.c -- crc32c of every block of the files we serve, kept in a hidden file next to each one
+*/
+
+#include "define.h"
+#include <stdint.h>
+
+#define CRC_POLY 0x82f63b78  // castagnoli, reflected
+#define CRC_LONG 8192        // lane length of the three-way hardware loop on large buffers
+#define CRC_SHORT 256        // and on the rest
+#define CRC_CHUNK 16         // blocks read and summed at a time
+
+int CHECKSUM_MODE = 1;  // 0 if files are served without block checksums
+
+/*
+** a file's sums live in ".name.crc" in the same directory: a header saying which state of the file they
+** describe, then one little endian crc32c per CRC_BLOCK of the file, the last block being summed as far
+** as the file goes; the header is written when the sums are opened and closed, so a file changed while we
+** were not looking (or while we crashed in the middle of a write) gets its sums rebuilt on the next open
+*/
+struct crc_head_t {
+    char magic[4];  // "CRC1"
+    int block;
+    long long size;  // of the file, and its mtime, when the sums were last known to be complete
+    long long sec;
+    long long nsec;
+};
+
+static uint32_t table[8][256];       // slicing-by-8 tables of the portable kernel
+static uint32_t long_shift[4][256];  // crc of CRC_LONG zero bytes appended, one table per byte of the crc
+static uint32_t short_shift[4][256];
+static uint32_t (*kernel)(uint32_t crc, const unsigned char* p, size_t n);
+
+static uint32_t crc_portable(uint32_t crc, const unsigned char* p, size_t n) {
+    crc = ~crc;
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;  // little endian
+        crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+              table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+    }
+    while (n-- > 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// the zeros operators are matrices over gf(2), applied to a crc by multiplying it as a bit vector
+static uint32_t gf2_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+
+// the operator that appends len zero bytes to a crc (len a power of two), found by squaring the one-bit operator
+static void zeros_op(uint32_t* even, size_t len) {
+    uint32_t odd[32];
+    odd[0] = CRC_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd);  // 2 zero bits
+    gf2_square(odd, even);  // 4 zero bits
+    do {
+        gf2_square(even, odd);
+        len >>= 1;
+        if (len == 0) return;
+        gf2_square(odd, even);
+        len >>= 1;
+    } while (len != 0);
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void zeros_table(uint32_t shift[][256], size_t len) {
+    uint32_t op[32];
+    zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++) {
+        shift[0][n] = gf2_times(op, n);
+        shift[1][n] = gf2_times(op, n << 8);
+        shift[2][n] = gf2_times(op, n << 16);
+        shift[3][n] = gf2_times(op, n << 24);
+    }
+}
+
+static uint32_t shift_crc(uint32_t shift[][256], uint32_t crc) {
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/*
+** the sse4.2 crc32 instruction has a latency of three cycles but a throughput of one, so large buffers are
+** summed as three independent lanes at once and the lane crcs combined by shifting them over the lanes after
+*/
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t crc0 = ~crc;
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        crc0 = __builtin_ia32_crc32qi((uint32_t)crc0, *p++);
+        n--;
+    }
+    size_t lanes[2] = {CRC_LONG, CRC_SHORT};
+    for (int l = 0; l < 2; l++) {
+        size_t lane = lanes[l];
+        while (n >= 3 * lane) {
+            uint64_t crc1 = 0, crc2 = 0;
+            const unsigned char* end = p + lane;
+            do {
+                uint64_t a, b, c;
+                memcpy(&a, p, 8);
+                memcpy(&b, p + lane, 8);
+                memcpy(&c, p + 2 * lane, 8);
+                crc0 = __builtin_ia32_crc32di(crc0, a);
+                crc1 = __builtin_ia32_crc32di(crc1, b);
+                crc2 = __builtin_ia32_crc32di(crc2, c);
+                p += 8;
+            } while (p < end);
+            uint32_t (*shift)[256] = l == 0 ? long_shift : short_shift;
+            crc0 = shift_crc(shift, (uint32_t)crc0) ^ crc1;
+            crc0 = shift_crc(shift, (uint32_t)crc0) ^ crc2;
+            p += 2 * lane;
+            n -= 3 * lane;
+        }
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc0 = __builtin_ia32_crc32di(crc0, v);
+    }
+    while (n-- > 0) {
+        crc0 = __builtin_ia32_crc32qi((uint32_t)crc0, *p++);
+    }
+    return ~(uint32_t)crc0;
+}
+#endif
+
+// build the tables and pick the fastest kernel this cpu runs, before any session starts
+void init_checksum(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+        }
+    }
+    zeros_table(long_shift, CRC_LONG);
+    zeros_table(short_shift, CRC_SHORT);
+
+    kernel = crc_portable;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) kernel = crc_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+    return kernel(crc, (const unsigned char*)buf, len);
+}
+
+static void sums_path(const char* name, char* path, int size) {
+    const char* slash = strrchr(name, '/');
+    snprintf(path, size, "%.*s.%s.crc", slash == NULL ? 0 : (int)(slash - name + 1), name, slash == NULL ? name : slash + 1);
+}
+
+static int stamp(int cfd, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    struct crc_head_t head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, "CRC1", 4);
+    head.block = CRC_BLOCK;
+    head.size = st.st_size;
+    head.sec = st.st_mtim.tv_sec;
+    head.nsec = st.st_mtim.tv_nsec;
+    return pwrite(cfd, &head, sizeof(head), 0) == sizeof(head) ? 0 : -1;
+}
+
+// compare the blocks held in buf (n bytes of the file from block first on) with their stored sums
+static int check_blocks(int cfd, const char* buf, long first, int n) {
+    int n_blocks = (n + CRC_BLOCK - 1) / CRC_BLOCK;
+    uint32_t sums[n_blocks > 0 ? n_blocks : 1];
+    if (n_blocks == 0) return 0;
+    ssize_t got = pread(cfd, sums, sizeof(uint32_t) * n_blocks, sizeof(struct crc_head_t) + sizeof(uint32_t) * first);
+    if (got != (ssize_t)(sizeof(uint32_t) * n_blocks)) return -1;  // sums missing for part of the file
+    for (int k = 0; k < n_blocks; k++) {
+        int len = n - k * CRC_BLOCK < CRC_BLOCK ? n - k * CRC_BLOCK : CRC_BLOCK;
+        if (crc32c(0, buf + (long)k * CRC_BLOCK, len) != sums[k]) return -1;
+    }
+    return 0;
+}
+
+// recompute the sums of the blocks a change of [offset, offset + len) touched, and of any block the file
+// has grown by since, dropping those of blocks it no longer has; the caller keeps readers out meanwhile
+int crc_update(int cfd, int fd, off_t offset, off_t len) {
+    if (cfd < 0) return 0;
+    struct stat st, cst;
+    if (fstat(fd, &st) != 0 || fstat(cfd, &cst) != 0) return -1;
+    long n_blocks = (st.st_size + CRC_BLOCK - 1) / CRC_BLOCK;
+    long have = cst.st_size > (off_t)sizeof(struct crc_head_t) ? (cst.st_size - sizeof(struct crc_head_t)) / sizeof(uint32_t) : 0;
+    if (have > n_blocks && ftruncate(cfd, sizeof(struct crc_head_t) + sizeof(uint32_t) * n_blocks) != 0) return -1;
+
+    long first = offset / CRC_BLOCK;
+    long last = len > 0 ? (offset + len - 1) / CRC_BLOCK : first;
+    if (have < first) first = have;  // blocks that appeared under a hole or an extension
+    if (n_blocks - 1 > last && have < n_blocks) last = n_blocks - 1;
+    if (last > n_blocks - 1) last = n_blocks - 1;
+
+    char buf[CRC_CHUNK * CRC_BLOCK];
+    uint32_t sums[CRC_CHUNK];
+    for (long b = first; b <= last; b += CRC_CHUNK) {
+        int count = last - b + 1 < CRC_CHUNK ? last - b + 1 : CRC_CHUNK;
+        ssize_t n = pread(fd, buf, (size_t)count * CRC_BLOCK, (off_t)b * CRC_BLOCK);
+        if (n < 0) return -1;
+        int k = 0;
+        for (; k < count && (ssize_t)k * CRC_BLOCK < n; k++) {
+            int part = n - k * CRC_BLOCK < CRC_BLOCK ? n - k * CRC_BLOCK : CRC_BLOCK;
+            sums[k] = crc32c(0, buf + (long)k * CRC_BLOCK, part);
+        }
+        if (k > 0 && pwrite(cfd, sums, sizeof(uint32_t) * k, sizeof(struct crc_head_t) + sizeof(uint32_t) * b) != (ssize_t)(sizeof(uint32_t) * k)) {
+            return -1;
+        }
+        if (k < count) break;  // the file got shorter under us
+    }
+    return 0;
+}
+
+// open the sums of the file open as fd, rebuilding them if they do not describe it, -1 if we keep none
+int crc_open(const char* name, int fd) {
+    if (!CHECKSUM_MODE) return -1;
+    char path[300];
+    sums_path(name, path, sizeof(path));
+    int cfd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (cfd < 0) return -1;
+
+    struct crc_head_t head;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(cfd);
+        return -1;
+    }
+    if (pread(cfd, &head, sizeof(head), 0) != sizeof(head) || memcmp(head.magic, "CRC1", 4) != 0 || head.block != CRC_BLOCK ||
+        head.size != st.st_size || head.sec != st.st_mtim.tv_sec || head.nsec != st.st_mtim.tv_nsec) {
+        // every sum is recomputed in place, so a reader of the file through another descriptor never finds them missing
+        if (crc_update(cfd, fd, 0, st.st_size) != 0 || stamp(cfd, fd) != 0) {
+            close(cfd);
+            return -1;
+        }
+    }
+    return cfd;
+}
+
+// the sums now describe the file as it is
+void crc_close(int cfd, int fd) {
+    if (cfd < 0) return;
+    stamp(cfd, fd);
+    close(cfd);
+}
+
+// the sums of a file that is going away
+void crc_remove(const char* name) {
+    char path[300];
+    sums_path(name, path, sizeof(path));
+    unlink(path);
+}
+
+// pread() that checks every block it touches against its sum, reading them whole, -1 with EIO on a mismatch
+ssize_t crc_pread(int cfd, int fd, char* buf, size_t len, off_t offset) {
+    if (cfd < 0) return pread(fd, buf, len, offset);
+    off_t from = offset / CRC_BLOCK * CRC_BLOCK;
+    size_t span = (offset + len + CRC_BLOCK - 1) / CRC_BLOCK * CRC_BLOCK - from;
+    char* blocks = (char*)malloc(span > 0 ? span : 1);
+    if (blocks == NULL) return -1;
+
+    // a replica applies its primary's writes without a writer lock, so a block caught half-written gets a second look
+    ssize_t n = -1;
+    for (int tries = 0; tries < 2; tries++) {
+        ssize_t got = pread(fd, blocks, span, from);
+        if (got < 0) break;
+        if (check_blocks(cfd, blocks, from / CRC_BLOCK, got) == 0) {
+            n = got > offset - from ? got - (offset - from) : 0;
+            if (n > (ssize_t)len) n = len;
+            memcpy(buf, blocks + (offset - from), n);
+            break;
+        }
+        errno = EIO;
+    }
+    free(blocks);
+    return n;
+}
+
+// check the blocks of [offset, offset + len) against their sums, -1 with EIO on a mismatch
+int crc_verify(int cfd, int fd, off_t offset, size_t len) {
+    if (cfd < 0 || len == 0) return 0;
+    char buf[CRC_CHUNK * CRC_BLOCK];
+    long last = (offset + len - 1) / CRC_BLOCK;
+    for (long b = offset / CRC_BLOCK; b <= last; b += CRC_CHUNK) {
+        int count = last - b + 1 < CRC_CHUNK ? last - b + 1 : CRC_CHUNK;
+        int ok = 0;
+        for (int tries = 0; tries < 2 && !ok; tries++) {
+            ssize_t n = pread(fd, buf, (size_t)count * CRC_BLOCK, (off_t)b * CRC_BLOCK);
+            if (n < 0) return -1;
+            ok = check_blocks(cfd, buf, b, n) == 0;
+        }
+        if (!ok) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// CHECKSUM [ON | OFF]: whether this session's FREAD responses end with the crc32c of the data they carry
+int set_checksum(int argc, char** argv, struct echo_t* echo, int* on) {
+    if (argc > 2 || (argc == 2 && strcasecmp(argv[1], "ON") != 0 && strcasecmp(argv[1], "OFF") != 0)) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: CHECKSUM [ON | OFF]";
+        return 0;
+    }
+    if (argc == 2) {
+        *on = strcasecmp(argv[1], "ON") == 0;
+    }
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = (char*)(*on ? (CHECKSUM_MODE ? "data checksums on, blocks verified on read"
+                                                 : "data checksums on, blocks not verified on read (checksum 0)")
+                                : (CHECKSUM_MODE ? "data checksums off, blocks verified on read"
+                                                 : "data checksums off, blocks not verified on read (checksum 0)"));
+    return 0;
+}
+
+static long wall_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// GB/s of a kernel over mb megabytes of buf summed in pieces of the given size
+static double throughput(uint32_t (*fn)(uint32_t, const unsigned char*, size_t), const unsigned char* buf, size_t size, int piece, int mb,
+                         uint32_t* crc) {
+    long total = (long)mb << 20;
+    long start = wall_ns();
+    uint32_t c = 0;
+    for (long done = 0; done < total; done += size) {
+        for (size_t at = 0; at < size; at += piece) {
+            c = fn(c, buf + at, piece);
+        }
+    }
+    *crc = c;
+    long ns = wall_ns() - start;
+    return ns > 0 ? (double)total / ns : 0;
+}
+
+// benchmark the kernels on block-sized and large pieces, from the shell's CHECKSUM command
+int bench_checksum(int mb, char* out, int size) {
+    size_t len = 1 << 20;
+    unsigned char* buf = (unsigned char*)malloc(len);
+    if (buf == NULL) return -1;
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = (unsigned char)x;
+    }
+
+    uint32_t check = crc32c(0, "123456789", 9);  // 0xe3069283 for crc32c
+    int o = snprintf(out, size, "crc32c kernel %s, check value %08x, checksums %s, %d byte blocks\n",
+                     kernel == crc_portable ? "portable" : "sse4.2", check, CHECKSUM_MODE ? "on" : "off", CRC_BLOCK);
+    int pieces[2] = {CRC_BLOCK, (int)len};
+    for (int p = 0; p < 2; p++) {
+        uint32_t a, b;
+        double fast = throughput(kernel, buf, len, pieces[p], mb, &a);
+        double slow = throughput(crc_portable, buf, len, pieces[p], mb, &b);
+        o += snprintf(out + o, size - o, "%8d byte pieces: %s %.2f GB/s, portable %.2f GB/s%s\n", pieces[p],
+                      kernel == crc_portable ? "portable" : "sse4.2", fast, slow, a == b ? "" : ", RESULTS DIFFER");
+    }
+    free(buf);
+    return o;
+}
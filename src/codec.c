@@ -0,0 +1,199 @@
+/*
+** codec.c -- negotiated block compression of requests and responses on a file session
+*/
+
+#include "define.h"
+#include <stdint.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/*
+** the block format is that of lz4: a sequence is a token byte (literal count in the high nibble, match
+** length - 4 in the low nibble, 15 meaning more follows in 255-runs), the literals, then a 2-byte little
+** endian offset back into the output and the rest of the match length; the last sequence has literals only
+*/
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int put_length(unsigned char* dst, int o, int cap, int len) {
+    for (; len >= 255; len -= 255) {
+        if (o >= cap) return -1;
+        dst[o++] = 255;
+    }
+    if (o >= cap) return -1;
+    dst[o++] = (unsigned char)len;
+    return o;
+}
+
+// one sequence of n_lit literals followed by a match of m_len bytes at offset back, m_len is 0 for the last one
+static int put_sequence(unsigned char* dst, int o, int cap, const unsigned char* lit, int n_lit, int offset, int m_len) {
+    if (o >= cap) return -1;
+    int token = o++;
+    dst[token] = (unsigned char)((n_lit >= 15 ? 15 : n_lit) << 4);
+    if (n_lit >= 15 && (o = put_length(dst, o, cap, n_lit - 15)) < 0) return -1;
+    if (n_lit > cap - o) return -1;
+    memcpy(dst + o, lit, n_lit);
+    o += n_lit;
+    if (m_len == 0) return o;
+
+    if (o + 2 > cap) return -1;
+    dst[o++] = (unsigned char)(offset & 0xff);
+    dst[o++] = (unsigned char)(offset >> 8);
+    dst[token] |= (unsigned char)(m_len - LZ_MIN_MATCH >= 15 ? 15 : m_len - LZ_MIN_MATCH);
+    if (m_len - LZ_MIN_MATCH >= 15 && (o = put_length(dst, o, cap, m_len - LZ_MIN_MATCH - 15)) < 0) return -1;
+    return o;
+}
+
+// compress n bytes into at most cap bytes, -1 if they do not fit (the data does not compress)
+int lz_compress(const char* in, int n, char* out, int cap) {
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    int table[1 << LZ_HASH_BITS];  // last position of each hashed 4-byte sequence
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) table[i] = -1;
+
+    int anchor = 0, o = 0;
+    for (int i = 0; i + LZ_MIN_MATCH <= n;) {
+        uint32_t v = read32(src + i);
+        int h = (int)((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+        int ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > LZ_MAX_OFFSET || read32(src + ref) != v) {
+            i++;
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (i + len < n && src[ref + len] == src[i + len]) len++;
+        if ((o = put_sequence(dst, o, cap, src + anchor, i - anchor, i - ref, len)) < 0) return -1;
+        i += len;
+        anchor = i;
+    }
+    return put_sequence(dst, o, cap, src + anchor, n - anchor, 0, 0);
+}
+
+// decompress n bytes into at most cap bytes, -1 if the block is malformed
+int lz_decompress(const char* in, int n, char* out, int cap) {
+    const unsigned char* src = (const unsigned char*)in;
+    unsigned char* dst = (unsigned char*)out;
+    int i = 0, o = 0;
+    while (i < n) {
+        int token = src[i++];
+        int n_lit = token >> 4;
+        for (int b = 255; n_lit >= 15 && b == 255; n_lit += b) {
+            if (i >= n) return -1;
+            b = src[i++];
+        }
+        if (n_lit > n - i || n_lit > cap - o) return -1;
+        memcpy(dst + o, src + i, n_lit);
+        i += n_lit;
+        o += n_lit;
+        if (i == n) break;  // the last sequence
+
+        if (i + 2 > n) return -1;
+        int offset = src[i] | (src[i + 1] << 8);
+        i += 2;
+        int m_len = (token & 15) + LZ_MIN_MATCH;
+        for (int b = 255; (token & 15) == 15 && b == 255; m_len += b) {
+            if (i >= n) return -1;
+            b = src[i++];
+        }
+        if (offset == 0 || offset > o || m_len > cap - o) return -1;
+        for (int k = 0; k < m_len; k++) {
+            dst[o + k] = dst[o - offset + k];  // byte by byte, a match may overlap its own output
+        }
+        o += m_len;
+    }
+    return o;
+}
+
+static long cpu_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// COMPRESS [ON [threshold] | OFF]: switch compression for this session, or report what it has saved so far
+int set_codec(int argc, char** argv, struct echo_t* echo, struct codec_t* codec) {
+    static __thread char message[256];
+    if (argc > 3 || (argc > 1 && strcasecmp(argv[1], "ON") != 0 && strcasecmp(argv[1], "OFF") != 0) ||
+        (argc == 3 && (strcasecmp(argv[1], "ON") != 0 || checkDigit(argv[2]) == 0))) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: COMPRESS [ON [threshold] | OFF]";
+        return 0;
+    }
+    if (argc > 1) {
+        codec->on = strcasecmp(argv[1], "ON") == 0;
+        codec->threshold = argc == 3 ? atoi(argv[2]) : CODEC_THRESHOLD;
+    }
+
+    memset(message, 0, sizeof(message));
+    snprintf(message, sizeof(message), "compression %s above %d bytes, sent %ld bytes as %ld (%.1fx), received %ld bytes as %ld (%.1fx), "
+             "%.2f ms cpu", codec->on ? "on" : "off", codec->threshold, codec->raw_out, codec->wire_out,
+             codec->wire_out > 0 ? (double)codec->raw_out / codec->wire_out : 1.0, codec->raw_in, codec->wire_in,
+             codec->wire_in > 0 ? (double)codec->raw_in / codec->wire_in : 1.0, codec->cpu_ns / 1e6);
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = message;
+    return 0;
+}
+
+// a request that starts with "Z wire raw\n" is followed by wire bytes that decompress to the raw request line,
+// req holds what has been received so far, returns the length of the request left in req, -1 if the session is lost
+int inflate_request(int csock, char* req, int size, int n_bytes, struct codec_t* codec) {
+    char* end = (char*)memchr(req, '\n', n_bytes);
+    int wire = 0, raw = 0;
+    if (end == NULL || sscanf(req, "Z %d %d", &wire, &raw) != 2 || wire <= 0 || raw <= 0 || raw >= size || wire > 2 * size) {
+        return -1;  // we cannot tell where the frame ends
+    }
+
+    char block[2 * size];
+    int have = n_bytes - (int)(end + 1 - req);
+    if (have > wire) have = wire;  // a pipelined request after the frame is not supported, as for plain requests
+    memcpy(block, end + 1, have);
+    while (have < wire) {
+        int n = recvTimeOut(csock, block + have, wire - have, 1000);
+        if (n <= 0) return -1;
+        have += n;
+    }
+
+    long start = cpu_ns();
+    memset(req, 0, size);
+    int n = lz_decompress(block, wire, req, size - 1);
+    codec->cpu_ns += cpu_ns() - start;
+    if (n != raw) {
+        memset(req, 0, size);
+        strcpy(req, "Z");  // a broken frame, answered as an invalid request
+        return 1;
+    }
+    codec->wire_in += wire;
+    codec->raw_in += raw;
+    return n;
+}
+
+// send a response line, as a compressed frame if the session asked for it and it pays off
+int send_response(int csock, const char* res, int* len, struct codec_t* codec) {
+    if (!codec->on || *len < codec->threshold) {
+        return sendAll(csock, res, len);
+    }
+
+    char frame[32 + *len];
+    long start = cpu_ns();
+    int wire = lz_compress(res, *len, frame + 32, *len - 32);  // only worth it if the whole frame is shorter than the line
+    codec->cpu_ns += cpu_ns() - start;
+    if (wire < 0) {
+        return sendAll(csock, res, len);  // incompressible
+    }
+
+    int head = sprintf(frame, "Z %d %d\n", wire, *len);  // well under 32 bytes
+    memmove(frame + head, frame + 32, wire);
+    codec->raw_out += *len;
+    codec->wire_out += head + wire;
+    int total = head + wire;
+    return sendAll(csock, frame, &total);
+}
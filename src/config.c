@@ -0,0 +1,237 @@
+/*
+** config.c -- server parameters, read from a config file at startup or changed live from the shell port
+*/
+
+#include "define.h"
+
+struct param_t {
+    const char* key;
+    int* value;   // the setting itself
+    int scale;    // stored value = given value * scale (timeouts are given in seconds)
+    int min;      // smallest acceptable given value
+    int max;      // largest acceptable given value, 0 if unbounded
+    int runtime;  // 1 if it can be changed on a running server
+};
+
+static struct param_t params[] = {
+    { "t_inc",     &monitor.t_inc, 1,    1, 0, 1 },
+    { "t_max",     &monitor.t_max, 1,    1, 0, 1 },
+    { "q_max",     &admit.q_max,   1,    0, 0, 1 },
+    { "w_max",     &admit.w_max,   1,    0, 0, 1 },
+    { "f_timeout", &f_timeout,     1000, 1, INT_MAX / 1000, 1 },
+    { "s_timeout", &s_timeout,     1000, 1, INT_MAX / 1000, 1 },
+    { "verbose",   &VERBOSE_MODE,  1,    0, 1, 1 },
+    { "delay",     &DELAY_MODE,    1,    0, 1, 1 },
+    { "r_batch",   &rlog.r_batch,  1,    1, 65536, 1 },
+    { "r_wait",    &rlog.r_wait,   1,    0, 0, 1 },
+    { "r_sync",    &rlog.r_sync,   1,    1, 64, 1 },
+    { "r_rate",    &rlog.r_rate,   1,    0, 0, 1 },
+    { "r_max",     &rlog.r_max,    1,    16, 0, 0 },
+    { "affinity",  &AFFINITY_MODE, 1,    0, 2, 0 },
+    { "checksum",  &CHECKSUM_MODE, 1,    0, 1, 0 },
+    { "dedup",     &DEDUP_MODE,    1,    0, 1, 0 },
+    { "lstore",    &LOG_MODE,      1,    0, 1, 0 },
+    { "kv_max",    &KV_MAX,        1,    1, 0, 1 },
+    { "kv_persist", &KV_PERSIST,   1,    0, 1, 0 },
+    { "readahead", &READAHEAD,     1,    0, 1048576, 1 },
+    { "prefetch",  &PREFETCH,      1,    0, 4096, 1 },
+    { "trace",     &TRACE,         1,    0, 1000000, 1 },
+    { NULL,        NULL,           0,    0, 0, 0 }
+};
+
+static struct param_t* find_param(const char* key) {
+    for (int i = 0; params[i].key != NULL; i++) {
+        if (strcasecmp(params[i].key, key) == 0) return &params[i];
+    }
+    return NULL;
+}
+
+// grow the thread pool table so that the monitor can allocate up to t_max + t_inc threads, caller holds m_mtx
+static void grow_pool(int size) {
+    if (thread_pool == NULL || size <= thread_pool_size) return;
+    struct thread_t* pool = (struct thread_t*)realloc(thread_pool, sizeof(struct thread_t) * size);
+    if (pool == NULL) return;  // keep the old table, the monitor stays within its bounds
+    for (int i = thread_pool_size; i < size; i++) {
+        pool[i].tid = -1;
+        pool[i].idle = 1;
+    }
+    thread_pool = pool;
+    thread_pool_size = size;
+}
+
+// resize the admission queue keeping pending clients in order, caller holds a_mtx
+static int resize_queue(int q_max) {
+    if (admit.queue == NULL) return 0;
+    struct pending_t* queue = (struct pending_t*)malloc(sizeof(struct pending_t) * (q_max > 0 ? q_max : 1));
+    if (queue == NULL) return -1;
+    for (int i = 0; i < admit.q_len; i++) {
+        queue[i] = admit.queue[(admit.q_head + i) % admit.q_max];
+    }
+    free(admit.queue);
+    admit.queue = queue;
+    admit.q_head = 0;
+    return 0;
+}
+
+int set_params(int argc, char** argv, int startup, struct echo_t* echo) {
+    static __thread char message[128];
+    memset(message, 0, sizeof(message));
+    echo->message = message;
+
+    if (argc < 3 || argc % 2 == 0) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: SET key value [key value ...]";
+        return -1;
+    }
+
+    // validate everything first, so that either all of the settings are applied or none
+    int n = (argc - 1) / 2;
+    struct param_t* targets[n];
+    int values[n];
+    for (int i = 0; i < n; i++) {
+        const char* key = argv[1 + 2 * i];
+        const char* value = argv[2 + 2 * i];
+
+        // ports are strings and only matter before the listeners are bound
+        if (startup && (strcasecmp(key, "s_port") == 0 || strcasecmp(key, "f_port") == 0)) {
+            if (atoi(value) == 0) {
+                sprintf(message, "invalid port %.64s", value);
+                echo->status = "FAIL";
+                echo->code = -5;
+                return -1;
+            }
+            targets[i] = NULL;
+            continue;
+        }
+
+        targets[i] = find_param(key);
+        if (targets[i] == NULL) {
+            sprintf(message, "unknown parameter %.64s", key);
+            echo->status = "FAIL";
+            echo->code = -5;
+            return -1;
+        }
+        if (!startup && !targets[i]->runtime) {
+            sprintf(message, "%s can only be set at startup", targets[i]->key);
+            echo->status = "ERR";
+            echo->code = EPERM;
+            return -1;
+        }
+        long long given = strtoll(value, NULL, 10);  // an unbounded key still has to fit in an int once scaled
+        if (checkDigit(value) == 0 || given < targets[i]->min || (targets[i]->max > 0 && given > targets[i]->max) ||
+            given > INT_MAX / targets[i]->scale) {
+            sprintf(message, "invalid value for %s", targets[i]->key);
+            echo->status = "FAIL";
+            echo->code = -5;
+            return -1;
+        }
+        values[i] = (int)given * targets[i]->scale;
+    }
+
+    if (!startup && fsock == -1) {
+        echo->status = "ERR";
+        echo->code = EBUSY;
+        echo->message = "server is reloading or upgrading, try again later";
+        return -1;
+    }
+
+    // apply under the pool and admission locks, sessions keep running and see the new values on their next check
+    pthread_mutex_lock(&monitor.m_mtx);
+    pthread_mutex_lock(&admit.a_mtx);
+
+    int t_inc = monitor.t_inc, t_max = monitor.t_max, q_max = admit.q_max;
+    for (int i = 0; i < n; i++) {
+        if (targets[i] == NULL) continue;
+        if (targets[i]->value == &monitor.t_inc) t_inc = values[i];
+        if (targets[i]->value == &monitor.t_max) t_max = values[i];
+        if (targets[i]->value == &admit.q_max) q_max = values[i];
+    }
+
+    int status = 0;
+    if (q_max < admit.q_len) {
+        sprintf(message, "%d clients are pending, q_max cannot be lower", admit.q_len);
+        status = -1;
+    }
+    else if (q_max != admit.q_max && resize_queue(q_max) != 0) {
+        sprintf(message, "cannot allocate the admission queue");
+        status = -1;
+    }
+
+    if (status == 0) {
+        grow_pool(t_max + t_inc);
+        for (int i = 0; i < n; i++) {
+            if (targets[i] != NULL) {
+                *targets[i]->value = values[i];
+            }
+            else if (strcasecmp(argv[1 + 2 * i], "s_port") == 0) {
+                s_port = strdup(argv[2 + 2 * i]);
+            }
+            else {
+                f_port = strdup(argv[2 + 2 * i]);
+            }
+        }
+        pthread_cond_broadcast(&monitor.m_cond);  // let the monitor and the admission thread re-check their bounds
+        sprintf(message, "%d parameter(s) updated", n);
+    }
+
+    pthread_mutex_unlock(&admit.a_mtx);
+    pthread_mutex_unlock(&monitor.m_mtx);
+
+    if (status == 0) {
+        echo->status = "OK";
+        echo->code = 0;
+    }
+    else {
+        echo->status = "ERR";
+        echo->code = EBUSY;
+    }
+    return status;
+}
+
+int show_params(char* buf, size_t size) {
+    size_t len = 0;
+    len += snprintf(buf + len, size - len, "s_port %s\nf_port %s\n", s_port, f_port);
+    for (int i = 0; params[i].key != NULL && len < size; i++) {
+        len += snprintf(buf + len, size - len, "%s %d%s\n", params[i].key, *params[i].value / params[i].scale,
+                        params[i].runtime ? "" : " (startup only)");
+    }
+    return len < size ? len : size - 1;
+}
+
+int load_config(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open config file");
+        return -1;
+    }
+
+    // one "key value" pair per line, blank lines and lines starting with '#' are skipped
+    char line[256];
+    int n_line = 0;
+    int n;
+    while ((n = readLine(fd, line, sizeof(line) - 1)) != -2) {
+        n_line++;
+        if (n == -1) break;
+
+        char* start = line;
+        while (*start == ' ' || *start == '\t') start++;
+        if (*start == '\0' || *start == '#' || *start == '\r') continue;
+        int slen = strlen(start);
+        if (start[slen - 1] == '\r') start[--slen] = '\0';
+
+        char* tokens[slen + 2];
+        tokens[0] = (char*)"SET";
+        int argc = tokenize(start, tokens + 1, slen) + 1;
+
+        struct echo_t echo;
+        if (set_params(argc, tokens, 1, &echo) != 0) {
+            fprintf(stderr, "%s:%d: %s\n", path, n_line, echo.message);
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
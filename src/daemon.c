@@ -3,6 +3,7 @@
 */
 
 #include "define.h"
+#include <sys/eventfd.h>
 
 void logger(const char* message) {
     pthread_mutex_lock(&logger_mutex);
@@ -67,12 +68,13 @@ int free_server(void) {
     logger("(free_server): temporarily closing master socket...");
     fsock_tmp = fsock;
     fsock = -1;
+    eventfd_write(halt_fd, 1);  // stays readable until reset_server() drains it
     sleep(2);
 
     // then, all the client threads will eventually quit on their own, so we just sit and wait
-    // this is because, idle threads blocking on accept will fail due to closed master socket
-    // similarly, busy threads will eventually become idle and fail on accept as well
-    // failed accept has been properly handled in fserv.c on line 551, so that threads exit normally
+    // this is because, idle threads polling the master socket also poll the halt signal and quit
+    // similarly, busy threads will eventually become idle and see the halt signal as well
+    // the halt signal is handled in file_thread() just like a failed accept, so that threads exit normally
     logger("(free_server): waiting for busy clients...");
     for (int i = 0; i < thread_pool_size; i++) {
         if (thread_pool[i].tid == -1) continue;  // skip unused entry
@@ -121,7 +123,7 @@ int stop_server(void) {
     fl.l_len = 0;
 
     logger("(stop_server): releasing server's lock file...");
-    if (fcntl(lockfile, F_SETLK, &fl) == -1) {
+    if (lockfile != -1 && fcntl(lockfile, F_OFD_SETLK, &fl) == -1) {
         perror("unlock log file");
         fflush(stderr);
         exit(1);
@@ -143,6 +145,8 @@ int reset_server(void) {
 
     // re-establish the master socket
     logger("(reset_server): re-establishing master socket connection...");
+    eventfd_t halted;
+    eventfd_read(halt_fd, &halted);
     fsock = fsock_tmp;
 
     // reset thread pool and preallocate a batch of threads
@@ -190,7 +194,9 @@ int daemonize(void) {
     fl.l_start = 0;
     fl.l_len = 0;  // lock to EOF
 
-    if (fcntl(lf, F_SETLK, &fl) == -1) {  // POSIX record locks suffice to ensure mutual exclusion among distinct processes
+    // an OFD lock ensures mutual exclusion among distinct processes just like a POSIX record lock,
+    // but belongs to the open file description, so it survives our exit when a new binary inherits it
+    if (fcntl(lf, F_OFD_SETLK, &fl) == -1) {
         printf("another copy of the server is already running, exiting pid %d...\n", getpid());
         exit(-1);
     }
@@ -231,7 +237,11 @@ int init_server() {
     pthread_attr_setstacksize(&attr, stacksize);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-    // start the daemon
+    // start the daemon (a new binary taking over from an upgrading daemon is one already)
+    if (upgrade_fd != -1) {
+        lockfile = DEBUG_MODE ? -1 : 1;  // the log file on stdout, locked by the old process for both of us
+        return 0;
+    }
     if (!DEBUG_MODE) {
         int pid = fork();
         if (pid == 0) {
@@ -239,6 +249,7 @@ int init_server() {
                 printf("failed to daemonize server\n");
                 return 1;
             }
+            return 0;
         }
         else {
             exit(0);
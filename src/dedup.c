@@ -0,0 +1,589 @@
+/*
+** dedup.c -- content-defined chunking of closed files into a shared, hash-addressed chunk store
+*/
+
+#include "define.h"
+#include <dirent.h>
+
+#define CHUNK_MIN 2048
+#define CHUNK_AVG 8192
+#define CHUNK_MAX 65536
+#define DEDUP_MIN 16384  // smaller files stay as they are, a recipe would not save anything
+#define DEDUP_SWEEP 600  // seconds between two garbage collections of the chunk store
+#define MASK_S 0x0003590703530000ULL  // 15 bits, for cut points before the average chunk size
+#define MASK_L 0x0000d90003530000ULL  // 11 bits, after it
+#define RECIPE_MAGIC "SUFD-RECIPE 1 "
+
+int DEDUP_MODE = 0;  // 1 if files are stored as chunk lists once they are closed
+
+/*
+** a frozen file is a recipe: the line "SUFD-RECIPE 1 size n crc" followed by n lines "chunk length", where crc is
+** the crc32c of those lines, and each chunk lives once in .chunks/xy/<name>, its name being a 64-bit hash and the
+** crc32c of its bytes (with a -k suffix in the unlikely case of a hash collision); reads go to the chunks directly,
+** the first write of an open file turns it back into a plain one, and unreferenced chunks are swept periodically
+*/
+struct recipe_t {
+    off_t size;
+    int n;
+    off_t* offsets;       // of each chunk in the file, n + 1 entries
+    char (*names)[32];
+};
+
+static uint64_t gear[256];  // random values of the rolling hash that finds cut points
+
+static struct {
+    pthread_mutex_t mtx;
+    long frozen;           // files turned into recipes since startup
+    long thawed;           // and back
+    long new_chunks;       // chunks written to the store
+    long new_bytes;
+    long seen_bytes;       // bytes of all the files frozen
+    long swept;            // chunks removed by the last sweep
+    long swept_bytes;
+    long live;             // chunks referenced at the last sweep
+    long live_bytes;
+    long refs;             // references to them
+    long logical;          // bytes of all the recipes found by the last sweep
+    long recipes;
+    time_t last;           // when the last sweep ran
+} dd = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t sweep_mtx = PTHREAD_MUTEX_INITIALIZER;  // one sweep at a time
+static pthread_rwlock_t freeze_lock = PTHREAD_RWLOCK_INITIALIZER;  // held shared by every freeze in progress
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t chunk_hash(const unsigned char* p, int n) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)n;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        h = (h ^ mix64(v)) * 0x9e3779b97f4a7c15ULL;
+        h = h << 29 | h >> 35;
+    }
+    uint64_t v = 0;
+    memcpy(&v, p + i, n - i);
+    return mix64(h ^ mix64(v ^ ((uint64_t)(n - i) << 56)));
+}
+
+// the length of the next chunk of n bytes, normalized around CHUNK_AVG (fastcdc)
+static int cut_point(const unsigned char* p, int n) {
+    if (n <= CHUNK_MIN) return n;
+    if (n > CHUNK_MAX) n = CHUNK_MAX;
+    int normal = n < CHUNK_AVG ? n : CHUNK_AVG;
+    uint64_t fp = 0;
+    int i = CHUNK_MIN;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if ((fp & MASK_S) == 0) return i + 1;
+    }
+    for (; i < n; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if ((fp & MASK_L) == 0) return i + 1;
+    }
+    return n;
+}
+
+static void chunk_path(const char* name, char* path, int size) {
+    snprintf(path, size, ".chunks/%.2s/%s", name, name);
+}
+
+static void side_path(const char* name, const char* suffix, char* path, int size) {
+    const char* slash = strrchr(name, '/');
+    snprintf(path, size, "%.*s.%s.%s", slash == NULL ? 0 : (int)(slash - name + 1), name, slash == NULL ? name : slash + 1, suffix);
+}
+
+// put a chunk in the store unless it is there already, name receives the name it is stored under, 1 if it is new
+static int store_chunk(const unsigned char* p, int n, char* name, unsigned char* scratch) {
+    char base[32], path[64];
+    snprintf(base, sizeof(base), "%016llx%08x", (unsigned long long)chunk_hash(p, n), crc32c(0, p, n));
+    for (int k = 0; k < 8; k++) {
+        if (k == 0) strcpy(name, base);
+        else snprintf(name, 32, "%s-%d", base, k);
+        chunk_path(name, path, sizeof(path));
+
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            struct stat st;
+            int same = fstat(fd, &st) == 0 && st.st_size == n && pread(fd, scratch, n, 0) == n && memcmp(scratch, p, n) == 0;
+            if (same) futimens(fd, NULL);  // recently used, a sweep in progress leaves it alone
+            close(fd);
+            if (same) return 0;
+            continue;  // a different chunk with the same hash, try the next name
+        }
+        if (errno != ENOENT) return -1;
+
+        // written aside and linked into place, so that a chunk is either complete or absent
+        char tmp[64];
+        snprintf(tmp, sizeof(tmp), ".chunks/%.2s/.tmp-%ld-%d", name, (long)gettid(), k);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0) return -1;
+        int status = write(fd, p, n) == n ? 0 : -1;
+        close(fd);
+        if (status == 0 && link(tmp, path) != 0) {
+            status = errno == EEXIST ? 1 : -1;  // stored by someone else meanwhile, compare with theirs
+        }
+        unlink(tmp);
+        if (status == 1) {
+            k--;
+            continue;
+        }
+        return status == 0 ? 1 : -1;
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+// the recipe of a frozen file open as fd, NULL if it is a plain file
+struct recipe_t* load_recipe(int fd) {
+    char head[128];
+    memset(head, 0, sizeof(head));
+    if (pread(fd, head, sizeof(head) - 1, 0) < (ssize_t)strlen(RECIPE_MAGIC) || strncmp(head, RECIPE_MAGIC, strlen(RECIPE_MAGIC)) != 0) {
+        return NULL;
+    }
+    long long size;
+    int n;
+    unsigned int crc;
+    char* end = strchr(head, '\n');
+    struct stat st;
+    if (end == NULL || sscanf(head + strlen(RECIPE_MAGIC), "%lld %d %x", &size, &n, &crc) != 3 || n < 0 || fstat(fd, &st) != 0) {
+        return NULL;
+    }
+    int skip = end + 1 - head;
+    long body_len = st.st_size - skip;
+    char* body = (char*)malloc(body_len + 1);
+    if (body == NULL || pread(fd, body, body_len, skip) != body_len || crc32c(0, body, body_len) != crc) {
+        free(body);
+        return NULL;  // plain data that happens to start like a recipe
+    }
+    body[body_len] = '\0';
+
+    struct recipe_t* r = (struct recipe_t*)malloc(sizeof(struct recipe_t));
+    r->size = size;
+    r->n = n;
+    r->offsets = (off_t*)malloc(sizeof(off_t) * (n + 1));
+    r->names = (char(*)[32])malloc(32 * (n > 0 ? n : 1));
+    off_t at = 0;
+    char* line = body;
+    for (int i = 0; i < n; i++) {
+        int len;
+        if (sscanf(line, "%31s %d", r->names[i], &len) != 2 || (line = strchr(line, '\n')) == NULL) {
+            free(body);
+            free_recipe(r);
+            return NULL;
+        }
+        line++;
+        r->offsets[i] = at;
+        at += len;
+    }
+    r->offsets[n] = at;
+    free(body);
+    return r;
+}
+
+void free_recipe(struct recipe_t* r) {
+    if (r == NULL) return;
+    free(r->offsets);
+    free(r->names);
+    free(r);
+}
+
+off_t recipe_size(struct recipe_t* r) {
+    return r->size;
+}
+
+// read chunk i whole into buf, checking it against the crc in its name, its length or -1 with EIO
+static int read_chunk(struct recipe_t* r, int i, char* buf) {
+    char path[64];
+    chunk_path(r->names[i], path, sizeof(path));
+    int len = r->offsets[i + 1] - r->offsets[i];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        errno = EIO;  // missing from the store
+        return -1;
+    }
+    int got = pread(fd, buf, len, 0);
+    close(fd);
+    unsigned int crc;
+    if (got != len || sscanf(r->names[i] + 16, "%8x", &crc) != 1 || (CHECKSUM_MODE && crc32c(0, buf, len) != crc)) {
+        errno = EIO;
+        return -1;
+    }
+    return len;
+}
+
+// pread() from the chunks of a frozen file
+ssize_t recipe_pread(struct recipe_t* r, char* buf, size_t len, off_t offset) {
+    if (offset >= r->size || len == 0) return 0;
+    if ((off_t)len > r->size - offset) len = r->size - offset;
+
+    int lo = 0, hi = r->n - 1;  // the chunk holding offset
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (r->offsets[mid] <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    char* chunk = (char*)malloc(CHUNK_MAX);
+    size_t done = 0;
+    for (int i = lo; i < r->n && done < len; i++) {
+        if (read_chunk(r, i, chunk) < 0) {
+            free(chunk);
+            return -1;
+        }
+        off_t from = offset + done - r->offsets[i];
+        size_t part = r->offsets[i + 1] - r->offsets[i] - from;
+        if (part > len - done) part = len - done;
+        memcpy(buf + done, chunk + from, part);
+        done += part;
+    }
+    free(chunk);
+    return done;
+}
+
+// write the whole contents of a frozen file into out
+int recipe_copy(struct recipe_t* r, int out) {
+    char* chunk = (char*)malloc(CHUNK_MAX);
+    int status = 0;
+    for (int i = 0; i < r->n && status == 0; i++) {
+        int len = read_chunk(r, i, chunk);
+        status = len < 0 || pwrite(out, chunk, len, r->offsets[i]) != len ? -1 : 0;
+    }
+    free(chunk);
+    return status == 0 ? ftruncate(out, r->size) : -1;
+}
+
+// replace the frozen file open as fd by a plain copy of its contents, under the same descriptor number
+int thaw_file(const char* name, int fd, struct recipe_t* r, int ofd_lock) {
+    char tmp_name[300];
+    side_path(name, "thaw", tmp_name, sizeof(tmp_name));
+    int tmp = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (tmp < 0) return -1;
+
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (recipe_copy(r, tmp) != 0 || fdatasync(tmp) != 0 || (ofd_lock && fcntl(tmp, F_OFD_SETLK, &fl) == -1) ||
+        rename(tmp_name, name) != 0) {
+        close(tmp);
+        unlink(tmp_name);
+        return -1;
+    }
+    dup2(tmp, fd);  // the identifier the clients know stays valid, the recipe goes away with the old description
+    close(tmp);
+    lseek(fd, pos, SEEK_SET);
+
+    pthread_mutex_lock(&dd.mtx);
+    dd.thawed++;
+    pthread_mutex_unlock(&dd.mtx);
+    return 0;
+}
+
+// make an open file plain before it is written, the caller is its writer
+int thaw_lock(struct lock_t* lock) {
+    lock->dirty = 1;  // every write goes through here first
+    if (lock->recipe == NULL) return 0;
+    if (thaw_file(lock->f_name, lock->fd, lock->recipe, 1) != 0) return -1;
+    free_recipe(lock->recipe);
+    lock->recipe = NULL;
+    lock->crc_fd = crc_open(lock->f_name, lock->fd);
+    return 0;
+}
+
+// read from an open file, through its chunks if it is frozen
+ssize_t lock_pread(struct lock_t* lock, char* buf, size_t len, off_t offset) {
+    long began = trace_clock();
+    ssize_t n = lock->recipe != NULL ? recipe_pread(lock->recipe, buf, len, offset) : crc_pread(lock->crc_fd, lock->fd, buf, len, offset);
+    trace_io("read", n, began);
+    return n;
+}
+
+// read from a file that is not open, frozen or not
+ssize_t read_contents(const char* name, char* buf, size_t len, off_t offset) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return -1;
+    struct recipe_t* r = load_recipe(fd);
+    ssize_t n = r != NULL ? recipe_pread(r, buf, len, offset) : pread(fd, buf, len, offset);
+    int saved = errno;
+    free_recipe(r);
+    close(fd);
+    errno = saved;
+    return n;
+}
+
+// a read-only descriptor on the contents of a file, an unnamed copy with the same mtime if it is frozen
+int open_contents(const char* name) {
+    int fd = open(name, O_RDONLY);
+    struct recipe_t* r = fd < 0 ? NULL : load_recipe(fd);
+    if (r == NULL) return fd;
+
+    char dir[256];
+    const char* slash = strrchr(name, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash == NULL ? 1 : (int)(slash - name), slash == NULL ? "." : name);
+    int tmp = open(dir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+    struct stat st;
+    if (tmp < 0 || recipe_copy(r, tmp) != 0 || fstat(fd, &st) != 0) {
+        if (tmp >= 0) close(tmp);
+        tmp = -1;
+    }
+    else {
+        struct timespec times[2];
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = st.st_mtim;  // what a resync compares with the peer's copy
+        futimens(tmp, times);
+    }
+    free_recipe(r);
+    close(fd);
+    return tmp;
+}
+
+// turn a plain file that is being closed into a recipe, 0 if it was, 1 if it stays as it is
+int freeze_file(const char* name, int fd) {
+    struct stat st;
+    if (!DEDUP_MODE || fstat(fd, &st) != 0 || st.st_size < DEDUP_MIN) return 1;
+    pthread_rwlock_rdlock(&freeze_lock);
+
+    int cap = 1 << 20;
+    unsigned char* buf = (unsigned char*)malloc(cap);
+    unsigned char* scratch = (unsigned char*)malloc(CHUNK_MAX);
+    long body_cap = 4096, body_len = 0;
+    char* body = (char*)malloc(body_cap);
+    int n = 0, have = 0, status = 0;
+    long new_chunks = 0, new_bytes = 0;
+    off_t at = 0;  // file offset of buf[0]
+    for (int eof = 0; status == 0 && (!eof || have > 0);) {
+        if (!eof && have < CHUNK_MAX) {
+            ssize_t got = pread(fd, buf + have, cap - have, at + have);
+            if (got < 0) status = -1;
+            if (got <= 0) eof = 1;
+            else have += got;
+            continue;
+        }
+        int len = cut_point(buf, have);
+        char name_of[32];
+        int fresh = store_chunk(buf, len, name_of, scratch);
+        if (fresh < 0) {
+            status = -1;
+            break;
+        }
+        new_chunks += fresh;
+        new_bytes += fresh ? len : 0;
+        if (body_len + 64 > body_cap) {
+            body_cap *= 2;
+            body = (char*)realloc(body, body_cap);
+        }
+        body_len += sprintf(body + body_len, "%s %d\n", name_of, len);
+        n++;
+        memmove(buf, buf + len, have - len);
+        have -= len;
+        at += len;
+    }
+    free(buf);
+    free(scratch);
+
+    // the new chunks reach the disk before the recipe that needs them replaces the data
+    char tmp_name[300];
+    side_path(name, "recipe", tmp_name, sizeof(tmp_name));
+    int tmp = status == 0 ? open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR) : -1;
+    if (tmp >= 0) {
+        char head[128];
+        int head_len = sprintf(head, RECIPE_MAGIC "%lld %d %08x\n", (long long)at, n, crc32c(0, body, body_len));
+        status = (new_chunks > 0 && syncfs(tmp) != 0) || write(tmp, head, head_len) != head_len || write(tmp, body, body_len) != body_len ||
+                 fdatasync(tmp) != 0 || rename(tmp_name, name) != 0 ? -1 : 0;
+        close(tmp);
+        if (status != 0) unlink(tmp_name);
+    }
+    free(body);
+    pthread_rwlock_unlock(&freeze_lock);
+    if (status != 0 || tmp < 0) {
+        return -1;  // the file stays plain, chunks written for it are swept later
+    }
+    crc_remove(name);  // the chunks carry their own crc
+
+    pthread_mutex_lock(&dd.mtx);
+    dd.frozen++;
+    dd.new_chunks += new_chunks;
+    dd.new_bytes += new_bytes;
+    dd.seen_bytes += at;
+    pthread_mutex_unlock(&dd.mtx);
+    return 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+** mark and sweep: every recipe under the run directory is read and the references to each chunk counted,
+** then chunks nobody references are removed; a chunk written or reused since the sweep started is kept,
+** since the recipe that needs it may not have been in place when we walked past
+*/
+int sweep_chunks(void) {
+    pthread_mutex_lock(&sweep_mtx);
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+    pthread_rwlock_wrlock(&freeze_lock);  // a freeze that reused chunks before we started has its recipe in place
+    pthread_rwlock_unlock(&freeze_lock);
+
+    char** files = NULL;
+    int n_files = list_files(&files);
+    char** refs = NULL;
+    long n_refs = 0, cap_refs = 0, logical = 0, recipes = 0;
+    for (int f = 0; f < n_files; f++) {
+        int fd = open(files[f], O_RDONLY);
+        struct recipe_t* r = fd < 0 ? NULL : load_recipe(fd);
+        if (fd >= 0) close(fd);
+        free(files[f]);
+        if (r == NULL) continue;
+        recipes++;
+        logical += r->size;
+        for (int i = 0; i < r->n; i++) {
+            if (n_refs == cap_refs) {
+                cap_refs = cap_refs == 0 ? 1024 : cap_refs * 2;
+                refs = (char**)realloc(refs, sizeof(char*) * cap_refs);
+            }
+            refs[n_refs++] = strdup(r->names[i]);
+        }
+        free_recipe(r);
+    }
+    free(files);
+    qsort(refs, n_refs, sizeof(char*), compare_names);
+
+    long live = 0, live_bytes = 0, swept = 0, swept_bytes = 0;
+    for (int d = 0; d < 256; d++) {
+        char dir_name[32];
+        sprintf(dir_name, ".chunks/%02x", d);
+        DIR* dir = opendir(dir_name);
+        if (dir == NULL) continue;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.' && strncmp(entry->d_name, ".tmp-", 5) != 0) continue;
+            char path[300];
+            snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
+            struct stat st;
+            if (stat(path, &st) != 0) continue;
+            const char* key = entry->d_name;
+            int referenced = entry->d_name[0] != '.' && bsearch(&key, refs, n_refs, sizeof(char*), compare_names) != NULL;
+            int recent = st.st_mtim.tv_sec > start.tv_sec - (entry->d_name[0] == '.' ? 3600 : 0) ||
+                         (st.st_mtim.tv_sec == start.tv_sec && st.st_mtim.tv_nsec >= start.tv_nsec);
+            if (referenced || recent) {
+                if (referenced) {
+                    live++;
+                    live_bytes += st.st_size;
+                }
+                continue;
+            }
+            if (unlink(path) == 0) {  // including temporaries left behind by a crash an hour ago or more
+                swept++;
+                swept_bytes += st.st_size;
+            }
+        }
+        closedir(dir);
+    }
+    for (long i = 0; i < n_refs; i++) free(refs[i]);
+    free(refs);
+
+    pthread_mutex_lock(&dd.mtx);
+    dd.swept = swept;
+    dd.swept_bytes = swept_bytes;
+    dd.live = live;
+    dd.live_bytes = live_bytes;
+    dd.refs = n_refs;
+    dd.logical = logical;
+    dd.recipes = recipes;
+    dd.last = start.tv_sec;
+    pthread_mutex_unlock(&dd.mtx);
+    pthread_mutex_unlock(&sweep_mtx);
+    return 0;
+}
+
+// keep the sweeps away while a snapshot still needs the chunks its recipes refer to, or let them run again
+void hold_chunks(int hold) {
+    if (hold) pthread_mutex_lock(&sweep_mtx);
+    else pthread_mutex_unlock(&sweep_mtx);
+}
+
+// share every chunk with a snapshot in dir, chunks never change once written; returns the chunks shared
+long link_chunks(const char* dir) {
+    char path[400];
+    snprintf(path, sizeof(path), "%s/.chunks", dir);
+    if (access(".chunks", F_OK) != 0) return 0;
+    if (mkdir(path, S_IRWXU) != 0 && errno != EEXIST) return -1;
+
+    long n = 0;
+    for (int d = 0; d < 256; d++) {
+        char dir_name[32];
+        sprintf(dir_name, ".chunks/%02x", d);
+        DIR* in = opendir(dir_name);
+        if (in == NULL) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, dir_name);
+        mkdir(path, S_IRWXU);
+        struct dirent* entry;
+        while ((entry = readdir(in)) != NULL && n >= 0) {
+            if (entry->d_name[0] == '.') continue;  // temporaries of chunks still being stored
+            char from[300];
+            snprintf(from, sizeof(from), "%s/%s", dir_name, entry->d_name);
+            snprintf(path, sizeof(path), "%s/%s", dir, from);
+            n = snap_link(from, path) == 0 ? n + 1 : -1;
+        }
+        closedir(in);
+        if (n < 0) return -1;
+    }
+    return n;
+}
+
+static void* sweep_thread(void* arg) {
+    while (1) {
+        sleep(DEDUP_SWEEP);
+        sweep_chunks();
+    }
+    return NULL;
+}
+
+// the chunk store, what the last sweep found in it and what the server has done since startup
+int show_dedup(char* buf, size_t size) {
+    pthread_mutex_lock(&dd.mtx);
+    int len = snprintf(buf, size, "dedup %s, %ld files frozen (%ld bytes) into %ld new chunks (%ld bytes), %ld thawed\n",
+                       DEDUP_MODE ? "on" : "off", dd.frozen, dd.seen_bytes, dd.new_chunks, dd.new_bytes, dd.thawed);
+    if (dd.last == 0) {
+        len += snprintf(buf + len, size - len, "no sweep yet, the next one runs within %ds\n", DEDUP_SWEEP);
+    } else {
+        len += snprintf(buf + len, size - len, "last sweep %lds ago: %ld recipes of %ld bytes, %ld chunks of %ld bytes referenced "
+                        "%ld times (%.2fx), %ld chunks of %ld bytes removed\n", (long)(time(NULL) - dd.last), dd.recipes, dd.logical,
+                        dd.live, dd.live_bytes, dd.refs, dd.live_bytes > 0 ? (double)dd.logical / dd.live_bytes : 1.0, dd.swept,
+                        dd.swept_bytes);
+    }
+    pthread_mutex_unlock(&dd.mtx);
+    return len;
+}
+
+int init_dedup(void) {
+    uint64_t seed = 0x5f0d0000d3d0ULL;
+    for (int i = 0; i < 256; i++) {  // splitmix64, the same table on every node and every run
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    if (!DEDUP_MODE) return 0;
+
+    mkdir(".chunks", S_IRWXU);
+    for (int d = 0; d < 256; d++) {
+        char dir_name[32];
+        sprintf(dir_name, ".chunks/%02x", d);
+        if (mkdir(dir_name, S_IRWXU) != 0 && errno != EEXIST) return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, sweep_thread, NULL) != 0) return -1;
+    pthread_detach(tid);
+    logger("(dedup): files are stored as chunks once they are closed");
+    return 0;
+}
@@ -0,0 +1,359 @@
+/*
+** fops.c -- server-side copy, append, truncate, preallocate and stat of open files
+*/
+
+#include "define.h"
+
+static __thread char message[128];  // a response that carries numbers, valid until the next request
+
+static void take_reader(struct lock_t* lock) {
+    pthread_mutex_lock(&lock->f_mtx);
+    while (lock->n_writer > 0) {
+        wait_file(lock, 0);
+    }
+    take_file(lock, 0);
+    pthread_mutex_unlock(&lock->f_mtx);
+}
+
+static void drop_reader(struct lock_t* lock) {
+    pthread_mutex_lock(&lock->f_mtx);
+    drop_file(lock, 0);
+    pthread_cond_broadcast(&lock->f_cond);
+    pthread_mutex_unlock(&lock->f_mtx);
+}
+
+static void take_writer(struct lock_t* lock) {
+    pthread_mutex_lock(&lock->f_mtx);
+    while (lock->n_reader > 0 || lock->n_writer > 0) {
+        wait_file(lock, 1);
+    }
+    take_file(lock, 1);
+    pthread_mutex_unlock(&lock->f_mtx);
+}
+
+static void drop_writer(struct lock_t* lock) {
+    pthread_mutex_lock(&lock->f_mtx);
+    drop_file(lock, 1);
+    pthread_cond_broadcast(&lock->f_cond);
+    pthread_mutex_unlock(&lock->f_mtx);
+}
+
+// validate "COMMAND identifier ..." with argc arguments, the first n_digits of which are numbers,
+// and that the identifier is the file of lock_id
+static int check_request(int argc, char** argv, int expected, int n_digits, const char* usage, struct echo_t* echo, int lock_id) {
+    if (argc != expected) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = (char*)usage;
+        return -1;
+    }
+    for (int i = 1; i <= n_digits; i++) {
+        if (checkDigit(argv[i]) == 0) {
+            echo->status = "FAIL";
+            echo->code = -5;
+            echo->message = "invalid argument(s)";
+            return -1;
+        }
+    }
+    if (atoi(argv[1]) != locks[lock_id].fd || locks[lock_id].fd <= 0) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "invalid identifier, no such file or directory";
+        return -1;
+    }
+    return 0;
+}
+
+// copy the whole of one file over another in the kernel, the target ends up exactly as long as the source
+int copy_contents(int in, int out) {
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        return -1;
+    }
+    off_t in_off = 0, out_off = 0;
+    while (in_off < st.st_size) {
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, st.st_size - in_off, 0);
+        if (n == 0) break;  // the source got shorter under us
+        if (n > 0) continue;
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+
+        // a kernel or file system that cannot copy between these files, go through our buffer instead
+        char buf[IO_BUF_SIZE];
+        ssize_t got = pread(in, buf, sizeof(buf), in_off);
+        if (got <= 0) {
+            if (got < 0) return -1;
+            break;
+        }
+        if (pwrite(out, buf, got, out_off) != got) {
+            return -1;
+        }
+        in_off += got;
+        out_off += got;
+    }
+    return ftruncate(out, out_off);
+}
+
+// copy through the store's own reads and writes, for a backend the kernel cannot copy within
+static int copy_stored(struct lock_t* src, struct lock_t* dst, off_t size) {
+    char buf[LINK_BUF_SIZE];
+    for (off_t off = 0; off < size;) {
+        ssize_t got = store->pread(src, buf, sizeof(buf), off);
+        if (got <= 0) {
+            if (got < 0) return -1;
+            break;
+        }
+        if (store->pwrite(dst, buf, got, off) != got) {
+            return -1;
+        }
+        off += got;
+    }
+    return store->truncate(dst, size);
+}
+
+// FCOPY identifier filename: copy the open file to another path without the bytes leaving the server
+int copier(int argc, char** argv, struct echo_t* echo, int lock_id) {
+    if (check_request(argc, argv, 3, 1, "Usage: FCOPY identifier filename", echo, lock_id) != 0) {
+        return 0;
+    }
+    struct lock_t* src = &locks[lock_id];
+    const char* target = argv[2];
+    if (strcmp(target, src->f_name) == 0) {
+        echo->status = "FAIL";
+        echo->code = -5;
+        echo->message = "cannot copy a file onto itself";
+        return 0;
+    }
+
+    // if the target is open too, we write it as its writer, both locks taken in lock table order
+    int dst_id = name_lock(target);
+    if (dst_id >= 0 && (locks[dst_id].fd <= 0 || strcmp(locks[dst_id].f_name, target) != 0)) dst_id = -1;
+    struct lock_t* dst = dst_id >= 0 ? &locks[dst_id] : NULL;
+    if (dst != NULL && dst_id < lock_id) take_writer(dst);
+    take_reader(src);
+    if (dst != NULL && dst_id > lock_id) take_writer(dst);
+
+    struct stat st;
+    int status = store->stat(src, &st);
+    if (status == 0 && dst != NULL && thaw_lock(dst) != 0) {
+        status = -1;
+    }
+    if (status == 0 && RAFT_MODE) {
+        // every member copies its own replica of the file once a majority has the entry
+        if (raft_commit('Y', target, 0, src->f_name, strlen(src->f_name)) != 0) {
+            status = -2;
+        }
+    }
+    else if (status == 0 && src->lfile != NULL) {
+        // segments hold the data of one name each, so the target is written through the store, opened here if it is closed
+        struct lock_t closed;
+        memset(&closed, 0, sizeof(closed));
+        struct lock_t* out = dst;
+        if (out == NULL && (closed.fd = store->open(target, 1, &closed)) >= 0) {
+            out = &closed;
+            name_added(target);
+        }
+        status = out == NULL ? (errno == EBUSY ? -3 : -1) : copy_stored(src, out, st.st_size);
+        if (status == 0) {
+            replicate('Y', target, 0, src->f_name, strlen(src->f_name));
+        }
+        if (out == &closed && store->close(&closed) != 0 && status == 0) {
+            status = -1;
+        }
+    }
+    else if (status == 0) {
+        int fd = dst != NULL ? dst->fd : open(target, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+        if (dst == NULL && fd >= 0) name_added(target);
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        if (fd < 0) {
+            status = -1;
+        }
+        else if (dst == NULL && fcntl(fd, F_OFD_SETLK, &fl) == -1) {
+            status = -3;  // opened by someone since we looked, no copying under their feet
+            close(fd);
+        }
+        else {
+            // a frozen source copied over a closed target makes a frozen copy sharing its chunks,
+            // an open target is written the data itself
+            snap_enter(target);
+            status = dst != NULL && src->recipe != NULL ? recipe_copy(src->recipe, fd) : copy_contents(src->fd, fd);
+            snap_leave();
+            if (dst != NULL) touch_lock(dst);
+            if (status == 0 && dst != NULL) {
+                crc_update(dst->crc_fd, fd, 0, st.st_size);  // a closed target gets its sums rebuilt when it is next opened
+            }
+            if (status == 0) {
+                replicate('Y', target, 0, src->f_name, strlen(src->f_name));
+            }
+            if (dst == NULL) {
+                close(fd);  // also releases our OFD lock
+            }
+        }
+    }
+
+    if (dst != NULL) drop_writer(dst);
+    drop_reader(src);
+
+    if (status != 0) {
+        echo->status = (char*)(status == -1 ? "FAIL" : "ERR");
+        echo->code = status == -1 ? errno : (status == -2 ? EREMOTE : EBUSY);
+        echo->message = (char*)(status == -1 ? "cannot copy file" : (status == -2 ? "leadership lost, the copy may or may not have been committed"
+                                                                                 : "target file is busy, retry later"));
+        return 0;
+    }
+    memset(message, 0, sizeof(message));
+    sprintf(message, "%lld bytes copied", (long long)st.st_size);
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = message;
+    return 0;
+}
+
+// FAPPEND identifier bytes: write at the end of the file as it is when we get the writer lock, no FSEEK needed
+int appender(int argc, char** argv, struct echo_t* echo, int lock_id) {
+    if (check_request(argc, argv, 3, 1, "Usage: FAPPEND identifier bytes", echo, lock_id) != 0) {
+        return 0;
+    }
+    struct lock_t* lock = &locks[lock_id];
+    const char* buf = argv[2];
+    int len = strlen(buf);
+
+    take_writer(lock);
+    struct stat st;
+    int status = thaw_lock(lock) == 0 ? store->stat(lock, &st) : -1;
+    off_t offset = status == 0 ? st.st_size : 0;
+    if (status == 0 && RAFT_MODE) {
+        status = raft_commit('W', lock->f_name, offset, buf, len) != 0 ? -2 : 0;
+    }
+    else if (status == 0) {
+        status = store->pwrite(lock, buf, len, offset) == len ? 0 : -1;  // the seek pointer stays where it is
+        if (status == 0) {
+            replicate('W', lock->f_name, offset, buf, len);
+        }
+    }
+    drop_writer(lock);
+
+    if (status != 0) {
+        echo->status = (char*)(status == -1 ? "FAIL" : "ERR");
+        echo->code = status == -1 ? errno : EREMOTE;
+        echo->message = (char*)(status == -1 ? "cannot append to the file" : "leadership lost, the append may or may not have been committed");
+        return 0;
+    }
+    memset(message, 0, sizeof(message));
+    sprintf(message, "data appended at offset %lld", (long long)offset);
+    echo->status = "OK";
+    echo->code = len;
+    echo->message = message;
+    return 0;
+}
+
+// FTRUNC identifier length: cut the file down, or extend it with zeros, to length bytes
+int truncater(int argc, char** argv, struct echo_t* echo, int lock_id) {
+    if (check_request(argc, argv, 3, 2, "Usage: FTRUNC identifier length", echo, lock_id) != 0) {
+        return 0;
+    }
+    struct lock_t* lock = &locks[lock_id];
+    off_t length = atol(argv[2]);
+
+    take_writer(lock);
+    int status;
+    if (thaw_lock(lock) != 0) {
+        status = -1;
+    }
+    else if (RAFT_MODE) {
+        status = raft_commit('T', lock->f_name, length, NULL, 0) != 0 ? -2 : 0;
+    }
+    else {
+        status = store->truncate(lock, length);
+        if (status == 0) {
+            replicate('T', lock->f_name, length, NULL, 0);
+        }
+    }
+    drop_writer(lock);
+
+    if (status != 0) {
+        echo->status = (char*)(status == -1 ? "FAIL" : "ERR");
+        echo->code = status == -1 ? errno : EREMOTE;
+        echo->message = (char*)(status == -1 ? "cannot truncate the file" : "leadership lost, the truncate may or may not have been committed");
+        return 0;
+    }
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = "file truncated";
+    return 0;
+}
+
+// FALLOC identifier offset length: reserve disk blocks for a range so that later writes to it cannot run out of space
+int allocator(int argc, char** argv, struct echo_t* echo, int lock_id) {
+    if (check_request(argc, argv, 4, 3, "Usage: FALLOC identifier offset length", echo, lock_id) != 0) {
+        return 0;
+    }
+    struct lock_t* lock = &locks[lock_id];
+    off_t offset = atol(argv[2]);
+    char* length = argv[3];  // replicated as the record's data
+    if (atol(length) <= 0) {
+        echo->status = "FAIL";
+        echo->code = -6;
+        echo->message = "invalid length value";
+        return 0;
+    }
+
+    take_writer(lock);
+    int status;
+    if (thaw_lock(lock) != 0) {
+        status = -1;
+    }
+    else if (RAFT_MODE) {
+        status = raft_commit('A', lock->f_name, offset, length, strlen(length)) != 0 ? -2 : 0;
+    }
+    else {
+        status = store->allocate(lock, offset, atol(length));
+        if (status == 0) {
+            replicate('A', lock->f_name, offset, length, strlen(length));
+        }
+    }
+    drop_writer(lock);
+
+    if (status != 0) {
+        echo->status = (char*)(status == -1 ? "FAIL" : "ERR");
+        echo->code = status == -1 ? errno : EREMOTE;
+        echo->message = (char*)(status == -1 ? "cannot allocate space for the file" : "leadership lost, the allocation may or may not have been committed");
+        return 0;
+    }
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = "space allocated";
+    return 0;
+}
+
+// FSTAT identifier: size, allocated blocks, seek pointer and modification time of the file
+int stater(int argc, char** argv, struct echo_t* echo, int lock_id) {
+    if (check_request(argc, argv, 2, 1, "Usage: FSTAT identifier", echo, lock_id) != 0) {
+        return 0;
+    }
+    struct lock_t* lock = &locks[lock_id];
+
+    take_reader(lock);  // not in the middle of a write
+    struct stat st;
+    int status = store->stat(lock, &st);
+    off_t pos = lseek(lock->fd, 0, SEEK_CUR);
+    drop_reader(lock);
+
+    if (status != 0) {
+        echo->status = "FAIL";
+        echo->code = errno;
+        echo->message = "cannot stat the file";
+        return 0;
+    }
+    memset(message, 0, sizeof(message));
+    sprintf(message, "size %lld blocks %lld pos %lld mtime %ld.%09ld", (long long)st.st_size, (long long)st.st_blocks,
+            (long long)pos, (long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = message;
+    return 0;
+}
@@ -5,10 +5,19 @@
 #include "define.h"
 
 void reset_lock(int lock_id) {
+    close_heat(&locks[lock_id]);
     if (locks[lock_id].fd > 0) {
-        close(locks[lock_id].fd);
+        store->close(&locks[lock_id]);
+    }
+    if (locks[lock_id].f_name[0] != '\0') {
+        name_opened(locks[lock_id].f_name, -1);
     }
     locks[lock_id].fd = -1;
+    locks[lock_id].crc_fd = -1;
+    free_recipe(locks[lock_id].recipe);
+    locks[lock_id].recipe = NULL;
+    locks[lock_id].dirty = 0;
+    locks[lock_id].lfile = NULL;
     // unlink(locks[lock_id].f_name);  // should not delete file
     memset(&locks[lock_id].f_name, 0, sizeof(locks[lock_id].f_name));
     locks[lock_id].n_reader = 0;
@@ -17,6 +26,15 @@ void reset_lock(int lock_id) {
     pthread_cond_destroy(&locks[lock_id].f_cond);  // release resource
 }
 
+// the lock_id of the open file with this identifier, 0 if none matches (the handler then reports ENOENT)
+static int find_lock(const char* identifier) {
+    int fd = atoi(identifier);
+    for (int i = 0; fd > 0 && i < n_lock; i++) {
+        if (locks[i].fd == fd) return i;
+    }
+    return 0;
+}
+
 int opener(int argc, char** argv, struct echo_t* echo) {
     // validate request format
     if (argc != 2) {
@@ -26,33 +44,45 @@ int opener(int argc, char** argv, struct echo_t* echo) {
         return 0;
     }
     char* filename = argv[1];
+    if (normal_name(filename) != 0) {  // "./a" and "a//b" are opened as "a" and "a/b", so each file has one lock entry
+        echo->status = "ERR";
+        echo->code = EACCES;
+        echo->message = "only files under the run directory can be opened";
+        return 0;
+    }
 
-    struct flock fl;
-    memset(&fl, 0, sizeof(fl));
-    fl.l_type = F_WRLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;  // lock to EOF
+    // a new file is created on every raft member through the log before we open it here
+    if (RAFT_MODE && access(filename, F_OK) != 0 && raft_commit('O', filename, 0, NULL, 0) != 0) {
+        echo->status = "ERR";
+        echo->code = EREMOTE;
+        echo->message = "leadership lost, cannot create file";
+        return 0;
+    }
 
-    int fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);  // if file already opened by another thread, we get a new fd for the same file
-    if (fd < 0) {
+    // files on a replica are created by the primary's log only
+    struct lock_t opened;  // what the store keeps of the file, copied into its lock entry below
+    memset(&opened, 0, sizeof(opened));
+    int fd = store->open(filename, !REPLICA_MODE, &opened);
+    if (fd < 0 && errno != EBUSY) {
         echo->status = "FAIL";
         echo->code = errno;
         echo->message = "cannot open file";
         return 0;
     }
 
-    if (fcntl(fd, F_OFD_SETLK, &fl) == -1) {  // OFD (open file description) locks are mutual exclusive among threads
-        close(fd);  // when file already opened, we just close this new fd and use the previously opened fd
+    if (fd < 0) {  // when file already opened, we use the previously opened fd
         echo->status = "ERR";
         echo->message = "file already opened";
         // find identifier of the already opened file
-        for (int i = 0; i < n_lock; i++) {
-            if (strcmp(locks[i].f_name, filename) == 0) {
-                echo->code = locks[i].fd;  // identifier
-                return i;  // lock_id
-            }
+        int i = name_lock(filename);
+        if (i >= 0 && strcmp(locks[i].f_name, filename) == 0) {
+            echo->code = locks[i].fd;  // identifier
+            return i;  // lock_id
         }
+        echo->status = "ERR";  // locked, but not by an open file of ours: a server-side copy is writing it
+        echo->code = EBUSY;
+        echo->message = "file is busy, retry later";
+        return 0;
     }
 
     // if we reach this, file is opened for the 1st time, assign it a new lock_id, and increment n_lock
@@ -64,11 +94,19 @@ int opener(int argc, char** argv, struct echo_t* echo) {
     // activate locks[lock_id], prepare file for future manipulation
     memset(&locks[lock_id].f_name, 0, sizeof(locks[lock_id].f_name));
     strcpy(locks[lock_id].f_name, filename);
+    open_heat(&locks[lock_id], filename);
     locks[lock_id].fd = fd;
+    locks[lock_id].recipe = opened.recipe;
+    locks[lock_id].dirty = 0;
+    locks[lock_id].crc_fd = opened.crc_fd;
+    locks[lock_id].lfile = opened.lfile;
     locks[lock_id].n_reader = 0;
     locks[lock_id].n_writer = 0;
     pthread_mutex_init(&locks[lock_id].f_mtx, NULL);
     pthread_cond_init(&locks[lock_id].f_cond, NULL);
+    name_opened(filename, lock_id);  // created, if it was not there
+    touch_lock(&locks[lock_id]);  // a window prefetched from the file that had this slot before is stale
+    replicate('O', filename, 0, NULL, 0);
 
     // success response
     echo->status = "OK";
@@ -94,7 +132,7 @@ int seeker(int argc, char** argv, struct echo_t* echo, int lock_id) {
     }
 
     int identifier = atoi(argv[1]);
-    off_t offset = atoi(argv[2]);  // offset can be negative!
+    off_t offset = atoll(argv[2]);  // offset can be negative!
     struct lock_t* lock = &locks[lock_id];
 
     if (identifier != lock->fd || lock->fd <= 0) {
@@ -107,23 +145,28 @@ int seeker(int argc, char** argv, struct echo_t* echo, int lock_id) {
     // waiting for resources
     pthread_mutex_lock(&lock->f_mtx);
     while (lock->n_reader > 0 || lock->n_writer > 0) {
-        pthread_cond_wait(&lock->f_cond, &lock->f_mtx);
+        wait_file(lock, 1);
     }
-    lock->n_writer++;  // seek is equivalent to a write
+    take_file(lock, 1);  // seek is equivalent to a write
     pthread_mutex_unlock(&lock->f_mtx);
 
     // seeking... all threads share one seek pointer on the same file
-    int pos = lseek(identifier, offset, SEEK_CUR);  // position of the seek pointer
+    off_t pos = lseek(identifier, offset, SEEK_CUR);  // position of the seek pointer
     if (pos == -1) {
+        pthread_mutex_lock(&lock->f_mtx);
+        drop_file(lock, 1);
+        pthread_cond_broadcast(&lock->f_cond);
+        pthread_mutex_unlock(&lock->f_mtx);
         echo->status = "FAIL";
         echo->code = errno;
         echo->message = "system call lseek() returns -1";
         return 0;
     }
+    replicate('S', lock->f_name, pos, NULL, 0);  // while still the writer, so that the log keeps our order
 
     // writing finished
     pthread_mutex_lock(&lock->f_mtx);
-    lock->n_writer--;
+    drop_file(lock, 1);
     pthread_cond_broadcast(&lock->f_cond);
     pthread_mutex_unlock(&lock->f_mtx);
 
@@ -132,21 +175,21 @@ int seeker(int argc, char** argv, struct echo_t* echo, int lock_id) {
     echo->code = 0;
     char temp[100];
     memset(temp, 0, sizeof(temp));
-    sprintf(temp, "seek pointer is now %d bytes from the beginning of the file", pos);
+    sprintf(temp, "seek pointer is now %lld bytes from the beginning of the file", (long long)pos);
     echo->message = strdup(temp);
 
     return 0;
 }
 
-int reader(int argc, char** argv, struct echo_t* echo, int lock_id) {
+int reader(int argc, char** argv, struct echo_t* echo, int lock_id, struct readahead_t* ra) {
     // validate request format
-    if (argc != 3) {
+    if (argc != 3 && argc != 4) {
         echo->status = "FAIL";
         echo->code = -1;
-        echo->message = "Usage: FREAD identifier length";
+        echo->message = "Usage: FREAD identifier length [staleness]";
         return 0;
     }
-    if (checkDigit(argv[1]) == 0 || checkDigit(argv[2]) == 0) {
+    if (checkDigit(argv[1]) == 0 || checkDigit(argv[2]) == 0 || (argc == 4 && checkDigit(argv[3]) == 0)) {
         echo->status = "FAIL";
         echo->code = -5;
         echo->message = "invalid argument(s)";
@@ -155,6 +198,7 @@ int reader(int argc, char** argv, struct echo_t* echo, int lock_id) {
 
     int identifier = atoi(argv[1]);
     int len = atoi(argv[2]);
+    int bound = argc == 4 ? atoi(argv[3]) : -1;  // milliseconds of staleness the client accepts, -1 if it does not say
     struct lock_t* lock = &locks[lock_id];
 
     if (len < 0) {
@@ -171,12 +215,25 @@ int reader(int argc, char** argv, struct echo_t* echo, int lock_id) {
         return 0;
     }
 
+    // under raft, the leader serves reads locally as long as a majority has recently confirmed its leadership
+    if (RAFT_MODE && raft_read() != 0) {
+        echo->status = "ERR";
+        echo->code = EREMOTE;
+        echo->message = "leader lease expired, retry later";
+        return 0;
+    }
+
+    // a replica serves the read only if it was current with the primary within the client's bound
+    if (check_stale(bound, echo) != 0) {
+        return 0;
+    }
+
     // waiting for resources
     pthread_mutex_lock(&lock->f_mtx);
     while (lock->n_writer > 0) {
-        pthread_cond_wait(&lock->f_cond, &lock->f_mtx);
+        wait_file(lock, 0);
     }
-    lock->n_reader++;
+    take_file(lock, 0);
     pthread_mutex_unlock(&lock->f_mtx);
 
     // reading...
@@ -187,17 +244,59 @@ int reader(int argc, char** argv, struct echo_t* echo, int lock_id) {
         logger(msg);
         sleep(3);
     }
-    char buf[4096];
-    memset(buf, 0, sizeof(buf));
-    int n = read(lock->fd, buf, len);
+    char* buf = io_buf;  // per-thread buffer, stays valid after we return
+    memset(buf, 0, IO_BUF_SIZE);
+    if (len > IO_BUF_SIZE - 1) {
+        len = IO_BUF_SIZE - 1;
+    }
+    int n;
+    if (bound >= 0 && n_peers > 0) {
+        // reserve our range of the shared offset so that concurrent readers still get consecutive chunks,
+        // then let a less busy replica within the bound serve it, or read it ourselves
+        pthread_mutex_lock(&lock->f_mtx);
+        off_t offset = lseek(lock->fd, 0, SEEK_CUR);
+        lseek(lock->fd, offset + len, SEEK_SET);
+        pthread_mutex_unlock(&lock->f_mtx);
+
+        n = read_replica(lock->f_name, offset, len, bound, buf);
+        if (n < 0) {
+            n = store->pread(lock, buf, len, offset);
+        }
+
+        pthread_mutex_lock(&lock->f_mtx);
+        if (n >= 0 && n < len && lseek(lock->fd, 0, SEEK_CUR) == offset + len) {
+            lseek(lock->fd, offset + n, SEEK_SET);  // short read at the end of the file, give the rest back
+        }
+        pthread_mutex_unlock(&lock->f_mtx);
+    }
+    else {
+        // our range of the shared offset, read with its blocks checked against their sums
+        // (or copied from the window this session prefetched)
+        pthread_mutex_lock(&lock->f_mtx);
+        off_t offset = lseek(lock->fd, 0, SEEK_CUR);
+        lseek(lock->fd, offset + len, SEEK_SET);
+        pthread_mutex_unlock(&lock->f_mtx);
+
+        n = read_ahead(ra, lock, buf, len, offset);
+
+        pthread_mutex_lock(&lock->f_mtx);
+        if (n < len && lseek(lock->fd, 0, SEEK_CUR) == offset + len) {
+            lseek(lock->fd, offset + (n > 0 ? n : 0), SEEK_SET);  // short or failed read, give the rest back
+        }
+        pthread_mutex_unlock(&lock->f_mtx);
+    }
     if (n == -1) {
+        pthread_mutex_lock(&lock->f_mtx);
+        drop_file(lock, 0);
+        pthread_cond_broadcast(&lock->f_cond);
+        pthread_mutex_unlock(&lock->f_mtx);
         echo->status = "FAIL";
         echo->code = errno;
-        echo->message = "system call read() returns -1";
+        echo->message = (char*)(errno == EIO ? "checksum mismatch, the file is damaged" : "system call read() returns -1");
         return 0;
     }
-    if (buf[strlen(buf) - 1] == '\n') {
-        buf[strlen(buf) - 1] = '\0';
+    if (n > 0 && buf[n - 1] == '\n') {  // nothing before buf, an empty read must not look at buf[-1]
+        buf[n - 1] = '\0';
     }
     if (DELAY_MODE) {
         char msg[128];
@@ -208,7 +307,7 @@ int reader(int argc, char** argv, struct echo_t* echo, int lock_id) {
 
     // reading finished
     pthread_mutex_lock(&lock->f_mtx);
-    lock->n_reader--;
+    drop_file(lock, 0);
     pthread_cond_broadcast(&lock->f_cond);
     pthread_mutex_unlock(&lock->f_mtx);
 
@@ -250,9 +349,9 @@ int writer(int argc, char** argv, struct echo_t* echo, int lock_id) {
     // waiting for resources
     pthread_mutex_lock(&lock->f_mtx);
     while (lock->n_reader > 0 || lock->n_writer > 0) {
-        pthread_cond_wait(&lock->f_cond, &lock->f_mtx);
+        wait_file(lock, 1);
     }
-    lock->n_writer++;
+    take_file(lock, 1);
     pthread_mutex_unlock(&lock->f_mtx);
 
     // writing...
@@ -263,21 +362,43 @@ int writer(int argc, char** argv, struct echo_t* echo, int lock_id) {
         logger(msg);
         sleep(6);
     }
+    if (thaw_lock(lock) != 0) {  // a frozen file gets its data back in place first
+        pthread_mutex_lock(&lock->f_mtx);
+        drop_file(lock, 1);
+        pthread_cond_broadcast(&lock->f_cond);
+        pthread_mutex_unlock(&lock->f_mtx);
+        echo->status = "FAIL";
+        echo->code = errno;
+        echo->message = "cannot restore the deduplicated file";
+        return 0;
+    }
     int len = strlen(buf);
-    int total = 0;   // bytes sent
-    int left = len;  // bytes left
-    int n;
-    while (total < left) {
-        n = write(lock->fd, buf + total, left);  // update seek
-        if (n == -1) {
-            echo->status = "FAIL";
-            echo->code = errno;
-            echo->message = "system call write() returns -1";
+    off_t offset = lseek(lock->fd, 0, SEEK_CUR);  // replicas write at the same place
+    if (RAFT_MODE) {
+        // the write goes through the raft log and is applied on every member once a majority has it on disk
+        if (raft_commit('W', lock->f_name, offset, buf, len) != 0) {
+            pthread_mutex_lock(&lock->f_mtx);
+            drop_file(lock, 1);
+            pthread_cond_broadcast(&lock->f_cond);
+            pthread_mutex_unlock(&lock->f_mtx);
+            echo->status = "ERR";
+            echo->code = EREMOTE;
+            echo->message = "leadership lost, the write may or may not have been committed";
             return 0;
         }
-        total += n;
-        left -= n;
     }
+    else if (store->pwrite(lock, buf, len, offset) != len) {  // under raft the write and its sums are applied from the log
+        pthread_mutex_lock(&lock->f_mtx);
+        drop_file(lock, 1);
+        pthread_cond_broadcast(&lock->f_cond);
+        pthread_mutex_unlock(&lock->f_mtx);
+        echo->status = "FAIL";
+        echo->code = errno;
+        echo->message = "system call write() returns -1";
+        return 0;
+    }
+    lseek(lock->fd, offset + len, SEEK_SET);  // update seek
+    replicate('W', lock->f_name, offset, buf, len);
     if (DELAY_MODE) {
         char msg[128];
         memset(msg, 0, sizeof(msg));
@@ -287,7 +408,7 @@ int writer(int argc, char** argv, struct echo_t* echo, int lock_id) {
 
     // writing finished
     pthread_mutex_lock(&lock->f_mtx);
-    lock->n_writer--;
+    drop_file(lock, 1);
     pthread_cond_broadcast(&lock->f_cond);
     pthread_mutex_unlock(&lock->f_mtx);
 
@@ -327,37 +448,31 @@ int closer(int argc, char** argv, struct echo_t* echo, int lock_id) {
     // wait until no readers or writers
     pthread_mutex_lock(&lock->f_mtx);
     while (lock->n_reader > 0 || lock->n_writer > 0) {
-        pthread_cond_wait(&lock->f_cond, &lock->f_mtx);
+        wait_file(lock, 1);
     }
-    lock->n_writer++;
+    take_file(lock, 1);
     pthread_mutex_unlock(&lock->f_mtx);
 
-    // closing... first unlock the file
-    struct flock fl;
-    memset(&fl, 0, sizeof(fl));
-    fl.l_type = F_UNLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;
-
-    if (fcntl(identifier, F_OFD_SETLK, &fl) == -1) {  // unlock file
-        echo->status = "FAIL";
-        echo->code = errno;
-        echo->message = "cannot close (unlock) file";
-        return 0;
-    }
-
-    // when we close this fd, all the locks on this physical file in the same process are released
-    // even if the locks were made using other file descriptors that remain open (but we won't let this happen)
-    if (close(identifier) < 0) {
+    // closing... the store unlocks the file and puts away what it keeps of it
+    if (store->close(lock) < 0) {
         echo->status = "FAIL";
         echo->code = errno;
         echo->message = "cannot close file";
+        pthread_mutex_lock(&lock->f_mtx);
+        drop_file(lock, 1);
+        pthread_cond_broadcast(&lock->f_cond);
+        pthread_mutex_unlock(&lock->f_mtx);
         return 0;
     }
 
+    replicate('C', lock->f_name, 0, NULL, 0);
+
     // upon close() success, reset the locks[lock_id] entry to avoid corrupt behavior in other threads
+    pthread_mutex_lock(&lock->f_mtx);
     locks[lock_id].fd = -1;
+    drop_file(lock, 1);  // its hold time still counts in the heat of the file
+    pthread_cond_broadcast(&lock->f_cond);
+    pthread_mutex_unlock(&lock->f_mtx);
     reset_lock(lock_id);
 
     // success response
@@ -378,21 +493,38 @@ void clean_client(int csock) {
     close(csock);
 }
 
-void serve_client(int csock) {
+int serve_client(int csock, int resumed) {
     const char* welcome = "Welcome to the database! Please issue your command, or type QUIT to exit.\n"
-                          "Available commands: FOPEN FSEEK FREAD FWRITE FCLOSE\n";
+                          "Available commands: FOPEN FSEEK FREAD FWRITE FCLOSE FREADV FWRITEV MGET FAPPEND FTRUNC FALLOC FCOPY FSTAT FLIST FSTREAM GET PUT DEL COMPRESS CHECKSUM\n";
     const char* prompt = "> ";
 
-    // welcome client socket and add it to poll
+    // welcome client socket and add it to poll, along with the halt signal of a reload or upgrade
+    // a session handed over by an upgrading process has already been welcomed and prompted
     int n_res;
-    struct pollfd cfds[1];
+    int n_opened = 0;  // files opened by this session, it cannot be handed over while it holds any
+    int prompted = resumed;
+    struct codec_t codec;  // off until the client asks for it
+    memset(&codec, 0, sizeof(codec));
+    codec.threshold = CODEC_THRESHOLD;
+    int with_sums = 0;  // whether responses carrying data end with their crc32c, set with CHECKSUM
+    struct readahead_t ra;  // how we read, and what we read ahead
+    memset(&ra, 0, sizeof(ra));
+    struct timer_node_t idle;  // our idle deadline, kept by the timer wheel
+    memset(&idle, 0, sizeof(idle));
+    struct pollfd cfds[2];
     cfds[0].fd = csock;
     cfds[0].events = POLLIN;
-    send(csock, welcome, strlen(welcome), 0);
+    cfds[1].fd = halt_fd;
+    cfds[1].events = POLLIN;
+    int nodelay = 1;  // a reply and the next prompt are two small writes, do not hold the prompt for an ack
+    setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (!resumed) {
+        send(csock, welcome, strlen(welcome), 0);
+    }
 
     // repeatedly receive a request from client and handle it
     while (1) {
-        if (send(csock, prompt, strlen(prompt), 0) < 0) {
+        if (!prompted && send(csock, prompt, strlen(prompt), 0) < 0) {
             if (errno == EPIPE) {
                 char msg[128];
                 memset(msg, 0, sizeof(msg));
@@ -405,14 +537,36 @@ void serve_client(int csock) {
             break;
         }
 
-        if ((n_res = poll(cfds, 1, 60000)) != 0) {  // time out after 1 minute of inactivity
+        prompted = 1;
+        prefetch_window(&ra);  // a sequential reader's next window, while the client takes in the reply
+
+        arm_timer(&idle, csock, f_timeout);  // time out after f_timeout of inactivity (1 minute by default)
+        n_res = poll(cfds, 2, -1);
+        if (disarm_timer(&idle)) {
+            n_res = 0;  // deadline reached, the wheel shut down our read side to wake us up
+        }
+
+        if (n_res != 0) {
             if (n_res < 0) {
                 perror("poll");
                 fflush(stderr);
                 break;
             }
 
-            char req[256];
+            // the server is halting: an idle session moves to the new process if it is upgrading,
+            // otherwise we stop listening to the halt signal and keep serving until the client leaves
+            if ((cfds[1].revents & POLLIN) && !(cfds[0].revents & POLLIN)) {
+                // what was negotiated with COMPRESS or CHECKSUM lives here only, such a session is not handed over
+                if (upgrading == 2 && n_opened == 0 && !codec.on && !with_sums && handoff_session(csock, 1) == 0) {
+                    end_readahead(&ra);
+                    return 1;
+                }
+                cfds[1].fd = -1;
+                continue;
+            }
+
+            long began = trace_begin();  // if this request is one of those sampled for tracing
+            char req[IO_BUF_SIZE];  // room for a batch, a short request still arrives in one piece
             memset(req, 0, sizeof(req));
             int n_bytes = 0;  // number of bytes received
 
@@ -431,6 +585,17 @@ void serve_client(int csock) {
                     fflush(stderr);
                     break;
                 }
+                // a long request may be split over several segments, collect it up to its newline
+                while (n_bytes < (int)sizeof(req) - 1 && memchr(req, '\n', n_bytes) == NULL) {
+                    int more = recvTimeOut(csock, req + n_bytes, sizeof(req) - 1 - n_bytes, 1000);
+                    if (more <= 0) break;
+                    n_bytes += more;
+                }
+                // a compressed request is a header line and a block holding the request line
+                if (strncmp(req, "Z ", 2) == 0 && (n_bytes = inflate_request(csock, req, sizeof(req), n_bytes, &codec)) < 0) {
+                    logger("malformed compressed request, closing the session");
+                    break;
+                }
             }
 
             // replace the newline
@@ -445,23 +610,78 @@ void serve_client(int csock) {
             char** argv = tokens;
             int argc = tokenize(req, argv, strlen(req));
             argv[argc] = 0;
+            trace_event("parse", NULL, began);
 
             // if client just pressed Enter('\n'), start over
+            prompted = 0;
             if (strlen(argv[0]) == 0) {
                 continue;
             }
 
             // execute command from client
             struct echo_t echo;
-            int lock_id = 0;  // specify an entry in struct lock_t locks[]
-
-            if (strcasecmp(argv[0], "FOPEN") == 0) {
+            int cut = 0;  // 1 if the session cannot go on
+            int lock_id = argc > 1 ? find_lock(argv[1]) : 0;  // specify an entry in struct lock_t locks[]
+            int exempt = strcasecmp(argv[0], "QUIT") == 0 || strcasecmp(argv[0], "REPLICATE") == 0 || strcasecmp(argv[0], "RESYNC") == 0 ||
+                         strcasecmp(argv[0], "RAFT") == 0;
+            int admitted = exempt || admit_request(argv[0]) == 0;  // takes a share of the cost budget
+            session_begin(argv[0], argc > 1 && locks[lock_id].fd == atoi(argv[1]) ? lock_id : -1, n_bytes);
+
+            if (strcasecmp(argv[0], "QUIT") == 0) {
+                break;  // bye
+            }
+            else if (strcasecmp(argv[0], "REPLICATE") == 0) {
+                serve_replica(csock, argc, argv);  // the session becomes a replication link until the primary leaves
+                break;
+            }
+            else if (strcasecmp(argv[0], "RESYNC") == 0) {
+                serve_resync(csock, argc, argv);  // the primary brings our files up to date, one connection per stream
+                break;
+            }
+            else if (strcasecmp(argv[0], "RAFT") == 0) {
+                serve_raft(csock, argc, argv);  // another member's requests, until it disconnects
+                break;
+            }
+            else if (!admitted) {  // over capacity, fail fast
+                shed_request(&echo);
+            }
+            else if (RAFT_MODE && strncasecmp(argv[0], "F", 1) == 0 && raft_redirect(&echo) != 0) {
+                // file commands go to the leader, tell the client where it is
+            }
+            else if (ROUTER_MODE && strcasecmp(argv[0], "FLIST") == 0) {
+                route_list(argc, argv, &echo);  // every shard lists the files it has
+            }
+            else if (ROUTER_MODE && strcasecmp(argv[0], "FSTREAM") == 0) {
+                echo.status = "ERR";
+                echo.code = EOPNOTSUPP;
+                echo.message = "streams are not routed, read from the shard holding the file";
+            }
+            else if (ROUTER_MODE && strncasecmp(argv[0], "F", 1) == 0) {
+                route_request(argc, argv, &echo);  // the shard owning the file serves it
+            }
+            else if (ROUTER_MODE && strcasecmp(argv[0], "MGET") == 0) {
+                route_mget(argc, argv, &echo);  // every shard serves the files it owns
+            }
+            else if (ROUTER_MODE && (strcasecmp(argv[0], "GET") == 0 || strcasecmp(argv[0], "PUT") == 0 || strcasecmp(argv[0], "DEL") == 0)) {
+                route_key(argc, argv, &echo);  // the shard owning the key keeps its value
+            }
+            else if (strcasecmp(argv[0], "GET") == 0) {
+                kv_get(argc, argv, &echo);
+            }
+            else if (strcasecmp(argv[0], "PUT") == 0) {
+                kv_put(argc, argv, &echo);
+            }
+            else if (strcasecmp(argv[0], "DEL") == 0) {
+                kv_del(argc, argv, &echo);
+            }
+            else if (strcasecmp(argv[0], "FOPEN") == 0) {
                 lock_id = opener(argc, argv, &echo);  // open the file and assign a lock_id
                 if (lock_id < 0) {
                     perror("opener");
                     fflush(stderr);
                     break;
                 }
+                n_opened += strcmp(echo.status, "OK") == 0;
             }
             else if (strcasecmp(argv[0], "FSEEK") == 0) {
                 if ((seeker(argc, argv, &echo, lock_id)) != 0) {
@@ -471,12 +691,45 @@ void serve_client(int csock) {
                 }
             }
             else if (strcasecmp(argv[0], "FREAD") == 0) {
-                if ((reader(argc, argv, &echo, lock_id)) != 0) {
+                if ((reader(argc, argv, &echo, lock_id, &ra)) != 0) {
                     perror("reader");
                     fflush(stderr);
                     break;
                 }
             }
+            else if (strcasecmp(argv[0], "FSTREAM") == 0) {
+                cut = streamer(argc, argv, &echo, lock_id, csock, with_sums) != 0;
+            }
+            else if (strcasecmp(argv[0], "COMPRESS") == 0) {
+                set_codec(argc, argv, &echo, &codec);
+            }
+            else if (strcasecmp(argv[0], "CHECKSUM") == 0) {
+                set_checksum(argc, argv, &echo, &with_sums);
+            }
+            else if (strcasecmp(argv[0], "FREADV") == 0) {
+                vector_reader(argc, argv, &echo, lock_id);
+            }
+            else if (strcasecmp(argv[0], "MGET") == 0) {
+                multi_reader(argc, argv, &echo);
+            }
+            else if (strcasecmp(argv[0], "FLIST") == 0) {
+                lister(argc, argv, &echo);
+            }
+            else if (strcasecmp(argv[0], "PREAD") == 0) {
+                serve_pread(csock, argc, argv, &echo);  // a read proxied by our primary
+            }
+            else if (strcasecmp(argv[0], "NAMES") == 0) {
+                serve_names(argc, argv, &echo);  // a router listing our files to rebalance them
+            }
+            else if (strcasecmp(argv[0], "MIGRATE") == 0) {
+                serve_migrate(argc, argv, &echo);  // a router moving one of our files to a new shard
+            }
+            else if (REPLICA_MODE && (strcasecmp(argv[0], "FWRITE") == 0 || strcasecmp(argv[0], "FWRITEV") == 0 || strcasecmp(argv[0], "FAPPEND") == 0 ||
+                                      strcasecmp(argv[0], "FTRUNC") == 0 || strcasecmp(argv[0], "FALLOC") == 0 || strcasecmp(argv[0], "FCOPY") == 0)) {
+                echo.status = "ERR";
+                echo.code = EROFS;
+                echo.message = "read-only replica, write to the primary";
+            }
             else if (strcasecmp(argv[0], "FWRITE") == 0) {
                 if ((writer(argc, argv, &echo, lock_id)) != 0) {
                     perror("writer");
@@ -484,41 +737,71 @@ void serve_client(int csock) {
                     break;
                 }
             }
+            else if (strcasecmp(argv[0], "FWRITEV") == 0) {
+                vector_writer(argc, argv, &echo, lock_id);
+            }
+            else if (strcasecmp(argv[0], "FAPPEND") == 0) {
+                appender(argc, argv, &echo, lock_id);
+            }
+            else if (strcasecmp(argv[0], "FTRUNC") == 0) {
+                truncater(argc, argv, &echo, lock_id);
+            }
+            else if (strcasecmp(argv[0], "FALLOC") == 0) {
+                allocator(argc, argv, &echo, lock_id);
+            }
+            else if (strcasecmp(argv[0], "FCOPY") == 0) {
+                copier(argc, argv, &echo, lock_id);
+            }
+            else if (strcasecmp(argv[0], "FSTAT") == 0) {
+                stater(argc, argv, &echo, lock_id);
+            }
             else if (strcasecmp(argv[0], "FCLOSE") == 0) {
                 if ((closer(argc, argv, &echo, lock_id)) != 0) {
                     perror("closer");
                     fflush(stderr);
                     break;
                 }
-            }
-            else if (strcasecmp(argv[0], "QUIT") == 0) {
-                break;  // bye
+                if (strcmp(echo.status, "OK") == 0 && n_opened > 0) n_opened--;
             }
             else {  // invalid command
                 echo.status = "FAIL";
                 echo.code = -9;
                 echo.message = "invalid request";
             }
+            if (admitted && !exempt) {
+                release_request(argv[0]);
+            }
+            if (cut) {
+                break;  // a stream broke off in the middle of a chunk, the client cannot tell where a reply would start
+            }
 
             // send response to client
-            char res[4096];
+            char res[IO_BUF_SIZE + 64];  // a full buffer of data after the status and code
             memset(res, 0, sizeof(res));
 
             sprintf(res, "%s", echo.status);
             sprintf(res + strlen(res), " %d", echo.code);
             sprintf(res + strlen(res), " %s", echo.message);
+            if (with_sums && strcmp(echo.status, "OK") == 0 && (strcasecmp(argv[0], "FREAD") == 0 || strcasecmp(argv[0], "FREADV") == 0 ||
+                                                               strcasecmp(argv[0], "MGET") == 0)) {
+                sprintf(res + strlen(res), " crc32c=%08x", crc32c(0, echo.message, strlen(echo.message)));  // of the data as sent
+            }
             int len = strlen(res);
             res[len] = '\n';
             len++;
 
-            if (sendAll(csock, res, &len) == -1) {
+            long sending = trace_clock();
+            if (send_response(csock, res, &len, &codec) == -1) {
                 perror("sendall");
                 printf("only %d bytes of data have been sent!\n", len);
                 fflush(stdout); fflush(stderr);
                 break;
             }
+            trace_event("send", NULL, sending);
+            session_end(len, n_opened);
+            trace_end(argv[0], argc > 1 && locks[lock_id].fd == atoi(argv[1]) ? locks[lock_id].f_name : argv[1], began);
         }
-        else {  // will reach here only if poll() timed out
+        else {  // will reach here only if the idle deadline expired
             const char* farewell = "your session has expired\n";
             int len = strlen(farewell);
             if (sendAll(csock, farewell, &len) == -1) {  // say good-bye to client
@@ -530,6 +813,22 @@ void serve_client(int csock) {
             break;  // bye
         }
     }
+
+    end_readahead(&ra);
+    if (codec.raw_out > 0 || codec.raw_in > 0) {
+        char msg[256];
+        memset(msg, 0, sizeof(msg));
+        snprintf(msg, sizeof(msg), "socket %d compressed %ld response bytes to %ld and received %ld request bytes as %ld, "
+                 "%.2f ms cpu", csock, codec.raw_out, codec.wire_out, codec.raw_in, codec.wire_in, codec.cpu_ns / 1e6);
+        logger(msg);
+    }
+    return 0;
+}
+
+void quit_thread(void* status) {
+    group_free(io_buf, IO_BUF_SIZE);
+    io_buf = NULL;
+    pthread_exit(status);
 }
 
 void* file_thread(void* id) {
@@ -537,52 +836,113 @@ void* file_thread(void* id) {
     socklen_t sin_size = sizeof(cli_addr);
     char ipstr[INET6_ADDRSTRLEN];
 
-    // add master socket to poll
-    struct pollfd pfds[1];
-    pfds[0].fd = fsock;
+    // pin to our group's cpus first, so that the buffer below is allocated from the local node
+    bind_group((int)(intptr_t)id);
+    io_buf = (char*)group_alloc((int)(intptr_t)id, IO_BUF_SIZE);
+    if (io_buf == NULL) {
+        perror("group_alloc");
+        fflush(stderr);
+        pthread_exit((void*)-12);
+    }
+
+    // add master socket to poll (our group's own listener when placement is enabled)
+    // along with the queue of clients the admission thread accepted while the pool was saturated
+    // and the halt signal of a reload or upgrade
+    struct pollfd pfds[3];
+    pfds[0].fd = group_sock((int)(intptr_t)id);
     pfds[0].events = POLLIN;
+    pfds[1].fd = pending_fd;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = halt_fd;
+    pfds[2].events = POLLIN;
+    pthread_mutex_t* wake = group_mutex((int)(intptr_t)id);
 
     while (1) {
-        // accept incoming clients or block if there's no client
-        pthread_mutex_lock(&wake_mutex);  // a wake mutex enforces no concurrent calls to accept, threads must wake up one by one
-        int csock = accept(pfds[0].fd, (struct sockaddr*)&cli_addr, &sin_size);
-        pthread_mutex_unlock(&wake_mutex);
+        // accept incoming clients or block if there's no client, queued clients go first
+        long waking = trace_now();
+        pthread_mutex_lock(wake);  // a wake mutex enforces no concurrent calls to accept, threads must wake up one by one
+        long accepting = trace_now();
+        int csock = -1;
+        int resumed = 0;
+        while (csock == -1) {
+            if (poll(pfds, 3, -1) == -1 && errno != EINTR) break;
+            if (pfds[2].revents & POLLIN) {  // server halting, leave the remaining queue to the drain
+                errno = EBADF;
+                break;
+            }
+            if ((pfds[1].revents & POLLIN) && (csock = dequeue_client(&resumed)) != -1) {
+                sin_size = sizeof(cli_addr);
+                getpeername(csock, (struct sockaddr*)&cli_addr, &sin_size);
+                break;
+            }
+            if (pfds[0].revents & (POLLIN | POLLERR | POLLNVAL)) {
+                sin_size = sizeof(cli_addr);
+                csock = accept(pfds[0].fd, (struct sockaddr*)&cli_addr, &sin_size);
+                if (csock == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;  // taken by the admission thread
+                break;
+            }
+        }
+        pthread_mutex_unlock(wake);
+        if (csock != -1 && trace_begin() > 0) {  // a new connection is sampled like a request
+            trace_span("wake_mutex", waking, accepting);
+            trace_event("accept", NULL, accepting);  // includes waiting for a client to come
+            trace_end(NULL, NULL, 0);
+        }
 
         if (csock == -1) {
-            if (fsock == -1 && errno == EBADF) {  // master socket temporarily closed by dynamic reconfiguration
+            if (fsock == -1 && errno == EBADF) {  // master socket temporarily closed by dynamic reconfiguration or upgrade
                 pthread_mutex_lock(&monitor.m_mtx);
                 monitor.t_tot--;
                 pthread_mutex_unlock(&monitor.m_mtx);
-                pthread_exit(NULL);  // thread quits normally
+                quit_thread(NULL);  // thread quits normally
             }
             perror("accept");  // system call failed
             fflush(stderr);
-            pthread_exit((void*)-13);  // thread quits with error
+            quit_thread((void*)-13);  // thread quits with error
+        }
+
+        if (VERBOSE_MODE && groups != NULL) {  // report connections that were not steered to their receiving cpu
+            int cpu = -1;
+            socklen_t optlen = sizeof(cpu);
+            getsockopt(csock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &optlen);
+            if (cpu >= 0 && !CPU_ISSET(cpu, &groups[(int)(intptr_t)id % n_groups].mask)) {
+                char msg[128];
+                memset(msg, 0, sizeof(msg));
+                sprintf(msg, "socket %d received on cpu %d but accepted by group %d", csock, cpu, (int)(intptr_t)id % n_groups);
+                logger(msg);
+            }
         }
 
         // new client connected
         inet_ntop(cli_addr.ss_family, extractAddr((struct sockaddr*)&cli_addr), ipstr, INET6_ADDRSTRLEN);
         char msg[128];
         memset(msg, 0, sizeof(msg));
-        sprintf(msg, "new connection from %s on socket %d", ipstr, csock);
+        sprintf(msg, "%s connection from %s on socket %d", resumed ? "resumed" : "new", ipstr, csock);
         logger(msg);
 
         // thread is now busy serving the client
         pthread_mutex_lock(&monitor.m_mtx);
         monitor.t_act++;
-        pthread_cond_signal(&monitor.m_cond);  // when we increment, notify the monitor to check threads occupancy
+        pthread_cond_broadcast(&monitor.m_cond);  // when we increment, notify the monitor and the admission thread to check threads occupancy
+        thread_pool[(int)(intptr_t)id].idle = 0;  // under m_mtx, the pool table may be grown by a live reconfiguration
         pthread_mutex_unlock(&monitor.m_mtx);
 
-        thread_pool[(int)(intptr_t)id].idle = 0;
-        serve_client(csock);
+        join_session(csock);  // listed by SESSIONS on the shell port while we serve it
+        int handed_off = serve_client(csock, resumed);
+        leave_session();
 
         // thread now becomes idle
         pthread_mutex_lock(&monitor.m_mtx);
         monitor.t_act--;
+        thread_pool[(int)(intptr_t)id].idle = 1;
         pthread_mutex_unlock(&monitor.m_mtx);
 
-        thread_pool[(int)(intptr_t)id].idle = 1;
-        clean_client(csock);
+        if (handed_off) {
+            close(csock);  // the new process owns the connection now, no shutdown
+        }
+        else {
+            clean_client(csock);
+        }
 
         // thread quits itself if there's too little network traffic
         int lower_bound = monitor.t_tot - monitor.t_inc;
@@ -590,7 +950,7 @@ void* file_thread(void* id) {
             pthread_mutex_lock(&monitor.m_mtx);
             monitor.t_tot--;
             pthread_mutex_unlock(&monitor.m_mtx);
-            pthread_exit(NULL);
+            quit_thread(NULL);
         }
     }
 }
@@ -0,0 +1,268 @@
+/*
+** heat.c -- how often each file is taken, how long its sessions wait for it and hold it, over the last minute
+*/
+
+#include "define.h"
+
+#define HEAT_FILES 4096  // files followed, the one idle the longest makes room for a new one
+#define HEAT_SPAN 5      // seconds per slot
+#define HEAT_SLOTS 12    // slots in the window, a minute
+
+/*
+** every file name has an entry, pointed to by the lock entry of the file while it is open; all the changes to an
+** entry are made under the f_mtx of that lock entry, so they cost no lock of their own; they go to the slot of the
+** current 5 seconds, and a listing adds up the slots of the last minute; a wait runs from the first time a session
+** has to wait for the file until it takes it, however often it is woken up in between; readers hold a file
+** together, so their hold time is the sum of the time each one held it, counted from the number of readers every
+** time it changes; the shell reads the entries without locking, so a listing may be a few updates behind
+*/
+struct heat_slot_t {
+    long epoch;        // the HEAT_SPAN seconds it counts, since the epoch
+    long reads;        // reader's shares taken
+    long writes;       // files taken to oneself
+    long r_waits;      // waits for a reader's share
+    long w_waits;      // waits for the file to oneself
+    long r_wait;       // us spent in them
+    long w_wait;
+    long r_wait_max;   // us, the longest
+    long w_wait_max;
+    long r_hold;       // us held by readers, all of them added up
+    long w_hold;       // us held by writers
+    long w_hold_max;   // us, the longest a writer held it
+};
+
+struct heat_t {
+    char name[256];
+    int refs;          // 1 while a lock entry points here, it is not given to another file meanwhile
+    long last;         // seconds when it was last taken
+    long r_changed;    // us when the number of readers last changed
+    long w_since;      // us when the writer took it
+    struct heat_slot_t slots[HEAT_SLOTS];
+};
+
+static struct heat_t heat_map[HEAT_FILES];
+static pthread_mutex_t heat_mtx = PTHREAD_MUTEX_INITIALIZER;  // guards the names of the entries
+static __thread struct lock_t* waiting = NULL;  // the file this thread waits for, since waiting_since
+static __thread long waiting_since;
+
+static long now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// the slot of the current HEAT_SPAN seconds, emptied if it last counted an older span
+static struct heat_slot_t* current(struct heat_t* heat, long now) {
+    long epoch = now / 1000000 / HEAT_SPAN;
+    struct heat_slot_t* slot = &heat->slots[epoch % HEAT_SLOTS];
+    if (slot->epoch != epoch) {
+        memset(slot, 0, sizeof(struct heat_slot_t));
+        slot->epoch = epoch;
+    }
+    return slot;
+}
+
+static unsigned heat_hash(const char* name) {
+    unsigned h = 2166136261u;  // fnv-1a
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h % HEAT_FILES;
+}
+
+// the entry of a file being opened into lock
+void open_heat(struct lock_t* lock, const char* name) {
+    struct heat_t* found = NULL;
+    struct heat_t* coldest = NULL;
+    long now = now_us();
+    pthread_mutex_lock(&heat_mtx);
+    for (unsigned i = 0, at = heat_hash(name); i < HEAT_FILES; i++, at = (at + 1) % HEAT_FILES) {
+        struct heat_t* heat = &heat_map[at];
+        if (heat->name[0] == '\0' || strcmp(heat->name, name) == 0) {
+            found = heat;
+            break;
+        }
+        if (heat->refs == 0 && (coldest == NULL || heat->last < coldest->last)) coldest = heat;
+    }
+    if (found == NULL) found = coldest;  // no free entry left, names are never removed so the probes stay valid
+    if (found != NULL && strcmp(found->name, name) != 0) {
+        memset(found, 0, sizeof(struct heat_t));
+        snprintf(found->name, sizeof(found->name), "%s", name);
+    }
+    if (found != NULL) {
+        found->refs++;
+        found->last = now / 1000000;
+        found->r_changed = now;
+    }
+    pthread_mutex_unlock(&heat_mtx);
+    lock->heat = found;
+}
+
+// the file in lock is closed, or its entry reset; the closer has already dropped its writer share
+void close_heat(struct lock_t* lock) {
+    struct heat_t* heat = lock->heat;
+    if (heat == NULL) return;
+    pthread_mutex_lock(&heat_mtx);
+    heat->refs--;
+    pthread_mutex_unlock(&heat_mtx);
+    lock->heat = NULL;
+}
+
+// readers' hold time up to now, before their number changes
+static void count_readers(struct lock_t* lock, struct heat_t* heat, long now) {
+    if (lock->n_reader > 0) current(heat, now)->r_hold += (now - heat->r_changed) * lock->n_reader;
+    heat->r_changed = now;
+}
+
+// a wait for the file that began at since just woke up; caller holds f_mtx
+void heat_waited(struct lock_t* lock, int writer, long since) {
+    struct heat_t* heat = lock->heat;
+    long now = now_us();
+    int first = waiting != lock;
+    if (first) {
+        waiting = lock;
+        waiting_since = since;
+    }
+    if (heat == NULL) return;
+    struct heat_slot_t* slot = current(heat, now);
+    long so_far = now - waiting_since;
+    if (writer) {
+        slot->w_waits += first;
+        slot->w_wait += now - since;
+        if (so_far > slot->w_wait_max) slot->w_wait_max = so_far;
+    }
+    else {
+        slot->r_waits += first;
+        slot->r_wait += now - since;
+        if (so_far > slot->r_wait_max) slot->r_wait_max = so_far;
+    }
+}
+
+// take a reader's share of the file, or the file to ourselves; caller holds f_mtx and waited for it
+void take_file(struct lock_t* lock, int writer) {
+    struct heat_t* heat = lock->heat;
+    if (waiting == lock) waiting = NULL;  // the wait is over
+    if (heat != NULL) {
+        long now = now_us();
+        struct heat_slot_t* slot = current(heat, now);
+        heat->last = now / 1000000;
+        if (writer) {
+            slot->writes++;
+            heat->w_since = now;
+        }
+        else {
+            count_readers(lock, heat, now);
+            slot->reads++;
+        }
+    }
+    if (writer) lock->n_writer++;
+    else lock->n_reader++;
+}
+
+// give it back; caller holds f_mtx, and broadcasts f_cond
+void drop_file(struct lock_t* lock, int writer) {
+    struct heat_t* heat = lock->heat;
+    if (heat != NULL) {
+        long now = now_us();
+        if (writer) {
+            struct heat_slot_t* slot = current(heat, now);
+            slot->w_hold += now - heat->w_since;
+            if (now - heat->w_since > slot->w_hold_max) slot->w_hold_max = now - heat->w_since;
+        }
+        else {
+            count_readers(lock, heat, now);
+        }
+    }
+    if (writer) lock->n_writer--;
+    else lock->n_reader--;
+}
+
+// the slots of the last minute of an entry, added up, with the maxima kept
+static void sum_window(struct heat_t* heat, struct heat_slot_t* sum, long now) {
+    long epoch = now / 1000000 / HEAT_SPAN;
+    memset(sum, 0, sizeof(struct heat_slot_t));
+    for (int i = 0; i < HEAT_SLOTS; i++) {
+        struct heat_slot_t slot = heat->slots[i];
+        if (slot.epoch <= epoch - HEAT_SLOTS || slot.epoch > epoch) continue;
+        sum->reads += slot.reads;
+        sum->writes += slot.writes;
+        sum->r_waits += slot.r_waits;
+        sum->w_waits += slot.w_waits;
+        sum->r_wait += slot.r_wait;
+        sum->w_wait += slot.w_wait;
+        sum->r_hold += slot.r_hold;
+        sum->w_hold += slot.w_hold;
+        if (slot.r_wait_max > sum->r_wait_max) sum->r_wait_max = slot.r_wait_max;
+        if (slot.w_wait_max > sum->w_wait_max) sum->w_wait_max = slot.w_wait_max;
+        if (slot.w_hold_max > sum->w_hold_max) sum->w_hold_max = slot.w_hold_max;
+    }
+}
+
+struct heat_row_t {
+    struct heat_t* heat;
+    struct heat_slot_t sum;
+};
+
+static int by_wait(const void* a, const void* b) {
+    const struct heat_slot_t* x = &((const struct heat_row_t*)a)->sum;
+    const struct heat_slot_t* y = &((const struct heat_row_t*)b)->sum;
+    long d = (y->r_wait + y->w_wait) - (x->r_wait + x->w_wait);
+    return d > 0 ? 1 : (d < 0 ? -1 : 0);
+}
+
+static int by_rate(const void* a, const void* b) {
+    const struct heat_slot_t* x = &((const struct heat_row_t*)a)->sum;
+    const struct heat_slot_t* y = &((const struct heat_row_t*)b)->sum;
+    long d = (y->reads + y->writes) - (x->reads + x->writes);
+    return d > 0 ? 1 : (d < 0 ? -1 : 0);
+}
+
+// the n most contended files of the last minute, then the n most taken; returns a buffer the caller frees
+char* show_heat(int n, int* len) {
+    struct heat_row_t* rows = (struct heat_row_t*)malloc(sizeof(struct heat_row_t) * HEAT_FILES);
+    size_t size = 512 + (size_t)n * 2 * 384;
+    char* buf = (char*)malloc(size);
+    if (rows == NULL || buf == NULL) {
+        free(rows);
+        free(buf);
+        return NULL;
+    }
+    long now = now_us();
+    int n_rows = 0;
+    for (int i = 0; i < HEAT_FILES; i++) {
+        if (heat_map[i].name[0] == '\0') continue;
+        rows[n_rows].heat = &heat_map[i];
+        sum_window(&heat_map[i], &rows[n_rows].sum, now);
+        if (rows[n_rows].sum.reads + rows[n_rows].sum.writes + rows[n_rows].sum.r_waits + rows[n_rows].sum.w_waits > 0) n_rows++;
+    }
+    double window = HEAT_SPAN * (HEAT_SLOTS - 1) + (now / 1000000 % HEAT_SPAN) + 1;  // seconds the slots cover
+
+    qsort(rows, n_rows, sizeof(struct heat_row_t), by_wait);
+    int o = snprintf(buf, size, "most contended in the last %d s, wait counts and ms (total/max) for a reader's share "
+                     "and for the file to oneself:\n%8s %14s %8s %14s %6s  %s\n", HEAT_SPAN * HEAT_SLOTS, "R.WAITS",
+                     "R.MS", "W.WAITS", "W.MS", "BUSY", "FILE");
+    for (int i = 0; i < n_rows && i < n; i++) {
+        struct heat_slot_t* s = &rows[i].sum;
+        if (s->r_waits + s->w_waits == 0) break;
+        char r_ms[32], w_ms[32];
+        snprintf(r_ms, sizeof(r_ms), "%.1f/%.1f", s->r_wait / 1000.0, s->r_wait_max / 1000.0);
+        snprintf(w_ms, sizeof(w_ms), "%.1f/%.1f", s->w_wait / 1000.0, s->w_wait_max / 1000.0);
+        o += snprintf(buf + o, size - o, "%8ld %14s %8ld %14s %5.1f%%  %s\n", s->r_waits, r_ms, s->w_waits, w_ms,
+                      100.0 * s->w_hold / 1000000 / window, rows[i].heat->name);
+    }
+
+    qsort(rows, n_rows, sizeof(struct heat_row_t), by_rate);
+    o += snprintf(buf + o, size - o, "hottest in the last %d s, shares taken per second and ms held (average, and max for "
+                  "writers):\n%8s %8s %10s %14s  %s\n", HEAT_SPAN * HEAT_SLOTS, "READS/S", "WRITES/S", "R.HOLD", "W.HOLD",
+                  "FILE");
+    for (int i = 0; i < n_rows && i < n; i++) {
+        struct heat_slot_t* s = &rows[i].sum;
+        if (s->reads + s->writes == 0) break;
+        char r_hold[32], w_hold[32];
+        snprintf(r_hold, sizeof(r_hold), "%.3f", s->reads > 0 ? s->r_hold / 1000.0 / s->reads : 0.0);
+        snprintf(w_hold, sizeof(w_hold), "%.3f/%.1f", s->writes > 0 ? s->w_hold / 1000.0 / s->writes : 0.0, s->w_hold_max / 1000.0);
+        o += snprintf(buf + o, size - o, "%8.1f %8.1f %10s %14s  %s\n", s->reads / window, s->writes / window, r_hold, w_hold,
+                      rows[i].heat->name);
+    }
+    free(rows);
+    *len = o;
+    return buf;
+}
@@ -0,0 +1,316 @@
+/*
+** jobs.c -- commands run from the shell port, spawned without copying our address space, with their output kept
+*/
+
+#include "define.h"
+#include <spawn.h>
+
+#define MAX_JOBS 16
+#define JOB_RING 65536  // the last bytes of output kept per job, for CPRINT
+
+/*
+** a job is spawned with posix_spawn, which borrows our memory until the command is exec'd instead of copying page
+** tables that grow with every thread stack we have; its stdout and stderr go to a pipe, read by the admin session
+** that started it and streamed to the admin as they come, or by a thread of its own for a job in the background;
+** either way the last JOB_RING bytes stay in the job's ring for CPRINT, until its slot is taken by a newer job
+*/
+struct job_t {
+    int id;                // 0 if the slot was never used
+    pid_t pid;
+    char cmd[128];
+    int out;               // read end of the pipe
+    int running;
+    int status;            // as returned by waitpid, once it is no longer running
+    time_t started;
+    time_t ended;
+    long produced;         // bytes of output so far, the ring holds the last JOB_RING of them
+    char ring[JOB_RING];
+};
+
+static struct job_t jobs[MAX_JOBS];
+static int last_id = 0;
+static pthread_mutex_t jobs_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// caller holds jobs_mtx
+static void keep_output(struct job_t* job, const char* buf, int n) {
+    if (n > JOB_RING) {
+        job->produced += n - JOB_RING;
+        buf += n - JOB_RING;
+        n = JOB_RING;
+    }
+    int at = job->produced % JOB_RING;
+    int first = JOB_RING - at < n ? JOB_RING - at : n;
+    memcpy(job->ring + at, buf, first);
+    memcpy(job->ring, buf + first, n - first);
+    job->produced += n;
+}
+
+// the job is done once its output reached EOF, all of it read by then
+static int end_job(struct job_t* job) {
+    int status = 0;
+    waitpid(job->pid, &status, 0);
+    close(job->out);
+    pthread_mutex_lock(&jobs_mtx);
+    job->status = status;
+    job->ended = time(NULL);
+    job->running = 0;
+    pthread_mutex_unlock(&jobs_mtx);
+    return status;
+}
+
+static void* job_thread(void* arg) {
+    struct job_t* job = (struct job_t*)arg;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(job->out, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n < 0) continue;
+        pthread_mutex_lock(&jobs_mtx);
+        keep_output(job, buf, n);
+        pthread_mutex_unlock(&jobs_mtx);
+    }
+    end_job(job);
+    return NULL;
+}
+
+static int go_background(struct job_t* job) {
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int status = pthread_create(&tid, &attr, job_thread, job);
+    pthread_attr_destroy(&attr);
+    return status == 0 ? 0 : -1;
+}
+
+// start argv[0], as given or else from /bin or /usr/bin, with out as its stdout and stderr and none of our other files
+static pid_t spawn(char** argv, int out) {
+    const char* path[] = {"/bin", "/usr/bin", 0};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out, 1);
+    posix_spawn_file_actions_adddup2(&actions, out, 2);
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);  // our sockets, and the descriptors holding file locks
+
+    // signals are blocked in our threads and handled by one of them, the command gets the defaults
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t none, all;
+    sigemptyset(&none);
+    sigfillset(&all);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    char* envp[] = { NULL };
+    pid_t pid = -1;
+    int err = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp);  // attempt to execute with no path prefix ...
+    for (size_t i = 0; err != 0 && strchr(argv[0], '/') == NULL && path[i] != 0; i++) {  // then try with path prefixed
+        char cp[256];
+        memset(cp, 0, sizeof(cp));
+        snprintf(cp, sizeof(cp), "%s/%s", path[i], argv[0]);
+        err = posix_spawn(&pid, cp, &actions, &attr, argv, envp);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// a slot for a new job: a free one, or that of the job that ended first
+static struct job_t* take_slot(void) {
+    struct job_t* slot = NULL;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0) return &jobs[i];
+        if (!jobs[i].running && (slot == NULL || jobs[i].ended < slot->ended)) slot = &jobs[i];
+    }
+    return slot;
+}
+
+static struct job_t* find_job(int id) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && (jobs[i].id == id || (id == 0 && jobs[i].id == last_id))) return &jobs[i];
+    }
+    return NULL;
+}
+
+// run a command for the admin on asock: in the background, or with its output sent on as it comes until it exits,
+// or until the admin hits Enter to leave it running in the background
+int run_job(int asock, char** argv, int background, struct echo_t* echo) {
+    static __thread char message[128];
+    memset(message, 0, sizeof(message));
+    echo->message = message;
+
+    int channel[2];
+    if (pipe2(channel, O_CLOEXEC) == -1) {
+        echo->status = "FAIL";
+        echo->code = errno;
+        echo->message = "Failed to create a pipe";
+        return 0;
+    }
+    pthread_mutex_lock(&jobs_mtx);
+    struct job_t* job = take_slot();
+    if (job == NULL) {
+        pthread_mutex_unlock(&jobs_mtx);
+        close(channel[0]);
+        close(channel[1]);
+        echo->status = "ERR";
+        echo->code = EAGAIN;
+        echo->message = "Too many jobs running";
+        return 0;
+    }
+    pid_t pid = spawn(argv, channel[1]);
+    close(channel[1]);
+    if (pid < 0) {
+        pthread_mutex_unlock(&jobs_mtx);
+        close(channel[0]);
+        echo->status = "FAIL";
+        echo->code = -4;
+        echo->message = "Failed to execute the command";
+        return 0;
+    }
+    memset(job, 0, sizeof(struct job_t) - JOB_RING);  // the ring is not read past what is produced
+    job->id = ++last_id;
+    job->pid = pid;
+    job->out = channel[0];
+    job->running = 1;
+    job->started = time(NULL);
+    for (int i = 0, len = 0; argv[i] != NULL && len < (int)sizeof(job->cmd) - 1; i++) {
+        len += snprintf(job->cmd + len, sizeof(job->cmd) - len, i > 0 ? " %s" : "%s", argv[i]);
+    }
+    int id = job->id;
+    pthread_mutex_unlock(&jobs_mtx);
+
+    if (background) {
+        if (go_background(job) != 0) {
+            job_thread(job);  // no thread to read its output, we do until it exits
+        }
+        echo->status = "OK";
+        echo->code = id;
+        snprintf(message, sizeof(message), "Job %d started in the background, pid %d", id, (int)pid);
+        return 0;
+    }
+
+    struct pollfd pfds[2];
+    pfds[0].fd = job->out;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = asock;
+    pfds[1].events = POLLIN;
+    char buf[4096];
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int n = recv(asock, buf, sizeof(buf), 0);
+            if (n <= 0 || memchr(buf, '\n', n) != NULL) {
+                if (go_background(job) == 0) {
+                    echo->status = "OK";
+                    echo->code = id;
+                    snprintf(message, sizeof(message), "Job %d left running in the background, CPRINT %d for its output", id, id);
+                    return 0;
+                }
+                pfds[1].fd = -1;  // no thread to hand it to, keep reading it here
+            }
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(job->out, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            pthread_mutex_lock(&jobs_mtx);
+            keep_output(job, buf, n);
+            pthread_mutex_unlock(&jobs_mtx);
+            int len = n;
+            if (pfds[1].fd >= 0 && sendAll(asock, buf, &len) == -1) {
+                pfds[1].fd = -1;  // the admin is gone, the output is still kept
+            }
+        }
+    }
+    int status = end_job(job);
+
+    echo->code = status;  // command executed, but may still have an error condition
+    if (status == 0) {
+        echo->status = "OK";
+        snprintf(message, sizeof(message), "Command execution complete, job %d", id);
+    }
+    else {
+        echo->status = "ERR";
+        snprintf(message, sizeof(message), "Command executed with errors, job %d", id);
+    }
+    return 0;
+}
+
+// send the output kept for a job, the last one started if id is 0
+int print_job(int asock, int id, struct echo_t* echo) {
+    pthread_mutex_lock(&jobs_mtx);
+    struct job_t* job = find_job(id);
+    if (job == NULL) {
+        pthread_mutex_unlock(&jobs_mtx);
+        echo->status = "ERR";
+        echo->code = EIO;
+        echo->message = (char*)(id == 0 ? "No command has been issued" : "No such job, or its output was dropped for a newer one");
+        return 0;
+    }
+    char* out = (char*)malloc(JOB_RING + 64);
+    int len = 0;
+    if (out != NULL) {
+        long kept = job->produced < JOB_RING ? job->produced : JOB_RING;
+        if (job->produced > kept) {
+            len = snprintf(out, 64, "[%ld bytes dropped]\n", job->produced - kept);
+        }
+        int at = (job->produced - kept) % JOB_RING;
+        int first = JOB_RING - at < kept ? JOB_RING - at : kept;
+        memcpy(out + len, job->ring + at, first);
+        memcpy(out + len + first, job->ring, kept - first);
+        len += kept;
+    }
+    int running = job->running;
+    pthread_mutex_unlock(&jobs_mtx);
+
+    if (out == NULL || sendAll(asock, out, &len) == -1) {
+        echo->status = "FAIL";
+        echo->code = -7;
+        echo->message = "Failed to send output";
+    }
+    else {
+        echo->status = "OK";
+        echo->code = 0;
+        echo->message = (char*)(running ? "Output so far printed, the job is still running" : "Output printed");
+    }
+    free(out);
+    return 0;
+}
+
+// one line per job: id, pid, state, output and command
+int show_jobs(char* buf, size_t size) {
+    int len = 0;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&jobs_mtx);
+    for (int i = 0; i < MAX_JOBS && len < (int)size; i++) {
+        struct job_t* job = &jobs[i];
+        if (job->id == 0) continue;
+        char state[64];
+        if (job->running) snprintf(state, sizeof(state), "running %lds", (long)(now - job->started));
+        else if (WIFEXITED(job->status)) snprintf(state, sizeof(state), "exited %d", WEXITSTATUS(job->status));
+        else snprintf(state, sizeof(state), "killed by signal %d", WTERMSIG(job->status));
+        len += snprintf(buf + len, size - len, "job %d pid %d %s, %ld bytes of output: %s\n", job->id, (int)job->pid, state,
+                        job->produced, job->cmd);
+    }
+    pthread_mutex_unlock(&jobs_mtx);
+    if (len == 0) len = snprintf(buf, size, "no jobs\n");
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// send SIGTERM to a running job
+int kill_job(int id) {
+    pthread_mutex_lock(&jobs_mtx);
+    struct job_t* job = id > 0 ? find_job(id) : NULL;
+    int status = job != NULL && job->running ? kill(job->pid, SIGTERM) : -1;
+    if (job == NULL || !job->running) errno = ESRCH;
+    pthread_mutex_unlock(&jobs_mtx);
+    return status;
+}
@@ -0,0 +1,430 @@
+/*
+** kv.c -- in-memory key-value store served on the file port, for values too small to be worth a file
+*/
+
+#include "define.h"
+#include <sys/uio.h>
+
+#define KV_STRIPES 256   // independent tables, each under its own mutex
+#define KV_KEY 250       // longest key
+#define KV_DIR ".kv"     // one log per stripe when values persist
+#define KV_SLACK 65536   // bytes of dead records a stripe log may hold beyond twice its live data
+
+int KV_MAX = 64;      // memory budget in MB, shared evenly by the stripes
+int KV_PERSIST = 0;   // 1 if every change is logged to the run directory and replayed at startup
+
+struct kv_t {
+    struct kv_t* next;   // in its bucket
+    struct kv_t* newer;  // in the stripe's recency list
+    struct kv_t* older;
+    uint64_t hash;
+    int klen;
+    int vlen;
+    char* key;           // both in the same allocation, after the entry
+    char* value;
+};
+
+struct kv_rec_t {        // precedes the key and value of a change in a stripe log
+    uint32_t crc;        // crc32c of the rest of the header, the key and the value
+    uint16_t klen;
+    uint8_t op;          // P(ut) / D(elete)
+    uint8_t pad;
+    uint32_t vlen;
+};
+
+static struct stripe_t {
+    pthread_mutex_t mtx;
+    struct kv_t** buckets;
+    int n_buckets;           // a power of 2
+    int n_keys;
+    long used;               // bytes of the entries
+    struct kv_t* newest;
+    struct kv_t* oldest;     // evicted first
+    int log_fd;              // -1 unless values persist
+    long log_bytes;
+    long hits;
+    long misses;
+    long evicted;
+} stripes[KV_STRIPES];
+
+static uint64_t key_hash(const char* key) {
+    uint64_t h = 14695981039346656037ULL;  // fnv-1a
+    for (; *key; key++) h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+    return h;
+}
+
+static long entry_size(struct kv_t* e) {
+    return sizeof(struct kv_t) + e->klen + e->vlen + 2;
+}
+
+// caller holds s->mtx, *link is where the entry is chained from if found
+static struct kv_t* find_entry(struct stripe_t* s, const char* key, uint64_t hash, struct kv_t*** link) {
+    struct kv_t** p = &s->buckets[(hash >> 8) & (s->n_buckets - 1)];
+    for (; *p != NULL; p = &(*p)->next) {
+        if ((*p)->hash == hash && strcmp((*p)->key, key) == 0) break;
+    }
+    if (link != NULL) *link = p;
+    return *p;
+}
+
+static void unlink_recency(struct stripe_t* s, struct kv_t* e) {
+    if (e->newer != NULL) e->newer->older = e->older;
+    else s->newest = e->older;
+    if (e->older != NULL) e->older->newer = e->newer;
+    else s->oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+static void push_recency(struct stripe_t* s, struct kv_t* e) {
+    e->older = s->newest;
+    e->newer = NULL;
+    if (s->newest != NULL) s->newest->newer = e;
+    s->newest = e;
+    if (s->oldest == NULL) s->oldest = e;
+}
+
+// take the entry out of the stripe and free it, caller holds s->mtx
+static void drop_entry(struct stripe_t* s, struct kv_t* e) {
+    struct kv_t** link;
+    find_entry(s, e->key, e->hash, &link);
+    *link = e->next;
+    unlink_recency(s, e);
+    s->used -= entry_size(e);
+    s->n_keys--;
+    free(e);
+}
+
+static void grow_buckets(struct stripe_t* s) {
+    int n = s->n_buckets * 2;
+    struct kv_t** buckets = (struct kv_t**)calloc(n, sizeof(struct kv_t*));
+    if (buckets == NULL) return;  // longer chains, still correct
+    for (int i = 0; i < s->n_buckets; i++) {
+        while (s->buckets[i] != NULL) {
+            struct kv_t* e = s->buckets[i];
+            s->buckets[i] = e->next;
+            e->next = buckets[(e->hash >> 8) & (n - 1)];
+            buckets[(e->hash >> 8) & (n - 1)] = e;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->n_buckets = n;
+}
+
+static int write_record(int fd, char op, const char* key, int klen, const char* value, int vlen) {
+    struct kv_rec_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.klen = klen;
+    rec.op = op;
+    rec.vlen = vlen;
+    rec.crc = crc32c(0, (const char*)&rec + 4, sizeof(rec) - 4);
+    rec.crc = crc32c(rec.crc, key, klen);
+    rec.crc = crc32c(rec.crc, value, vlen);
+    struct iovec iov[3] = { { &rec, sizeof(rec) }, { (void*)key, (size_t)klen }, { (void*)value, (size_t)vlen } };
+    ssize_t total = sizeof(rec) + klen + vlen;
+    return writev(fd, iov, 3) == total ? (int)total : -1;
+}
+
+// replace the stripe log by one record per live entry, oldest first so that replaying it keeps the recency order
+static void rewrite_log(struct stripe_t* s, int id) {
+    char path[64], tmp[64];
+    snprintf(path, sizeof(path), "%s/%02x.log", KV_DIR, id);
+    snprintf(tmp, sizeof(tmp), "%s/%02x.tmp", KV_DIR, id);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+    if (fd < 0) return;
+    long bytes = 0;
+    for (struct kv_t* e = s->oldest; e != NULL && bytes >= 0; e = e->newer) {
+        int n = write_record(fd, 'P', e->key, e->klen, e->value, e->vlen);
+        bytes = n < 0 ? -1 : bytes + n;
+    }
+    if (bytes < 0 || fdatasync(fd) != 0 || rename(tmp, path) != 0) {
+        close(fd);
+        unlink(tmp);
+        return;  // the old log is still complete
+    }
+    close(s->log_fd);
+    s->log_fd = fd;
+    s->log_bytes = bytes;
+}
+
+// log one change, caller holds s->mtx so that the log keeps the order of the changes to a key
+static void log_change(struct stripe_t* s, char op, const char* key, int klen, const char* value, int vlen) {
+    if (s->log_fd < 0) return;
+    int n = write_record(s->log_fd, op, key, klen, value, vlen);
+    if (n < 0) {
+        logger("(kv): cannot log a change, it is kept in memory only");
+        return;
+    }
+    s->log_bytes += n;
+    if (s->log_bytes > 2 * s->used + KV_SLACK) {
+        rewrite_log(s, (int)(s - stripes));
+    }
+}
+
+// store a copy of key and value, evicting the least recently used entries of the stripe beyond its share of the budget
+static int put_entry(const char* key, const char* value, int logged) {
+    int klen = strlen(key), vlen = strlen(value);
+    struct kv_t* e = (struct kv_t*)malloc(sizeof(struct kv_t) + klen + vlen + 2);
+    if (e == NULL) return -1;
+    memset(e, 0, sizeof(struct kv_t));
+    e->hash = key_hash(key);
+    e->klen = klen;
+    e->vlen = vlen;
+    e->key = (char*)(e + 1);
+    e->value = e->key + klen + 1;
+    memcpy(e->key, key, klen + 1);
+    memcpy(e->value, value, vlen + 1);
+
+    struct stripe_t* s = &stripes[e->hash % KV_STRIPES];
+    long budget = (long)KV_MAX * 1048576 / KV_STRIPES;
+    pthread_mutex_lock(&s->mtx);
+    struct kv_t** link;
+    struct kv_t* old = find_entry(s, key, e->hash, &link);
+    if (old != NULL) {
+        drop_entry(s, old);
+        find_entry(s, key, e->hash, &link);
+    }
+    e->next = *link;
+    *link = e;
+    push_recency(s, e);
+    s->used += entry_size(e);
+    s->n_keys++;
+    if (logged) log_change(s, 'P', key, klen, value, vlen);
+
+    while (s->used > budget && s->oldest != e) {
+        struct kv_t* victim = s->oldest;
+        if (logged) log_change(s, 'D', victim->key, victim->klen, "", 0);
+        drop_entry(s, victim);
+        s->evicted++;
+    }
+    if (s->n_keys > s->n_buckets) {
+        grow_buckets(s);
+    }
+    pthread_mutex_unlock(&s->mtx);
+    return 0;
+}
+
+static int del_entry(const char* key, int logged) {
+    uint64_t hash = key_hash(key);
+    struct stripe_t* s = &stripes[hash % KV_STRIPES];
+    pthread_mutex_lock(&s->mtx);
+    struct kv_t* e = find_entry(s, key, hash, NULL);
+    if (e != NULL) {
+        if (logged) log_change(s, 'D', key, e->klen, "", 0);
+        drop_entry(s, e);
+    }
+    pthread_mutex_unlock(&s->mtx);
+    return e != NULL;
+}
+
+static int check_key(int argc, char** argv, int expected, const char* usage, struct echo_t* echo) {
+    if (argc != expected) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = (char*)usage;
+        return -1;
+    }
+    if (strlen(argv[1]) > KV_KEY) {
+        echo->status = "FAIL";
+        echo->code = -5;
+        echo->message = "key too long";
+        return -1;
+    }
+    return 0;
+}
+
+// GET key: the value, which stays in memory longer for having been asked for
+int kv_get(int argc, char** argv, struct echo_t* echo) {
+    if (check_key(argc, argv, 2, "Usage: GET key", echo) != 0) {
+        return 0;
+    }
+    uint64_t hash = key_hash(argv[1]);
+    struct stripe_t* s = &stripes[hash % KV_STRIPES];
+    char* buf = io_buf;  // per-thread buffer, stays valid after we return
+    memset(buf, 0, IO_BUF_SIZE);
+    pthread_mutex_lock(&s->mtx);
+    struct kv_t* e = find_entry(s, argv[1], hash, NULL);
+    int vlen = e != NULL ? e->vlen : -1;
+    if (e != NULL) {
+        memcpy(buf, e->value, vlen < IO_BUF_SIZE - 1 ? vlen : IO_BUF_SIZE - 1);  // a request line never carries more
+        unlink_recency(s, e);
+        push_recency(s, e);
+        s->hits++;
+    }
+    else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->mtx);
+
+    if (vlen < 0) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "no such key";
+        return 0;
+    }
+    echo->status = "OK";
+    echo->code = vlen;
+    echo->message = buf;
+    return 0;
+}
+
+// PUT key value: store or replace the value
+int kv_put(int argc, char** argv, struct echo_t* echo) {
+    if (check_key(argc, argv, 3, "Usage: PUT key value", echo) != 0) {
+        return 0;
+    }
+    if (put_entry(argv[1], argv[2], 1) != 0) {
+        echo->status = "FAIL";
+        echo->code = ENOMEM;
+        echo->message = "out of memory";
+        return 0;
+    }
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = "value stored";
+    return 0;
+}
+
+// DEL key: forget the value, the code is the number of keys deleted
+int kv_del(int argc, char** argv, struct echo_t* echo) {
+    if (check_key(argc, argv, 2, "Usage: DEL key", echo) != 0) {
+        return 0;
+    }
+    int n = del_entry(argv[1], 1);
+    echo->status = "OK";
+    echo->code = n;
+    echo->message = (char*)(n > 0 ? "key deleted" : "no such key");
+    return 0;
+}
+
+// apply a stripe log, a torn record at its end is cut off; returns the records applied
+static long replay_log(int fd, int id) {
+    char* buf = (char*)malloc(KV_KEY + 1 + IO_BUF_SIZE + 1);
+    struct stat st;
+    if (buf == NULL || fstat(fd, &st) != 0) {
+        free(buf);
+        return -1;
+    }
+    long applied = 0;
+    off_t pos = 0;
+    while (pos < st.st_size) {
+        struct kv_rec_t rec;
+        int ok = pread(fd, &rec, sizeof(rec), pos) == sizeof(rec) && rec.klen > 0 && rec.klen <= KV_KEY &&
+                 rec.vlen < IO_BUF_SIZE && (rec.op == 'P' || rec.op == 'D');
+        ok = ok && pread(fd, buf, rec.klen + rec.vlen, pos + sizeof(rec)) == rec.klen + rec.vlen;
+        if (ok) {
+            uint32_t crc = crc32c(0, (const char*)&rec + 4, sizeof(rec) - 4);
+            ok = crc32c(crc, buf, rec.klen + rec.vlen) == rec.crc;
+        }
+        if (!ok) {
+            char msg[128];
+            memset(msg, 0, sizeof(msg));
+            sprintf(msg, "(kv): log %02x ends in a torn record at byte %lld, dropped", id, (long long)pos);
+            logger(msg);
+            ftruncate(fd, pos);
+            break;
+        }
+        char key[KV_KEY + 1];
+        memcpy(key, buf, rec.klen);
+        key[rec.klen] = '\0';
+        buf[rec.klen + rec.vlen] = '\0';
+        if (rec.op == 'P') put_entry(key, buf + rec.klen, 0);
+        else del_entry(key, 0);
+        pos += sizeof(rec) + rec.klen + rec.vlen;
+        applied++;
+    }
+    free(buf);
+    return applied;
+}
+
+int init_kv(void) {
+    for (int i = 0; i < KV_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].mtx, NULL);
+        stripes[i].n_buckets = 64;
+        stripes[i].buckets = (struct kv_t**)calloc(stripes[i].n_buckets, sizeof(struct kv_t*));
+        stripes[i].log_fd = -1;
+        if (stripes[i].buckets == NULL) return -1;
+    }
+    if (!KV_PERSIST) {
+        return 0;
+    }
+
+    // the logs are replayed before they are reopened for appending, so nothing is logged twice
+    if (mkdir(KV_DIR, S_IRWXU) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    long records = 0, keys = 0;
+    for (int i = 0; i < KV_STRIPES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%02x.log", KV_DIR, i);
+        int fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+        long applied = fd < 0 ? -1 : replay_log(fd, i);
+        if (applied < 0) {
+            return -1;
+        }
+        records += applied;
+        keys += stripes[i].n_keys;
+        stripes[i].evicted = 0;  // replaying the puts evicts again what was evicted before
+        stripes[i].log_fd = fd;
+        stripes[i].log_bytes = lseek(fd, 0, SEEK_END);
+        if (stripes[i].log_bytes > 2 * stripes[i].used + KV_SLACK) {
+            rewrite_log(&stripes[i], i);
+        }
+    }
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(kv): %ld keys recovered, %ld records replayed", keys, records);
+    logger(msg);
+    return 0;
+}
+
+// fork a process that writes the stripes as they are now to dir/.kv, in the format of the logs, while we go on
+// changing our copy of them; the stripes are locked only across the fork
+pid_t dump_kv(const char* dir, long* keys) {
+    char path[400];
+    snprintf(path, sizeof(path), "%s/%s", dir, KV_DIR);
+    if (mkdir(path, S_IRWXU) != 0) return -1;
+
+    *keys = 0;
+    for (int i = 0; i < KV_STRIPES; i++) {
+        pthread_mutex_lock(&stripes[i].mtx);
+        *keys += stripes[i].n_keys;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        int status = 0;  // the only thread left, the locks it holds are its own
+        for (int i = 0; i < KV_STRIPES && status == 0; i++) {
+            snprintf(path, sizeof(path), "%s/%s/%02x.log", dir, KV_DIR, i);
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+            for (struct kv_t* e = stripes[i].oldest; e != NULL && fd >= 0 && status == 0; e = e->newer) {
+                status = write_record(fd, 'P', e->key, e->klen, e->value, e->vlen) < 0;
+            }
+            status = status || fd < 0 || fdatasync(fd) != 0;
+            if (fd >= 0) close(fd);
+        }
+        _exit(status);
+    }
+    for (int i = 0; i < KV_STRIPES; i++) pthread_mutex_unlock(&stripes[i].mtx);
+    return pid;
+}
+
+// keys, memory against the budget, hit rate and evictions, summed over the stripes
+int show_kv(char* buf, size_t size) {
+    long keys = 0, used = 0, hits = 0, misses = 0, evicted = 0, logged = 0;
+    for (int i = 0; i < KV_STRIPES; i++) {
+        pthread_mutex_lock(&stripes[i].mtx);
+        keys += stripes[i].n_keys;
+        used += stripes[i].used;
+        hits += stripes[i].hits;
+        misses += stripes[i].misses;
+        evicted += stripes[i].evicted;
+        logged += stripes[i].log_fd >= 0 ? stripes[i].log_bytes : 0;
+        pthread_mutex_unlock(&stripes[i].mtx);
+    }
+    int len = snprintf(buf, size, "%ld keys in %ld of %ld bytes, %ld hits and %ld misses (%.1f%%), %ld evicted", keys, used,
+                       (long)KV_MAX * 1048576, hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0, evicted);
+    if (KV_PERSIST) len += snprintf(buf + len, size - len, ", %ld bytes of logs in %s", logged, KV_DIR);
+    len += snprintf(buf + len, size - len, "\n");
+    return len;
+}
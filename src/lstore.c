@@ -0,0 +1,707 @@
+/*
+** lstore.c -- log-structured storage engine, the data of all files appended to a few large segment files
+*/
+
+#include "define.h"
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define SEG_DIR ".segments"
+#define SEG_SIZE (64 << 20)    // a segment is sealed once it holds this many bytes
+#define SEG_RECORD (1 << 20)   // most data in one record, compaction merges neighbouring extents up to it
+#define SEG_MAGIC 0x4c465553   // "SUFL"
+#define COMPACT_PERIOD 30      // seconds between looks at the dead bytes
+#define COMPACT_DEAD 50        // percent of dead data in the sealed segments above which they are compacted
+#define N_BUCKETS 65536
+
+int LOG_MODE = 0;
+
+struct head_t {         // precedes the name and data of every record in a segment
+    uint32_t magic;
+    uint32_t crc;       // crc32c of the rest of the header, the name and the data
+    uint64_t seq;       // order among all the records ever appended
+    uint64_t offset;    // where the data goes in the file
+    uint64_t size;      // size of the file once the record is applied
+    int64_t mtime;      // when the file was changed, in nanoseconds
+    uint32_t len;       // bytes of data
+    uint16_t name_len;
+    uint8_t op;         // W(rite), or S(ize) for a record without data: a creation, a truncation, or a compacted one
+    uint8_t pad;
+};
+
+struct segment_t {
+    long id;                 // named after it, in the order segments were started
+    int fd;
+    off_t tail;              // bytes appended
+    long data;               // bytes of data in its records
+    long live;               // of which still part of a file
+    struct segment_t* next;  // the next newer one
+};
+
+struct extent_t {            // a range of a file that is stored in one place of a segment
+    off_t offset;
+    off_t len;
+    struct segment_t* seg;
+    off_t pos;
+};
+
+struct lfile_t {
+    char name[256];
+    off_t size;
+    int64_t mtime;
+    int n_ext;
+    int cap;
+    struct extent_t* ext;    // sorted by offset, never overlapping, gaps read as zeros
+    long meta;               // segment of the newest record of the file, it holds the size
+    int open;                // 1 while a lock entry uses it
+    int dirty;               // written since it was opened
+    pthread_mutex_t mtx;     // orders the records of the file between its writer and the compaction
+    struct lfile_t* next;    // in its hash bucket
+};
+
+static struct lfile_t* buckets[N_BUCKETS];
+static long n_files = 0;
+static struct segment_t* oldest = NULL;
+static struct segment_t* active = NULL;  // the one appended to, never compacted
+static uint64_t next_seq = 1;
+
+// readers of the extents and segments take it shared, changes exclusive; lfile.mtx, then append_mtx, then this one
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t append_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t compact_mtx = PTHREAD_MUTEX_INITIALIZER;  // one compaction at a time
+
+static struct {
+    long records;      // appended since startup
+    long bytes;
+    long compacted;    // segments removed by compaction
+    long moved;        // bytes it had to copy
+    time_t last;       // when it last removed a segment
+} ls;
+
+static int64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static unsigned name_hash(const char* name) {
+    unsigned h = 2166136261u;  // fnv-1a
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h % N_BUCKETS;
+}
+
+// caller holds index_lock
+static struct lfile_t* find_file(const char* name) {
+    for (struct lfile_t* f = buckets[name_hash(name)]; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) return f;
+    }
+    return NULL;
+}
+
+// caller holds index_lock exclusively
+static struct lfile_t* add_file(const char* name) {
+    struct lfile_t* f = (struct lfile_t*)calloc(1, sizeof(struct lfile_t));
+    if (f == NULL) return NULL;
+    strncpy(f->name, name, sizeof(f->name) - 1);
+    f->meta = -1;
+    pthread_mutex_init(&f->mtx, NULL);
+    unsigned h = name_hash(name);
+    f->next = buckets[h];
+    buckets[h] = f;
+    n_files++;
+    return f;
+}
+
+// index of the first extent that ends after offset
+static int first_after(struct lfile_t* f, off_t offset) {
+    int lo = 0, hi = f->n_ext;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (f->ext[mid].offset + f->ext[mid].len <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// replace what the file has in [from, to) with ins, or with a hole if ins is NULL; caller holds index_lock exclusively
+static int put_extent(struct lfile_t* f, off_t from, off_t to, struct extent_t* ins) {
+    if (f->n_ext + 2 > f->cap) {
+        int cap = f->cap == 0 ? 8 : f->cap * 2;
+        struct extent_t* ext = (struct extent_t*)realloc(f->ext, cap * sizeof(struct extent_t));
+        if (ext == NULL) return -1;
+        f->ext = ext;
+        f->cap = cap;
+    }
+
+    int i = first_after(f, from), j = i;
+    while (j < f->n_ext && f->ext[j].offset < to) j++;  // i..j-1 overlap the range
+
+    struct extent_t keep[3];  // what replaces them: the head of the first, ins, the tail of the last
+    int k = 0;
+    if (i < j && f->ext[i].offset < from) {
+        keep[k] = f->ext[i];
+        keep[k++].len = from - f->ext[i].offset;
+    }
+    if (ins != NULL) {
+        keep[k++] = *ins;
+        ins->seg->live += ins->len;
+    }
+    if (i < j && f->ext[j - 1].offset + f->ext[j - 1].len > to) {
+        struct extent_t* last = &f->ext[j - 1];
+        keep[k].offset = to;
+        keep[k].len = last->offset + last->len - to;
+        keep[k].seg = last->seg;
+        keep[k++].pos = last->pos + (to - last->offset);
+    }
+    for (int m = i; m < j; m++) {
+        off_t start = f->ext[m].offset > from ? f->ext[m].offset : from;
+        off_t end = f->ext[m].offset + f->ext[m].len < to ? f->ext[m].offset + f->ext[m].len : to;
+        f->ext[m].seg->live -= end - start;
+    }
+
+    memmove(&f->ext[i + k], &f->ext[j], (f->n_ext - j) * sizeof(struct extent_t));
+    memcpy(&f->ext[i], keep, k * sizeof(struct extent_t));
+    f->n_ext += k - (j - i);
+    return 0;
+}
+
+// a record changes the size, and a shorter file loses whatever was stored past its end
+static void set_size(struct lfile_t* f, off_t size) {
+    if (size < f->size) put_extent(f, size, INT64_MAX, NULL);
+    f->size = size;
+}
+
+static struct segment_t* start_segment(long id) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/%010ld.seg", SEG_DIR, id);
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) return NULL;
+    struct segment_t* seg = (struct segment_t*)calloc(1, sizeof(struct segment_t));
+    seg->id = id;
+    seg->fd = fd;
+    return seg;
+}
+
+// append one record to the active segment, *seg and *pos tell where its data went; caller holds f->mtx
+static int append_record(char op, struct lfile_t* f, off_t offset, const char* data, size_t len, off_t size, int64_t mtime,
+                         struct segment_t** seg, off_t* pos) {
+    struct head_t head;
+    memset(&head, 0, sizeof(head));
+    head.magic = SEG_MAGIC;
+    head.offset = offset;
+    head.size = size;
+    head.mtime = mtime;
+    head.len = len;
+    head.name_len = strlen(f->name);
+    head.op = op;
+    off_t total = sizeof(head) + head.name_len + len;
+
+    snap_enter(NULL);  // no record goes in while a snapshot is cut
+    pthread_mutex_lock(&append_mtx);
+    if (active->tail > 0 && active->tail + total > SEG_SIZE) {
+        // sealed: made durable once, and from then on only ever read and eventually compacted
+        struct segment_t* seg = start_segment(active->id + 1);
+        if (seg == NULL) {
+            pthread_mutex_unlock(&append_mtx);
+            snap_leave();
+            return -1;
+        }
+        fdatasync(active->fd);
+        pthread_rwlock_wrlock(&index_lock);
+        active->next = seg;
+        active = seg;
+        pthread_rwlock_unlock(&index_lock);
+    }
+    head.seq = next_seq;
+    head.crc = crc32c(0, (const char*)&head + 8, sizeof(head) - 8);
+    head.crc = crc32c(head.crc, f->name, head.name_len);
+    head.crc = crc32c(head.crc, data, len);
+
+    struct iovec iov[3] = { { &head, sizeof(head) }, { f->name, head.name_len }, { (void*)data, len } };
+    if (pwritev(active->fd, iov, 3, active->tail) != total) {
+        int saved = errno;
+        ftruncate(active->fd, active->tail);  // no torn record in the middle of the segment
+        pthread_mutex_unlock(&append_mtx);
+        snap_leave();
+        errno = saved == 0 ? ENOSPC : saved;
+        return -1;
+    }
+    next_seq++;
+    *seg = active;
+    *pos = active->tail + sizeof(head) + head.name_len;
+    active->tail += total;
+    active->data += len;
+    ls.records++;
+    ls.bytes += total;
+    pthread_mutex_unlock(&append_mtx);
+    snap_leave();
+    return 0;
+}
+
+// a write or size record for the file, then the index points at it; caller holds f->mtx
+static int log_change(char op, struct lfile_t* f, off_t offset, const char* data, size_t len, off_t size) {
+    struct segment_t* seg;
+    off_t pos;
+    int64_t mtime = now_ns();
+    if (append_record(op, f, offset, data, len, size, mtime, &seg, &pos) != 0) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    int status = 0;
+    if (len > 0) {
+        struct extent_t ext = { offset, (off_t)len, seg, pos };
+        status = put_extent(f, offset, offset + len, &ext);
+    }
+    set_size(f, size);
+    f->mtime = mtime;
+    f->meta = seg->id;
+    f->dirty = 1;
+    pthread_rwlock_unlock(&index_lock);
+    return status;
+}
+
+// copy [offset, offset + len) of the file into buf, holes as zeros; caller holds index_lock
+static ssize_t read_extents(struct lfile_t* f, char* buf, size_t len, off_t offset) {
+    if (offset >= f->size) return 0;
+    if ((off_t)len > f->size - offset) len = f->size - offset;
+    memset(buf, 0, len);
+    off_t end = offset + len;
+    for (int i = first_after(f, offset); i < f->n_ext && f->ext[i].offset < end; i++) {
+        struct extent_t* e = &f->ext[i];
+        off_t start = e->offset > offset ? e->offset : offset;
+        off_t stop = e->offset + e->len < end ? e->offset + e->len : end;
+        if (pread(e->seg->fd, buf + (start - offset), stop - start, e->pos + (start - e->offset)) != stop - start) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return len;
+}
+
+// the identifier of a file in the store is an empty memfd, whose offset is the file's shared seek pointer
+static int log_open(const char* name, int create, struct lock_t* lock) {
+    if (strlen(name) >= sizeof(((struct lfile_t*)0)->name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    struct lfile_t* f = find_file(name);
+    int created = f == NULL || f->meta < 0;
+    if (f == NULL && create) {
+        f = add_file(name);
+    }
+    if (f == NULL || (created && !create) || f->open) {
+        int saved = f == NULL ? (create ? ENOMEM : ENOENT) : (f->open ? EBUSY : ENOENT);
+        pthread_rwlock_unlock(&index_lock);
+        errno = saved;
+        return -1;
+    }
+    f->open = 1;
+    f->dirty = 0;
+    pthread_rwlock_unlock(&index_lock);
+
+    int fd = memfd_create("sufd", MFD_CLOEXEC);
+    pthread_mutex_lock(&f->mtx);
+    int status = fd < 0 ? -1 : (created ? log_change('S', f, 0, NULL, 0, 0) : 0);  // a new file exists once its record does
+    pthread_mutex_unlock(&f->mtx);
+    if (status != 0) {
+        int saved = errno;
+        if (fd >= 0) close(fd);
+        pthread_rwlock_wrlock(&index_lock);
+        f->open = 0;
+        pthread_rwlock_unlock(&index_lock);
+        errno = saved;
+        return -1;
+    }
+    lock->lfile = f;
+    lock->recipe = NULL;
+    lock->crc_fd = -1;  // every record carries its own checksum
+    return fd;
+}
+
+static ssize_t log_pread(struct lock_t* lock, char* buf, size_t len, off_t offset) {
+    long began = trace_clock();
+    pthread_rwlock_rdlock(&index_lock);
+    ssize_t n = read_extents(lock->lfile, buf, len, offset);
+    pthread_rwlock_unlock(&index_lock);
+    trace_io("read", n, began);
+    return n;
+}
+
+static ssize_t log_pwrite(struct lock_t* lock, const char* buf, size_t len, off_t offset) {
+    struct lfile_t* f = lock->lfile;
+    long began = trace_clock();
+    for (size_t done = 0; done < len;) {  // split so that compaction can always read a record back in one piece
+        size_t n = len - done < SEG_RECORD ? len - done : SEG_RECORD;
+        pthread_mutex_lock(&f->mtx);
+        off_t end = offset + done + n;
+        int status = log_change('W', f, offset + done, buf + done, n, end > f->size ? end : f->size);
+        pthread_mutex_unlock(&f->mtx);
+        touch_lock(lock);
+        if (status != 0) {
+            trace_io("write", -1, began);
+            return -1;
+        }
+        done += n;
+    }
+    trace_io("write", len, began);
+    return len;
+}
+
+static int log_stat(struct lock_t* lock, struct stat* st) {
+    memset(st, 0, sizeof(struct stat));
+    pthread_rwlock_rdlock(&index_lock);
+    struct lfile_t* f = lock->lfile;
+    off_t stored = 0;
+    for (int i = 0; i < f->n_ext; i++) stored += f->ext[i].len;
+    st->st_mode = S_IFREG | S_IRUSR | S_IWUSR;
+    st->st_nlink = 1;
+    st->st_size = f->size;
+    st->st_blocks = (stored + 511) / 512;  // holes take no room in the segments
+    st->st_mtim.tv_sec = f->mtime / 1000000000LL;
+    st->st_mtim.tv_nsec = f->mtime % 1000000000LL;
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+}
+
+static int log_truncate(struct lock_t* lock, off_t length) {
+    pthread_mutex_lock(&lock->lfile->mtx);
+    int status = log_change('S', lock->lfile, length, NULL, 0, length);
+    pthread_mutex_unlock(&lock->lfile->mtx);
+    touch_lock(lock);
+    return status;
+}
+
+// there is no room to reserve in an append-only log, the file just grows to cover the range
+static int log_allocate(struct lock_t* lock, off_t offset, off_t len) {
+    return offset + len > lock->lfile->size ? log_truncate(lock, offset + len) : 0;
+}
+
+// what a closed file was written is on disk before FCLOSE answers
+static int log_close(struct lock_t* lock) {
+    struct lfile_t* f = lock->lfile;
+    int status = 0;
+    if (f->dirty) {
+        pthread_rwlock_rdlock(&index_lock);  // sealed segments were synced when sealed
+        status = fdatasync(active->fd);
+        pthread_rwlock_unlock(&index_lock);
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    f->open = 0;
+    pthread_rwlock_unlock(&index_lock);
+    lock->lfile = NULL;
+    if (close(lock->fd) != 0) status = -1;
+    return status;
+}
+
+static ssize_t log_read_name(const char* name, char* buf, size_t len, off_t offset) {
+    pthread_rwlock_rdlock(&index_lock);
+    struct lfile_t* f = find_file(name);
+    ssize_t n = -1;
+    if (f == NULL || f->meta < 0) errno = ENOENT;
+    else n = read_extents(f, buf, len, offset);
+    pthread_rwlock_unlock(&index_lock);
+    return n;
+}
+
+struct store_t log_store = { "log", log_open, log_pread, log_pwrite, log_stat, log_truncate, log_allocate, log_close,
+                             log_read_name };
+
+// move what the file still keeps in victim to the head of the log, merging neighbouring extents; caller holds f->mtx
+static int move_file(struct lfile_t* f, struct segment_t* victim, char* buf) {
+    int i = 0;
+    while (1) {
+        while (i < f->n_ext && f->ext[i].seg != victim) i++;
+        if (i == f->n_ext) break;
+
+        off_t from = f->ext[i].offset, len = 0;  // a run of extents of victim that follow each other in the file, at least one
+                                                 // as no extent is longer than a record
+        for (int k = i; k < f->n_ext && f->ext[k].seg == victim && f->ext[k].offset == from + len &&
+                        len + f->ext[k].len <= SEG_RECORD; k++) {
+            if (pread(victim->fd, buf + len, f->ext[k].len, f->ext[k].pos) != f->ext[k].len) return -1;
+            len += f->ext[k].len;
+        }
+
+        struct segment_t* seg;
+        off_t pos;
+        if (append_record('W', f, from, buf, len, f->size, f->mtime, &seg, &pos) != 0) return -1;
+        struct extent_t ext = { from, len, seg, pos };
+        pthread_rwlock_wrlock(&index_lock);
+        put_extent(f, from, from + len, &ext);
+        f->meta = seg->id;
+        pthread_rwlock_unlock(&index_lock);
+        i = first_after(f, from + len);
+        ls.moved += len;
+    }
+
+    if (f->meta == victim->id) {  // the newest size of the file must outlive the segment
+        struct segment_t* seg;
+        off_t pos;
+        if (append_record('S', f, f->size, NULL, 0, f->size, f->mtime, &seg, &pos) != 0) return -1;
+        pthread_rwlock_wrlock(&index_lock);
+        f->meta = seg->id;
+        pthread_rwlock_unlock(&index_lock);
+    }
+    return 0;
+}
+
+// copy the live data of the oldest segment to the head of the log, then delete it; the oldest goes first so that
+// the truncations a removed segment recorded can no longer be needed to hide the data of an older one
+static int compact_oldest(char* buf) {
+    pthread_rwlock_rdlock(&index_lock);
+    struct segment_t* victim = oldest;
+    int n = 0;
+    struct lfile_t** files = (struct lfile_t**)malloc((n_files + 1) * sizeof(struct lfile_t*));
+    for (int b = 0; b < N_BUCKETS && files != NULL; b++) {
+        for (struct lfile_t* f = buckets[b]; f != NULL; f = f->next) {
+            int uses = f->meta == victim->id;
+            for (int i = 0; i < f->n_ext && !uses; i++) uses = f->ext[i].seg == victim;
+            if (uses) files[n++] = f;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    if (files == NULL) return -1;
+
+    int status = 0;
+    for (int k = 0; k < n && status == 0; k++) {
+        pthread_mutex_lock(&files[k]->mtx);
+        status = move_file(files[k], victim, buf);
+        pthread_mutex_unlock(&files[k]->mtx);
+    }
+    free(files);
+    if (status != 0 || victim->live != 0) {
+        logger("(lstore): cannot compact a segment, it is kept");
+        return -1;
+    }
+
+    // what was moved must be on disk before the only other copy goes
+    pthread_mutex_lock(&append_mtx);
+    fdatasync(active->fd);
+    pthread_rwlock_wrlock(&index_lock);
+    oldest = victim->next;
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&append_mtx);
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s/%010ld.seg", SEG_DIR, victim->id);
+    unlink(path);
+    close(victim->fd);
+    free(victim);
+    ls.compacted++;
+    ls.last = time(NULL);
+    return 0;
+}
+
+// compact while more than COMPACT_DEAD percent of the data in sealed segments is dead, returns segments removed
+int compact_segments(void) {
+    if (!LOG_MODE) return 0;
+    pthread_mutex_lock(&compact_mtx);
+    char* buf = (char*)malloc(SEG_RECORD);
+    int removed = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    int rounds = 0;  // each sealed segment at most once, a fully live one just moves to the head
+    for (struct segment_t* s = oldest; s != active; s = s->next) rounds++;
+    pthread_rwlock_unlock(&index_lock);
+
+    for (; buf != NULL && rounds > 0; rounds--) {
+        pthread_rwlock_rdlock(&index_lock);
+        long data = 0, live = 0;
+        for (struct segment_t* s = oldest; s != active; s = s->next) {
+            data += s->data;
+            live += s->live;
+        }
+        int worth = oldest != active && (oldest->live == 0 || (data - live) * 100 > data * COMPACT_DEAD);
+        pthread_rwlock_unlock(&index_lock);
+        if (!worth || compact_oldest(buf) != 0) break;
+        removed++;
+    }
+    free(buf);
+    pthread_mutex_unlock(&compact_mtx);
+    return removed;
+}
+
+static void* compact_thread(void* arg) {
+    while (1) {
+        sleep(COMPACT_PERIOD);
+        compact_segments();
+    }
+    return NULL;
+}
+
+static int compare_longs(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// rebuild the index from one segment, a torn or damaged record ends it; returns the records applied
+static long replay_segment(struct segment_t* seg, char* buf) {
+    struct stat st;
+    if (fstat(seg->fd, &st) != 0) return -1;
+    long applied = 0;
+    off_t pos = 0;
+    while (pos < st.st_size) {
+        struct head_t head;
+        int ok = pread(seg->fd, &head, sizeof(head), pos) == sizeof(head) && head.magic == SEG_MAGIC &&
+                 head.name_len > 0 && head.name_len < 256 && head.len <= SEG_RECORD && head.seq >= next_seq &&
+                 pos + (off_t)(sizeof(head) + head.name_len + head.len) <= st.st_size;
+        ok = ok && pread(seg->fd, buf, head.name_len + head.len, pos + sizeof(head)) == head.name_len + head.len;
+        if (ok) {
+            uint32_t crc = crc32c(0, (const char*)&head + 8, sizeof(head) - 8);
+            ok = crc32c(crc, buf, head.name_len + head.len) == head.crc;
+        }
+        if (!ok) {
+            char msg[128];
+            memset(msg, 0, sizeof(msg));
+            sprintf(msg, "(lstore): segment %ld ends in a torn record at byte %lld, dropped", seg->id, (long long)pos);
+            logger(msg);
+            ftruncate(seg->fd, pos);
+            break;
+        }
+
+        char name[256];
+        memset(name, 0, sizeof(name));
+        memcpy(name, buf, head.name_len);
+        struct lfile_t* f = find_file(name);
+        if (f == NULL && (f = add_file(name)) == NULL) return -1;
+        off_t data = pos + sizeof(head) + head.name_len;
+        if (head.op == 'W' && head.len > 0) {
+            struct extent_t ext = { (off_t)head.offset, (off_t)head.len, seg, data };
+            if (put_extent(f, head.offset, head.offset + head.len, &ext) != 0) return -1;
+        }
+        set_size(f, head.size);
+        f->mtime = head.mtime;
+        f->meta = seg->id;
+        seg->data += head.len;
+        next_seq = head.seq + 1;
+        pos = data + head.len;
+        applied++;
+    }
+    seg->tail = pos;
+    return applied;
+}
+
+// open the segments and replay them in order, so the index is as the last record before a crash left it
+int init_lstore(void) {
+    if (!LOG_MODE) {
+        return 0;
+    }
+    if (mkdir(SEG_DIR, S_IRWXU) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    DIR* dir = opendir(SEG_DIR);
+    if (dir == NULL) {
+        return -1;
+    }
+    long* ids = NULL;
+    int n_ids = 0, cap = 0;
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        long id;
+        char rest[8];
+        if (sscanf(d->d_name, "%ld.%7s", &id, rest) != 2 || strcmp(rest, "seg") != 0) continue;
+        if (n_ids == cap) {
+            cap = cap == 0 ? 64 : cap * 2;
+            ids = (long*)realloc(ids, cap * sizeof(long));
+        }
+        ids[n_ids++] = id;
+    }
+    closedir(dir);
+    qsort(ids, n_ids, sizeof(long), compare_longs);
+
+    char* buf = (char*)malloc(SEG_RECORD + 256);
+    long records = 0;
+    struct segment_t* last = NULL;
+    for (int i = 0; i < n_ids; i++) {
+        struct segment_t* seg = start_segment(ids[i]);
+        long applied = seg == NULL ? -1 : replay_segment(seg, buf);
+        if (applied < 0) {
+            free(buf);
+            free(ids);
+            return -1;
+        }
+        records += applied;
+        if (last == NULL) oldest = seg;
+        else last->next = seg;
+        last = seg;
+    }
+    free(buf);
+    free(ids);
+    if (last == NULL && (last = oldest = start_segment(1)) == NULL) {
+        return -1;
+    }
+    active = last;
+
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, compact_thread, NULL) != 0) {
+        return -1;
+    }
+    store = &log_store;
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(lstore): %ld files recovered from %d segments, %ld records replayed", n_files, n_ids, records);
+    logger(msg);
+    return 0;
+}
+
+// share the sealed segments with a snapshot in dir and tell how much of the active one it gets, nothing is being
+// appended meanwhile; returns the segments, the active one open as *in and its copy to be as *out
+int snap_segments(const char* dir, int* in, int* out, off_t* len) {
+    *in = *out = -1;
+    *len = 0;
+    if (!LOG_MODE) return 0;
+    char path[400];
+    snprintf(path, sizeof(path), "%s/%s", dir, SEG_DIR);
+    if (mkdir(path, S_IRWXU) != 0) return -1;
+
+    int n = 0;
+    pthread_rwlock_rdlock(&index_lock);  // a segment on the list is still on disk
+    for (struct segment_t* s = oldest; s != NULL && n >= 0; s = s->next) {
+        char from[64];
+        snprintf(from, sizeof(from), "%s/%010ld.seg", SEG_DIR, s->id);
+        snprintf(path, sizeof(path), "%s/%s", dir, from);
+        if (s == active) {
+            *in = open(from, O_RDONLY);  // only appended to, what it holds now stays as it is
+            *out = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            *len = s->tail;
+            n = *in < 0 || *out < 0 ? -1 : n + 1;
+        }
+        else {
+            n = snap_link(from, path) == 0 ? n + 1 : -1;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return n;
+}
+
+// every file in the index, for the name index at startup
+void each_lfile(void (*fn)(const char* name)) {
+    pthread_rwlock_rdlock(&index_lock);
+    for (int b = 0; b < N_BUCKETS; b++) {
+        for (struct lfile_t* f = buckets[b]; f != NULL; f = f->next) fn(f->name);
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// segments, how much of them is live, and what has been appended and compacted since startup
+int show_lstore(char* buf, size_t size) {
+    if (!LOG_MODE) {
+        return snprintf(buf, size, "log-structured store off, every file is an OS file\n");
+    }
+    pthread_rwlock_rdlock(&index_lock);
+    long n_segs = 0, data = 0, live = 0, bytes = 0;
+    for (struct segment_t* s = oldest; s != NULL; s = s->next) {
+        n_segs++;
+        data += s->data;
+        live += s->live;
+        bytes += s->tail;
+    }
+    int len = snprintf(buf, size, "%ld files in %ld segments (%ld to %ld) of %ld bytes, %ld bytes of data of which %ld live (%.1f%%)\n"
+                       "%ld records of %ld bytes appended, %ld segments compacted moving %ld bytes", n_files, n_segs, oldest->id,
+                       active->id, bytes, data, live, data > 0 ? 100.0 * live / data : 100.0, ls.records, ls.bytes, ls.compacted, ls.moved);
+    pthread_rwlock_unlock(&index_lock);
+    if (ls.last > 0) len += snprintf(buf + len, size - len, ", the last %lds ago", (long)(time(NULL) - ls.last));
+    len += snprintf(buf + len, size - len, "\n");
+    return len;
+}
@@ -6,17 +6,21 @@
 */
 
 #include "define.h"
+#include <sys/eventfd.h>
 
 // define global variables and initialize
 int lockfile = -1;
 int DEBUG_MODE = 0;
 int DELAY_MODE = 0;
 int VERBOSE_MODE = 0;
+int AFFINITY_MODE = 0;
 int ssock = 0;
 int fsock = 0;
 int fsock_tmp = 0;
 char* s_port = "9001";  // default shell port number
 char* f_port = "9002";  // default file port number
+int s_timeout = 300000;  // admin session expires after 5 minutes of inactivity
+int f_timeout = 60000;   // file session expires after 1 minute of inactivity
 char* peers[64] = { NULL };
 pthread_attr_t attr;
 pthread_mutex_t wake_mutex;
@@ -24,14 +28,25 @@ pthread_mutex_t lock_mutex;
 pthread_mutex_t logger_mutex;
 int thread_pool_size = 0;
 struct thread_t* thread_pool;
+int n_groups = 0;
+struct group_t* groups = NULL;
 struct monitor_t monitor = { .t_inc=128, .t_act=0, .t_tot=0, .t_max=256 };  // default thread pool parameters
+struct admit_t admit = { .queue=NULL, .q_head=0, .q_len=0, .q_max=64, .w_act=0, .w_max=0 };  // default admission parameters
 struct lock_t locks[65535];
 int n_lock = 0;
+int halt_fd = -1;
 
 int main(int argc, char* argv[]) {
+    // remember how we were started, a binary upgrade re-executes the same command line
+    saved_argv = argv;
+    memset(exe_path, 0, sizeof(exe_path));
+    if (readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1) == -1) {
+        strncpy(exe_path, argv[0], sizeof(exe_path) - 1);
+    }
+
     // parse command line switches and arguments
     int copt = 0, err_switch = 0, count = 0, index;
-    while ((copt = getopt(argc, argv, "dvDf:s:t:T:p:")) != -1) {
+    while ((copt = getopt(argc, argv, "dvDrHCLa:c:f:R:s:i:I:t:T:q:w:p:U:")) != -1) {
         char c = (char)copt;
         switch (c) {
             case 'd':
@@ -40,9 +55,33 @@ int main(int argc, char* argv[]) {
             case 'D':
                 DELAY_MODE = 1;
                 break;
+            case 'r':
+                REPLICA_MODE = 1;
+                break;
+            case 'H':  // route the file commands over the -p instances instead of serving files
+                ROUTER_MODE = 1;
+                break;
+            case 'C':  // store closed files as lists of shared chunks
+                DEDUP_MODE = 1;
+                break;
+            case 'L':  // append file data to the segments of the log-structured store
+                LOG_MODE = 1;
+                break;
+            case 'R':  // our own address as the other raft members list it with -p
+                RAFT_MODE = 1;
+                raft_self = optarg;
+                break;
             case 'v':
                 VERBOSE_MODE = 1;
                 break;
+            case 'a':
+                if (strcmp(optarg, "cpu") == 0) AFFINITY_MODE = 1;
+                else if (strcmp(optarg, "node") == 0) AFFINITY_MODE = 2;
+                else err_switch = 1;
+                break;
+            case 'c':  // options that follow on the command line override the config file
+                if (load_config(optarg) != 0) err_switch = 1;
+                break;
             case 's':
                 if (atoi(optarg) == 0) err_switch = 1;
                 s_port = optarg;
@@ -51,6 +90,14 @@ int main(int argc, char* argv[]) {
                 if (atoi(optarg) == 0) err_switch = 1;
                 f_port = optarg;
                 break;
+            case 'i':  // seconds, kept in ms, so no more than fits in an int once scaled
+                if (checkDigit(optarg) == 0 || strtoll(optarg, NULL, 10) <= 0 || strtoll(optarg, NULL, 10) > INT_MAX / 1000) err_switch = 1;
+                else f_timeout = atoi(optarg) * 1000;
+                break;
+            case 'I':
+                if (checkDigit(optarg) == 0 || strtoll(optarg, NULL, 10) <= 0 || strtoll(optarg, NULL, 10) > INT_MAX / 1000) err_switch = 1;
+                else s_timeout = atoi(optarg) * 1000;
+                break;
             case 't':
                 monitor.t_inc = atoi(optarg);
                 if (monitor.t_inc == 0) err_switch = 1;
@@ -59,6 +106,17 @@ int main(int argc, char* argv[]) {
                 monitor.t_max = atoi(optarg);
                 if (monitor.t_max == 0) err_switch = 1;
                 break;
+            case 'q':
+                admit.q_max = atoi(optarg);
+                if (admit.q_max < 0 || checkDigit(optarg) == 0) err_switch = 1;
+                break;
+            case 'w':
+                admit.w_max = atoi(optarg);
+                if (admit.w_max < 0 || checkDigit(optarg) == 0) err_switch = 1;
+                break;
+            case 'U':  // internal: we are the new binary of an upgrade, listeners arrive on this fd
+                upgrade_fd = atoi(optarg);
+                break;
             case 'p':
                 index = optind - 1;
                 while (index < argc) {  // fetch all valid host:port pairs
@@ -77,8 +135,21 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (REPLICA_MODE && RAFT_MODE) {
+        err_switch = 1;  // replication is either primary/replica or raft, not both
+    }
+    if (ROUTER_MODE && (REPLICA_MODE || RAFT_MODE)) {
+        err_switch = 1;  // a router keeps no files, its -p instances are its shards
+    }
+    if (DEDUP_MODE && (REPLICA_MODE || RAFT_MODE || ROUTER_MODE)) {
+        err_switch = 1;  // records are applied to plain files, a primary ships its data and not its chunks
+    }
+    if (LOG_MODE && (REPLICA_MODE || RAFT_MODE || ROUTER_MODE || DEDUP_MODE || peers[0] != NULL)) {
+        err_switch = 1;  // replication, resync and migration work on OS files, and segments are not chunked
+    }
+
     if (err_switch) {
-        fprintf(stderr, "Usage: %s -p <host1:port1>..<hostN:portN> [-t] [-T] [-d] [-D] [-v] [-s port] [-f port] \n", argv[0]);
+        fprintf(stderr, "Usage: %s -p <host1:port1>..<hostN:portN> [-t] [-T] [-q] [-w] [-d] [-D] [-r] [-R host:port] [-H] [-C] [-L] [-v] [-a cpu|node] [-c file] [-s port] [-f port] [-i secs] [-I secs] \n", argv[0]);
         exit(29);
     }
 
@@ -88,20 +159,67 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    // establish master sockets
-    ssock = setListener("localhost", s_port, 1);  // loopback socket, allow only 1 connection from localhost
-    fsock = setListener(NULL, f_port, 1024);  // passive socket, wait for client connections
+    // establish master sockets, or take them over from the old process during an upgrade
+    halt_fd = eventfd(0, EFD_NONBLOCK);
+    if (upgrade_fd != -1) {
+        if (inherit_listeners() != 0) {
+            logger("unable to inherit listener sockets");
+            exit(2);
+        }
+    }
+    else {
+        ssock = setListener("localhost", s_port, 1);  // loopback socket, allow only 1 connection from localhost
+        if (AFFINITY_MODE) {
+            fsock = init_groups(NULL, 0);  // one passive socket per cpu/node group, sharing the file port
+        }
+        else {
+            fsock = setListener(NULL, f_port, 1024);  // passive socket, wait for client connections
+        }
+    }
     if (ssock == -1 || fsock == -1) {
         logger("unable to establish a listener socket");
         exit(2);
     }
 
+    init_checksum();  // picks the crc32c kernel this cpu runs
+    if (init_dedup() != 0) {
+        logger("unable to set up the chunk store");
+        exit(2);
+    }
+    if (init_lstore() != 0) {
+        logger("unable to recover the log-structured store");
+        exit(2);
+    }
+    if (init_kv() != 0) {
+        logger("unable to recover the key-value store");
+        exit(2);
+    }
+    if (init_names() != 0) {
+        logger("unable to index the file names");
+        exit(2);
+    }
+
+    if (init_admission() != 0) {
+        logger("unable to set up admission control");
+        exit(2);
+    }
+
+    // start shipping our write log to the replicas (a replica receives it on its file port instead)
+    if (init_replication() != 0 || init_raft() != 0) {
+        logger("unable to set up replication");
+        exit(2);
+    }
+    if (init_router() != 0) {
+        logger("unable to set up the shard ring");
+        exit(2);
+    }
+
     // establish signal mask in the main thread to block unwanted signals
     sigset_t set;
     sigemptyset(&set);
 
-    int sigs[8] = {SIGINT, SIGTERM, SIGALRM, SIGABRT, SIGPIPE, SIGCHLD, SIGHUP, SIGQUIT};
-    for (int i = 0; i < 8 ; i++) {
+    int sigs[9] = {SIGINT, SIGTERM, SIGALRM, SIGABRT, SIGPIPE, SIGCHLD, SIGHUP, SIGQUIT, SIGUSR2};
+    for (int i = 0; i < 9 ; i++) {
         sigaddset(&set, sigs[i]);
     }
 
@@ -118,6 +236,15 @@ int main(int argc, char* argv[]) {
         exit(-17);
     }
 
+    // launch the timer thread that expires idle sessions
+    pthread_t wid;
+    init_wheel();
+    if (pthread_create(&wid, &attr, timer_thread, NULL) != 0) {
+        perror("pthread_create");
+        fflush(stderr);
+        exit(4);
+    }
+
     // launch the monitor thread for dynamic threads management and reconfiguration
     pthread_t mid;
     if (pthread_create(&mid, &attr, monitor_thread, NULL) != 0) {
@@ -126,6 +253,20 @@ int main(int argc, char* argv[]) {
         exit(3);
     }
 
+    // launch the admission thread that queues or sheds clients when the pool is saturated
+    pthread_t aid;
+    if (pthread_create(&aid, &attr, admit_thread, NULL) != 0) {
+        perror("pthread_create");
+        fflush(stderr);
+        exit(5);
+    }
+
+    // tell the old process we are serving, it then stops accepting and hands over idle sessions
+    if (upgrade_fd != -1 && resume_upgrade() != 0) {
+        logger("unable to take over from the old process");
+        exit(6);
+    }
+
     // the main thread continues to become the shell server, accept command from a local administrator
     struct sockaddr_storage cli_addr;
     socklen_t sin_size = sizeof(cli_addr);
@@ -134,10 +275,19 @@ int main(int argc, char* argv[]) {
     struct pollfd pfds[1];
     pfds[0].fd = ssock;
     pfds[0].events = POLLIN;
+    fcntl(ssock, F_SETFL, fcntl(ssock, F_GETFL) | O_NONBLOCK);  // shared with the other process during an upgrade
 
     while (1) {
+        // once upgraded, the shell port belongs to the new process: we stop watching it, or a connection
+        // pending there would wake us up at once, over and over, while the new process is busy with its admin
+        pfds[0].fd = upgrading ? -1 : ssock;
+        if (poll(pfds, 1, 1000) <= 0 || upgrading) {
+            continue;
+        }
+        sin_size = sizeof(cli_addr);
         int asock = accept(pfds[0].fd, (struct sockaddr*)&cli_addr, &sin_size);
         if (asock == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
             perror("accept");
             fflush(stderr);
             exit(133);
@@ -0,0 +1,382 @@
+/*
+** names.c -- radix tree of the names of all files, for prefix listings and for finding the lock entry of an open file
+*/
+
+#include "define.h"
+#include <dirent.h>
+
+#define N_WALKERS 8    // threads walking the run directory at startup
+#define LIST_MAX 1000  // most names in one FLIST page
+
+struct rnode_t {
+    char* label;              // what this edge adds to the name of its parent, not terminated
+    int len;
+    int n_kids;
+    struct rnode_t** kids;    // sorted by their first byte, which differs among siblings
+    int is_name;              // a file ends here
+    int lock_id;              // its entry in the lock table while it is open, -1 otherwise
+};
+
+static struct rnode_t root = { NULL, 0, 0, NULL, 0, -1 };
+static long n_names = 0;
+static pthread_rwlock_t names_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct rnode_t* new_node(const char* label, int len) {
+    struct rnode_t* node = (struct rnode_t*)calloc(1, sizeof(struct rnode_t) + len);
+    node->label = (char*)(node + 1);
+    memcpy(node->label, label, len);
+    node->len = len;
+    node->lock_id = -1;
+    return node;
+}
+
+// index of the child starting with byte c, or where it would go as a negative -(index + 1)
+static int find_kid(struct rnode_t* node, unsigned char c) {
+    int lo = 0, hi = node->n_kids - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        unsigned char m = node->kids[mid]->label[0];
+        if (m == c) return mid;
+        if (m < c) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -(lo + 1);
+}
+
+static void add_kid(struct rnode_t* node, int at, struct rnode_t* kid) {
+    node->kids = (struct rnode_t**)realloc(node->kids, (node->n_kids + 1) * sizeof(struct rnode_t*));
+    memmove(node->kids + at + 1, node->kids + at, (node->n_kids - at) * sizeof(struct rnode_t*));
+    node->kids[at] = kid;
+    node->n_kids++;
+}
+
+// the node where name ends, NULL if there is none; caller holds names_lock
+static struct rnode_t* find_node(const char* name) {
+    struct rnode_t* node = &root;
+    while (*name != '\0') {
+        int i = find_kid(node, *name);
+        if (i < 0) return NULL;
+        node = node->kids[i];
+        if (strncmp(name, node->label, node->len) != 0) return NULL;  // also if the name ends along the edge
+        name += node->len;
+    }
+    return node;
+}
+
+// the node for name, splitting an edge if it ends halfway along one; caller holds names_lock exclusively
+static struct rnode_t* make_node(const char* name) {
+    struct rnode_t* node = &root;
+    while (*name != '\0') {
+        int i = find_kid(node, *name);
+        if (i < 0) {
+            struct rnode_t* leaf = new_node(name, strlen(name));
+            add_kid(node, -(i + 1), leaf);
+            return leaf;
+        }
+        struct rnode_t* kid = node->kids[i];
+        int common = 0;
+        while (common < kid->len && name[common] == kid->label[common]) common++;
+        if (common < kid->len) {
+            // the new name leaves the edge halfway, the part in common becomes a node of its own
+            struct rnode_t* mid = new_node(kid->label, common);
+            struct rnode_t* rest = new_node(kid->label + common, kid->len - common);
+            rest->n_kids = kid->n_kids;
+            rest->kids = kid->kids;
+            rest->is_name = kid->is_name;
+            rest->lock_id = kid->lock_id;
+            add_kid(mid, 0, rest);
+            node->kids[i] = mid;
+            free(kid);
+            kid = mid;
+        }
+        node = kid;
+        name += common;
+    }
+    return node;
+}
+
+// put a name in the form the tree keeps it in, relative to the run directory, without empty or "." parts and with
+// ".." resolved, in place as it never gets longer; -1 if it is absolute, goes above the run directory or is empty
+int normal_name(char* name) {
+    if (name[0] == '/') return -1;
+    char* out = name;
+    const char* part = name;
+    while (*part != '\0') {
+        const char* end = strchr(part, '/');
+        int len = end == NULL ? strlen(part) : end - part;
+        if (len == 2 && part[0] == '.' && part[1] == '.') {
+            if (out == name) return -1;
+            while (out > name && out[-1] != '/') out--;  // drop the last part written
+            if (out > name) out--;
+        }
+        else if (len > 0 && !(len == 1 && part[0] == '.')) {
+            if (out > name) *out++ = '/';
+            memmove(out, part, len);
+            out += len;
+        }
+        part += len + (end != NULL);
+    }
+    *out = '\0';
+    return out == name ? -1 : 0;
+}
+
+// the name as the tree keeps it, in buf, NULL if it has no place there
+static const char* tree_name(const char* name, char* buf, int size) {
+    if (snprintf(buf, size, "%s", name) >= size || normal_name(buf) != 0) return NULL;
+    return buf;
+}
+
+// a file was created, or found at startup
+void name_added(const char* name) {
+    char buf[4096];
+    if ((name = tree_name(name, buf, sizeof(buf))) == NULL) return;
+    pthread_rwlock_rdlock(&names_lock);
+    struct rnode_t* node = find_node(name);
+    int known = node != NULL && node->is_name;
+    pthread_rwlock_unlock(&names_lock);
+    if (known) return;  // most opens are of files we already have
+
+    pthread_rwlock_wrlock(&names_lock);
+    node = make_node(name);
+    n_names += !node->is_name;
+    node->is_name = 1;
+    pthread_rwlock_unlock(&names_lock);
+}
+
+// drop a node that no longer ends a name, merging its only child into it; caller holds names_lock exclusively
+static int prune(struct rnode_t* parent, const char* name) {
+    int i = find_kid(parent, *name);
+    if (i < 0) return 0;
+    struct rnode_t* node = parent->kids[i];
+    if (strncmp(name, node->label, node->len) != 0) return 0;
+    int removed = name[node->len] == '\0' ? node->is_name : prune(node, name + node->len);
+    if (name[node->len] == '\0') node->is_name = 0;
+
+    if (!node->is_name && node->n_kids == 0) {
+        memmove(parent->kids + i, parent->kids + i + 1, (parent->n_kids - i - 1) * sizeof(struct rnode_t*));
+        parent->n_kids--;
+        free(node);
+    }
+    else if (!node->is_name && node->n_kids == 1) {
+        struct rnode_t* kid = node->kids[0];
+        struct rnode_t* merged = new_node(node->label, node->len + kid->len);
+        memcpy(merged->label + node->len, kid->label, kid->len);
+        merged->n_kids = kid->n_kids;
+        merged->kids = kid->kids;
+        merged->is_name = kid->is_name;
+        merged->lock_id = kid->lock_id;
+        parent->kids[i] = merged;
+        free(node->kids);
+        free(node);
+        free(kid);
+    }
+    return removed;
+}
+
+// a file was removed from the run directory
+void name_removed(const char* name) {
+    char buf[4096];
+    if ((name = tree_name(name, buf, sizeof(buf))) == NULL) return;
+    pthread_rwlock_wrlock(&names_lock);
+    n_names -= prune(&root, name);
+    pthread_rwlock_unlock(&names_lock);
+}
+
+// the file is open as locks[lock_id], or no longer open with -1
+void name_opened(const char* name, int lock_id) {
+    char buf[4096];
+    if ((name = tree_name(name, buf, sizeof(buf))) == NULL) return;
+    if (lock_id >= 0) name_added(name);
+    pthread_rwlock_wrlock(&names_lock);
+    struct rnode_t* node = find_node(name);
+    if (node != NULL) node->lock_id = lock_id;
+    pthread_rwlock_unlock(&names_lock);
+}
+
+// the lock entry of the file while it is open, -1 otherwise
+int name_lock(const char* name) {
+    char buf[4096];
+    if ((name = tree_name(name, buf, sizeof(buf))) == NULL) return -1;
+    pthread_rwlock_rdlock(&names_lock);
+    struct rnode_t* node = find_node(name);
+    int lock_id = node != NULL && node->is_name ? node->lock_id : -1;
+    pthread_rwlock_unlock(&names_lock);
+    return lock_id;
+}
+
+struct page_t {
+    const char* prefix;
+    const char* after;
+    char* path;          // name of the node being visited
+    char* out;
+    int size;
+    int len;
+    int n;
+    int max;
+};
+
+// names in the subtree in order, those not under the prefix or not after the cursor are skipped without descending
+static void visit(struct rnode_t* node, int depth, struct page_t* pg) {
+    int plen = strlen(pg->prefix);
+    int cmp = strncmp(pg->path, pg->prefix, depth < plen ? depth : plen);
+    if (cmp != 0) return;
+    if (strncmp(pg->path, pg->after, depth) < 0) return;  // every name down here sorts before the cursor
+
+    if (node->is_name && depth >= plen && strcmp(pg->path, pg->after) > 0) {
+        if (pg->n >= pg->max || pg->len + depth + 2 > pg->size) {
+            pg->max = -1;  // the page is full
+            return;
+        }
+        pg->len += sprintf(pg->out + pg->len, pg->n > 0 ? " %s" : "%s", pg->path);
+        pg->n++;
+    }
+    for (int i = 0; i < node->n_kids && pg->max >= 0; i++) {
+        struct rnode_t* kid = node->kids[i];
+        if (depth + kid->len > 4096) continue;
+        memcpy(pg->path + depth, kid->label, kid->len);
+        pg->path[depth + kid->len] = '\0';
+        visit(kid, depth + kid->len, pg);
+        pg->path[depth] = '\0';
+    }
+}
+
+// up to max names starting with prefix and sorting after the cursor, separated by spaces; returns how many
+int list_names(const char* prefix, const char* after, int max, char* out, int size) {
+    char path[4097];
+    memset(path, 0, sizeof(path));
+    struct page_t pg = { prefix, after, path, out, size, 0, 0, max };
+    out[0] = '\0';
+    pthread_rwlock_rdlock(&names_lock);
+    visit(&root, 0, &pg);
+    pthread_rwlock_unlock(&names_lock);
+    return pg.n;
+}
+
+// FLIST count [prefix [after]]: the names of the files in order, a page at a time, the last name given back as after;
+// names are relative to the run directory, so a prefix of / lists them all
+int lister(int argc, char** argv, struct echo_t* echo) {
+    static __thread char message[IO_BUF_SIZE];
+    if (argc < 2 || argc > 4 || checkDigit(argv[1]) == 0 || atoi(argv[1]) < 1) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: FLIST count [prefix [after]]";
+        return 0;
+    }
+    int max = atoi(argv[1]) < LIST_MAX ? atoi(argv[1]) : LIST_MAX;
+    echo->status = "OK";
+    const char* prefix = argc > 2 && strcmp(argv[2], "/") != 0 ? argv[2] : "";
+    echo->code = list_names(prefix, argc > 3 ? argv[3] : "", max, message, sizeof(message) - 1);
+    echo->message = message;
+    return 0;
+}
+
+static struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    char** dirs;       // waiting to be read
+    int n_dirs;
+    int cap;
+    int busy;          // walkers reading a directory, which may add more
+} walk = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void push_dir(char* dir) {
+    pthread_mutex_lock(&walk.mtx);
+    if (walk.n_dirs == walk.cap) {
+        walk.cap = walk.cap == 0 ? 64 : walk.cap * 2;
+        walk.dirs = (char**)realloc(walk.dirs, walk.cap * sizeof(char*));
+    }
+    walk.dirs[walk.n_dirs++] = dir;
+    pthread_cond_signal(&walk.cond);
+    pthread_mutex_unlock(&walk.mtx);
+}
+
+// read directories off the queue until it is empty and no walker can add to it any more
+static void* walker(void* arg) {
+    char** found = NULL;
+    int n_found = 0, cap = 0;
+    while (1) {
+        pthread_mutex_lock(&walk.mtx);
+        while (walk.n_dirs == 0 && walk.busy > 0) pthread_cond_wait(&walk.cond, &walk.mtx);
+        if (walk.n_dirs == 0) {
+            pthread_cond_broadcast(&walk.cond);
+            pthread_mutex_unlock(&walk.mtx);
+            break;
+        }
+        char* dir = walk.dirs[--walk.n_dirs];
+        walk.busy++;
+        pthread_mutex_unlock(&walk.mtx);
+
+        DIR* d = opendir(dir[0] == '\0' ? "." : dir);
+        struct dirent* entry;
+        while (d != NULL && (entry = readdir(d)) != NULL) {
+            if (entry->d_name[0] == '.') continue;  // raft state, checksums, chunks, segments, snapshots
+            if (dir[0] == '\0' && strcmp(entry->d_name, "sufd.log") == 0) continue;
+            char path[4096];
+            snprintf(path, sizeof(path), dir[0] == '\0' ? "%s%s" : "%s/%s", dir, entry->d_name);
+            int type = entry->d_type;
+            if (type == DT_UNKNOWN) {  // file systems that do not say, ask
+                struct stat st;
+                type = lstat(path, &st) != 0 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR) {
+                push_dir(strdup(path));
+            }
+            else if (type == DT_REG) {
+                if (n_found == cap) {
+                    cap = cap == 0 ? 1024 : cap * 2;
+                    found = (char**)realloc(found, cap * sizeof(char*));
+                }
+                found[n_found++] = strdup(path);
+            }
+        }
+        if (d != NULL) closedir(d);
+        free(dir);
+
+        pthread_mutex_lock(&walk.mtx);
+        walk.busy--;
+        if (walk.busy == 0 && walk.n_dirs == 0) pthread_cond_broadcast(&walk.cond);
+        pthread_mutex_unlock(&walk.mtx);
+    }
+
+    // one batch per walker, so they do not take turns at the tree for every name
+    pthread_rwlock_wrlock(&names_lock);
+    for (int i = 0; i < n_found; i++) {
+        struct rnode_t* node = make_node(found[i]);
+        n_names += !node->is_name;
+        node->is_name = 1;
+        free(found[i]);
+    }
+    pthread_rwlock_unlock(&names_lock);
+    free(found);
+    return NULL;
+}
+
+int init_names(void) {
+    if (ROUTER_MODE) {
+        return 0;  // the shards list their own files
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (LOG_MODE) {
+        each_lfile(name_added);  // names live in the segments, not in the directory
+    }
+    else {
+        push_dir(strdup(""));
+        pthread_t walkers[N_WALKERS];
+        int n = 0;
+        for (; n < N_WALKERS; n++) {
+            if (pthread_create(&walkers[n], NULL, walker, NULL) != 0) break;
+        }
+        if (n == 0) return -1;
+        for (int i = 0; i < n; i++) pthread_join(walkers[i], NULL);
+        free(walk.dirs);
+        walk.dirs = NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(names): %ld files indexed in %ld ms", n_names, (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+    logger(msg);
+    return 0;
+}
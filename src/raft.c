@@ -0,0 +1,800 @@
+/*
+** raft.c -- optional raft consensus among the -p peers, with pipelined appends, group commit and lease reads
+*/
+
+#include "define.h"
+#include <sys/eventfd.h>
+
+#define ELECTION_MIN 1000  // ms, a follower that hears nothing from a leader for [min, 2 * min) starts an election
+#define HEARTBEAT 100      // ms of silence before the leader sends an empty append
+#define LEASE 900          // ms a majority's acknowledgement keeps the leader's lease, kept below ELECTION_MIN for clock drift
+#define IN_FLIGHT 4        // pipelined append requests per follower
+#define COMMIT_WAIT 5      // seconds a client write waits for its entry to commit
+#define APPEND_MAX 65536   // entries in one append, the largest r_batch
+
+#define FOLLOWER 0
+#define CANDIDATE 1
+#define LEADER 2
+
+int RAFT_MODE = 0;
+char* raft_self = NULL;
+
+struct entry_t {
+    long term;
+    off_t pos;               // where the entry starts in the log file
+    struct record_t r;       // r.seq is the log index
+};
+
+struct member_t {            // another node of the cluster
+    char* id;                // host:port of its file port, as given with -p
+    char* host;
+    char* port;
+    int sock;                // our connection for requests to it, replies come back on it in order
+    int efd;                 // eventfd signalled when there is something to send
+    long next;               // next log index to send
+    long match;              // highest log index known to be stored on it
+    long asked;              // last term we asked it for a vote
+    int n_flight;            // append requests waiting for a reply
+    struct timespec flight[IN_FLIGHT];  // when each of them was sent, oldest first
+    struct timespec contact; // send time of the latest append it acknowledged, for the lease
+    struct timespec sent_t;  // when we last sent it an append
+};
+
+static pthread_mutex_t raft_mtx = PTHREAD_MUTEX_INITIALIZER;  // guards all of the state below
+static pthread_cond_t raft_cond = PTHREAD_COND_INITIALIZER;   // commit, apply and role changes
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;   // entries waiting for the group commit
+
+static int role = FOLLOWER;
+static long term = 0;           // persisted along with voted_for
+static char voted_for[256];
+static char leader_id[256];     // who we believe is leading, empty if unknown
+static int votes = 0;
+
+static struct entry_t* entries = NULL;  // entries[0] is a sentinel of term 0
+static long last = 0;        // index of the last entry
+static long cap = 0;
+static long synced = 0;      // entries up to here are on disk
+static long commit = 0;      // entries up to here are on a majority's disk
+static long applied = 0;     // entries up to here have been applied to our files
+static long term_start = 0;  // index of the no-op the leader appended for its term
+static int log_fd = -1;
+static int state_fd = -1;
+
+static int n_members = 0;
+static struct member_t* members = NULL;
+static struct timespec deadline;     // when we start an election if no leader shows up
+static struct timespec heard;        // when a leader last contacted us
+static struct timespec lease_until;  // leader only, reads are served locally until then
+
+static void add_ms(struct timespec* t, long ms) {
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (ms % 1000) * 1000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+static long ms_since(const struct timespec* t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static int majority(void) {
+    return (n_members + 1) / 2 + 1;
+}
+
+static const char* role_name(int r) {
+    return r == LEADER ? "leader" : r == CANDIDATE ? "candidate" : "follower";
+}
+
+static void set_role(int r) {
+    if (role == r) return;
+    role = r;
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(raft): %s in term %ld", role_name(r), term);
+    logger(msg);
+    pthread_cond_broadcast(&raft_cond);  // waiting client writes find out they lost leadership
+}
+
+static void wake_members(void) {
+    for (int i = 0; i < n_members; i++) {
+        eventfd_write(members[i].efd, 1);
+    }
+}
+
+static void reset_deadline(void) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    add_ms(&deadline, ELECTION_MIN + rand() % ELECTION_MIN);  // randomized so that elections rarely split
+}
+
+// term and vote must be on disk before we act on them
+static void persist_state(void) {
+    char buf[300];
+    memset(buf, 0, sizeof(buf));
+    int len = snprintf(buf, sizeof(buf), "%ld %s\n", term, voted_for[0] ? voted_for : "-");
+    pwrite(state_fd, buf, len, 0);
+    ftruncate(state_fd, len);
+    fdatasync(state_fd);
+}
+
+static void step_down(long t) {
+    if (t > term) {
+        term = t;
+        memset(voted_for, 0, sizeof(voted_for));
+        persist_state();
+    }
+    set_role(FOLLOWER);
+}
+
+// add an entry to the in-memory log, caller holds raft_mtx
+static long add_entry(long t, char op, const char* name, off_t offset, const char* data, int len) {
+    if (last + 1 >= cap) {
+        cap = cap == 0 ? 1024 : cap * 2;
+        entries = (struct entry_t*)realloc(entries, sizeof(struct entry_t) * cap);
+    }
+    struct entry_t* e = &entries[++last];
+    memset(e, 0, sizeof(*e));
+    e->term = t;
+    e->r.seq = last;
+    e->r.op = op;
+    e->r.offset = offset;
+    e->r.len = len;
+    if (len > 0) {
+        e->r.data = (char*)malloc(len);
+        memcpy(e->r.data, data, len);
+    }
+    strncpy(e->r.name, name, sizeof(e->r.name) - 1);
+    clock_gettime(CLOCK_MONOTONIC, &e->r.t);
+    return last;
+}
+
+// append an entry to the log and to the log file (not yet synced), caller holds raft_mtx
+static long append_entry(long t, char op, const char* name, off_t offset, const char* data, int len) {
+    long index = add_entry(t, op, name, offset, data, len);  // may move the array, index it afterwards
+    struct entry_t* e = &entries[index];
+    char header[400];
+    memset(header, 0, sizeof(header));
+    int n = snprintf(header, sizeof(header), "%ld %c %lld %d %s\n", t, op, (long long)offset, len, name[0] ? name : "-");
+    e->pos = lseek(log_fd, 0, SEEK_END);
+    write(log_fd, header, n);
+    if (len > 0) write(log_fd, data, len);
+    return last;
+}
+
+// drop the entries from index on, they conflict with the leader's log, caller holds raft_mtx
+static void truncate_log(long index) {
+    ftruncate(log_fd, entries[index].pos);
+    for (long i = index; i <= last; i++) {
+        free(entries[i].r.data);
+    }
+    last = index - 1;
+    if (synced > last) synced = last;
+}
+
+static void load_state(void) {
+    state_fd = open(".raft.state", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    char buf[300];
+    memset(buf, 0, sizeof(buf));
+    memset(voted_for, 0, sizeof(voted_for));
+    if (read(state_fd, buf, sizeof(buf) - 1) > 0) {
+        sscanf(buf, "%ld %255s", &term, voted_for);
+        if (strcmp(voted_for, "-") == 0) memset(voted_for, 0, sizeof(voted_for));
+    }
+}
+
+// replay our log file, a torn entry at the end (crash during a write) is cut off
+static int load_log(void) {
+    log_fd = open(".raft.log", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (log_fd < 0) return -1;
+
+    cap = 1024;
+    entries = (struct entry_t*)calloc(cap, sizeof(struct entry_t));
+    struct stat st;
+    fstat(log_fd, &st);
+    char* buf = (char*)malloc(st.st_size + 1);
+    off_t size = read(log_fd, buf, st.st_size);
+    off_t pos = 0;
+    while (pos < size) {
+        char* eol = (char*)memchr(buf + pos, '\n', size - pos);
+        if (eol == NULL) break;
+        *eol = '\0';
+        long t;
+        char op;
+        long long offset;
+        int len;
+        char name[256];
+        memset(name, 0, sizeof(name));
+        if (sscanf(buf + pos, "%ld %c %lld %d %255s", &t, &op, &offset, &len, name) != 5) break;
+        off_t data = eol + 1 - buf;
+        if (data + len > size) break;
+        if (strcmp(name, "-") == 0) name[0] = '\0';
+
+        long index = add_entry(t, op, name, offset, buf + data, len);
+        entries[index].pos = pos;
+        pos = data + len;
+    }
+    ftruncate(log_fd, pos);
+    lseek(log_fd, 0, SEEK_END);
+    free(buf);
+    synced = last;
+    return 0;
+}
+
+// the highest index stored on a majority becomes committed once it is from our own term
+static void advance_commit(void) {
+    long m[n_members + 1];
+    m[0] = synced;
+    for (int i = 0; i < n_members; i++) m[i + 1] = members[i].match;
+    for (int i = 1; i <= n_members; i++) {  // sort descending
+        for (int j = i; j > 0 && m[j] > m[j - 1]; j--) {
+            long x = m[j]; m[j] = m[j - 1]; m[j - 1] = x;
+        }
+    }
+    long n = m[majority() - 1];
+    if (n > commit && entries[n].term == term) {
+        commit = n;
+        pthread_cond_broadcast(&raft_cond);
+    }
+}
+
+// the lease runs from the time a majority (us included) last confirmed our leadership
+static void renew_lease(void) {
+    struct timespec c[n_members + 1];
+    clock_gettime(CLOCK_MONOTONIC, &c[0]);
+    for (int i = 0; i < n_members; i++) c[i + 1] = members[i].contact;
+    for (int i = 1; i <= n_members; i++) {  // sort descending
+        for (int j = i; j > 0 && (c[j].tv_sec > c[j - 1].tv_sec ||
+             (c[j].tv_sec == c[j - 1].tv_sec && c[j].tv_nsec > c[j - 1].tv_nsec)); j--) {
+            struct timespec x = c[j]; c[j] = c[j - 1]; c[j - 1] = x;
+        }
+    }
+    lease_until = c[majority() - 1];
+    add_ms(&lease_until, LEASE);
+}
+
+static void become_leader(void) {
+    set_role(LEADER);
+    strcpy(leader_id, raft_self);
+    for (int i = 0; i < n_members; i++) {
+        members[i].next = last + 1;
+        members[i].match = 0;
+        members[i].n_flight = 0;
+        memset(&members[i].contact, 0, sizeof(members[i].contact));
+        memset(&members[i].sent_t, 0, sizeof(members[i].sent_t));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &lease_until);  // expired, until a majority acknowledges us
+    term_start = append_entry(term, 'N', "", 0, NULL, 0);  // commits the entries of earlier terms, and our reads wait for it
+    pthread_cond_signal(&sync_cond);
+    wake_members();
+}
+
+static void start_election(void) {
+    term++;
+    memset(voted_for, 0, sizeof(voted_for));
+    strcpy(voted_for, raft_self);
+    persist_state();
+    memset(leader_id, 0, sizeof(leader_id));
+    votes = 1;
+    set_role(CANDIDATE);
+    reset_deadline();
+    if (votes >= majority()) {
+        become_leader();  // a cluster of one
+    }
+    wake_members();
+}
+
+/*
+** threads
+*/
+
+// group commit: one fdatasync covers every entry appended while the previous one was running
+static void* sync_thread(void* omitted) {
+    while (1) {
+        pthread_mutex_lock(&raft_mtx);
+        while (role != LEADER || synced >= last) {
+            pthread_cond_wait(&sync_cond, &raft_mtx);
+        }
+        long target = last;
+        pthread_mutex_unlock(&raft_mtx);
+
+        fdatasync(log_fd);
+
+        pthread_mutex_lock(&raft_mtx);
+        if (target > synced) synced = target < last ? target : last;
+        if (role == LEADER) advance_commit();
+        pthread_mutex_unlock(&raft_mtx);
+    }
+}
+
+// apply committed entries to our files in log order, on every member
+static void* apply_thread(void* omitted) {
+    while (1) {
+        pthread_mutex_lock(&raft_mtx);
+        while (applied >= commit) {
+            pthread_cond_wait(&raft_cond, &raft_mtx);
+        }
+        struct record_t r = entries[applied + 1].r;  // committed entries never change, the data stays put
+        pthread_mutex_unlock(&raft_mtx);
+
+        if (r.op != 'N' && apply_record(r.op, r.name, r.offset, r.data, r.len) != 0) {
+            perror("apply_record");
+            fflush(stderr);
+        }
+
+        pthread_mutex_lock(&raft_mtx);
+        applied++;
+        pthread_cond_broadcast(&raft_cond);
+        pthread_mutex_unlock(&raft_mtx);
+    }
+}
+
+static void* election_thread(void* omitted) {
+    while (1) {
+        usleep(50000);
+        pthread_mutex_lock(&raft_mtx);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (role != LEADER && (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec))) {
+            start_election();
+        }
+        else if (role == LEADER && n_members > 0 && ms_since(&lease_until) > ELECTION_MIN) {
+            memset(leader_id, 0, sizeof(leader_id));
+            set_role(FOLLOWER);  // cut off from a majority, let clients look for the new leader
+            reset_deadline();
+        }
+        pthread_mutex_unlock(&raft_mtx);
+    }
+}
+
+// handle one reply from a member, caller holds raft_mtx
+static int handle_reply(struct member_t* m, const char* line) {
+    long t, match, req;
+    int ok;
+    if (sscanf(line, "VOTED %ld %d", &t, &ok) == 2) {
+        if (t > term) {
+            step_down(t);
+            reset_deadline();
+        }
+        else if (role == CANDIDATE && t == term && ok && ++votes >= majority()) {
+            become_leader();
+        }
+        return 0;
+    }
+    if (sscanf(line, "APPENDED %ld %d %ld %ld", &t, &ok, &match, &req) == 4) {
+        if (t > term) {
+            step_down(t);
+            reset_deadline();
+            return 0;
+        }
+        if (role != LEADER || req != term || m->n_flight == 0) {
+            return 0;  // a reply to a request of an earlier term
+        }
+        m->contact = m->flight[0];
+        memmove(m->flight, m->flight + 1, sizeof(struct timespec) * (IN_FLIGHT - 1));
+        m->n_flight--;
+        if (ok) {
+            if (match > m->match) m->match = match;
+            advance_commit();
+        }
+        else if (match + 1 < m->next) {
+            m->next = match + 1;  // its log is shorter or diverges, back up to where it says
+        }
+        renew_lease();
+        return 0;
+    }
+    return -1;
+}
+
+// append the next batch of entries (or a heartbeat) for a member to buf, caller holds raft_mtx
+static int build_append(struct member_t* m, char** buf, int* size, int used) {
+    long hi = last < m->next + rlog.r_batch - 1 ? last : m->next + rlog.r_batch - 1;
+    long prev = m->next - 1;
+    int need = used + 128;
+    for (long i = m->next; i <= hi; i++) need += 96 + strlen(entries[i].r.name) + entries[i].r.len;
+    if (need > *size) {
+        *buf = (char*)realloc(*buf, need);
+        *size = need;
+    }
+
+    int len = used + sprintf(*buf + used, "APPEND %ld %s %ld %ld %ld %ld\n", term, raft_self, prev, entries[prev].term,
+                             commit, hi >= m->next ? hi - m->next + 1 : 0);
+    for (long i = m->next; i <= hi; i++) {
+        struct record_t* r = &entries[i].r;
+        len += sprintf(*buf + len, "%ld %c %lld %d %s\n", entries[i].term, r->op, (long long)r->offset, r->len, r->name[0] ? r->name : "-");
+        if (r->len > 0) {
+            memcpy(*buf + len, r->data, r->len);
+            len += r->len;
+        }
+    }
+    if (hi >= m->next) m->next = hi + 1;
+    clock_gettime(CLOCK_MONOTONIC, &m->flight[m->n_flight++]);
+    m->sent_t = m->flight[m->n_flight - 1];
+    return len;
+}
+
+static int connect_member(struct member_t* m, struct link_t* link) {
+    m->sock = socketConnect(m->host, m->port);
+    if (m->sock < 0) {
+        m->sock = -1;
+        return -1;
+    }
+    link->sock = m->sock;
+    link->halt = -1;
+    link->pos = link->len = link->broken = 0;
+
+    char line[300];
+    memset(line, 0, sizeof(line));
+    sprintf(line, "RAFT %s\n", raft_self);
+    int len = strlen(line);
+    if (sendAll(m->sock, line, &len) == -1) return -1;
+
+    struct pollfd pfd;
+    pfd.fd = m->sock;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, ELECTION_MIN) > 0 && link_line(link, line, sizeof(line)) >= 0) {  // skip the welcome banner
+        if (strstr(line, "RAFT OK") != NULL) {
+            pthread_mutex_lock(&raft_mtx);
+            m->n_flight = 0;
+            m->asked = 0;
+            pthread_mutex_unlock(&raft_mtx);
+            return 0;
+        }
+        if (strstr(line, "FAIL") != NULL) break;
+    }
+    return -1;
+}
+
+static void drop_member(struct member_t* m) {
+    close(m->sock);
+    pthread_mutex_lock(&raft_mtx);
+    m->sock = -1;
+    m->n_flight = 0;
+    if (m->next > m->match + 1) m->next = m->match + 1;  // resend whatever was in flight
+    pthread_mutex_unlock(&raft_mtx);
+}
+
+static void* member_thread(void* arg) {
+    struct member_t* m = (struct member_t*)arg;
+    struct link_t* link = (struct link_t*)malloc(sizeof(struct link_t));
+    char* buf = NULL;
+    int size = 0;
+
+    while (1) {
+        if (m->sock == -1 && connect_member(m, link) != 0) {
+            if (m->sock != -1) {
+                close(m->sock);
+                m->sock = -1;
+            }
+            sleep(1);
+            continue;
+        }
+
+        struct pollfd pfds[2];
+        pfds[0].fd = m->sock;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = m->efd;
+        pfds[1].events = POLLIN;
+        poll(pfds, 2, HEARTBEAT / 2);
+        if (pfds[1].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(m->efd, &count);
+        }
+
+        int failed = 0;
+        if (pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            do {  // replies come in order, several may have arrived at once
+                char line[128];
+                if (link_line(link, line, sizeof(line)) < 0) {
+                    failed = 1;
+                    break;
+                }
+                pthread_mutex_lock(&raft_mtx);
+                handle_reply(m, line);
+                pthread_mutex_unlock(&raft_mtx);
+            } while (link->pos < link->len);
+        }
+
+        // ask for a vote, or pipeline appends: new entries as soon as they exist, a heartbeat otherwise
+        int len = 0;
+        pthread_mutex_lock(&raft_mtx);
+        if (role == CANDIDATE && m->asked != term) {
+            if (size < 512) {
+                buf = (char*)realloc(buf, 512);
+                size = 512;
+            }
+            len = sprintf(buf, "VOTE %ld %s %ld %ld\n", term, raft_self, last, entries[last].term);
+            m->asked = term;
+        }
+        else if (role == LEADER) {
+            while (m->n_flight < IN_FLIGHT && (m->next <= last || ms_since(&m->sent_t) >= HEARTBEAT)) {
+                len = build_append(m, &buf, &size, len);
+            }
+            if (m->n_flight > 0 && ms_since(&m->flight[0]) > 2 * ELECTION_MIN) {
+                failed = 1;  // no reply for too long, reconnect
+            }
+        }
+        pthread_mutex_unlock(&raft_mtx);
+
+        if (failed || (len > 0 && sendAll(m->sock, buf, &len) == -1)) {
+            drop_member(m);
+        }
+    }
+}
+
+/*
+** requests from other members
+*/
+
+static int reply(int sock, const char* fmt, long a, long b, long c, long d) {
+    char line[128];
+    memset(line, 0, sizeof(line));
+    sprintf(line, fmt, a, b, c, d);
+    int len = strlen(line);
+    return sendAll(sock, line, &len);
+}
+
+static int handle_vote(int sock, long t, const char* candidate, long last_index, long last_term) {
+    pthread_mutex_lock(&raft_mtx);
+    // a member that heard from a live leader lately ignores candidates, which is what makes lease reads safe
+    int sticky = role == LEADER || (leader_id[0] && ms_since(&heard) < ELECTION_MIN);
+    if (t > term && !sticky) {
+        step_down(t);
+    }
+    int up_to_date = last_term > entries[last].term || (last_term == entries[last].term && last_index >= last);
+    int granted = !sticky && t == term && up_to_date && (voted_for[0] == '\0' || strcmp(voted_for, candidate) == 0);
+    if (granted) {
+        strcpy(voted_for, candidate);
+        persist_state();
+        reset_deadline();
+    }
+    long current = term;
+    pthread_mutex_unlock(&raft_mtx);
+    return reply(sock, "VOTED %ld %ld\n", current, granted, 0, 0);
+}
+
+static int handle_append(int sock, struct link_t* link, char* line) {
+    long t, prev, prev_term, leader_commit, n;
+    char leader[256];
+    memset(leader, 0, sizeof(leader));
+    if (sscanf(line, "APPEND %ld %255s %ld %ld %ld %ld", &t, leader, &prev, &prev_term, &leader_commit, &n) != 6 ||
+        prev < 0 || n < 0 || n > APPEND_MAX) {
+        return -1;
+    }
+
+    // read the whole batch before touching the log
+    struct entry_t* batch = (struct entry_t*)calloc(n > 0 ? n : 1, sizeof(struct entry_t));
+    int status = 0;
+    for (long i = 0; i < n && status == 0; i++) {
+        long long offset;
+        char name[256];
+        memset(name, 0, sizeof(name));
+        if (link_line(link, line, 512) < 0 ||
+            sscanf(line, "%ld %c %lld %d %255s", &batch[i].term, &batch[i].r.op, &offset, &batch[i].r.len, name) != 5 ||
+            batch[i].r.len < 0 || batch[i].r.len > IO_BUF_SIZE) {  // a record carries at most one request's data
+            status = -1;
+            break;
+        }
+        batch[i].r.offset = offset;
+        strcpy(batch[i].r.name, strcmp(name, "-") == 0 ? "" : name);
+        batch[i].r.data = (char*)malloc(batch[i].r.len + 1);
+        status = link_bytes(link, batch[i].r.data, batch[i].r.len);
+    }
+
+    long current, match = 0;
+    int ok = 0;
+    if (status == 0) {
+        pthread_mutex_lock(&raft_mtx);
+        if (t >= term) {
+            if (t > term || role != FOLLOWER) step_down(t);
+            strcpy(leader_id, leader);
+            clock_gettime(CLOCK_MONOTONIC, &heard);
+            reset_deadline();
+
+            if (prev > last || entries[prev].term != prev_term) {
+                match = prev > last ? last : prev - 1;  // tell the leader where to back up to
+            }
+            else {
+                long index = prev;
+                int appended = 0;
+                for (long i = 0; i < n; i++) {
+                    index++;
+                    if (index <= last) {
+                        if (entries[index].term == batch[i].term) continue;  // already have it
+                        truncate_log(index);
+                    }
+                    append_entry(batch[i].term, batch[i].r.op, batch[i].r.name, batch[i].r.offset, batch[i].r.data, batch[i].r.len);
+                    appended = 1;
+                }
+                if (appended) {  // one sync for the whole batch before we acknowledge it
+                    fdatasync(log_fd);
+                    synced = last;
+                }
+                ok = 1;
+                match = prev + n;
+                long limit = leader_commit < match ? leader_commit : match;
+                if (limit > commit) {
+                    commit = limit;
+                    pthread_cond_broadcast(&raft_cond);
+                }
+            }
+        }
+        current = term;
+        pthread_mutex_unlock(&raft_mtx);
+    }
+
+    for (long i = 0; i < n; i++) free(batch[i].r.data);
+    free(batch);
+    if (status != 0) return -1;
+    return reply(sock, "APPENDED %ld %ld %ld %ld\n", current, ok, match, t);
+}
+
+int serve_raft(int csock, int argc, char** argv) {
+    if (!RAFT_MODE || argc != 2) {
+        const char* refuse = "FAIL -10 not in raft mode, start it with -R\n";
+        int len = strlen(refuse);
+        sendAll(csock, refuse, &len);
+        return -1;
+    }
+    if (!from_peer(csock)) {  // an append from anyone else would be applied on every member
+        const char* refuse = "FAIL -13 not a member, members are the -p instances\n";
+        int len = strlen(refuse);
+        sendAll(csock, refuse, &len);
+        return -1;
+    }
+
+    const char* ok = "RAFT OK\n";
+    int len = strlen(ok);
+    struct link_t* link = (struct link_t*)malloc(sizeof(struct link_t));
+    link->sock = csock;
+    link->halt = halt_fd;
+    link->pos = link->len = link->broken = 0;
+    char line[512];
+
+    int status = sendAll(csock, ok, &len);
+    while (status == 0 && link_line(link, line, sizeof(line)) >= 0) {
+        long t, last_index, last_term;
+        char candidate[256];
+        memset(candidate, 0, sizeof(candidate));
+        if (sscanf(line, "VOTE %ld %255s %ld %ld", &t, candidate, &last_index, &last_term) == 4) {
+            status = handle_vote(csock, t, candidate, last_index, last_term);
+        }
+        else {
+            status = handle_append(csock, link, line);
+        }
+    }
+
+    free(link);
+    return status;
+}
+
+/*
+** the client side: writes go through the log, reads are served under the leader's lease
+*/
+
+int raft_redirect(struct echo_t* echo) {
+    static __thread char message[320];
+    pthread_mutex_lock(&raft_mtx);
+    int leading = role == LEADER;
+    memset(message, 0, sizeof(message));
+    if (leader_id[0]) {
+        sprintf(message, "not the leader, connect to %s", leader_id);
+    }
+    else {
+        sprintf(message, "no leader elected yet, retry later");
+    }
+    pthread_mutex_unlock(&raft_mtx);
+
+    if (leading) return 0;
+    echo->status = "ERR";
+    echo->code = EREMOTE;
+    echo->message = message;
+    return -1;
+}
+
+int raft_commit(char op, const char* name, off_t offset, const char* data, int len) {
+    pthread_mutex_lock(&raft_mtx);
+    if (role != LEADER) {
+        pthread_mutex_unlock(&raft_mtx);
+        return -1;
+    }
+    long t = term;
+    long index = append_entry(t, op, name, offset, data, len);
+    pthread_cond_signal(&sync_cond);
+    wake_members();
+
+    // wait until the entry is on a majority's disk and applied to our own files
+    struct timespec limit;
+    clock_gettime(CLOCK_REALTIME, &limit);
+    limit.tv_sec += COMMIT_WAIT;
+    int status = 0;
+    while (applied < index) {
+        if (role != LEADER || term != t || pthread_cond_timedwait(&raft_cond, &raft_mtx, &limit) == ETIMEDOUT) {
+            status = -2;  // outcome unknown, the entry may still commit under the next leader
+            break;
+        }
+    }
+    pthread_mutex_unlock(&raft_mtx);
+    return status;
+}
+
+int raft_read(void) {
+    pthread_mutex_lock(&raft_mtx);
+    struct timespec limit;
+    clock_gettime(CLOCK_REALTIME, &limit);
+    add_ms(&limit, 2 * HEARTBEAT);  // give a renewal of the lease (or our no-op) a moment
+
+    int status = 0;
+    while (role != LEADER || applied < term_start || (n_members > 0 && ms_since(&lease_until) >= 0)) {
+        if (role != LEADER || pthread_cond_timedwait(&raft_cond, &raft_mtx, &limit) == ETIMEDOUT) {
+            status = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&raft_mtx);
+    return status;
+}
+
+int init_raft(void) {
+    if (!RAFT_MODE) return 0;
+
+    for (n_members = 0; n_members < 64 && peers[n_members] != NULL; n_members++) {}
+    members = (struct member_t*)calloc(n_members > 0 ? n_members : 1, sizeof(struct member_t));
+    for (int i = 0; i < n_members; i++) {
+        struct member_t* m = &members[i];
+        char* colon = strrchr(peers[i], ':');
+        if (colon == NULL) {
+            fprintf(stderr, "invalid peer %s, expected host:port\n", peers[i]);
+            fflush(stderr);
+            return -1;
+        }
+        m->id = peers[i];
+        m->host = strndup(peers[i], colon - peers[i]);
+        m->port = strdup(colon + 1);
+        m->sock = -1;
+        m->next = 1;
+        m->efd = eventfd(0, EFD_NONBLOCK);
+    }
+
+    srand(getpid() ^ time(NULL));
+    memset(leader_id, 0, sizeof(leader_id));
+    load_state();
+    if (state_fd < 0 || load_log() != 0) {
+        perror("open raft log");
+        fflush(stderr);
+        return -1;
+    }
+    reset_deadline();
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(raft): recovered term %ld and %ld log entries", term, last);
+    logger(msg);
+
+    pthread_t tid;
+    void* (*threads[3])(void*) = { sync_thread, apply_thread, election_thread };
+    for (int i = 0; i < 3; i++) {
+        if (pthread_create(&tid, &attr, threads[i], NULL) != 0) return -1;
+    }
+    for (int i = 0; i < n_members; i++) {
+        if (members[i].efd == -1 || pthread_create(&tid, &attr, member_thread, &members[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+int show_raft(char* buf, size_t size) {
+    pthread_mutex_lock(&raft_mtx);
+    long lease = role == LEADER ? -ms_since(&lease_until) : 0;
+    size_t len = snprintf(buf, size, "raft %s %s in term %ld, leader %s, log %ld synced %ld committed %ld applied %ld, lease %ld ms\n",
+                          raft_self, role_name(role), term, leader_id[0] ? leader_id : "unknown", last, synced, commit, applied,
+                          lease > 0 ? lease : 0);
+    for (int i = 0; i < n_members && len < size; i++) {
+        struct member_t* m = &members[i];
+        len += snprintf(buf + len, size - len, "member %s %s, match %ld next %ld, %d appends in flight\n",
+                        m->id, m->sock == -1 ? "down" : "up", m->match, m->next, m->n_flight);
+    }
+    pthread_mutex_unlock(&raft_mtx);
+    return len < size ? len : size - 1;
+}
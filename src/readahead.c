@@ -0,0 +1,211 @@
+/*
+** readahead.c -- access patterns of file sessions, readahead hints for them and a prefetched window of the file
+*/
+
+#include "define.h"
+
+#define RA_START 65536    // first window hinted ahead of a sequential reader, doubled while it keeps on
+#define RA_STRIDES 4      // strides hinted ahead of a strided reader
+#define RA_TRIGGER 2      // reads following the pattern before we act on it
+#define PF_START 16384    // first prefetched window, doubled up to prefetch KB while it is used up
+
+int READAHEAD = 1024;  // KB, the largest window hinted ahead of a sequential reader, 0 for no hints
+int PREFETCH = 64;     // KB, the largest window a sequential session reads into memory between requests, 0 for none
+
+/*
+** a session follows the file it last read: a read starting where the previous one ended continues a sequential run,
+** one as far from the previous start as that was from the one before continues a strided run, anything else is
+** random; the kernel is told what an OS file will be read next (posix_fadvise starts the reads without waiting),
+** and a sequential session also reads its next window itself once the reply is out, while the client is busy with
+** it, so that its next FREAD is a copy from memory; the window is good as long as no change touched the file since
+*/
+
+static struct {
+    pthread_mutex_t mtx;
+    long hints;       // posix_fadvise calls
+    long prefetches;  // windows read ahead
+    long prefetched;  // bytes in them
+    long hits;        // FREADs served from a window
+    long served;      // bytes they got from it
+    long wasted;      // prefetched bytes dropped unread
+} ra_stats = { PTHREAD_MUTEX_INITIALIZER };
+
+static long changes;  // last generation given to a file
+static pthread_mutex_t changes_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// a new generation for a file whose data just changed (or that was just opened)
+void touch_lock(struct lock_t* lock) {
+    pthread_mutex_lock(&changes_mtx);
+    lock->gen = ++changes;
+    pthread_mutex_unlock(&changes_mtx);
+}
+
+// same, for a change made by name, to a file a session may have open
+void touch_name(const char* name) {
+    int lock_id = name_lock(name);
+    if (lock_id >= 0) touch_lock(&locks[lock_id]);
+}
+
+static void count(long* counter, long n) {
+    pthread_mutex_lock(&ra_stats.mtx);
+    *counter += n;
+    pthread_mutex_unlock(&ra_stats.mtx);
+}
+
+// forget the prefetched window, counting what was never read from it
+static void drop_window(struct readahead_t* ra) {
+    if (ra->w_len > ra->w_used) count(&ra_stats.wasted, ra->w_len - ra->w_used);
+    ra->w_len = ra->w_used = 0;
+    ra->w_eof = 0;
+}
+
+static void hint(struct readahead_t* ra, off_t offset, off_t len) {
+    if (posix_fadvise(ra->fd, offset, len, POSIX_FADV_WILLNEED) == 0) count(&ra_stats.hints, 1);
+}
+
+// classify this read and hint what comes next, n is how much of it was read
+static void follow(struct readahead_t* ra, struct lock_t* lock, off_t offset, int len, int n) {
+    int kind = RA_RANDOM;
+    if (ra->fd != lock->fd || ra->lock != lock) {
+        drop_window(ra);
+        ra->fd = lock->fd;
+        ra->lock = lock;
+        ra->w_size = 0;
+        ra->stride = 0;
+    }
+    else if (offset == ra->next) {
+        kind = RA_SEQUENTIAL;
+    }
+    else if (offset - ra->last == ra->stride && ra->stride > 0) {
+        kind = RA_STRIDED;
+    }
+    if (kind != ra->pattern || kind == RA_RANDOM) {
+        ra->pattern = kind;  // a new run, nothing is hinted for it yet
+        ra->run = 0;
+        ra->hinted = 0;
+        ra->window = 0;
+    }
+    ra->run++;
+    ra->stride = offset - ra->last;
+    ra->last = offset;
+    ra->next = offset + n;
+    ra->want = 0;
+    if (ra->run < RA_TRIGGER) return;
+
+    // the data of a log-structured or a frozen file is not where the descriptor points
+    int hints = READAHEAD > 0 && lock->lfile == NULL && lock->recipe == NULL && n == len;
+    if (ra->pattern == RA_SEQUENTIAL) {
+        if (ra->window == 0) ra->window = RA_START;
+        if (hints && ra->hinted < ra->next + ra->window / 2) {
+            off_t from = ra->hinted > ra->next ? ra->hinted : ra->next;
+            hint(ra, from, ra->next + ra->window - from);
+            ra->hinted = ra->next + ra->window;
+            if (ra->window < (off_t)READAHEAD * 1024) ra->window *= 2;
+        }
+        if (ra->window > (off_t)READAHEAD * 1024) ra->window = (off_t)READAHEAD * 1024;
+
+        // fetch the next window once the next read would not be in this one
+        ra->len = len;
+        ra->want = PREFETCH > 0 && (ra->w_len == 0 || ra->next + len > ra->w_off + ra->w_len) && !ra->w_eof;
+    }
+    else if (ra->pattern == RA_STRIDED) {
+        if (hints) {
+            off_t to = offset + RA_STRIDES * ra->stride;
+            for (off_t at = ra->hinted > offset ? ra->hinted : offset + ra->stride; at <= to; at += ra->stride) {
+                hint(ra, at, len);
+            }
+            ra->hinted = to + ra->stride;
+        }
+    }
+}
+
+// read len bytes at offset of a file for a session, from the window it prefetched if that holds them
+int read_ahead(struct readahead_t* ra, struct lock_t* lock, char* buf, int len, off_t offset) {
+    int n = -1;
+    if (ra->w_len > 0 && ra->lock == lock && ra->fd == lock->fd) {
+        if (lock->gen != ra->w_gen) {
+            drop_window(ra);  // written since, caller holds a reader's share so no change is in progress
+        }
+        else if (offset >= ra->w_off && offset < ra->w_off + ra->w_len &&
+                 (offset + len <= ra->w_off + ra->w_len || ra->w_eof)) {
+            n = ra->w_off + ra->w_len - offset < len ? ra->w_off + ra->w_len - offset : len;
+            memcpy(buf, ra->buf + (offset - ra->w_off), n);
+            ra->w_used += n;
+            pthread_mutex_lock(&ra_stats.mtx);
+            ra_stats.hits++;
+            ra_stats.served += n;
+            pthread_mutex_unlock(&ra_stats.mtx);
+        }
+    }
+    if (n < 0) {
+        n = store->pread(lock, buf, len, offset);
+    }
+    if (n >= 0) {
+        follow(ra, lock, offset, len, n);
+    }
+    return n;
+}
+
+// read the next window of a sequential session, once the reply to its last FREAD is out
+void prefetch_window(struct readahead_t* ra) {
+    if (!ra->want) return;
+    ra->want = 0;
+    struct lock_t* lock = ra->lock;
+
+    // never wait for a writer here, the client may already be sending its next request
+    pthread_mutex_lock(&lock->f_mtx);
+    if (lock->fd != ra->fd || lock->fd <= 0 || lock->n_writer > 0) {
+        pthread_mutex_unlock(&lock->f_mtx);
+        return;
+    }
+    take_file(lock, 0);
+    long gen = lock->gen;
+    pthread_mutex_unlock(&lock->f_mtx);
+
+    drop_window(ra);
+    int size = ra->w_size == 0 ? PF_START : ra->w_size * 2;  // the last window was used up
+    if (size > PREFETCH * 1024) size = PREFETCH * 1024;
+    if (size < ra->len) size = ra->len;
+    if (size != ra->w_size) {
+        char* grown = (char*)realloc(ra->buf, size);
+        if (grown != NULL) {
+            ra->buf = grown;
+            ra->w_size = size;
+        }
+    }
+    ssize_t n = ra->buf != NULL ? store->pread(lock, ra->buf, ra->w_size, ra->next) : -1;
+
+    pthread_mutex_lock(&lock->f_mtx);
+    drop_file(lock, 0);
+    pthread_cond_broadcast(&lock->f_cond);
+    pthread_mutex_unlock(&lock->f_mtx);
+
+    if (n <= 0) return;
+    ra->w_off = ra->next;
+    ra->w_len = n;
+    ra->w_used = 0;
+    ra->w_gen = gen;
+    ra->w_eof = n < ra->w_size;
+    pthread_mutex_lock(&ra_stats.mtx);
+    ra_stats.prefetches++;
+    ra_stats.prefetched += n;
+    pthread_mutex_unlock(&ra_stats.mtx);
+}
+
+// the session is over
+void end_readahead(struct readahead_t* ra) {
+    drop_window(ra);
+    free(ra->buf);
+    memset(ra, 0, sizeof(*ra));
+}
+
+// hints, prefetched windows and how much of them was read
+int show_readahead(char* buf, size_t size) {
+    pthread_mutex_lock(&ra_stats.mtx);
+    int len = snprintf(buf, size, "%ld hints (up to %d KB ahead), %ld windows prefetched (up to %d KB) holding %ld bytes, "
+                       "%ld reads served from them (%ld bytes), %ld bytes dropped unread (%.1f%%)\n", ra_stats.hints,
+                       READAHEAD, ra_stats.prefetches, PREFETCH, ra_stats.prefetched, ra_stats.hits, ra_stats.served,
+                       ra_stats.wasted, ra_stats.prefetched > 0 ? 100.0 * ra_stats.wasted / ra_stats.prefetched : 0.0);
+    pthread_mutex_unlock(&ra_stats.mtx);
+    return len;
+}
@@ -0,0 +1,934 @@
+/*
+** replica.c -- asynchronous log-shipping replication from the primary to its -p peers
+*/
+
+#include "define.h"
+#include <sys/eventfd.h>
+
+#define N_APPLY 256        // files kept open by a replica while applying records
+#define ACK_TIMEOUT 5      // seconds without an ack before a link is considered dead
+#define PING_INTERVAL 200  // milliseconds of silence before the primary sends a heartbeat, bounds how stale an idle replica looks
+
+int REPLICA_MODE = 0;
+int n_peers = 0;
+struct peer_t* replicas = NULL;
+struct rlog_t rlog = { .ring=NULL, .r_max=65536, .head=1, .next=1, .r_batch=256, .r_wait=1000, .r_sync=4, .r_rate=0 };
+
+static long epoch = 0;  // identifies this primary's log, replicas start over when it changes
+
+// refill the buffer, fails on error, EOF, timeout or halt
+static int link_fill(struct link_t* link) {
+    if (link->halt != -1) {
+        struct pollfd pfds[2];
+        pfds[0].fd = link->sock;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = link->halt;
+        pfds[1].events = POLLIN;
+        if (poll(pfds, 2, 3 * ACK_TIMEOUT * 1000) <= 0 || (pfds[1].revents & POLLIN)) {
+            return -1;
+        }
+    }
+    link->pos = 0;
+    link->len = recv(link->sock, link->buf, LINK_BUF_SIZE, 0);
+    if (link->len <= 0) {
+        link->len = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// read a '\n'-terminated line, returns its length or -1 on error, timeout or EOF
+int link_line(struct link_t* link, char* line, int size) {
+    int n = 0;
+    while (1) {
+        if (link->pos == link->len && link_fill(link) != 0) {
+            return -1;
+        }
+        char c = link->buf[link->pos++];
+        if (c == '\n') break;
+        if (n < size - 1) line[n++] = c;
+    }
+    line[n] = '\0';
+    if (n > 0 && line[n - 1] == '\r') line[--n] = '\0';
+    return n;
+}
+
+// read exactly len bytes
+int link_bytes(struct link_t* link, char* data, int len) {
+    int total = 0;
+    while (total < len) {
+        if (link->pos == link->len && link_fill(link) != 0) {
+            return -1;
+        }
+        int n = link->len - link->pos < len - total ? link->len - link->pos : len - total;
+        memcpy(data + total, link->buf + link->pos, n);
+        link->pos += n;
+        total += n;
+    }
+    return 0;
+}
+
+// connect to a node's file port, with a receive timeout in seconds, the welcome banner is left to link_request
+struct link_t* link_open(const char* host, const char* port, int timeout) {
+    int sock = socketConnect(host, port);
+    if (sock < 0) {
+        return NULL;
+    }
+    struct timeval tv = { timeout, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct link_t* link = (struct link_t*)malloc(sizeof(struct link_t));
+    link->sock = sock;
+    link->halt = -1;
+    link->pos = link->len = link->broken = 0;
+    return link;
+}
+
+void link_close(struct link_t* link) {
+    if (link == NULL) return;
+    close(link->sock);
+    free(link);
+}
+
+// whether the OK reply to req lacks data that went on past the end of its line: the data of FREAD and PREAD is as
+// long as the code says (one byte less if its trailing newline was cut), FREADV and MGET give a length per item
+static int reply_short(const char* req, const char* reply) {
+    if (strncmp(reply, "OK ", 3) != 0) return 0;
+    char* end;
+    long code = strtol(reply + 3, &end, 10);
+    const char* data = *end == ' ' ? end + 1 : end;
+    if (strncasecmp(req, "FREAD ", 6) == 0 || strncasecmp(req, "PREAD ", 6) == 0) {
+        return (long)strlen(data) < code - 1;
+    }
+    if (strncasecmp(req, "FREADV ", 7) == 0 || strncasecmp(req, "MGET ", 5) == 0) {
+        const char* p = data;
+        for (long k = 0; k < code; k++) {
+            long len = strtol(p, &end, 10);
+            if (end == p) return 1;
+            p = end;
+            if (len > 0) {
+                if ((long)strlen(p) < 1 + len) return 1;
+                p += 1 + len;
+            }
+        }
+    }
+    return 0;
+}
+
+// send a request line on a file session and return its OK/ERR/FAIL reply, past the banner and prompts, NULL on error;
+// data holding newlines is read to its end and joined back, if it cannot be (a null byte cut it short, or a line of
+// it starts like the prompt that follows every reply) the link is marked broken and the reply returned as it is
+char* link_request(struct link_t* link, const char* req, char* line, int size) {
+    int len = strlen(req);
+    if (sendAll(link->sock, req, &len) == -1) {
+        return NULL;
+    }
+    while (link_line(link, line, size) >= 0) {
+        char* reply = line;
+        while (strncmp(reply, "> ", 2) == 0) reply += 2;
+        if (strncmp(reply, "OK", 2) != 0 && strncmp(reply, "ERR", 3) != 0 && strncmp(reply, "FAIL", 4) != 0) {
+            continue;
+        }
+        int n = strlen(line);
+        while (reply_short(req, reply)) {
+            if ((link->pos == link->len && link_fill(link) != 0) || n >= size - 1 ||
+                (link->len - link->pos >= 2 && strncmp(link->buf + link->pos, "> ", 2) == 0)) {
+                link->broken = 1;
+                break;
+            }
+            line[n++] = '\n';
+            int got = link_line(link, line + n, size - n);
+            if (got < 0) {
+                link->broken = 1;
+                break;
+            }
+            n += got;
+        }
+        return reply;
+    }
+    return NULL;
+}
+
+// whether the other end of a session is one of our -p instances, by address: the primary of a replica, the
+// replicas of a primary, the other members of a raft group or the shards that move files to us
+int from_peer(int csock) {
+    int found = 0;
+    for (int i = 0; i < 64 && peers[i] != NULL && !found; i++) {
+        char* colon = strrchr(peers[i], ':');
+        char* host = colon == NULL ? strdup(peers[i]) : strndup(peers[i], colon - peers[i]);
+        found = socketFrom(csock, host);
+        free(host);
+    }
+    return found;
+}
+
+static long elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// on a replica, how far behind the primary we may be: the primary announces its log head with every
+// batch and heartbeat, and once we have applied up to an announced head we were current when it was sent
+static pthread_mutex_t fresh_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec fresh_t;  // when we were last known to be current, zero if never
+static struct timespec claim_t;  // when the primary announced a head we have not reached yet
+static long claim = -1;          // that head, -1 if none is pending
+
+static void track_head(long head, const struct timespec* at) {
+    pthread_mutex_lock(&fresh_mtx);
+    long applied = rlog.next - 1;
+    if (claim >= 0 && applied >= claim) {
+        fresh_t = claim_t;
+        claim = -1;
+    }
+    if (applied >= head) {
+        fresh_t = *at;
+        claim = -1;
+    }
+    else if (claim < 0) {  // keep the oldest pending head, it is the first one we will reach
+        claim = head;
+        claim_t = *at;
+    }
+    pthread_mutex_unlock(&fresh_mtx);
+}
+
+// milliseconds since we were last known to be current, -1 if we never were
+static long staleness(void) {
+    pthread_mutex_lock(&fresh_mtx);
+    long ms = fresh_t.tv_sec == 0 && fresh_t.tv_nsec == 0 ? -1 : elapsed_ms(&fresh_t);
+    pthread_mutex_unlock(&fresh_mtx);
+    return ms;
+}
+
+static const char* state_name(int state) {
+    switch (state) {
+        case PEER_STREAMING: return "streaming";
+        case PEER_STALE: return "stale";
+        case PEER_SYNCING: return "resyncing";
+        default: return "down";
+    }
+}
+
+static void set_state(struct peer_t* peer, int state) {
+    if (peer->state == state) return;
+    peer->state = state;
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(replication): peer %s:%s is %s", peer->host, peer->port, state_name(state));
+    logger(msg);
+}
+
+/*
+** primary side
+*/
+
+void replicate(char op, const char* name, off_t offset, const char* data, int len) {
+    if (n_peers == 0) return;
+
+    pthread_mutex_lock(&rlog.r_mtx);
+    while (rlog.next - rlog.head >= rlog.r_max) {
+        // the log is full, the oldest record can go unless a connected peer still needs it
+        int needed = 0;
+        for (int i = 0; i < n_peers; i++) {
+            if (replicas[i].state == PEER_STREAMING && replicas[i].acked < rlog.head) needed = 1;
+        }
+        if (!needed) {
+            struct record_t* r = &rlog.ring[rlog.head % rlog.r_max];
+            free(r->data);
+            r->data = NULL;
+            rlog.head++;
+            continue;
+        }
+
+        // backpressure: give slow peers r_wait ms to catch up, then cut them loose
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += rlog.r_wait / 1000;
+        deadline.tv_nsec += (rlog.r_wait % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&rlog.r_cond, &rlog.r_mtx, &deadline) == ETIMEDOUT) {
+            for (int i = 0; i < n_peers; i++) {
+                if (replicas[i].state == PEER_STREAMING && replicas[i].acked < rlog.head) {
+                    set_state(&replicas[i], PEER_STALE);
+                    shutdown(replicas[i].sock, SHUT_RDWR);  // its shipper notices and closes the link
+                }
+            }
+        }
+    }
+
+    struct record_t* r = &rlog.ring[rlog.next % rlog.r_max];
+    free(r->data);
+    r->seq = rlog.next++;
+    r->op = op;
+    r->offset = offset;
+    r->len = len;
+    r->data = NULL;
+    if (len > 0) {
+        r->data = (char*)malloc(len);
+        memcpy(r->data, data, len);
+    }
+    memset(r->name, 0, sizeof(r->name));
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    clock_gettime(CLOCK_MONOTONIC, &r->t);
+    pthread_mutex_unlock(&rlog.r_mtx);
+
+    for (int i = 0; i < n_peers; i++) {
+        eventfd_write(replicas[i].efd, 1);  // wake up the shippers
+    }
+}
+
+// connect and agree on where to resume, returns 0 when the peer can be streamed to,
+// a peer we just resynced is told where the log picks up from
+static int handshake(struct peer_t* peer, struct link_t* link, long resynced) {
+    peer->sock = socketConnect(peer->host, peer->port);
+    if (peer->sock < 0) {
+        peer->sock = -1;
+        return -1;
+    }
+    struct timeval tv = { ACK_TIMEOUT, 0 };
+    setsockopt(peer->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    link->sock = peer->sock;
+    link->halt = -1;
+    link->pos = link->len = link->broken = 0;
+
+    char line[256];
+    memset(line, 0, sizeof(line));
+    if (resynced >= 0) sprintf(line, "REPLICATE %lx %ld\n", epoch, resynced);
+    else sprintf(line, "REPLICATE %lx\n", epoch);
+    int len = strlen(line);
+    if (sendAll(peer->sock, line, &len) == -1) {
+        return -1;
+    }
+
+    // skip the welcome banner and prompt, the replica answers with the last record it applied
+    long applied = -1;
+    while (link_line(link, line, sizeof(line)) >= 0) {
+        char* reply = strstr(line, "REPLICA ");
+        if (reply != NULL) {
+            applied = atol(reply + 8);
+            break;
+        }
+        if (strstr(line, "FAIL") != NULL || strstr(line, "ERR") != NULL) break;
+    }
+    if (applied < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&rlog.r_mtx);
+    int status = 0;
+    if (applied + 1 < rlog.head || applied >= rlog.next) {
+        set_state(peer, PEER_STALE);  // records it is missing are gone, it needs a full resync
+        status = -1;
+    }
+    else {
+        peer->sent = peer->acked = applied;
+        set_state(peer, PEER_STREAMING);
+    }
+    pthread_mutex_unlock(&rlog.r_mtx);
+    return status;
+}
+
+// append the records after peer->sent to buf, up to r_batch of them, returns the batch size in bytes
+static int build_batch(struct peer_t* peer, char** buf, int* size) {
+    pthread_mutex_lock(&rlog.r_mtx);
+    long first = peer->sent + 1;
+    long last = rlog.next - 1;
+    if (last - first + 1 > rlog.r_batch) last = first + rlog.r_batch - 1;
+    if (first < rlog.head || last < first) {
+        pthread_mutex_unlock(&rlog.r_mtx);
+        return 0;
+    }
+
+    int need = 64;
+    for (long seq = first; seq <= last; seq++) {
+        need += 96 + strlen(rlog.ring[seq % rlog.r_max].name) + rlog.ring[seq % rlog.r_max].len;
+    }
+    if (need > *size) {
+        *buf = (char*)realloc(*buf, need);
+        *size = need;
+    }
+
+    int len = sprintf(*buf, "BATCH %ld %ld %ld\n", last - first + 1, last, rlog.next - 1);  // the head tells the replica how far behind it is
+    for (long seq = first; seq <= last; seq++) {
+        struct record_t* r = &rlog.ring[seq % rlog.r_max];
+        len += sprintf(*buf + len, "%c %ld %lld %d %s\n", r->op, r->seq, (long long)r->offset, r->len, r->name);
+        if (r->len > 0) {
+            memcpy(*buf + len, r->data, r->len);
+            len += r->len;
+        }
+    }
+    peer->sent = last;
+    pthread_mutex_unlock(&rlog.r_mtx);
+    return len;
+}
+
+// age of the oldest record a peer has not confirmed, caller holds r_mtx
+static long lag_ms(struct peer_t* peer) {
+    if (peer->acked >= rlog.next - 1 || peer->acked + 1 < rlog.head) return 0;
+    return elapsed_ms(&rlog.ring[(peer->acked + 1) % rlog.r_max].t);
+}
+
+static void drop_link(struct peer_t* peer) {
+    pthread_mutex_lock(&rlog.r_mtx);
+    if (peer->state == PEER_STREAMING) set_state(peer, PEER_DOWN);
+    close(peer->sock);
+    peer->sock = -1;
+    pthread_cond_broadcast(&rlog.r_cond);  // a writer waiting on this peer may go on
+    pthread_mutex_unlock(&rlog.r_mtx);
+}
+
+static void* ship_thread(void* arg) {
+    struct peer_t* peer = (struct peer_t*)arg;
+    struct link_t* link = (struct link_t*)malloc(sizeof(struct link_t));
+    char* buf = NULL;
+    int size = 0;
+    int backoff = 1;
+
+    while (1) {
+        if (peer->sock == -1) {
+            // a stale peer first gets the files, then the records logged since we started sending them
+            long resynced = -1;
+            if (peer->state == PEER_STALE) {
+                pthread_mutex_lock(&rlog.r_mtx);
+                set_state(peer, PEER_SYNCING);
+                pthread_mutex_unlock(&rlog.r_mtx);
+                resynced = resync_peer(peer, epoch);
+                if (resynced < 0) {
+                    pthread_mutex_lock(&rlog.r_mtx);
+                    set_state(peer, PEER_STALE);
+                    pthread_mutex_unlock(&rlog.r_mtx);
+                    sleep(8);
+                    continue;
+                }
+                backoff = 1;  // the records logged meanwhile may be gone again, then we go round once more
+            }
+            if (handshake(peer, link, resynced) != 0) {
+                if (peer->state == PEER_SYNCING) {
+                    pthread_mutex_lock(&rlog.r_mtx);
+                    set_state(peer, PEER_STALE);  // it never heard where to resume, start over
+                    pthread_mutex_unlock(&rlog.r_mtx);
+                }
+                if (peer->sock != -1) {
+                    close(peer->sock);
+                    peer->sock = -1;
+                }
+                sleep(backoff);  // retry every 1, 2, 4, 8, 8... seconds
+                backoff = backoff < 8 ? backoff * 2 : 8;
+                continue;
+            }
+            backoff = 1;
+            clock_gettime(CLOCK_MONOTONIC, &peer->acked_t);
+            clock_gettime(CLOCK_MONOTONIC, &peer->sent_t);
+        }
+
+        // wait for new records or acks, whichever comes first
+        struct pollfd pfds[2];
+        pfds[0].fd = peer->sock;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = peer->efd;
+        pfds[1].events = POLLIN;
+        if (poll(pfds, 2, PING_INTERVAL) < 0 && errno != EINTR) {
+            drop_link(peer);
+            continue;
+        }
+        if (pfds[1].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(peer->efd, &count);
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            int failed = 0;
+            do {  // several acks may have arrived at once
+                char line[128];
+                long seq;
+                int load;
+                if (link_line(link, line, sizeof(line)) < 0 || sscanf(line, "ACK %ld %d", &seq, &load) != 2) {
+                    failed = 1;
+                    break;
+                }
+                pthread_mutex_lock(&rlog.r_mtx);
+                if (seq > peer->acked) peer->acked = seq;
+                peer->load = load;
+                clock_gettime(CLOCK_MONOTONIC, &peer->acked_t);
+                pthread_cond_broadcast(&rlog.r_cond);  // room in the log for waiting writers
+                pthread_mutex_unlock(&rlog.r_mtx);
+            } while (link->pos < link->len);
+            if (failed) {
+                drop_link(peer);
+                continue;
+            }
+        }
+
+        // pipeline batches without waiting for acks, up to 4 batches in flight
+        int failed = 0;
+        while (peer->state == PEER_STREAMING && peer->sent < rlog.next - 1 && peer->sent - peer->acked < 4 * rlog.r_batch) {
+            int len = build_batch(peer, &buf, &size);
+            if (len == 0) break;
+            if (sendAll(peer->sock, buf, &len) == -1) {
+                failed = 1;
+                break;
+            }
+            peer->bytes += len;
+            peer->batches++;
+            clock_gettime(CLOCK_MONOTONIC, &peer->sent_t);
+        }
+        if (peer->state == PEER_STALE) failed = 1;  // cut loose by backpressure
+
+        // keep the link alive and the peer's load report fresh
+        if (!failed && elapsed_ms(&peer->sent_t) >= PING_INTERVAL) {
+            char ping[64];
+            memset(ping, 0, sizeof(ping));
+            pthread_mutex_lock(&rlog.r_mtx);
+            sprintf(ping, "PING %ld\n", rlog.next - 1);
+            pthread_mutex_unlock(&rlog.r_mtx);
+            int len = strlen(ping);
+            failed = sendAll(peer->sock, ping, &len) == -1;
+            clock_gettime(CLOCK_MONOTONIC, &peer->sent_t);
+        }
+        if (failed || elapsed_ms(&peer->acked_t) > ACK_TIMEOUT * 1000) {
+            drop_link(peer);
+        }
+    }
+}
+
+int init_replication(void) {
+    if (REPLICA_MODE || RAFT_MODE || ROUTER_MODE) return 0;  // replicas apply, they do not ship, raft has a log of its own, a router has shards
+    for (n_peers = 0; n_peers < 64 && peers[n_peers] != NULL; n_peers++) {}
+    if (n_peers == 0) return 0;
+
+    epoch = ((long)time(NULL) << 20) ^ getpid();
+    rlog.ring = (struct record_t*)calloc(rlog.r_max, sizeof(struct record_t));
+    replicas = (struct peer_t*)calloc(n_peers, sizeof(struct peer_t));
+    pthread_mutex_init(&rlog.r_mtx, NULL);
+    pthread_cond_init(&rlog.r_cond, NULL);
+    if (rlog.ring == NULL || replicas == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < n_peers; i++) {
+        struct peer_t* peer = &replicas[i];
+        char* colon = strrchr(peers[i], ':');
+        if (colon == NULL) {
+            fprintf(stderr, "invalid peer %s, expected host:port\n", peers[i]);
+            fflush(stderr);
+            return -1;
+        }
+        peer->host = strndup(peers[i], colon - peers[i]);
+        peer->port = strdup(colon + 1);
+        peer->sock = -1;
+        peer->state = PEER_DOWN;
+        peer->efd = eventfd(0, EFD_NONBLOCK);
+
+        pthread_t tid;
+        if (peer->efd == -1 || pthread_create(&tid, &attr, ship_thread, peer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int show_peers(char* buf, size_t size) {
+    if (RAFT_MODE) return show_raft(buf, size);
+    if (ROUTER_MODE) return show_shards(buf, size);
+    size_t len = 0;
+    if (REPLICA_MODE) {
+        long behind = staleness();
+        len += snprintf(buf, size, "replica of %s, applied %ld records of log %lx, ",
+                        peers[0] != NULL ? peers[0] : "(unknown)", rlog.next - 1, epoch);
+        if (behind < 0) len += snprintf(buf + len, size - len, "never caught up\n");
+        else len += snprintf(buf + len, size - len, "caught up %ld ms ago\n", behind);
+        return len < size ? len : size - 1;
+    }
+
+    pthread_mutex_lock(&rlog.r_mtx);
+    for (int i = 0; i < n_peers && len < size; i++) {
+        struct peer_t* peer = &replicas[i];
+        len += snprintf(buf + len, size - len, "peer %s:%s %s, acked %ld of %ld, lag %ld records %ld ms, "
+                        "%ld batches %ld bytes shipped, load %d, %d reads proxied now\n", peer->host, peer->port,
+                        state_name(peer->state), peer->acked, rlog.next - 1, rlog.next - 1 - peer->acked, lag_ms(peer),
+                        peer->batches, peer->bytes, peer->load, peer->proxied);
+    }
+    pthread_mutex_unlock(&rlog.r_mtx);
+    return len < size ? len : size - 1;
+}
+
+// pick the least busy streaming replica that is within bound ms of us and less busy than we are, caller holds r_mtx
+static struct peer_t* pick_replica(int bound) {
+    struct peer_t* best = NULL;
+    int best_load = monitor.t_act;
+    for (int i = 0; i < n_peers; i++) {
+        struct peer_t* peer = &replicas[i];
+        if (peer->state != PEER_STREAMING || lag_ms(peer) > bound) continue;
+        if (peer->load + peer->proxied < best_load) {  // reads we already sent it count until its next report
+            best = peer;
+            best_load = peer->load + peer->proxied;
+        }
+    }
+    return best;
+}
+
+int read_replica(const char* name, off_t offset, int len, int bound, char* buf) {
+    if (n_peers == 0 || REPLICA_MODE || RAFT_MODE) return -1;
+
+    pthread_mutex_lock(&rlog.r_mtx);
+    struct peer_t* peer = pick_replica(bound);
+    struct link_t* link = NULL;
+    if (peer != NULL) {
+        peer->proxied++;
+        if (peer->n_pool > 0) link = peer->pool[--peer->n_pool];
+    }
+    pthread_mutex_unlock(&rlog.r_mtx);
+    if (peer == NULL) return -1;
+
+    if (link == NULL) {
+        link = link_open(peer->host, peer->port, ACK_TIMEOUT);
+    }
+
+    // the replica checks the bound again against its own view, and fails the read if it cannot meet it
+    char req[320];
+    char line[IO_BUF_SIZE + 64];
+    memset(req, 0, sizeof(req));
+    snprintf(req, sizeof(req), "PREAD %s %lld %d %d\n", name, (long long)offset, len, bound);
+    char* reply = link == NULL ? NULL : link_request(link, req, line, sizeof(line));
+    int n = -1;
+    if (reply != NULL && strncmp(reply, "OK ", 3) == 0) {  // a FAIL means stale or busy, we read it ourselves
+        char* data = strchr(reply + 3, ' ');
+        n = atoi(reply + 3);
+        memset(buf, 0, IO_BUF_SIZE);
+        if (data != NULL) strncpy(buf, data + 1, IO_BUF_SIZE - 1);
+    }
+
+    pthread_mutex_lock(&rlog.r_mtx);
+    peer->proxied--;
+    if (reply != NULL && !link->broken && peer->n_pool < PROXY_POOL) {  // timed out, closed or broken links are of no further use
+        peer->pool[peer->n_pool++] = link;
+        link = NULL;
+    }
+    pthread_mutex_unlock(&rlog.r_mtx);
+    link_close(link);
+    return n;
+}
+
+/*
+** replica side
+*/
+
+static struct {
+    char name[256];
+    int fd;
+    int crc_fd;  // the file's block checksums, kept up to date as records are applied
+} applying[N_APPLY];  // files touched by the primary's records, opened on demand
+
+static pthread_mutex_t replica_mtx = PTHREAD_MUTEX_INITIALIZER;  // one primary link at a time
+static int replica_sock = -1;
+
+static int apply_slot(const char* name) {
+    int slot = -1;
+    for (int i = 0; i < N_APPLY; i++) {
+        if (applying[i].fd > 0 && strcmp(applying[i].name, name) == 0) return i;
+        if (slot == -1 && applying[i].fd <= 0) slot = i;
+    }
+    if (slot == -1) {  // table full, recycle a slot
+        slot = (int)(rlog.next % N_APPLY);
+        crc_close(applying[slot].crc_fd, applying[slot].fd);
+        close(applying[slot].fd);
+    }
+    applying[slot].fd = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (applying[slot].fd >= 0) name_added(name);
+    struct recipe_t* r = applying[slot].fd < 0 ? NULL : load_recipe(applying[slot].fd);
+    if (r != NULL && thaw_file(name, applying[slot].fd, r, 0) != 0) {  // frozen by an earlier run with -C
+        close(applying[slot].fd);
+        applying[slot].fd = -1;
+    }
+    free_recipe(r);
+    applying[slot].crc_fd = applying[slot].fd < 0 ? -1 : crc_open(name, applying[slot].fd);
+    memset(applying[slot].name, 0, sizeof(applying[slot].name));
+    strncpy(applying[slot].name, name, sizeof(applying[slot].name) - 1);
+    return slot;
+}
+
+static void close_slot(int slot) {
+    crc_close(applying[slot].crc_fd, applying[slot].fd);
+    close(applying[slot].fd);
+    applying[slot].fd = -1;
+    applying[slot].crc_fd = -1;
+}
+
+static int apply_change(char op, const char* name, off_t offset, const char* data, int len) {
+    if (name[0] == '/' || strstr(name, "..") != NULL) {
+        errno = EACCES;
+        return -1;  // only files under our run directory, whatever the log says
+    }
+    int slot = apply_slot(name);
+    int fd = applying[slot].fd;
+    int cfd = applying[slot].crc_fd;
+    if (fd < 0) return -1;
+
+    int status = -1;
+    switch (op) {
+        case 'O':
+            return 0;
+        case 'W':
+            status = pwrite(fd, data, len, offset) == len ? 0 : -1;
+            if (status == 0) crc_update(cfd, fd, offset, len);
+            return status;
+        case 'S':
+            return lseek(fd, offset, SEEK_SET) == -1 ? -1 : 0;
+        case 'T':
+            status = ftruncate(fd, offset);
+            if (status == 0) crc_update(cfd, fd, offset, 0);
+            return status;
+        case 'A': {
+            char length[32];  // the data is the length of the range, as text
+            memset(length, 0, sizeof(length));
+            memcpy(length, data, len < (int)sizeof(length) - 1 ? len : (int)sizeof(length) - 1);
+            status = fallocate(fd, 0, offset, atol(length));
+            if (status == 0) crc_update(cfd, fd, offset, atol(length));
+            return status;
+        }
+        case 'Y': {
+            char source[256];  // the data is the name of the file copied over this one
+            memset(source, 0, sizeof(source));
+            memcpy(source, data, len < (int)sizeof(source) - 1 ? len : (int)sizeof(source) - 1);
+            int in = source[0] == '/' || strstr(source, "..") != NULL ? -1 : open(source, O_RDONLY);
+            status = in < 0 ? -1 : copy_contents(in, fd);
+            if (in >= 0) close(in);
+            struct stat st;
+            if (status == 0 && fstat(fd, &st) == 0) crc_update(cfd, fd, 0, st.st_size);
+            return status;
+        }
+        case 'C':
+            close_slot(slot);
+            return 0;
+    }
+    return -1;
+}
+
+// apply one record of a primary's (or a raft leader's) log to our files
+int apply_record(char op, const char* name, off_t offset, const char* data, int len) {
+    int in_place = op == 'W' || op == 'T' || op == 'A' || op == 'Y';
+    if (in_place) snap_enter(name);  // a snapshot in progress gets the file as it was first
+    int status = apply_change(op, name, offset, data, len);
+    if (in_place) snap_leave();
+    if (in_place) touch_name(name);  // a session reading the file here drops what it prefetched
+    return status;
+}
+
+static void close_applying(void) {
+    for (int i = 0; i < N_APPLY; i++) {
+        if (applying[i].fd > 0) close_slot(i);
+        applying[i].fd = -1;
+    }
+}
+
+static int send_ack(int sock) {
+    char ack[64];
+    memset(ack, 0, sizeof(ack));
+    sprintf(ack, "ACK %ld %d\n", rlog.next - 1, monitor.t_act);
+    int len = strlen(ack);
+    return sendAll(sock, ack, &len);
+}
+
+int serve_replica(int csock, int argc, char** argv) {
+    if (!REPLICA_MODE || (argc != 2 && argc != 3)) {
+        const char* refuse = "FAIL -10 not a replica, start it with -r\n";
+        int len = strlen(refuse);
+        sendAll(csock, refuse, &len);
+        return -1;
+    }
+    if (!from_peer(csock)) {  // only our primary may take over the link
+        const char* refuse = "FAIL -13 not our primary, it must be the -p of this replica\n";
+        int len = strlen(refuse);
+        sendAll(csock, refuse, &len);
+        return -1;
+    }
+
+    // a reconnecting primary takes over from its previous, possibly half-dead link
+    if (replica_sock != -1) shutdown(replica_sock, SHUT_RDWR);
+    pthread_mutex_lock(&replica_mtx);
+    replica_sock = csock;
+
+    // on a replica, rlog.next - 1 is the last record applied from the primary's log
+    long from = strtol(argv[1], NULL, 16);
+    if (argc == 3) {  // our files were just resynced up to this record of the primary's log
+        epoch = from;
+        rlog.next = atol(argv[2]) + 1;
+        close_applying();
+    }
+    else if (from != epoch) {
+        epoch = from;
+        rlog.next = 1;
+        close_applying();
+        pthread_mutex_lock(&fresh_mtx);
+        memset(&fresh_t, 0, sizeof(fresh_t));  // a new log, we know nothing about it yet
+        claim = -1;
+        pthread_mutex_unlock(&fresh_mtx);
+    }
+    logger("(replication): primary connected, applying its log");
+
+    char line[512];
+    memset(line, 0, sizeof(line));
+    sprintf(line, "REPLICA %ld\n", rlog.next - 1);
+    int len = strlen(line);
+    struct link_t* link = (struct link_t*)malloc(sizeof(struct link_t));
+    link->sock = csock;
+    link->halt = halt_fd;  // a reload or upgrade closes the link, the primary reconnects
+    link->pos = link->len = link->broken = 0;
+    char* data = NULL;
+    int size = 0;
+
+    int status = sendAll(csock, line, &len);
+    while (status == 0 && link_line(link, line, sizeof(line)) >= 0) {
+        long n, last, head;
+        struct timespec at;
+        clock_gettime(CLOCK_MONOTONIC, &at);
+        if (sscanf(line, "PING %ld", &head) == 1) {
+            track_head(head, &at);
+            status = send_ack(csock);
+            continue;
+        }
+        if (sscanf(line, "BATCH %ld %ld %ld", &n, &last, &head) != 3) {
+            status = -1;
+            break;
+        }
+
+        for (long i = 0; i < n && status == 0; i++) {
+            char op;
+            long seq;
+            long long offset;
+            char name[256];
+            memset(name, 0, sizeof(name));
+            if (link_line(link, line, sizeof(line)) < 0 || sscanf(line, "%c %ld %lld %d %255s", &op, &seq, &offset, &len, name) != 5) {
+                status = -1;
+                break;
+            }
+            if (len > size) {
+                data = (char*)realloc(data, len);
+                size = len;
+            }
+            if (link_bytes(link, data, len) != 0) {
+                status = -1;
+                break;
+            }
+            if (seq != rlog.next) continue;  // already applied before a reconnect
+            if (apply_record(op, name, (off_t)offset, data, len) != 0) {
+                perror("apply_record");
+                fflush(stderr);
+            }
+            rlog.next = seq + 1;
+        }
+        if (status == 0) {
+            track_head(head, &at);
+            status = send_ack(csock);
+        }
+    }
+
+    logger("(replication): link to the primary closed");
+    replica_sock = -1;
+    pthread_mutex_unlock(&replica_mtx);
+    free(data);
+    free(link);
+    return status;
+}
+
+int check_stale(int bound, struct echo_t* echo) {
+    static __thread char message[96];
+    long behind = staleness();
+    if (!REPLICA_MODE || bound < 0 || (behind >= 0 && behind <= bound)) return 0;
+
+    memset(message, 0, sizeof(message));
+    if (behind < 0) sprintf(message, "stale, this replica has not caught up with the primary yet");
+    else sprintf(message, "stale, this replica was last current %ld ms ago", behind);
+    echo->status = "FAIL";
+    echo->code = -11;
+    echo->message = message;
+    return -1;
+}
+
+int serve_pread(int csock, int argc, char** argv, struct echo_t* echo) {
+    if (argc != 5 || checkDigit(argv[2]) == 0 || checkDigit(argv[3]) == 0 || checkDigit(argv[4]) == 0) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: PREAD filename offset length staleness";
+        return 0;
+    }
+    if (!REPLICA_MODE || !from_peer(csock)) {
+        echo->status = "ERR";
+        echo->code = EACCES;
+        echo->message = "only a replica's primary may read by name";
+        return 0;
+    }
+    const char* name = argv[1];
+    if (name[0] == '/' || strstr(name, "..") != NULL) {
+        echo->status = "ERR";
+        echo->code = EACCES;
+        echo->message = "only files under the run directory can be read";
+        return 0;
+    }
+    if (check_stale(atoi(argv[4]), echo) != 0) {
+        return 0;
+    }
+
+    // a positional read that leaves no state behind, for a primary proxying its clients' reads; if a session
+    // has the file open here, we read it as one of its readers
+    int lock_id = name_lock(name);
+    struct lock_t* lock = lock_id >= 0 && locks[lock_id].fd > 0 && strcmp(locks[lock_id].f_name, name) == 0 ? &locks[lock_id] : NULL;
+    if (lock != NULL) {
+        pthread_mutex_lock(&lock->f_mtx);
+        while (lock->n_writer > 0) {
+            wait_file(lock, 0);
+        }
+        take_file(lock, 0);
+        pthread_mutex_unlock(&lock->f_mtx);
+    }
+    char* buf = io_buf;
+    memset(buf, 0, IO_BUF_SIZE);
+    int len = atoi(argv[3]);
+    if (len > IO_BUF_SIZE - 1) {
+        len = IO_BUF_SIZE - 1;
+    }
+    int n = read_contents(name, buf, len, atoll(argv[2]));
+    if (lock != NULL) {
+        int saved = errno;
+        pthread_mutex_lock(&lock->f_mtx);
+        drop_file(lock, 0);
+        pthread_cond_broadcast(&lock->f_cond);
+        pthread_mutex_unlock(&lock->f_mtx);
+        errno = saved;
+    }
+    if (n == -1 && errno == ENOENT) {
+        echo->status = "FAIL";
+        echo->code = errno;
+        echo->message = "cannot open file";
+        return 0;
+    }
+    if (n == -1) {
+        echo->status = "FAIL";
+        echo->code = errno;
+        echo->message = "system call pread() returns -1";
+        return 0;
+    }
+    if (strlen(buf) > 0 && buf[strlen(buf) - 1] == '\n') {
+        buf[strlen(buf) - 1] = '\0';
+    }
+
+    echo->status = "OK";
+    echo->code = n;
+    echo->message = buf;
+    return 0;
+}
+
+int force_resync(void) {
+    if (n_peers == 0) return -1;
+    pthread_mutex_lock(&rlog.r_mtx);
+    for (int i = 0; i < n_peers; i++) {
+        if (replicas[i].state == PEER_SYNCING) continue;
+        set_state(&replicas[i], PEER_STALE);
+        if (replicas[i].sock != -1) shutdown(replicas[i].sock, SHUT_RDWR);  // its shipper notices and resyncs
+    }
+    pthread_mutex_unlock(&rlog.r_mtx);
+    return 0;
+}
@@ -0,0 +1,724 @@
+/*
+** resync.c -- rsync-style delta transfer of the run directory to a peer that fell off the replication log
+*/
+
+#include "define.h"
+#include <ftw.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define LITERAL_MAX 65536   // largest run of literal bytes sent in one piece
+#define OUT_BUF_SIZE 65536  // instructions are batched up to this size before going to the socket
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct sum_t {          // checksums of one block of the peer's copy
+    uint32_t weak;
+    uint64_t strong;
+};
+
+struct job_t {          // one resync of one peer, shared by its workers
+    struct peer_t* peer;
+    long epoch;
+    char** files;
+    int n_files;
+    int next;           // next file to hand out
+    int failed;
+    long same;          // files skipped because size and mtime matched
+    long long matched;  // bytes the peer already had
+    long long literal;  // bytes we had to send
+    pthread_mutex_t mtx;
+};
+
+/*
+** shared by both ends
+*/
+
+// rsync's weak checksum, cheap to roll one byte forward
+static uint32_t weak_sum(const unsigned char* p, int n, uint32_t* a, uint32_t* b) {
+    *a = 0;
+    *b = 0;
+    for (int i = 0; i < n; i++) {
+        *a += p[i];
+        *b += (uint32_t)(n - i) * p[i];
+    }
+    return (*a & 0xffff) | (*b << 16);
+}
+
+static uint64_t strong_sum(const unsigned char* p, int n, uint64_t h) {
+    for (int i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// blocks of about sqrt(size) bytes keep the checksum list and the literal overhead both small
+static int block_size(long long size) {
+    long long b = ((long long)sqrt((double)size) + 1023) / 1024 * 1024;
+    return b < 1024 ? 1024 : (b > 65536 ? 65536 : (int)b);
+}
+
+// sleep as needed so that all resync traffic of this node stays under r_rate KB/s
+static void throttle(int bytes) {
+    static pthread_mutex_t throttle_mtx = PTHREAD_MUTEX_INITIALIZER;
+    static struct timespec paid;  // when the bytes sent so far are paid for
+    int rate = rlog.r_rate;
+    if (rate <= 0) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&throttle_mtx);
+    if (paid.tv_sec < now.tv_sec || (paid.tv_sec == now.tv_sec && paid.tv_nsec < now.tv_nsec)) {
+        paid = now;  // idle time is not saved up for later bursts
+    }
+    long long ns = (long long)bytes * 1000000LL / rate;  // KB/s is bytes per ms
+    paid.tv_sec += ns / 1000000000LL;
+    paid.tv_nsec += ns % 1000000000LL;
+    if (paid.tv_nsec >= 1000000000L) {
+        paid.tv_sec++;
+        paid.tv_nsec -= 1000000000L;
+    }
+    struct timespec until = paid;
+    pthread_mutex_unlock(&throttle_mtx);
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+// small pieces, so that a low rate does not stall the other end long enough to time out
+static int send_throttled(int sock, const char* buf, int len) {
+    for (int off = 0; off < len; ) {
+        int n = len - off < 4096 ? len - off : 4096;
+        throttle(n);
+        if (sendAll(sock, buf + off, &n) == -1) return -1;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+** primary side
+*/
+
+struct out_t {  // buffered instruction stream to the peer
+    int sock;
+    int len;
+    char buf[OUT_BUF_SIZE + 64];
+};
+
+static int out_flush(struct out_t* out) {
+    int status = out->len > 0 ? send_throttled(out->sock, out->buf, out->len) : 0;
+    out->len = 0;
+    return status;
+}
+
+static int out_put(struct out_t* out, const char* data, int len) {
+    if (out->len + len > OUT_BUF_SIZE && out_flush(out) != 0) return -1;
+    if (len > OUT_BUF_SIZE) return send_throttled(out->sock, data, len);
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+static int put_literal(struct out_t* out, const unsigned char* data, int len) {
+    char header[32];
+    memset(header, 0, sizeof(header));
+    sprintf(header, "DATA %d\n", len);
+    if (out_put(out, header, strlen(header)) != 0) return -1;
+    return out_put(out, (const char*)data, len);
+}
+
+static char** collected = NULL;  // files found by the current directory walk
+static int n_collected = 0;
+static int cap_collected = 0;
+static pthread_mutex_t collect_mtx = PTHREAD_MUTEX_INITIALIZER;  // nftw has no user argument
+
+static int collect(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    const char* base = path + ftw->base;
+    if (ftw->level > 0 && base[0] == '.') {  // raft state, resync temporaries and other hidden files
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    }
+    if (type != FTW_F || !S_ISREG(st->st_mode) || strcmp(base, "sufd.log") == 0) {
+        return FTW_CONTINUE;
+    }
+    if (n_collected == cap_collected) {
+        cap_collected = cap_collected == 0 ? 256 : cap_collected * 2;
+        collected = (char**)realloc(collected, sizeof(char*) * cap_collected);
+    }
+    collected[n_collected++] = strdup(strncmp(path, "./", 2) == 0 ? path + 2 : path);
+    return FTW_CONTINUE;
+}
+
+// read the peer's block checksums into a hash table keyed by weak sum
+static int recv_sums(struct link_t* link, struct sum_t** sums, int** table, int** chain, int* n, int* mask) {
+    char line[128];
+    int block;
+    if (link_line(link, line, sizeof(line)) < 0 || sscanf(line, "SUMS %d %d", n, &block) != 2 || *n < 0 || block < 1) {
+        return -1;
+    }
+    int size = 1;
+    while (size < 2 * *n) size <<= 1;
+    *mask = size - 1;
+    *sums = (struct sum_t*)malloc(sizeof(struct sum_t) * (*n > 0 ? *n : 1));
+    *table = (int*)malloc(sizeof(int) * size);
+    *chain = (int*)malloc(sizeof(int) * (*n > 0 ? *n : 1));
+    for (int i = 0; i < size; i++) (*table)[i] = -1;
+
+    for (int i = 0; i < *n; i++) {
+        unsigned int weak;
+        unsigned long long strong;
+        if (link_line(link, line, sizeof(line)) < 0 || sscanf(line, "%x %llx", &weak, &strong) != 2) {
+            return -1;
+        }
+        (*sums)[i].weak = weak;
+        (*sums)[i].strong = strong;
+        (*chain)[i] = (*table)[weak & *mask];  // later blocks first, any match will do
+        (*table)[weak & *mask] = i;
+    }
+    return block;
+}
+
+// slide a block-sized window over our copy, sending block references where the peer has the same bytes
+static int send_delta(struct out_t* out, int fd, const struct sum_t* sums, const int* table, const int* chain,
+                      int mask, int n, int block, long long* total, uint64_t* hash, struct job_t* job) {
+    int cap = LITERAL_MAX + 2 * block;
+    unsigned char* buf = (unsigned char*)malloc(cap);
+    int avail = 0;  // bytes in buf
+    int pos = 0;    // window start
+    int lit = 0;    // start of the literal bytes not sent yet, always <= pos
+    int eof = 0;
+    int rolled = 0; // a and b are valid for the window at pos
+    uint32_t a = 0, b = 0;
+    int status = 0;
+
+    while (status == 0) {
+        if (avail - pos <= block && !eof) {  // keep a window plus the byte after it in the buffer
+            if (lit > 0) {
+                memmove(buf, buf + lit, avail - lit);
+                avail -= lit;
+                pos -= lit;
+                lit = 0;
+            }
+            int got = read(fd, buf + avail, cap - avail);
+            if (got < 0) {
+                status = -1;
+            }
+            else if (got == 0) {
+                eof = 1;
+            }
+            avail += got > 0 ? got : 0;
+            continue;
+        }
+        if (avail - pos < block) {  // the tail is shorter than a block and goes as it is
+            if (avail > lit) {
+                status = put_literal(out, buf + lit, avail - lit);
+                *hash = strong_sum(buf + lit, avail - lit, *hash);
+                job->literal += avail - lit;
+                *total += avail - lit;
+            }
+            break;
+        }
+        if (pos - lit >= LITERAL_MAX) {
+            status = put_literal(out, buf + lit, pos - lit);
+            *hash = strong_sum(buf + lit, pos - lit, *hash);
+            job->literal += pos - lit;
+            *total += pos - lit;
+            lit = pos;
+            continue;
+        }
+
+        if (!rolled) {
+            weak_sum(buf + pos, block, &a, &b);
+            rolled = 1;
+        }
+        uint32_t weak = (a & 0xffff) | (b << 16);
+        int match = -1;
+        if (n > 0) {
+            uint64_t strong = 0;
+            int have_strong = 0;
+            for (int i = table[weak & mask]; i != -1; i = chain[i]) {
+                if (sums[i].weak != weak) continue;
+                if (!have_strong) {
+                    strong = strong_sum(buf + pos, block, FNV_OFFSET);
+                    have_strong = 1;
+                }
+                if (sums[i].strong == strong) {
+                    match = i;
+                    break;
+                }
+            }
+        }
+
+        if (match >= 0) {
+            char ref[32];
+            memset(ref, 0, sizeof(ref));
+            sprintf(ref, "COPY %d\n", match);
+            if (pos > lit) {
+                status = put_literal(out, buf + lit, pos - lit);
+                *hash = strong_sum(buf + lit, pos - lit, *hash);
+                job->literal += pos - lit;
+                *total += pos - lit;
+            }
+            if (status == 0) status = out_put(out, ref, strlen(ref));
+            *hash = strong_sum(buf + pos, block, *hash);
+            job->matched += block;
+            *total += block;
+            pos += block;
+            lit = pos;
+            rolled = 0;
+            continue;
+        }
+
+        // no match, slide the window by one byte
+        if (pos + block < avail) {
+            uint32_t drop = buf[pos], add = buf[pos + block];
+            a += add - drop;
+            b += a - (uint32_t)block * drop;
+        }
+        else {
+            rolled = 0;
+        }
+        pos++;
+    }
+    free(buf);
+    return status;
+}
+
+static int sync_file(struct link_t* link, struct out_t* out, const char* name, struct job_t* job) {
+    int fd = open_contents(name);  // the data of a frozen file, not its recipe
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return errno == ENOENT ? 0 : -1;  // removed since the walk
+    }
+
+    char line[512];
+    memset(line, 0, sizeof(line));
+    sprintf(line, "FILE %s %lld %ld %ld\n", name, (long long)st.st_size, (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    int len = strlen(line);
+    if (sendAll(link->sock, line, &len) == -1 || link_line(link, line, sizeof(line)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (strcmp(line, "SAME") == 0) {  // same size and mtime as we left it last time
+        close(fd);
+        pthread_mutex_lock(&job->mtx);
+        job->same++;
+        pthread_mutex_unlock(&job->mtx);
+        return 0;
+    }
+    if (strncmp(line, "WANT", 4) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct sum_t* sums = NULL;
+    int* table = NULL;
+    int* chain = NULL;
+    int n = 0, mask = 0;
+    int block = recv_sums(link, &sums, &table, &chain, &n, &mask);
+    int status = block > 0 ? 0 : -1;
+
+    // the file may change while we scan it, the log records after the resync point fix that up
+    long long total = 0;
+    uint64_t hash = FNV_OFFSET;
+    struct job_t counts;  // per file byte counts, added to the job at the end
+    memset(&counts, 0, sizeof(counts));
+    out->sock = link->sock;
+    out->len = 0;
+    if (status == 0) {
+        status = send_delta(out, fd, sums, table, chain, mask, n, block, &total, &hash, &counts);
+    }
+    if (status == 0) {
+        memset(line, 0, sizeof(line));
+        sprintf(line, "END %lld %016llx\n", total, (unsigned long long)hash);
+        status = out_put(out, line, strlen(line)) != 0 || out_flush(out) != 0 ? -1 : 0;
+    }
+    if (status == 0 && (link_line(link, line, sizeof(line)) < 0 || strncmp(line, "SYNCED", 6) != 0)) {
+        status = -1;
+    }
+    close(fd);
+    free(sums);
+    free(table);
+    free(chain);
+
+    pthread_mutex_lock(&job->mtx);
+    job->matched += counts.matched;
+    job->literal += counts.literal;
+    pthread_mutex_unlock(&job->mtx);
+    return status;
+}
+
+// open a resync link to a node's file port, NULL if it refuses
+static struct link_t* open_resync(const char* host, const char* port, long epoch) {
+    struct link_t* link = link_open(host, port, 30);  // the peer may take a while to checksum a large file
+    char req[64];
+    char line[256];
+    memset(req, 0, sizeof(req));
+    sprintf(req, "RESYNC %lx\n", epoch);
+    char* reply = link == NULL ? NULL : link_request(link, req, line, sizeof(line));
+    if (reply == NULL || strncmp(reply, "OK", 2) != 0) {
+        link_close(link);
+        return NULL;
+    }
+    return link;
+}
+
+static void* sync_worker(void* arg) {
+    struct job_t* job = (struct job_t*)arg;
+    struct link_t* link = open_resync(job->peer->host, job->peer->port, job->epoch);
+    struct out_t* out = (struct out_t*)malloc(sizeof(struct out_t));
+    int status = link == NULL ? -1 : 0;
+
+    while (status == 0) {
+        pthread_mutex_lock(&job->mtx);
+        int i = job->failed ? job->n_files : job->next++;
+        pthread_mutex_unlock(&job->mtx);
+        if (i >= job->n_files) break;
+        status = sync_file(link, out, job->files[i], job);
+    }
+
+    if (status == 0) {
+        int len = 5;
+        sendAll(link->sock, "DONE\n", &len);
+    }
+    else {
+        pthread_mutex_lock(&job->mtx);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->mtx);
+    }
+    link_close(link);
+    free(out);
+    return NULL;
+}
+
+int list_files(char*** files) {
+    pthread_mutex_lock(&collect_mtx);
+    n_collected = cap_collected = 0;
+    collected = NULL;
+    nftw(".", collect, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+    *files = collected;
+    int n = n_collected;
+    pthread_mutex_unlock(&collect_mtx);
+    return n;
+}
+
+int push_file(const char* host, const char* port, const char* name) {
+    struct job_t job;
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.mtx, NULL);
+    struct link_t* link = open_resync(host, port, 0);
+    struct out_t* out = (struct out_t*)malloc(sizeof(struct out_t));
+
+    int status = link == NULL ? -1 : sync_file(link, out, name, &job);
+    if (status == 0) {
+        int len = 5;
+        status = sendAll(link->sock, "DONE\n", &len);
+    }
+    link_close(link);
+    free(out);
+    pthread_mutex_destroy(&job.mtx);
+    return status;
+}
+
+long resync_peer(struct peer_t* peer, long epoch) {
+    // everything up to the resync point is covered by the files, the log replays the rest afterwards
+    pthread_mutex_lock(&rlog.r_mtx);
+    long point = rlog.next - 1;
+    pthread_mutex_unlock(&rlog.r_mtx);
+
+    struct job_t job;
+    memset(&job, 0, sizeof(job));
+    job.peer = peer;
+    job.epoch = epoch;
+    pthread_mutex_init(&job.mtx, NULL);
+
+    job.n_files = list_files(&job.files);
+
+    char msg[256];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(replication): resyncing %d files to %s:%s, %d at a time", job.n_files, peer->host, peer->port, rlog.r_sync);
+    logger(msg);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n_workers = rlog.r_sync < job.n_files ? rlog.r_sync : job.n_files;
+    if (n_workers < 1) n_workers = 1;  // still checks the peer is reachable
+    pthread_t workers[n_workers];
+    int started = 0;
+    for (int i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i], NULL, sync_worker, &job) != 0) {  // joinable, unlike the session threads
+            job.failed = 1;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(replication): resync to %s:%s %s in %ld ms, %ld files unchanged, %lld bytes matched, %lld bytes sent",
+            peer->host, peer->port, job.failed ? "failed" : "done",
+            (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000, job.same, job.matched, job.literal);
+    logger(msg);
+
+    for (int i = 0; i < job.n_files; i++) free(job.files[i]);
+    free(job.files);
+    pthread_mutex_destroy(&job.mtx);
+    return job.failed ? -1 : point;
+}
+
+/*
+** replica side
+*/
+
+struct range_t {  // bytes of the new copy that differ from the old one at the same offset
+    long long from;
+    long long to;
+};
+
+// create the missing directories of a relative path
+static void make_dirs(const char* name) {
+    char path[256];
+    memset(path, 0, sizeof(path));
+    strncpy(path, name, sizeof(path) - 1);
+    for (char* p = strchr(path, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(path, S_IRWXU);
+        *p = '/';
+    }
+}
+
+static int send_sums(int sock, int fd, long long size, int block) {
+    int n = size / block;
+    char* buf = (char*)malloc(OUT_BUF_SIZE + 64);
+    unsigned char* data = (unsigned char*)malloc(block);
+    int len = sprintf(buf, "WANT\nSUMS %d %d\n", n, block);
+    int status = 0;
+    for (int i = 0; i < n && status == 0; i++) {
+        if (pread(fd, data, block, (off_t)i * block) != block) {
+            status = -1;
+            break;
+        }
+        uint32_t a, b;
+        len += sprintf(buf + len, "%08x %016llx\n", weak_sum(data, block, &a, &b),
+                       (unsigned long long)strong_sum(data, block, FNV_OFFSET));
+        if (len > 4096) {  // keep the primary fed while we read a large file
+            status = send_throttled(sock, buf, len);
+            len = 0;
+        }
+    }
+    if (status == 0 && len > 0) status = send_throttled(sock, buf, len);
+    free(buf);
+    free(data);
+    return status;
+}
+
+// copy the changed ranges of the rebuilt copy back into the file, so that open descriptors see the new data
+static int write_back(int tmp, int fd, struct range_t* ranges, int n, long long size) {
+    char* buf = (char*)malloc(LITERAL_MAX);
+    int status = 0;
+    for (int i = 0; i < n && status == 0; i++) {
+        for (long long off = ranges[i].from; off < ranges[i].to && status == 0; ) {
+            int len = ranges[i].to - off < LITERAL_MAX ? ranges[i].to - off : LITERAL_MAX;
+            if (pread(tmp, buf, len, off) != len || pwrite(fd, buf, len, off) != len) status = -1;
+            off += len;
+        }
+    }
+    free(buf);
+    if (status == 0 && ftruncate(fd, size) != 0) status = -1;
+    return status;
+}
+
+static int receive_file(struct link_t* link, char* name, long long size, struct timespec* mtime) {
+    int sock = link->sock;
+    if (name[0] == '/' || strstr(name, "..") != NULL || name_lock(name) >= 0) {
+        // only files under our run directory, and none a session has open: we would write under its locks
+        char refuse[320];
+        memset(refuse, 0, sizeof(refuse));
+        sprintf(refuse, "FAIL -16 %.256s is open or outside the run directory\n", name);
+        int len = strlen(refuse);
+        sendAll(sock, refuse, &len);
+        return -1;
+    }
+
+    struct stat st;
+    int exists = stat(name, &st) == 0;
+    if (exists && st.st_size == size && st.st_mtim.tv_sec == mtime->tv_sec && st.st_mtim.tv_nsec == mtime->tv_nsec) {
+        int len = 5;
+        return sendAll(sock, "SAME\n", &len) == -1 ? -1 : 1;
+    }
+
+    make_dirs(name);
+    int fd = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd >= 0) name_added(name);
+    char tmp_name[300];
+    memset(tmp_name, 0, sizeof(tmp_name));
+    const char* slash = strrchr(name, '/');
+    sprintf(tmp_name, "%.*s.%s.sync", slash == NULL ? 0 : (int)(slash - name + 1), name, slash == NULL ? name : slash + 1);
+    int tmp = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0 || tmp < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        if (tmp >= 0) close(tmp);
+        return -1;
+    }
+
+    int block = block_size(st.st_size);
+    int status = send_sums(sock, fd, st.st_size, block);
+
+    // rebuild the primary's copy in a temporary file from our blocks and its literal bytes
+    char line[128];
+    char* data = (char*)malloc(LITERAL_MAX > block ? LITERAL_MAX : block);
+    struct range_t* ranges = NULL;
+    int n_ranges = 0, cap_ranges = 0;
+    long long at = 0;
+    uint64_t hash = FNV_OFFSET;
+    while (status == 0) {
+        int idx, len;
+        long long total;
+        unsigned long long expect;
+        if (link_line(link, line, sizeof(line)) < 0) {
+            status = -1;
+        }
+        else if (sscanf(line, "COPY %d", &idx) == 1) {
+            if (idx < 0 || (long long)(idx + 1) * block > st.st_size || pread(fd, data, block, (off_t)idx * block) != block) {
+                status = -1;
+                break;
+            }
+            len = block;
+            if ((long long)idx * block == at) {  // same place, nothing to write back
+                hash = strong_sum((unsigned char*)data, len, hash);
+                status = pwrite(tmp, data, len, at) == len ? 0 : -1;
+                at += len;
+                continue;
+            }
+        }
+        else if (sscanf(line, "DATA %d", &len) == 1) {
+            if (len < 0 || len > LITERAL_MAX || link_bytes(link, data, len) != 0) {
+                status = -1;
+                break;
+            }
+        }
+        else if (sscanf(line, "END %lld %llx", &total, &expect) == 2) {
+            status = total == at && expect == hash ? 1 : -1;
+            break;
+        }
+        else {
+            status = -1;
+            break;
+        }
+
+        // a literal, or one of our blocks that moved: a range to write back
+        if (status == 0) {
+            hash = strong_sum((unsigned char*)data, len, hash);
+            status = pwrite(tmp, data, len, at) == len ? 0 : -1;
+            if (n_ranges > 0 && ranges[n_ranges - 1].to == at) {
+                ranges[n_ranges - 1].to = at + len;
+            }
+            else {
+                if (n_ranges == cap_ranges) {
+                    cap_ranges = cap_ranges == 0 ? 64 : cap_ranges * 2;
+                    ranges = (struct range_t*)realloc(ranges, sizeof(struct range_t) * cap_ranges);
+                }
+                ranges[n_ranges].from = at;
+                ranges[n_ranges].to = at + len;
+                n_ranges++;
+            }
+            at += len;
+        }
+    }
+
+    long long changed = 0;
+    for (int i = 0; i < n_ranges; i++) changed += ranges[i].to - ranges[i].from;
+    if (status == 1) {
+        snap_enter(name);
+        status = write_back(tmp, fd, ranges, n_ranges, at);
+        snap_leave();
+        touch_name(name);
+    }
+    if (status == 0) {
+        struct timespec times[2];
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = *mtime;  // lets the next resync skip the file if neither side touches it
+        futimens(fd, times);
+        fdatasync(fd);
+        crc_close(crc_open(name, fd), fd);  // sums rebuilt now rather than on the next open
+    }
+    close(fd);
+    close(tmp);
+    unlink(tmp_name);
+    free(data);
+    free(ranges);
+
+    memset(line, 0, sizeof(line));
+    if (status == 0) sprintf(line, "SYNCED %lld\n", changed);
+    else sprintf(line, "FAIL -12 resync of %.64s failed\n", name);
+    int len = strlen(line);
+    sendAll(sock, line, &len);
+    return status;
+}
+
+// files come from our primary when we are a replica, or from another shard moving them over to us
+int serve_resync(int csock, int argc, char** argv) {
+    if (RAFT_MODE || argc != 2) {
+        const char* refuse = "FAIL -10 files of a raft member only change through its log\n";
+        int len = strlen(refuse);
+        sendAll(csock, refuse, &len);
+        return -1;
+    }
+    if (!from_peer(csock)) {
+        const char* refuse = "FAIL -13 resyncs are only taken from our -p instances\n";
+        int len = strlen(refuse);
+        sendAll(csock, refuse, &len);
+        return -1;
+    }
+
+    const char* ready = "OK 0 resyncing\n";
+    int len = strlen(ready);
+    if (sendAll(csock, ready, &len) == -1) {
+        return -1;
+    }
+
+    struct link_t* link = (struct link_t*)malloc(sizeof(struct link_t));
+    link->sock = csock;
+    link->halt = halt_fd;
+    link->pos = link->len = link->broken = 0;
+
+    char line[512];
+    int status = 0;
+    long n_files = 0, n_changed = 0;
+    while (status == 0 && link_line(link, line, sizeof(line)) >= 0) {
+        char name[256];
+        long long size;
+        long sec, nsec;
+        memset(name, 0, sizeof(name));
+        if (strcmp(line, "DONE") == 0) {
+            break;
+        }
+        if (sscanf(line, "FILE %255s %lld %ld %ld", name, &size, &sec, &nsec) != 4) {
+            status = -1;
+            break;
+        }
+        struct timespec mtime = { sec, nsec };
+        int got = receive_file(link, name, size, &mtime);
+        status = got < 0 ? -1 : 0;
+        n_changed += got == 0;
+        n_files++;
+    }
+
+    // files that arrive outside our log reach our own replicas by a resync of theirs
+    if (!REPLICA_MODE && n_changed > 0) {
+        force_resync();
+    }
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(replication): resync link closed after %ld files%s", n_files, status == 0 ? "" : ", with errors");
+    logger(msg);
+    free(link);
+    return status;
+}
@@ -0,0 +1,824 @@
+/*
+** router.c -- consistent-hash sharding of the file namespace over the -p instances
+*/
+
+#include "define.h"
+#include <stdint.h>
+
+#define MAX_SHARDS 64
+#define N_VNODES 160       // points per shard on the ring, evens out the share of each shard
+#define MAX_ROUTES 65535   // files open through the router at a time, as many as a shard's lock table
+#define NAMES_PAGE 64      // file names asked from a shard at a time while rebalancing
+
+int ROUTER_MODE = 0;
+
+struct shard_t {
+    char* host;
+    char* port;
+    int n_pool;                       // idle connections in pool
+    struct link_t* pool[PROXY_POOL];
+    long requests;                    // requests forwarded
+    long failures;                    // requests that found the shard unreachable
+    long moved;                       // files moved to it by rebalancing
+};
+
+struct vnode_t {
+    uint64_t hash;
+    int shard;
+};
+
+struct ring_t {
+    struct vnode_t* nodes;  // sorted by hash
+    int n;
+};
+
+struct route_t {            // a file opened through the router
+    int shard;
+    int id;                 // the shard's identifier of the file, 0 if the entry is free
+    char name[256];
+};
+
+static struct shard_t shards[MAX_SHARDS];
+static int n_shards = 0;
+static struct ring_t ring = { NULL, 0 };
+static struct ring_t prev = { NULL, 0 };  // the ring before the last shard was added, files may still sit where it put them
+static int moving = 0;                    // 1 while a rebalance is in progress
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t move_mtx = PTHREAD_MUTEX_INITIALIZER;  // a file is moved or opened, not both
+
+static struct route_t routes[MAX_ROUTES];  // the router's identifier of a file is its index + 1
+static pthread_mutex_t route_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash_key(const char* key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char* p = (const unsigned char*)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;  // fnv alone clusters similar names, mix the bits
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compare_vnodes(const void* a, const void* b) {
+    uint64_t x = ((const struct vnode_t*)a)->hash;
+    uint64_t y = ((const struct vnode_t*)b)->hash;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void build_ring(struct ring_t* r, int n) {
+    r->nodes = (struct vnode_t*)malloc(sizeof(struct vnode_t) * N_VNODES * n);
+    r->n = N_VNODES * n;
+    for (int s = 0; s < n; s++) {
+        for (int v = 0; v < N_VNODES; v++) {
+            char key[300];
+            memset(key, 0, sizeof(key));
+            sprintf(key, "%s:%s#%d", shards[s].host, shards[s].port, v);
+            r->nodes[s * N_VNODES + v].hash = hash_key(key);
+            r->nodes[s * N_VNODES + v].shard = s;
+        }
+    }
+    qsort(r->nodes, r->n, sizeof(struct vnode_t), compare_vnodes);
+}
+
+// the shard owning a name: the first point on the ring at or after the name's hash, caller holds ring_lock
+static int owner(const struct ring_t* r, const char* name) {
+    uint64_t h = hash_key(name);
+    int lo = 0, hi = r->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r->nodes[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return r->nodes[lo == r->n ? 0 : lo].shard;
+}
+
+// forward one request to a shard over a pooled connection, retrying once on a fresh one if a pooled one went stale
+static char* forward(int s, const char* req, char* line, int size) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        struct link_t* link = NULL;
+        pthread_mutex_lock(&pool_mtx);
+        if (shards[s].n_pool > 0) link = shards[s].pool[--shards[s].n_pool];
+        shards[s].requests += attempt == 0;
+        pthread_mutex_unlock(&pool_mtx);
+
+        int pooled = link != NULL;
+        if (link == NULL) {
+            link = link_open(shards[s].host, shards[s].port, 30);
+        }
+        char* reply = link == NULL ? NULL : link_request(link, req, line, size);
+
+        pthread_mutex_lock(&pool_mtx);
+        if (reply != NULL && !link->broken && shards[s].n_pool < PROXY_POOL) {  // a broken link has bytes of this reply left
+            shards[s].pool[shards[s].n_pool++] = link;
+            link = NULL;
+        }
+        shards[s].failures += reply == NULL && !pooled;
+        pthread_mutex_unlock(&pool_mtx);
+        link_close(link);
+
+        if (reply != NULL || !pooled) return reply;  // the shard idled out our pooled session, try a new one
+    }
+    return NULL;
+}
+
+// split a shard's "status code message" reply into echo, the message stays in the caller's buffer
+static void parse_reply(char* reply, struct echo_t* echo) {
+    if (strncmp(reply, "OK", 2) == 0) echo->status = "OK";
+    else if (strncmp(reply, "ERR", 3) == 0) echo->status = "ERR";
+    else echo->status = "FAIL";
+    char* code = strchr(reply, ' ');
+    echo->code = code == NULL ? 0 : atoi(code + 1);
+    char* message = code == NULL ? NULL : strchr(code + 1, ' ');
+    echo->message = message == NULL ? (char*)"" : message + 1;
+}
+
+// ask a shard to move a file to the shard that owns it now, 0 if moved or not there, caller holds move_mtx
+static int migrate(int from, int to, const char* name) {
+    char req[600];
+    char line[512];
+    memset(req, 0, sizeof(req));
+    snprintf(req, sizeof(req), "MIGRATE %s %s:%s\n", name, shards[to].host, shards[to].port);
+    char* reply = forward(from, req, line, sizeof(line));
+    if (reply == NULL) return -1;
+    if (strncmp(reply, "OK", 2) == 0) {
+        if (strstr(reply, "moved") != NULL) {
+            pthread_mutex_lock(&pool_mtx);
+            shards[to].moved++;
+            pthread_mutex_unlock(&pool_mtx);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static int find_route(const char* name) {
+    for (int i = 0; i < MAX_ROUTES; i++) {
+        if (routes[i].id > 0 && strcmp(routes[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int open_route(int shard, int id, const char* name) {
+    pthread_mutex_lock(&route_mtx);
+    int free_slot = -1;
+    for (int i = 0; i < MAX_ROUTES; i++) {
+        if (routes[i].id == id && routes[i].shard == shard) {
+            pthread_mutex_unlock(&route_mtx);
+            return i;  // another client opened it through us already
+        }
+        if (free_slot == -1 && routes[i].id <= 0) free_slot = i;
+    }
+    if (free_slot != -1) {
+        routes[free_slot].shard = shard;
+        routes[free_slot].id = id;
+        memset(routes[free_slot].name, 0, sizeof(routes[free_slot].name));
+        strncpy(routes[free_slot].name, name, sizeof(routes[free_slot].name) - 1);
+    }
+    pthread_mutex_unlock(&route_mtx);
+    return free_slot;
+}
+
+static int route_open(int argc, char** argv, struct echo_t* echo, char* line, int size) {
+    if (argc != 2) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: FOPEN filename";
+        return 0;
+    }
+    const char* name = argv[1];
+    if (normal_name(argv[1]) != 0) {  // hashed as the shard will keep it, "./a" lands where "a" does
+        echo->status = "ERR";
+        echo->code = EACCES;
+        echo->message = "only files under the run directory can be opened";
+        return 0;
+    }
+    char req[300];
+    memset(req, 0, sizeof(req));
+    snprintf(req, sizeof(req), "FOPEN %s\n", name);
+
+    // a file that is open stays on its shard until it is closed, even if the ring has changed since
+    pthread_mutex_lock(&route_mtx);
+    int r = find_route(name);
+    int s = r >= 0 ? routes[r].shard : -1;
+    pthread_mutex_unlock(&route_mtx);
+
+    char* reply = NULL;
+    if (s >= 0) {
+        reply = forward(s, req, line, size);
+    }
+    else {
+        pthread_rwlock_rdlock(&ring_lock);
+        s = owner(&ring, name);
+        int from = prev.n > 0 ? owner(&prev, name) : s;
+        pthread_rwlock_unlock(&ring_lock);
+
+        // a file whose owner changed is moved over before anyone opens it, in case the mover has not got to it
+        if (from != s) {
+            pthread_mutex_lock(&move_mtx);
+            if (migrate(from, s, name) != 0) {
+                pthread_mutex_unlock(&move_mtx);
+                echo->status = "ERR";
+                echo->code = EBUSY;
+                echo->message = "file is moving to another shard, retry later";
+                return 0;
+            }
+            reply = forward(s, req, line, size);
+            pthread_mutex_unlock(&move_mtx);
+        }
+        else {
+            reply = forward(s, req, line, size);
+        }
+    }
+    if (reply == NULL) {
+        echo->status = "ERR";
+        echo->code = EHOSTUNREACH;
+        echo->message = "shard unreachable";
+        return 0;
+    }
+
+    // the shard's identifier (in an OK, or in the ERR for a file already opened) becomes one of ours
+    parse_reply(reply, echo);
+    int opened = strcmp(echo->status, "OK") == 0 || (strcmp(echo->status, "ERR") == 0 && strstr(echo->message, "already opened") != NULL);
+    if (opened && echo->code > 0) {
+        r = open_route(s, echo->code, name);
+        if (r < 0) {
+            echo->status = "ERR";
+            echo->code = ENFILE;
+            echo->message = "too many files open through the router";
+            return 0;
+        }
+        echo->code = r + 1;
+    }
+    return 0;
+}
+
+int route_request(int argc, char** argv, struct echo_t* echo) {
+    static __thread char line[IO_BUF_SIZE + 64];
+    memset(line, 0, sizeof(line));
+
+    if (strcasecmp(argv[0], "FOPEN") == 0) {
+        return route_open(argc, argv, echo, line, sizeof(line));
+    }
+    if (argc < 2 || checkDigit(argv[1]) == 0 || atoi(argv[1]) < 1 || atoi(argv[1]) > MAX_ROUTES) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "invalid identifier, no such file or directory";
+        return 0;
+    }
+
+    int r = atoi(argv[1]) - 1;
+    pthread_mutex_lock(&route_mtx);
+    int s = routes[r].shard;
+    int id = routes[r].id;
+    pthread_mutex_unlock(&route_mtx);
+    if (id <= 0) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "invalid identifier, no such file or directory";
+        return 0;
+    }
+
+    // a copy is done by the shard holding the file, so the target has to live there as well
+    if (strcasecmp(argv[0], "FCOPY") == 0 && argc == 3) {
+        pthread_rwlock_rdlock(&ring_lock);
+        int target = owner(&ring, argv[2]);
+        pthread_rwlock_unlock(&ring_lock);
+        if (target != s) {
+            echo->status = "ERR";
+            echo->code = EXDEV;
+            echo->message = "target belongs to another shard, copy it through the client";
+            return 0;
+        }
+    }
+
+    // same request with the shard's identifier in place of ours
+    char req[IO_BUF_SIZE + 64];
+    memset(req, 0, sizeof(req));
+    int len = snprintf(req, sizeof(req), "%s %d", argv[0], id);
+    for (int i = 2; i < argc && len < (int)sizeof(req) - 2; i++) {
+        len += snprintf(req + len, sizeof(req) - len, " %s", argv[i]);
+    }
+    req[len < (int)sizeof(req) - 1 ? len : (int)sizeof(req) - 2] = '\n';
+
+    char* reply = forward(s, req, line, sizeof(line));
+    if (reply == NULL) {
+        echo->status = "ERR";
+        echo->code = EHOSTUNREACH;
+        echo->message = "shard unreachable";
+        return 0;
+    }
+    parse_reply(reply, echo);
+    if (strcasecmp(argv[0], "FCLOSE") == 0 && strcmp(echo->status, "OK") == 0) {
+        // a file the mover skipped because it was open follows its new owner once it is closed
+        pthread_mutex_lock(&move_mtx);
+        pthread_mutex_lock(&route_mtx);
+        char name[256];
+        memcpy(name, routes[r].name, sizeof(name));
+        routes[r].id = 0;
+        pthread_mutex_unlock(&route_mtx);
+        pthread_rwlock_rdlock(&ring_lock);
+        int to = owner(&ring, name);
+        pthread_rwlock_unlock(&ring_lock);
+        if (to != s) migrate(s, to, name);  // if it fails, the next FOPEN tries again
+        pthread_mutex_unlock(&move_mtx);
+    }
+    return 0;
+}
+
+// GET, PUT and DEL go as they are to the shard owning the key, keys are not moved when a shard is added
+int route_key(int argc, char** argv, struct echo_t* echo) {
+    static __thread char line[IO_BUF_SIZE + 64];
+    memset(line, 0, sizeof(line));
+    if (argc < 2) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = (char*)(strcasecmp(argv[0], "PUT") == 0 ? "Usage: PUT key value" : "Usage: GET|DEL key");
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&ring_lock);
+    int s = owner(&ring, argv[1]);
+    pthread_rwlock_unlock(&ring_lock);
+
+    char req[IO_BUF_SIZE + 64];
+    memset(req, 0, sizeof(req));
+    int len = snprintf(req, sizeof(req), "%s", argv[0]);
+    for (int i = 1; i < argc && len < (int)sizeof(req) - 2; i++) {
+        len += snprintf(req + len, sizeof(req) - len, " %s", argv[i]);
+    }
+    req[len < (int)sizeof(req) - 1 ? len : (int)sizeof(req) - 2] = '\n';
+
+    char* reply = forward(s, req, line, sizeof(line));
+    if (reply == NULL) {
+        echo->status = "ERR";
+        echo->code = EHOSTUNREACH;
+        echo->message = "shard unreachable";
+        return 0;
+    }
+    parse_reply(reply, echo);
+    return 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// FLIST asks every shard for a page and keeps the first names of their union, a file being moved is listed once
+int route_list(int argc, char** argv, struct echo_t* echo) {
+    static __thread char message[IO_BUF_SIZE];
+    static __thread char line[IO_BUF_SIZE + 64];
+    if (argc < 2 || argc > 4 || checkDigit(argv[1]) == 0 || atoi(argv[1]) < 1) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: FLIST count [prefix [after]]";
+        return 0;
+    }
+    char req[IO_BUF_SIZE];
+    memset(req, 0, sizeof(req));
+    snprintf(req, sizeof(req), "FLIST %s %s %s\n", argv[1], argc > 2 ? argv[2] : "/", argc > 3 ? argv[3] : "");
+
+    char** names = NULL;
+    int n = 0, cap = 0;
+    char bound[IO_BUF_SIZE];  // the smallest of the last names of the shards' pages
+    bound[0] = '\0';
+    for (int s = 0; s < n_shards; s++) {
+        memset(line, 0, sizeof(line));
+        char* reply = forward(s, req, line, sizeof(line));
+        if (reply == NULL || strncmp(reply, "OK", 2) != 0) {
+            for (int i = 0; i < n; i++) free(names[i]);
+            free(names);
+            echo->status = "ERR";
+            echo->code = EHOSTUNREACH;
+            echo->message = "shard unreachable, the listing would be incomplete";
+            return 0;
+        }
+        struct echo_t part;
+        parse_reply(reply, &part);
+        char* save = NULL;
+        int first = n;
+        for (char* name = strtok_r(part.message, " \r\n", &save); name != NULL; name = strtok_r(NULL, " \r\n", &save)) {
+            if (n == cap) {
+                cap = cap == 0 ? 256 : cap * 2;
+                names = (char**)realloc(names, cap * sizeof(char*));
+            }
+            names[n++] = strdup(name);
+        }
+        if (n > first && (bound[0] == '\0' || strcmp(names[n - 1], bound) < 0)) {
+            snprintf(bound, sizeof(bound), "%s", names[n - 1]);
+        }
+    }
+    qsort(names, n, sizeof(char*), compare_names);
+
+    // a shard's page ends where its own names ran out, so the merged page is only good up to the shortest of them
+    int max = atoi(argv[1]), count = 0, len = 0;
+    memset(message, 0, sizeof(message));
+    for (int i = 0; i < n; i++) {
+        if ((i > 0 && strcmp(names[i], names[i - 1]) == 0) || strcmp(names[i], bound) > 0 || count >= max ||
+            len + (int)strlen(names[i]) + 2 > (int)sizeof(message)) {
+            free(names[i]);
+            continue;
+        }
+        len += sprintf(message + len, count > 0 ? " %s" : "%s", names[i]);
+        count++;
+        free(names[i]);
+    }
+    free(names);
+    echo->status = "OK";
+    echo->code = count;
+    echo->message = message;
+    return 0;
+}
+
+// ask one shard for its share of an MGET, copying each item into our buffer, -1 if the shard did not answer
+static int fetch_items(int s, const char* len, char** names, const int* items, int n, int* lens, char** data,
+                       char* store, int* stored, int room) {
+    static __thread char req[IO_BUF_SIZE + 64];
+    static __thread char line[IO_BUF_SIZE + 64];
+    memset(req, 0, sizeof(req));
+    int pos = snprintf(req, sizeof(req), "MGET %s", len);
+    for (int k = 0; k < n; k++) {
+        pos += snprintf(req + pos, sizeof(req) - pos, " %s", names[items[k]]);
+    }
+    req[pos < (int)sizeof(req) - 1 ? pos : (int)sizeof(req) - 2] = '\n';
+
+    char* reply = forward(s, req, line, sizeof(line));
+    if (reply == NULL || strncmp(reply, "OK", 2) != 0) return -1;
+    struct echo_t echo;
+    parse_reply(reply, &echo);
+
+    // "length bytes" per item, the bytes may hold blanks so we go by the lengths
+    char* p = echo.message;
+    for (int k = 0; k < n; k++) {
+        char* end;
+        int got = strtol(p, &end, 10);
+        if (end == p) return -1;
+        p = end;
+        lens[items[k]] = got;
+        data[items[k]] = store + *stored;
+        if (got > 0) {
+            if ((int)strlen(p) < 1 + got) return -1;  // cut short, the rest never came
+            int keep = got < room - *stored ? got : room - *stored;  // the merged answer has one buffer's room
+            memcpy(store + *stored, p + 1, keep);
+            lens[items[k]] = keep;
+            *stored += keep;
+            p += 1 + got;
+        }
+        while (*p == ' ') p++;
+    }
+    return 0;
+}
+
+// split an MGET by the shard owning each name and merge the answers back in request order
+int route_mget(int argc, char** argv, struct echo_t* echo) {
+    static __thread char store[IO_BUF_SIZE];
+    static __thread char message[IO_BUF_SIZE];
+    if (argc < 3 || argc - 2 > 128 || checkDigit(argv[1]) == 0) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: MGET length filename [filename ...], up to 128 files";
+        return 0;
+    }
+    int n = argc - 2;
+    char** names = argv + 2;
+    int owners[128], before[128], lens[128];
+    char* data[128];
+    pthread_rwlock_rdlock(&ring_lock);
+    for (int i = 0; i < n; i++) {
+        owners[i] = owner(&ring, names[i]);
+        before[i] = prev.n > 0 ? owner(&prev, names[i]) : owners[i];
+    }
+    pthread_rwlock_unlock(&ring_lock);
+
+    int stored = 0;
+    int room = IO_BUF_SIZE - 128 - 12 * n;
+    for (int pass = 0; pass < 2; pass++) {
+        // the second pass asks the previous owner for the names the mover has not brought over yet
+        for (int s = 0; s < n_shards; s++) {
+            int items[128], n_items = 0;
+            for (int i = 0; i < n; i++) {
+                if (pass == 0 && owners[i] == s) items[n_items++] = i;
+                if (pass == 1 && before[i] == s && before[i] != owners[i] && lens[i] == -ENOENT) items[n_items++] = i;
+            }
+            if (n_items == 0) continue;
+            if (fetch_items(s, argv[1], names, items, n_items, lens, data, store, &stored, room) != 0) {
+                for (int k = 0; k < n_items; k++) lens[items[k]] = -EHOSTUNREACH;
+            }
+        }
+    }
+
+    memset(message, 0, sizeof(message));
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        pos += sprintf(message + pos, i > 0 ? " %d" : "%d", lens[i]);
+        if (lens[i] > 0) {
+            message[pos++] = ' ';
+            memcpy(message + pos, data[i], lens[i]);
+            pos += lens[i];
+        }
+    }
+    echo->status = "OK";
+    echo->code = n;
+    echo->message = message;
+    return 0;
+}
+
+// move every file of the old shards whose owner changed, files open through us move when they are closed
+static void* rebalance_thread(void* omitted) {
+    pthread_rwlock_rdlock(&ring_lock);
+    int n_old = prev.n / N_VNODES;
+    pthread_rwlock_unlock(&ring_lock);
+
+    long moved = 0, pending = 0;
+    int busy = 1;
+    for (int round = 0; busy > 0 && round < 30; round++) {
+        if (round > 0) sleep(1);
+        busy = 0;
+        pending = 0;
+        for (int s = 0; s < n_old; s++) {
+            char after[256];
+            memset(after, 0, sizeof(after));
+            strcpy(after, "-");
+            while (1) {
+                char req[300];
+                char line[IO_BUF_SIZE + 64];
+                memset(req, 0, sizeof(req));
+                snprintf(req, sizeof(req), "NAMES %s %d\n", after, NAMES_PAGE);
+                char* reply = forward(s, req, line, sizeof(line));
+                if (reply == NULL || strncmp(reply, "OK", 2) != 0) {
+                    busy++;  // unreachable, try again next round
+                    break;
+                }
+
+                struct echo_t echo;
+                parse_reply(reply, &echo);
+                if (echo.code == 0) break;
+                char* names[NAMES_PAGE + 1];
+                int n = tokenize(echo.message, names, strlen(echo.message));
+                if (n > NAMES_PAGE) n = NAMES_PAGE;
+                for (int i = 0; i < n; i++) {
+                    pthread_rwlock_rdlock(&ring_lock);
+                    int to = owner(&ring, names[i]);
+                    pthread_rwlock_unlock(&ring_lock);
+                    if (to == s) continue;
+
+                    pthread_mutex_lock(&move_mtx);
+                    pthread_mutex_lock(&route_mtx);
+                    int open = find_route(names[i]) >= 0;
+                    pthread_mutex_unlock(&route_mtx);
+                    if (open) pending++;
+                    else if (migrate(s, to, names[i]) != 0) busy++;
+                    else moved++;
+                    pthread_mutex_unlock(&move_mtx);
+                }
+                memset(after, 0, sizeof(after));
+                strncpy(after, names[n - 1], sizeof(after) - 1);
+                if (n < NAMES_PAGE) break;
+            }
+        }
+    }
+
+    pthread_rwlock_wrlock(&ring_lock);
+    moving = 0;
+    pthread_rwlock_unlock(&ring_lock);
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(router): rebalance done, %ld files moved, %ld open ones move when closed, %d left behind", moved, pending, busy);
+    logger(msg);
+    return NULL;
+}
+
+static int add_shard_entry(const char* addr) {
+    const char* colon = strrchr(addr, ':');
+    if (colon == NULL || n_shards == MAX_SHARDS) {
+        return -1;
+    }
+    shards[n_shards].host = strndup(addr, colon - addr);
+    shards[n_shards].port = strdup(colon + 1);
+    shards[n_shards].n_pool = 0;
+    n_shards++;
+    return 0;
+}
+
+int add_shard(const char* addr, struct echo_t* echo) {
+    pthread_rwlock_wrlock(&ring_lock);
+    if (!ROUTER_MODE || moving) {
+        pthread_rwlock_unlock(&ring_lock);
+        echo->status = "ERR";
+        echo->code = EBUSY;
+        echo->message = (char*)(ROUTER_MODE ? "a rebalance is still in progress" : "not a router, start it with -H");
+        return -1;
+    }
+    for (int i = 0; i < n_shards; i++) {
+        char known[300];
+        memset(known, 0, sizeof(known));
+        sprintf(known, "%s:%s", shards[i].host, shards[i].port);
+        if (strcmp(known, addr) == 0) {
+            pthread_rwlock_unlock(&ring_lock);
+            echo->status = "ERR";
+            echo->code = EEXIST;
+            echo->message = "already a shard";
+            return -1;
+        }
+    }
+    if (add_shard_entry(addr) != 0) {
+        pthread_rwlock_unlock(&ring_lock);
+        echo->status = "FAIL";
+        echo->code = -5;
+        echo->message = "invalid shard, expected host:port";
+        return -1;
+    }
+
+    // only the names that land on the new shard's points change owner, everything else stays put
+    free(prev.nodes);
+    prev = ring;
+    build_ring(&ring, n_shards);
+    moving = 1;
+    pthread_rwlock_unlock(&ring_lock);
+
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, rebalance_thread, NULL) != 0) {
+        perror("pthread_create");
+        fflush(stderr);
+        exit(29);
+    }
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(router): shard %.64s added, rebalancing", addr);
+    logger(msg);
+
+    echo->status = "OK";
+    echo->code = n_shards;
+    echo->message = "shard added, files are moving in the background";
+    return 0;
+}
+
+int init_router(void) {
+    if (!ROUTER_MODE) return 0;
+    for (int i = 0; i < MAX_SHARDS && peers[i] != NULL; i++) {
+        if (add_shard_entry(peers[i]) != 0) {
+            fprintf(stderr, "invalid shard %s, expected host:port\n", peers[i]);
+            fflush(stderr);
+            return -1;
+        }
+    }
+    if (n_shards == 0) {
+        fprintf(stderr, "a router needs at least one shard given by -p\n");
+        fflush(stderr);
+        return -1;
+    }
+    build_ring(&ring, n_shards);
+    return 0;
+}
+
+int show_shards(char* buf, size_t size) {
+    size_t len = 0;
+    int open = 0;
+    pthread_mutex_lock(&route_mtx);
+    for (int i = 0; i < MAX_ROUTES; i++) open += routes[i].id > 0;
+    pthread_mutex_unlock(&route_mtx);
+
+    pthread_rwlock_rdlock(&ring_lock);
+    len += snprintf(buf, size, "router over %d shards, %d vnodes each, %d files open%s\n",
+                    n_shards, N_VNODES, open, moving ? ", rebalancing" : "");
+    pthread_mutex_lock(&pool_mtx);
+    for (int s = 0; s < n_shards && len < size; s++) {
+        int points = 0;
+        uint64_t share = 0;  // fraction of the hash space owned, out of 2^64
+        for (int i = 0; i < ring.n; i++) {
+            if (ring.nodes[i].shard != s) continue;
+            points++;
+            share += ring.nodes[i].hash - (i > 0 ? ring.nodes[i - 1].hash : ring.nodes[ring.n - 1].hash);
+        }
+        len += snprintf(buf + len, size - len, "shard %s:%s owns %.1f%% of names, %ld requests, %ld failures, "
+                        "%ld files moved in, %d idle connections\n", shards[s].host, shards[s].port,
+                        100.0 * (double)share / 18446744073709551616.0, shards[s].requests, shards[s].failures,
+                        shards[s].moved, shards[s].n_pool);
+    }
+    pthread_mutex_unlock(&pool_mtx);
+    pthread_rwlock_unlock(&ring_lock);
+    return len < size ? len : size - 1;
+}
+
+/*
+** shard side
+*/
+
+// list our files in name order, after a given name (or "-" to start), for a router rebalancing the namespace
+int serve_names(int argc, char** argv, struct echo_t* echo) {
+    static __thread char message[3840];  // leaves room for the status and code in a response line
+    if (argc != 3 || checkDigit(argv[2]) == 0) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: NAMES after count";
+        return 0;
+    }
+    if (LOG_MODE) {
+        echo->status = "ERR";
+        echo->code = EOPNOTSUPP;
+        echo->message = "files in the log-structured store cannot be rebalanced";
+        return 0;
+    }
+
+    char** files = NULL;
+    int n = list_files(&files);
+    const char* after = strcmp(argv[1], "-") == 0 ? "" : argv[1];
+    int count = atoi(argv[2]);
+
+    // pick the next count names after the cursor without sorting everything
+    memset(message, 0, sizeof(message));
+    int len = 0, listed = 0;
+    const char* last = after;
+    while (listed < count) {
+        const char* best = NULL;
+        for (int i = 0; i < n; i++) {
+            if (strcmp(files[i], last) > 0 && (best == NULL || strcmp(files[i], best) < 0)) best = files[i];
+        }
+        if (best == NULL || len + (int)strlen(best) + 2 > (int)sizeof(message)) break;
+        len += sprintf(message + len, "%s%s", listed > 0 ? " " : "", best);
+        last = best;
+        listed++;
+    }
+    for (int i = 0; i < n; i++) free(files[i]);
+    free(files);
+
+    echo->status = "OK";
+    echo->code = listed;
+    echo->message = message;
+    return 0;
+}
+
+// hand a file over to another shard: push it with the resync protocol, then drop our copy
+int serve_migrate(int argc, char** argv, struct echo_t* echo) {
+    if (argc != 3 || strchr(argv[2], ':') == NULL) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: MIGRATE filename host:port";
+        return 0;
+    }
+    if (LOG_MODE) {
+        echo->status = "ERR";
+        echo->code = EOPNOTSUPP;
+        echo->message = "files in the log-structured store cannot be rebalanced";
+        return 0;
+    }
+    const char* name = argv[1];
+    if (name[0] == '/' || strstr(name, "..") != NULL) {
+        echo->status = "ERR";
+        echo->code = EACCES;
+        echo->message = "only files under the run directory can be moved";
+        return 0;
+    }
+    int known = 0;  // files only go to an instance we were configured with, never wherever a client says
+    for (int i = 0; i < 64 && peers[i] != NULL && !known; i++) {
+        known = strcmp(peers[i], argv[2]) == 0;
+    }
+    if (!known) {
+        echo->status = "ERR";
+        echo->code = EACCES;
+        echo->message = "target is not one of our peers";
+        return 0;
+    }
+    if (access(name, F_OK) != 0) {
+        echo->status = "OK";
+        echo->code = 0;
+        echo->message = "nothing to move";
+        return 0;
+    }
+
+    // a file open here (by a client that bypassed the router) stays until it is closed, and our write lock
+    // keeps it from being opened until our copy is gone, so no write goes to the unlinked file
+    int fd = open(name, O_RDWR);  // a write lock needs a descriptor open for writing
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if (fd < 0 || name_lock(name) >= 0 || fcntl(fd, F_OFD_SETLK, &fl) == -1) {
+        if (fd >= 0) close(fd);
+        echo->status = "ERR";
+        echo->code = fd < 0 ? errno : EBUSY;
+        echo->message = (char*)(fd < 0 ? "cannot open file" : "file is open");
+        return 0;
+    }
+
+    char* host = strndup(argv[2], strrchr(argv[2], ':') - argv[2]);
+    int status = push_file(host, strrchr(argv[2], ':') + 1, name);
+    free(host);
+    if (status != 0 || unlink(name) != 0) {
+        close(fd);
+        echo->status = "ERR";
+        echo->code = EIO;
+        echo->message = "cannot move file";
+        return 0;
+    }
+    crc_remove(name);  // the new shard sums the file when it is first opened there
+    name_removed(name);
+    close(fd);  // also releases our OFD lock, an FOPEN from now on creates a new file
+    echo->status = "OK";
+    echo->code = 0;
+    echo->message = "file moved";
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+** sessions.c -- a registry of the file sessions in progress, what each one is doing, for the admin to look into
+*/
+
+#include "define.h"
+
+#define MAX_SESSIONS 4096
+
+/*
+** every session owns one slot and is the only one writing it, so it never takes a lock: it makes the slot's
+** sequence number odd while it changes the slot and even again once done, and a reader copies the slot until it
+** gets the same even number before and after the copy; claiming a free slot is a compare-and-swap
+*/
+struct session_t {
+    int used;               // 1 while a session owns the slot
+    volatile unsigned seq;  // odd while the owner is changing the slot
+    long id;                // serial number of the session, never reused
+    int csock;
+    char peer[64];          // address:port of the client
+    long since;             // ms when the session started
+    long last;              // ms when the last request came in, or its reply went out
+    long begun;             // ms when the request in progress came in
+    long wait_since;        // ms when it started waiting for the file in waited
+    int waited;             // lock_id it waited for in this request, -1 if none
+    int state;
+    char cmd[16];           // the request in progress, or the last one
+    int lock_id;            // the file it names, -1 if none
+    int n_opened;
+    long ops;
+    long bytes_in;
+    long bytes_out;
+};
+
+static struct session_t registry[MAX_SESSIONS];
+static long serial = 0;
+static __thread struct session_t* self = NULL;  // the slot of the session this thread serves, NULL if none
+
+static long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void begin_update(struct session_t* s) {
+    s->seq++;
+    __sync_synchronize();
+}
+
+static void end_update(struct session_t* s) {
+    __sync_synchronize();
+    s->seq++;
+}
+
+// a consistent copy of a slot, 0 if it is not in use
+static int read_slot(struct session_t* s, struct session_t* copy) {
+    for (int tries = 0; tries < 1000; tries++) {
+        unsigned seq = s->seq;
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+        memcpy(copy, s, sizeof(struct session_t));
+        __sync_synchronize();
+        if (s->seq == seq) return copy->used;
+    }
+    return 0;
+}
+
+// the session on csock starts, served by this thread
+void join_session(int csock) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char ipstr[INET6_ADDRSTRLEN];
+    memset(ipstr, 0, sizeof(ipstr));
+    int port = 0;
+    if (getpeername(csock, (struct sockaddr*)&addr, &len) == 0) {
+        inet_ntop(addr.ss_family, extractAddr((struct sockaddr*)&addr), ipstr, INET6_ADDRSTRLEN);
+        port = ntohs(addr.ss_family == AF_INET ? ((struct sockaddr_in*)&addr)->sin_port : ((struct sockaddr_in6*)&addr)->sin6_port);
+    }
+
+    self = NULL;
+    for (int i = 0; i < MAX_SESSIONS && self == NULL; i++) {
+        if (registry[i].used == 0 && __sync_bool_compare_and_swap(&registry[i].used, 0, 1)) self = &registry[i];
+    }
+    if (self == NULL) return;  // more sessions than slots, this one goes unlisted
+    begin_update(self);
+    self->id = __sync_add_and_fetch(&serial, 1);
+    self->csock = csock;
+    snprintf(self->peer, sizeof(self->peer), "%s:%d", ipstr, port);
+    self->since = self->last = self->begun = now_ms();
+    self->waited = -1;
+    self->state = SESSION_IDLE;
+    memset(self->cmd, 0, sizeof(self->cmd));
+    self->lock_id = -1;
+    self->n_opened = 0;
+    self->ops = self->bytes_in = self->bytes_out = 0;
+    end_update(self);
+}
+
+void leave_session(void) {
+    if (self == NULL) return;
+    begin_update(self);
+    self->used = 0;
+    end_update(self);
+    self = NULL;
+}
+
+// a request of n bytes came in and is being served
+void session_begin(const char* cmd, int lock_id, int n_bytes) {
+    if (self == NULL) return;
+    begin_update(self);
+    self->last = self->begun = now_ms();
+    self->state = SESSION_RUNNING;
+    self->waited = -1;
+    snprintf(self->cmd, sizeof(self->cmd), "%s", cmd);
+    self->lock_id = lock_id;
+    self->bytes_in += n_bytes;
+    end_update(self);
+}
+
+// its reply of n bytes went out
+void session_end(int n_bytes, int n_opened) {
+    if (self == NULL) return;
+    begin_update(self);
+    self->last = now_ms();
+    self->state = SESSION_IDLE;
+    self->bytes_out += n_bytes;
+    self->n_opened = n_opened;
+    self->ops++;
+    end_update(self);
+}
+
+// bytes sent outside of a reply line, e.g. the chunks of a stream
+void session_sent(long n_bytes) {
+    if (self == NULL) return;
+    begin_update(self);
+    self->bytes_out += n_bytes;
+    end_update(self);
+}
+
+// wait for another session to be done with a file, shown as such meanwhile; caller holds f_mtx and loops over it
+void wait_file(struct lock_t* lock, int writer) {
+    if (self != NULL) {
+        begin_update(self);
+        if (self->waited != lock - locks) {
+            self->waited = lock - locks;  // woken up and still waiting goes on counting from the first time
+            self->wait_since = now_ms();
+        }
+        self->state = writer ? SESSION_WAIT_WRITE : SESSION_WAIT_READ;
+        end_update(self);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long since = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    pthread_cond_wait(&lock->f_cond, &lock->f_mtx);
+    heat_waited(lock, writer, since);
+    trace_event("wait", lock->f_name, since);  // if the request is traced
+    if (self != NULL) {
+        begin_update(self);
+        self->state = SESSION_RUNNING;
+        end_update(self);
+    }
+}
+
+static long since_state(const struct session_t* s) {
+    return s->state == SESSION_WAIT_READ || s->state == SESSION_WAIT_WRITE ? s->wait_since : (s->state == SESSION_RUNNING ? s->begun : s->last);
+}
+
+// name of the file in a lock entry, -1 for none
+static void file_name(int lock_id, char* name, size_t size) {
+    memset(name, 0, size);
+    if (lock_id >= 0) memcpy(name, locks[lock_id].f_name, size - 1);
+}
+
+static int compare_sessions(const void* a, const void* b, void* column) {
+    const struct session_t* x = (const struct session_t*)a;
+    const struct session_t* y = (const struct session_t*)b;
+    const char* c = (const char*)column;
+    long d;
+    if (strcasecmp(c, "peer") == 0) return strcmp(x->peer, y->peer);
+    if (strcasecmp(c, "cmd") == 0) return strcmp(x->cmd, y->cmd);
+    if (strcasecmp(c, "file") == 0) {
+        char a_name[256], b_name[256];
+        file_name(x->lock_id, a_name, sizeof(a_name));
+        file_name(y->lock_id, b_name, sizeof(b_name));
+        return strcmp(a_name, b_name);
+    }
+    // the other columns put the largest first, the oldest, busiest or longest stuck sessions at the top
+    if (strcasecmp(c, "age") == 0) d = x->since - y->since;
+    else if (strcasecmp(c, "idle") == 0) d = x->last - y->last;
+    else if (strcasecmp(c, "state") == 0) d = y->state != x->state ? y->state - x->state : since_state(x) - since_state(y);
+    else if (strcasecmp(c, "ops") == 0) d = y->ops - x->ops;
+    else if (strcasecmp(c, "in") == 0) d = y->bytes_in - x->bytes_in;
+    else if (strcasecmp(c, "out") == 0) d = y->bytes_out - x->bytes_out;
+    else if (strcasecmp(c, "open") == 0) d = y->n_opened - x->n_opened;
+    else d = x->id - y->id;
+    return d > 0 ? 1 : (d < 0 ? -1 : 0);
+}
+
+int valid_column(const char* column) {
+    const char* columns[] = {"id", "peer", "age", "idle", "ops", "in", "out", "open", "cmd", "file", "state", 0};
+    for (int i = 0; columns[i] != 0; i++) {
+        if (strcasecmp(columns[i], column) == 0) return 1;
+    }
+    return 0;
+}
+
+// one line per session, sorted by column; returns a buffer the caller frees and its length in len
+char* show_sessions(const char* column, int* len) {
+    struct session_t* copies = (struct session_t*)malloc(sizeof(struct session_t) * MAX_SESSIONS);
+    if (copies == NULL) return NULL;
+    int n = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (registry[i].used && read_slot(&registry[i], &copies[n])) n++;
+    }
+    qsort_r(copies, n, sizeof(struct session_t), compare_sessions, (void*)column);
+
+    size_t size = 128 + (size_t)n * 384;
+    char* buf = (char*)malloc(size);
+    if (buf == NULL) {
+        free(copies);
+        return NULL;
+    }
+    long now = now_ms();
+    int o = snprintf(buf, size, "%6s %-24s %7s %7s %8s %10s %10s %4s  %s\n", "ID", "PEER", "AGE", "IDLE", "OPS", "IN", "OUT",
+                     "OPEN", "STATE");
+    for (int i = 0; i < n; i++) {
+        struct session_t* s = &copies[i];
+        char name[256];
+        file_name(s->lock_id, name, sizeof(name));
+        char state[400];
+        if (s->state == SESSION_WAIT_WRITE || s->state == SESSION_WAIT_READ) {
+            file_name(s->waited, name, sizeof(name));  // the file it waits for, as a batch names several
+            snprintf(state, sizeof(state), "%s waiting %.1fs for %s lock on %s", s->cmd, (now - s->wait_since) / 1000.0,
+                     s->state == SESSION_WAIT_WRITE ? "exclusive" : "reader", name);
+        }
+        else if (s->state == SESSION_RUNNING) {
+            snprintf(state, sizeof(state), "%s running %.1fs%s%s", s->cmd, (now - s->begun) / 1000.0, name[0] ? " on " : "", name);
+        }
+        else {
+            snprintf(state, sizeof(state), "idle%s%s%s%s", s->cmd[0] ? ", last " : "", s->cmd, name[0] ? " on " : "", name);
+        }
+        o += snprintf(buf + o, size - o, "%6ld %-24s %6lds %6.1fs %8ld %10ld %10ld %4d  %s\n", s->id, s->peer,
+                      (now - s->since) / 1000, (now - s->last) / 1000.0, s->ops, s->bytes_in, s->bytes_out, s->n_opened, state);
+    }
+    free(copies);
+    *len = o;
+    return buf;
+}
+
+// end a session: its read side is shut down, as the timer wheel does on an idle deadline, so it leaves once it is
+// done with the request in progress; 0 if found
+int kill_session(long id) {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        struct session_t copy;
+        if (!registry[i].used || !read_slot(&registry[i], &copy) || copy.id != id) continue;
+        shutdown(copy.csock, SHUT_RD);
+        char msg[160];
+        memset(msg, 0, sizeof(msg));
+        snprintf(msg, sizeof(msg), "(sessions): session %ld from %s on socket %d killed by admin", id, copy.peer, copy.csock);
+        logger(msg);
+        return 0;
+    }
+    return -1;
+}
@@ -29,6 +29,11 @@ void* signal_thread(void* set) {
                 fflush(stdout);
                 stop_server();
                 break;
+            case SIGUSR2:
+                printf("received signal \"%s\" (%d), upgrading server...\n", strsignal(sig), sig);
+                fflush(stdout);
+                upgrade_server(0);
+                break;
             case SIGHUP:
                 printf("received signal \"%s\" (%d), reloading server...\n", strsignal(sig), sig);
                 fflush(stdout);
@@ -0,0 +1,234 @@
+/*
+** snapshot.c -- point-in-time copies of the run directory, taken while clients go on writing
+*/
+
+#include "define.h"
+#include <linux/fs.h>
+
+#define SNAP_DIR ".snapshots"
+
+/*
+** a snapshot is cut by taking cut_lock exclusively, which every change to a file holds shared: meanwhile the names
+** of the files are listed, the sealed segments and their active one's length are noted, and a forked process gets
+** the key-value store as it is; writers then go on, and a file is copied (cloned where the file system can) by the
+** snapshot, or by its next writer before it is changed, whichever comes first
+*/
+struct snapfile_t {
+    char* name;
+    int state;   // 0 to copy, 1 being copied, 2 done
+};
+
+static struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int busy;                 // one snapshot at a time
+    char dir[300];
+    struct snapfile_t* files;  // sorted by name
+    int n_files;
+    int n_left;               // files not copied yet, only ever goes down once the cut is over
+    long bytes;
+    int cloned;               // files the file system shares the blocks of
+    int by_writers;           // files copied by a writer about to change them
+    int failed;
+} snap = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// writer-preferring, or a steady stream of writes could keep a snapshot from ever being cut
+static pthread_rwlock_t cut_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+static int compare_pending(const void* a, const void* b) {
+    return strcmp(((const struct snapfile_t*)a)->name, ((const struct snapfile_t*)b)->name);
+}
+
+static void make_parents(const char* path) {
+    char dir[600];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char* slash = strchr(dir, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, S_IRWXU);
+        *slash = '/';
+    }
+}
+
+// copy one file into to, a clone sharing its blocks if the file system can; returns its size, or -1
+static long clone_file(const char* from, const char* to, int* cloned) {
+    int in = open(from, O_RDONLY);
+    int out = in < 0 ? -1 : open(to, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    struct stat st;
+    long n = -1;
+    if (out >= 0 && fstat(in, &st) == 0) {
+        *cloned = ioctl(out, FICLONE, in) == 0;
+        if (*cloned || copy_contents(in, out) == 0) {
+            struct timespec times[2];
+            times[0].tv_nsec = UTIME_OMIT;
+            times[1] = st.st_mtim;  // a resync from the restored copy skips what did not change
+            futimens(out, times);
+            n = st.st_size;
+        }
+    }
+    if (out >= 0) close(out);
+    if (in >= 0) close(in);
+    return n;
+}
+
+// share a file that never changes again with a snapshot, a copy if a link cannot cross file systems
+int snap_link(const char* from, const char* to) {
+    if (link(from, to) == 0 || errno == EEXIST) return 0;
+    int cloned;
+    return errno == EXDEV && clone_file(from, to, &cloned) >= 0 ? 0 : -1;
+}
+
+// copy a file as it was at the cut unless someone else did, caller holds cut_lock shared or is the snapshot
+static void take_copy(struct snapfile_t* p, int writer) {
+    pthread_mutex_lock(&snap.mtx);
+    while (p->state == 1) pthread_cond_wait(&snap.cond, &snap.mtx);
+    if (p->state == 2) {
+        pthread_mutex_unlock(&snap.mtx);
+        return;
+    }
+    p->state = 1;
+    pthread_mutex_unlock(&snap.mtx);
+
+    char path[600];
+    snprintf(path, sizeof(path), "%s/%s", snap.dir, p->name);
+    make_parents(path);
+    int cloned = 0;
+    long n = clone_file(p->name, path, &cloned);
+
+    pthread_mutex_lock(&snap.mtx);
+    p->state = 2;
+    snap.n_left--;
+    snap.bytes += n > 0 ? n : 0;
+    snap.cloned += n >= 0 && cloned;
+    snap.by_writers += writer;
+    snap.failed += n < 0;
+    pthread_cond_broadcast(&snap.cond);
+    pthread_mutex_unlock(&snap.mtx);
+}
+
+// before changing a file in place, NULL for changes that only append; pair with snap_leave()
+void snap_enter(const char* name) {
+    pthread_rwlock_rdlock(&cut_lock);
+    if (name == NULL || snap.n_left == 0) return;
+    struct snapfile_t key = { (char*)name, 0 };
+    struct snapfile_t* p = (struct snapfile_t*)bsearch(&key, snap.files, snap.n_files, sizeof(key), compare_pending);
+    if (p != NULL) take_copy(p, 1);  // the snapshot gets the file as it was before this change
+}
+
+void snap_leave(void) {
+    pthread_rwlock_unlock(&cut_lock);
+}
+
+static int report(int asock, const char* fmt, long a, long b, long c) {
+    char line[256];
+    memset(line, 0, sizeof(line));
+    snprintf(line, sizeof(line), fmt, a, b, c);
+    int len = strlen(line);
+    return sendAll(asock, line, &len);
+}
+
+// SNAPSHOT [name]: a consistent copy of the files, chunks, segments and keys in .snapshots/name, progress to asock
+int take_snapshot(int asock, const char* name) {
+    char stamp[32];
+    if (name == NULL) {
+        time_t now = time(NULL);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+        name = stamp;
+    }
+    if (name[0] == '.' || strchr(name, '/') != NULL || strlen(name) > 64) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&snap.mtx);
+    int busy = snap.busy;
+    snap.busy = 1;
+    pthread_mutex_unlock(&snap.mtx);
+    if (busy) {
+        errno = EBUSY;
+        return -1;
+    }
+    snprintf(snap.dir, sizeof(snap.dir), "%s/%s", SNAP_DIR, name);
+    mkdir(SNAP_DIR, S_IRWXU);
+    if (mkdir(snap.dir, S_IRWXU) != 0) {
+        pthread_mutex_lock(&snap.mtx);
+        snap.busy = 0;
+        pthread_mutex_unlock(&snap.mtx);
+        return -1;
+    }
+    snap.bytes = snap.cloned = snap.by_writers = snap.failed = 0;
+
+    // the cut, no file changes from here until the lock is released
+    hold_chunks(1);  // the chunks of the recipes we copy stay until they are shared
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_rwlock_wrlock(&cut_lock);
+    char** names = NULL;
+    int n = list_files(&names);
+    snap.files = (struct snapfile_t*)calloc(n > 0 ? n : 1, sizeof(struct snapfile_t));
+    for (int i = 0; i < n; i++) snap.files[i].name = names[i];
+    free(names);
+    qsort(snap.files, n, sizeof(struct snapfile_t), compare_pending);
+    snap.n_files = snap.n_left = n;
+    int seg_in, seg_out;
+    off_t seg_len;
+    int n_segs = snap_segments(snap.dir, &seg_in, &seg_out, &seg_len);
+    long keys = 0;
+    pid_t dumper = dump_kv(snap.dir, &keys);
+    pthread_rwlock_unlock(&cut_lock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long paused = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+    int status = report(asock, "cut in %ld us: %ld files, %ld keys\n", paused, n, keys);
+    time_t last = time(NULL);
+    for (int i = 0; i < n; i++) {
+        take_copy(&snap.files[i], 0);
+        if (status == 0 && time(NULL) != last) {  // once a second at most
+            last = time(NULL);
+            pthread_mutex_lock(&snap.mtx);
+            long done = n - snap.n_left, mb = snap.bytes >> 20;
+            pthread_mutex_unlock(&snap.mtx);
+            status = report(asock, "copied %ld of %ld files, %ld MB\n", done, n, mb);
+        }
+    }
+
+    // segments are only appended to, the active one is copied up to where it stood at the cut
+    if (seg_in >= 0 && seg_out >= 0 && (copy_contents(seg_in, seg_out) != 0 || ftruncate(seg_out, seg_len) != 0)) {
+        n_segs = -1;
+    }
+    if (seg_in >= 0) close(seg_in);
+    if (seg_out >= 0) close(seg_out);
+    long n_chunks = link_chunks(snap.dir);
+    hold_chunks(0);
+
+    int kv_status = -1;
+    if (dumper > 0) waitpid(dumper, &kv_status, 0);
+    int kv_ok = dumper > 0 && WIFEXITED(kv_status) && WEXITSTATUS(kv_status) == 0;
+
+    pthread_rwlock_wrlock(&cut_lock);  // no writer is looking the files up any more
+    for (int i = 0; i < n; i++) free(snap.files[i].name);
+    free(snap.files);
+    snap.files = NULL;
+    snap.n_files = 0;
+    pthread_rwlock_unlock(&cut_lock);
+
+    int failed = snap.failed > 0 || n_segs < 0 || n_chunks < 0 || !kv_ok;
+    if (status == 0) {
+        status = report(asock, "%ld files (%ld MB), %ld cloned", n, snap.bytes >> 20, snap.cloned);
+    }
+    if (status == 0) {
+        status = report(asock, ", %ld copied first by their writers, %ld chunks, %ld segments\n", snap.by_writers, n_chunks, n_segs);
+    }
+    char msg[400];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(snapshot): %s taken, %d files, writers paused for %ld us%s", snap.dir, n, paused,
+            failed ? ", some of it could not be copied" : "");
+    logger(msg);
+
+    pthread_mutex_lock(&snap.mtx);
+    snap.busy = 0;
+    pthread_mutex_unlock(&snap.mtx);
+    if (failed) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
@@ -6,24 +6,14 @@
 
 void serve_admin(int asock) {
     const char* prompt = "> ";
-    const char* path[] = {"/bin", "/usr/bin", 0};
     const char* welcome = "Welcome to the daemon! Please issue your shell command, or type QUIT to exit.\n"
-                          "You can type MONITOR to view the current threads usage, hit Enter to stop.\n";
-
-    // prepare for execution
-    int status = 0;     // exit status of the child process
-    int executed = 0;   // check if a shell command has been issued
-    char output[4096];  // buffer to store the shell command output
-
-    int channel[2];  // create a pipe for IPC
-    if (pipe(channel) == -1) {
-        perror("pipe");
-        fflush(stderr);
-        exit(16);
-    }
+                          "You can type MONITOR to view the current threads usage, hit Enter to stop.\n"
+                          "GET prints the server parameters, SET key value changes them.\n";
 
     // welcome admin socket and add it to poll
     int n_res;
+    struct timer_node_t idle;  // our idle deadline, kept by the timer wheel
+    memset(&idle, 0, sizeof(idle));
     struct pollfd pfds[1];
     pfds[0].fd = asock;
     pfds[0].events = POLLIN;
@@ -44,9 +34,15 @@ void serve_admin(int asock) {
             break;
         }
 
+        arm_timer(&idle, asock, s_timeout);  // time out after s_timeout of inactivity (5 minutes by default)
         retry:
-        if ((n_res = poll(pfds, 1, 300000)) != 0) {  // time out after 5 minutes of inactivity
-            if (errno == EINTR) goto retry;
+        n_res = poll(pfds, 1, -1);
+        if (n_res < 0 && errno == EINTR) goto retry;
+        if (disarm_timer(&idle)) {
+            n_res = 0;  // deadline reached, the wheel shut down our read side to wake us up
+        }
+
+        if (n_res != 0) {
             if (n_res < 0) {
                 perror("poll");
                 fflush(stderr);
@@ -88,7 +84,6 @@ void serve_admin(int asock) {
             }
 
             // parse admin request to obtain argv[]
-            char* envp[] = { NULL };
             char* tokens[strlen(req)];
             char** argv = tokens;
             int argc = tokenize(req, argv, strlen(req));
@@ -102,33 +97,323 @@ void serve_admin(int asock) {
             // ready to execute command
             struct echo_t echo;
             if (strcasecmp(argv[0], "CPRINT") == 0) {
-                // send shell output on request
-                if (executed == 0) {
+                // send the output kept for a job on request, the last one started if none is given
+                print_job(asock, argc > 1 ? atoi(argv[1]) : 0, &echo);
+            }
+            else if (strcasecmp(argv[0], "BG") == 0) {
+                // run a command in the background, its job id comes back at once
+                if (argc < 2) {
+                    echo.status = "FAIL";
+                    echo.code = -1;
+                    echo.message = "Usage: BG command [args]";
+                }
+                else {
+                    run_job(asock, argv + 1, 1, &echo);
+                }
+            }
+            else if (strcasecmp(argv[0], "JOBS") == 0) {
+                char info[4096];
+                memset(info, 0, sizeof(info));
+                int len = show_jobs(info, sizeof(info));
+                if (sendAll(asock, info, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to send the job list";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Jobs printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "JKILL") == 0) {
+                if (argc != 2 || kill_job(atoi(argv[1])) != 0) {
                     echo.status = "ERR";
-                    echo.code = EIO;
-                    echo.message = "No command has been issued";
+                    echo.code = ESRCH;
+                    echo.message = "Usage: JKILL job, of a job still running";
                 }
                 else {
-                    if (send(asock, output, strlen(output), 0) < 0) {
-                        perror("send");
-                        fflush(stderr);
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Job sent SIGTERM";
+                }
+            }
+            else if (strcasecmp(argv[0], "SET") == 0) {
+                // change server parameters live, all pairs are applied atomically or none
+                set_params(argc, argv, 0, &echo);
+            }
+            else if (strcasecmp(argv[0], "GET") == 0) {
+                char params[1024];
+                memset(params, 0, sizeof(params));
+                int len = show_params(params, sizeof(params));
+                if (sendAll(asock, params, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to send parameters";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Parameters printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "PEERS") == 0) {
+                // replication state and lag of each peer
+                char info[4096];
+                memset(info, 0, sizeof(info));
+                int len = show_peers(info, sizeof(info));
+                if (len > 0 && sendAll(asock, info, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to send replication status";
+                }
+                else if (len == 0) {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "No peers to replicate to";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Replication status printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "RESYNC") == 0) {
+                // bring every replica's files up to date, e.g. after the primary restarted with a new log
+                if (force_resync() != 0) {
+                    echo.status = "FAIL";
+                    echo.code = -8;
+                    echo.message = "No replicas to resync";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Replicas marked stale, resync started";
+                }
+            }
+            else if (strcasecmp(argv[0], "SHARD") == 0) {
+                // grow a router's ring by one instance, the files it now owns move over in the background
+                if (argc != 2) {
+                    echo.status = "FAIL";
+                    echo.code = -1;
+                    echo.message = "Usage: SHARD host:port";
+                }
+                else {
+                    add_shard(argv[1], &echo);
+                }
+            }
+            else if (strcasecmp(argv[0], "CHECKSUM") == 0) {
+                // benchmark the crc32c kernel in use against the portable one, over some megabytes (256 by default)
+                char info[512];
+                memset(info, 0, sizeof(info));
+                int mb = argc > 1 && checkDigit(argv[1]) ? atoi(argv[1]) : 256;
+                int len = bench_checksum(mb > 0 ? mb : 1, info, sizeof(info));
+                if (len <= 0 || sendAll(asock, info, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to run the checksum benchmark";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Checksum benchmark printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "DEDUP") == 0) {
+                // the chunk store, DEDUP GC collects the chunks no file refers to any more right away
+                char info[512];
+                memset(info, 0, sizeof(info));
+                if (argc > 1 && strcasecmp(argv[1], "GC") == 0) sweep_chunks();
+                int len = show_dedup(info, sizeof(info));
+                if (sendAll(asock, info, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to send chunk store status";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Chunk store status printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "SEGMENTS") == 0) {
+                // the log-structured store, SEGMENTS COMPACT compacts right away if enough of it is dead
+                char info[512];
+                memset(info, 0, sizeof(info));
+                if (argc > 1 && strcasecmp(argv[1], "COMPACT") == 0) compact_segments();
+                int len = show_lstore(info, sizeof(info));
+                if (sendAll(asock, info, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to send segment status";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Segment status printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "KV") == 0) {
+                // the in-memory key-value store
+                char info[512];
+                memset(info, 0, sizeof(info));
+                int len = show_kv(info, sizeof(info));
+                if (sendAll(asock, info, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to send key-value status";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Key-value status printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "READAHEAD") == 0) {
+                // hints given for the file sessions reading in a pattern, and the windows they prefetched
+                char info[512];
+                memset(info, 0, sizeof(info));
+                int len = show_readahead(info, sizeof(info));
+                if (sendAll(asock, info, &len) == -1) {
+                    echo.status = "FAIL";
+                    echo.code = -7;
+                    echo.message = "Failed to send readahead status";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Readahead status printed";
+                }
+            }
+            else if (strcasecmp(argv[0], "SESSIONS") == 0) {
+                // the file sessions in progress and what each one is doing, or end one of them
+                if (argc == 3 && strcasecmp(argv[1], "KILL") == 0 && checkDigit(argv[2])) {
+                    if (kill_session(atol(argv[2])) != 0) {
+                        echo.status = "ERR";
+                        echo.code = ESRCH;
+                        echo.message = "No such session";
+                    }
+                    else {
+                        echo.status = "OK";
+                        echo.code = 0;
+                        echo.message = "Session killed, it ends once its request in progress is served";
+                    }
+                }
+                else if (argc > 2 || (argc == 2 && !valid_column(argv[1]))) {
+                    echo.status = "FAIL";
+                    echo.code = -1;
+                    echo.message = "Usage: SESSIONS [id|peer|age|idle|ops|in|out|open|cmd|file|state] | SESSIONS KILL id";
+                }
+                else {
+                    int len = 0;
+                    char* info = show_sessions(argc == 2 ? argv[1] : "id", &len);
+                    if (info == NULL || sendAll(asock, info, &len) == -1) {
+                        echo.status = "FAIL";
+                        echo.code = -7;
+                        echo.message = "Failed to send the sessions";
+                    }
+                    else {
+                        echo.status = "OK";
+                        echo.code = 0;
+                        echo.message = "Sessions printed";
+                    }
+                    free(info);
+                }
+            }
+            else if (strcasecmp(argv[0], "HEAT") == 0) {
+                // the files waited for the most and taken the most in the last minute
+                if (argc > 2 || (argc == 2 && (checkDigit(argv[1]) == 0 || atoi(argv[1]) <= 0))) {
+                    echo.status = "FAIL";
+                    echo.code = -1;
+                    echo.message = "Usage: HEAT [n]";
+                }
+                else {
+                    int len = 0;
+                    int n = argc == 2 ? atoi(argv[1]) : 10;
+                    char* info = show_heat(n < 1000 ? n : 1000, &len);
+                    if (info == NULL || sendAll(asock, info, &len) == -1) {
                         echo.status = "FAIL";
                         echo.code = -7;
-                        echo.message = "Failed to send output";
+                        echo.message = "Failed to send the heat map";
                     }
                     else {
                         echo.status = "OK";
                         echo.code = 0;
-                        echo.message = "Output printed";
+                        echo.message = "Heat map printed";
                     }
+                    free(info);
+                }
+            }
+            else if (strcasecmp(argv[0], "TRACE") == 0) {
+                // the phases of the requests sampled lately, as a trace event file for chrome://tracing or Perfetto
+                static __thread char message[128];
+                memset(message, 0, sizeof(message));
+                char name[256];
+                memset(name, 0, sizeof(name));
+                if (argc == 2) {
+                    snprintf(name, sizeof(name), "%s", argv[1]);
+                }
+                else {
+                    time_t now = time(NULL);
+                    strftime(name, sizeof(name), "trace-%Y%m%d-%H%M%S.json", localtime(&now));
+                }
+                long n_events;
+                if (argc > 2 || name[0] == '.' || strchr(name, '/') != NULL) {
+                    echo.status = "FAIL";
+                    echo.code = -1;
+                    echo.message = "Usage: TRACE [file name], written to the run directory";
+                }
+                else if ((n_events = dump_trace(name)) < 0) {
+                    echo.status = "FAIL";
+                    echo.code = errno;
+                    echo.message = "Failed to write the trace";
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    snprintf(message, sizeof(message), "%ld events written to %s%s", n_events, name,
+                             TRACE == 0 ? ", tracing is off (SET trace n traces one request in n)" : "");
+                    echo.message = message;
+                }
+            }
+            else if (strcasecmp(argv[0], "SNAPSHOT") == 0) {
+                // a consistent copy of the run directory in .snapshots, clients keep writing meanwhile
+                if (take_snapshot(asock, argc > 1 ? argv[1] : NULL) != 0) {
+                    echo.status = "FAIL";
+                    echo.code = errno;
+                    echo.message = (char*)(errno == EBUSY ? "Another snapshot is in progress"
+                                           : errno == EEXIST ? "A snapshot of that name exists already"
+                                           : errno == EINVAL ? "Usage: SNAPSHOT [name]" : "Failed to take a complete snapshot");
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "Snapshot taken";
+                }
+            }
+            else if (strcasecmp(argv[0], "UPGRADE") == 0) {
+                // hand our listeners (and idle sessions with UPGRADE SESSIONS) to a freshly started binary
+                int with_sessions = argc > 1 && strcasecmp(argv[1], "SESSIONS") == 0;
+                if (upgrade_server(with_sessions) != 0) {
+                    echo.status = "FAIL";
+                    echo.code = -8;
+                    echo.message = (char*)(errno == EOPNOTSUPP ? "Upgrade refused in this mode, restart the server instead"
+                                                               : "Upgrade failed, still serving from this process");
+                }
+                else {
+                    echo.status = "OK";
+                    echo.code = 0;
+                    echo.message = "New binary is serving, this process exits once its clients have left";
                 }
             }
             else if (strcasecmp(argv[0], "MONITOR") == 0) {
                 // display threads usage info per second until admin hits Enter
-                char info[128];
+                char info[256];
                 while (1) {
                     memset(info, 0, sizeof(info));
-                    sprintf(info, "Threads Usage: %d out of %d total threads are currently active\n", monitor.t_act, monitor.t_tot);
+                    sprintf(info, "Threads Usage: %d out of %d total threads are currently active, %d clients pending, "
+                                  "%ld connections and %ld requests shed\n",
+                            monitor.t_act, monitor.t_tot, admit.q_len, admit.shed_conn, admit.shed_req);
                     send(asock, info, strlen(info), 0);
                     memset(info, 0, sizeof(info));
                     int x_bytes = recvTimeOut(asock, info, sizeof(info), 1000);  // non-block recv()
@@ -146,62 +431,7 @@ void serve_admin(int asock) {
                 continue;
             }
             else {
-                pid_t child = fork();
-
-                // child exec() the shell command
-                if (child == 0) {
-                    close(1);  // stdout
-                    close(2);  // stderr
-                    dup(channel[1]);  // redirect child's STDOUT to channel[1]
-                    dup(channel[1]);  // redirect child's STDERR to channel[1]
-                    close(channel[0]);
-                    execve(argv[0], argv, envp);  // attempt to execute with no path prefix ...
-                    for (size_t i = 0; path[i] != 0; i++) {  // then try with path prefixed
-                        char cp[256];
-                        memset(cp, 0, sizeof(cp));
-                        sprintf(cp, "%s/%s", path[i], argv[0]);
-                        execve(cp, argv, envp);
-                    }
-                    perror("execve");
-                    _exit(-1);  // exit child if execve() failed
-                }
-
-                // parent wait() for child's output
-                else {
-                    memset(output, 0, sizeof(output));  // flush output buffer
-                    while (1) {
-                        int n_bytes = readTimeOut(channel[0], output, sizeof(output), 200);  // non-block read()
-                        if (n_bytes == -1) {
-                            if (errno == EINTR) { continue; }
-                            perror("readTimeOut");
-                            fflush(stderr);
-                            exit(713);
-                        }
-                        else if (n_bytes == 0 || n_bytes == -2) {  // EOF, no data in the pipe
-                            break;
-                        }
-                    }
-                    waitpid(child, &status, 0);
-                }
-
-                // only parent continues
-                if (strlen(output) == 0) {
-                    echo.status = "FAIL";
-                    echo.code = -4;
-                    echo.message = "Failed to execute the command";
-                }
-                else {
-                    executed = 1;  // command executed, but may still have an error condition
-                    echo.code = status;
-                    if (status == 0) {
-                        echo.status = "OK";
-                        echo.message = "Command execution complete";
-                    }
-                    else {
-                        echo.status = "ERR";
-                        echo.message = "Command executed with errors";
-                    }
-                }
+                run_job(asock, argv, 0, &echo);  // the output goes to the admin as the command produces it
             }
 
             // send response to admin
@@ -223,7 +453,7 @@ void serve_admin(int asock) {
             }
         }
 
-        else {  // will reach here only if poll() timed out
+        else {  // will reach here only if the idle deadline expired
             const char* farewell = "your session has expired\n";
             int len = strlen(farewell);
             if (sendAll(asock, farewell, &len) == -1) {  // say good-bye to client
@@ -244,6 +474,4 @@ void serve_admin(int asock) {
     // end this session
     shutdown(asock, SHUT_WR);  // civilized server shutdown first before close
     close(asock);
-    close(channel[0]);  // close pipe
-    close(channel[1]);  // close pipe
 }
@@ -0,0 +1,106 @@
+/*
+** store.c -- storage backends, the default one keeps every file as an OS file of the same name
+*/
+
+#include "define.h"
+
+// the descriptor is the identifier, an OFD lock on it tells other sessions and server-side copies the file is open
+static int file_open(const char* name, int create, struct lock_t* lock) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;  // lock to EOF
+
+    int fd = open(name, create ? O_RDWR | O_CREAT : O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fcntl(fd, F_OFD_SETLK, &fl) == -1) {  // OFD (open file description) locks are mutual exclusive among threads
+        close(fd);
+        errno = EBUSY;
+        return -1;
+    }
+    lock->recipe = load_recipe(fd);  // a frozen file is read from its chunks until it is written
+    lock->crc_fd = lock->recipe == NULL ? crc_open(name, fd) : -1;  // rebuilt first if the file changed while it was closed
+    lock->lfile = NULL;
+    return fd;
+}
+
+static ssize_t file_pwrite(struct lock_t* lock, const char* buf, size_t len, off_t offset) {
+    size_t total = 0;
+    long began = trace_clock();
+    snap_enter(lock->f_name);  // a snapshot in progress gets the file as it was first
+    while (total < len) {
+        ssize_t n = pwrite(lock->fd, buf + total, len - total, offset + total);
+        if (n == -1) {
+            snap_leave();
+            trace_io("write", -1, began);
+            return -1;
+        }
+        total += n;
+    }
+    snap_leave();
+    touch_lock(lock);
+    crc_update(lock->crc_fd, lock->fd, offset, total);
+    trace_io("write", total, began);
+    return total;
+}
+
+static int file_stat(struct lock_t* lock, struct stat* st) {
+    if (fstat(lock->fd, st) != 0) return -1;
+    if (lock->recipe != NULL) {
+        st->st_size = recipe_size(lock->recipe);  // blocks are those of the recipe for a frozen file
+    }
+    return 0;
+}
+
+static int file_truncate(struct lock_t* lock, off_t length) {
+    snap_enter(lock->f_name);
+    int status = ftruncate(lock->fd, length);
+    snap_leave();
+    touch_lock(lock);
+    if (status != 0) return -1;
+    crc_update(lock->crc_fd, lock->fd, length, 0);  // the new last block, and any the file grew by
+    return 0;
+}
+
+static int file_allocate(struct lock_t* lock, off_t offset, off_t len) {
+    snap_enter(lock->f_name);
+    int status = fallocate(lock->fd, 0, offset, len);
+    snap_leave();
+    touch_lock(lock);
+    if (status != 0) return -1;
+    crc_update(lock->crc_fd, lock->fd, offset, len);
+    return 0;
+}
+
+static int file_close(struct lock_t* lock) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+    if (fcntl(lock->fd, F_OFD_SETLK, &fl) == -1) {
+        return -1;
+    }
+
+    // a file written since it was opened is split into chunks now, while we still hold it,
+    // one only read is left as it is
+    if (lock->dirty && lock->recipe == NULL && !REPLICA_MODE && !RAFT_MODE && freeze_file(lock->f_name, lock->fd) < 0) {
+        logger("(dedup): cannot freeze a closed file, it stays as it is");
+    }
+    crc_close(lock->crc_fd, lock->fd);
+    lock->crc_fd = -1;
+
+    // when we close this fd, all the locks on this physical file in the same process are released
+    // even if the locks were made using other file descriptors that remain open (but we won't let this happen)
+    return close(lock->fd);
+}
+
+struct store_t file_store = { "file", file_open, lock_pread, file_pwrite, file_stat, file_truncate, file_allocate, file_close,
+                              read_contents };
+
+struct store_t* store = &file_store;
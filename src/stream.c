@@ -0,0 +1,179 @@
+/*
+** stream.c -- reads of any length, sent as a sequence of framed chunks paced by the client's socket
+*/
+
+#include "define.h"
+
+#define STREAM_MIN 65536     // smallest chunk, however small the send buffer
+#define STREAM_MAX 1048576   // largest chunk, however large the send buffer
+
+/*
+** FSTREAM identifier length reserves the range of the shared seek pointer like FREAD, then sends it a chunk at a
+** time: a line with the chunk's length (and its crc32c on a CHECKSUM session), then that many raw bytes; the usual
+** status line ends the stream; a chunk is read under a reader's share that is dropped before it is sent, so writers
+** get in between chunks, and the next chunk is only read once the last one is all in the send buffer, so a slow
+** client holds back the disk instead of filling our memory
+*/
+
+// send all of len bytes, waiting at most f_timeout for the client to make room each time the send buffer is full
+static int send_paced(int csock, const char* buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = send(csock, buf + total, len - total, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+        struct pollfd pfd;
+        pfd.fd = csock;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, f_timeout) <= 0) {
+            errno = ETIMEDOUT;  // the client stopped reading
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// a reader's share of the file, if it is still the one with this identifier
+static int take_share(struct lock_t* lock, int identifier) {
+    pthread_mutex_lock(&lock->f_mtx);
+    while (lock->n_writer > 0 && lock->fd == identifier) {
+        wait_file(lock, 0);
+    }
+    int ok = lock->fd == identifier;
+    if (ok) take_file(lock, 0);
+    pthread_mutex_unlock(&lock->f_mtx);
+    return ok ? 0 : -1;
+}
+
+static void drop_share(struct lock_t* lock) {
+    pthread_mutex_lock(&lock->f_mtx);
+    drop_file(lock, 0);
+    pthread_cond_broadcast(&lock->f_cond);
+    pthread_mutex_unlock(&lock->f_mtx);
+}
+
+// returns -1 if the session has to end, the client having stopped reading in the middle of a stream
+int streamer(int argc, char** argv, struct echo_t* echo, int lock_id, int csock, int with_sums) {
+    static __thread char message[128];
+    memset(message, 0, sizeof(message));
+
+    if (argc != 3) {
+        echo->status = "FAIL";
+        echo->code = -1;
+        echo->message = "Usage: FSTREAM identifier length";
+        return 0;
+    }
+    if (checkDigit(argv[1]) == 0 || checkDigit(argv[2]) == 0 || argv[2][0] == '-') {
+        echo->status = "FAIL";
+        echo->code = -5;
+        echo->message = "invalid argument(s)";
+        return 0;
+    }
+
+    int identifier = atoi(argv[1]);
+    long long len = atoll(argv[2]);
+    struct lock_t* lock = &locks[lock_id];
+
+    if (identifier != lock->fd || lock->fd <= 0) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "invalid identifier, no such file or directory";
+        return 0;
+    }
+    if (RAFT_MODE && raft_read() != 0) {
+        echo->status = "ERR";
+        echo->code = EREMOTE;
+        echo->message = "leader lease expired, retry later";
+        return 0;
+    }
+
+    // our range of the shared offset, no further than the end of the file as it is now
+    if (take_share(lock, identifier) != 0) {
+        echo->status = "ERR";
+        echo->code = ENOENT;
+        echo->message = "invalid identifier, no such file or directory";
+        return 0;
+    }
+    struct stat st;
+    int status = store->stat(lock, &st);
+    pthread_mutex_lock(&lock->f_mtx);
+    off_t offset = lseek(lock->fd, 0, SEEK_CUR);
+    off_t end = status == 0 && st.st_size > offset ? (st.st_size - offset < len ? st.st_size : offset + len) : offset;
+    lseek(lock->fd, end, SEEK_SET);
+    pthread_mutex_unlock(&lock->f_mtx);
+    drop_share(lock);
+
+    // a chunk about the size of the send buffer keeps it full without holding more than that in memory
+    int sndbuf = 0;
+    socklen_t optlen = sizeof(sndbuf);
+    getsockopt(csock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen);
+    size_t chunk = sndbuf < STREAM_MIN ? STREAM_MIN : (sndbuf > STREAM_MAX ? STREAM_MAX : sndbuf);
+    char* buf = end > offset ? (char*)malloc(chunk) : NULL;
+    if (end > offset && buf == NULL) {
+        status = -1;
+    }
+    int hints = lock->lfile == NULL && lock->recipe == NULL;
+
+    off_t at = offset;
+    long n_chunks = 0;
+    int broken = 0;  // the client can no longer be talked to
+    while (status == 0 && at < end) {
+        size_t want = end - at < (off_t)chunk ? end - at : chunk;
+        if (take_share(lock, identifier) != 0) {
+            errno = EBADF;
+            status = -1;
+            break;
+        }
+        ssize_t n = store->pread(lock, buf, want, at);
+        drop_share(lock);
+        if (n <= 0) {
+            status = n < 0 ? -1 : 1;  // or the file was cut short meanwhile, we end with what we sent
+            break;
+        }
+        if (hints && at + n < end) {
+            posix_fadvise(lock->fd, at + n, end - at - n < (off_t)chunk ? end - at - n : chunk, POSIX_FADV_WILLNEED);
+        }
+
+        char head[64];
+        if (with_sums) snprintf(head, sizeof(head), "%zd crc32c=%08x\n", n, crc32c(0, buf, n));
+        else snprintf(head, sizeof(head), "%zd\n", n);
+        long sending = trace_clock();
+        if (send_paced(csock, head, strlen(head)) != 0 || send_paced(csock, buf, n) != 0) {
+            broken = 1;
+            break;
+        }
+        trace_io("send", strlen(head) + n, sending);
+        at += n;
+        n_chunks++;
+        session_sent(strlen(head) + n);
+    }
+    free(buf);
+
+    // give back what we did not send, unless someone moved the pointer meanwhile
+    pthread_mutex_lock(&lock->f_mtx);
+    if (at < end && lock->fd == identifier && lseek(lock->fd, 0, SEEK_CUR) == end) {
+        lseek(lock->fd, at, SEEK_SET);
+    }
+    pthread_mutex_unlock(&lock->f_mtx);
+
+    if (broken) {
+        snprintf(message, sizeof(message), "stream on socket %d cut after %lld bytes: %s", csock, (long long)(at - offset), strerror(errno));
+        logger(message);
+        return -1;
+    }
+    if (status < 0) {
+        echo->status = "FAIL";
+        echo->code = errno;
+        echo->message = (char*)(errno == EIO ? "checksum mismatch, the file is damaged"
+                                : errno == EBADF ? "file closed during the stream" : "system call read() returns -1");
+        return 0;
+    }
+    echo->status = "OK";
+    echo->code = 0;
+    snprintf(message, sizeof(message), "%lld bytes streamed in %ld chunks", (long long)(at - offset), n_chunks);
+    echo->message = message;
+    return 0;
+}
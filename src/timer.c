@@ -0,0 +1,117 @@
+/*
+** timer.c -- a hierarchical timer wheel that tracks idle deadlines of all sessions
+*/
+
+#include "define.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)  // slots per level
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4                // 64^4 ticks of 100 ms, about 19 days
+#define WHEEL_TICK 100                // resolution in milliseconds
+
+static struct timer_node_t slots[WHEEL_LEVELS][WHEEL_SIZE];  // list heads (sentinels)
+static unsigned long now_tick = 0;  // ticks elapsed since the wheel started
+static pthread_mutex_t wheel_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlink_node(struct timer_node_t* t) {
+    if (t->next != NULL) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->next = t->prev = NULL;
+    }
+}
+
+static void link_node(struct timer_node_t* t) {
+    unsigned long delta = t->expires > now_tick ? t->expires - now_tick : 1;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1UL << (WHEEL_BITS * WHEEL_LEVELS))) {  // clamp to the farthest slot we can represent
+        t->expires = now_tick + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+
+    struct timer_node_t* head = &slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+// move every node of a higher level slot down to where it now belongs
+static void cascade(int level) {
+    struct timer_node_t* head = &slots[level][(now_tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct timer_node_t* t = head->next;
+    head->next = head->prev = head;
+    while (t != head) {
+        struct timer_node_t* next = t->next;
+        t->next = t->prev = NULL;
+        link_node(t);
+        t = next;
+    }
+}
+
+static void advance(void) {
+    now_tick++;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if ((now_tick & ((1UL << (WHEEL_BITS * level)) - 1)) != 0) break;
+        cascade(level);
+    }
+
+    // expire the current slot: mark the session and shut down its read side to wake its poll()
+    struct timer_node_t* head = &slots[0][now_tick & WHEEL_MASK];
+    while (head->next != head) {
+        struct timer_node_t* t = head->next;
+        unlink_node(t);
+        t->expired = 1;
+        shutdown(t->sock, SHUT_RD);
+    }
+}
+
+void arm_timer(struct timer_node_t* t, int sock, int timeout) {
+    pthread_mutex_lock(&wheel_mtx);
+    unlink_node(t);
+    t->sock = sock;
+    t->expired = 0;
+    t->expires = now_tick + (timeout + WHEEL_TICK - 1) / WHEEL_TICK + 1;  // +1 since the current tick is partly gone
+    link_node(t);
+    pthread_mutex_unlock(&wheel_mtx);
+}
+
+int disarm_timer(struct timer_node_t* t) {
+    pthread_mutex_lock(&wheel_mtx);
+    unlink_node(t);
+    int expired = t->expired;
+    pthread_mutex_unlock(&wheel_mtx);
+    return expired;
+}
+
+void init_wheel(void) {
+    pthread_mutex_lock(&wheel_mtx);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SIZE; i++) {
+            slots[level][i].next = slots[level][i].prev = &slots[level][i];
+        }
+    }
+    now_tick = 0;
+    pthread_mutex_unlock(&wheel_mtx);
+}
+
+void* timer_thread(void* omitted) {
+    // tick on absolute deadlines so that the wheel does not drift under load
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        next.tv_nsec += WHEEL_TICK * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+
+        pthread_mutex_lock(&wheel_mtx);
+        advance();
+        pthread_mutex_unlock(&wheel_mtx);
+    }
+}
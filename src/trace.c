@@ -0,0 +1,163 @@
+/*
+** trace.c -- phases of sampled requests, kept per thread and written out as a Chrome trace on demand
+*/
+
+#include "define.h"
+#include <sys/syscall.h>
+
+#define TRACE_EVENTS 4096  // the last events kept per thread
+#define TRACE_RINGS 1024   // threads that can trace, those started after the first TRACE_RINGS that did are not traced
+
+int TRACE = 0;  // trace one request in TRACE, 0 for none
+
+/*
+** a sampled request records when it began and how long each of its phases took: receiving and parsing it, every
+** wait for a file, every read or write of the store, and sending the reply; a thread that serves one writes the
+** events to a ring of its own, with no lock, and moves the ring's head on once an event is complete; a dump copies
+** every ring and keeps only the events that the owner could not have overwritten while it copied, then writes them
+** as complete events ("ph":"X") of the trace event format, one track per thread, which chrome://tracing and
+** Perfetto load as they are and show each request with its phases nested inside it
+*/
+struct trace_event_t {
+    long ts;         // us, on the monotonic clock
+    long dur;        // us
+    const char* name;  // a string literal, or the command in cmd
+    char cmd[16];
+    char arg[48];    // the file of a request, the file waited for or the bytes moved by a phase, or empty
+};
+
+struct trace_ring_t {
+    int tid;
+    volatile long head;  // events recorded so far, the last TRACE_EVENTS of them are in the ring
+    struct trace_event_t events[TRACE_EVENTS];
+};
+
+static struct trace_ring_t* rings[TRACE_RINGS];
+static int n_rings = 0;
+static long n_sampled = 0;  // requests seen while tracing is on, one in TRACE of them is traced
+static pthread_mutex_t dump_mtx = PTHREAD_MUTEX_INITIALIZER;  // one dump at a time
+static __thread struct trace_ring_t* ring = NULL;
+static __thread int tracing = 0;  // the request in progress on this thread is traced
+
+long trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// decide whether the request (or connection) this thread starts is traced; the time it starts, or 0 if it is not
+long trace_begin(void) {
+    int every = TRACE;
+    tracing = every > 0 && __sync_fetch_and_add(&n_sampled, 1) % every == 0;
+    if (tracing && ring == NULL && n_rings < TRACE_RINGS) {
+        int at = __sync_fetch_and_add(&n_rings, 1);
+        if (at < TRACE_RINGS) {
+            ring = (struct trace_ring_t*)calloc(1, sizeof(struct trace_ring_t));
+            if (ring != NULL) ring->tid = (int)syscall(SYS_gettid);
+            rings[at] = ring;
+        }
+    }
+    if (ring == NULL) tracing = 0;
+    return tracing ? trace_now() : 0;
+}
+
+// the time a phase starts, or 0 if the request is not traced
+long trace_clock(void) {
+    return tracing ? trace_now() : 0;
+}
+
+static void record(const char* name, const char* cmd, const char* arg, long since, long until) {
+    struct trace_event_t* e = &ring->events[ring->head % TRACE_EVENTS];
+    e->ts = since;
+    e->dur = until - since;
+    e->name = name;
+    memset(e->cmd, 0, sizeof(e->cmd));
+    if (cmd != NULL) snprintf(e->cmd, sizeof(e->cmd), "%s", cmd);
+    memset(e->arg, 0, sizeof(e->arg));
+    if (arg != NULL) snprintf(e->arg, sizeof(e->arg), "%s", arg);
+    __sync_synchronize();  // complete before it is counted
+    ring->head++;
+}
+
+// a phase of the traced request, from since until now
+void trace_event(const char* name, const char* arg, long since) {
+    if (tracing && since > 0) record(name, NULL, arg, since, trace_now());
+}
+
+// same, for a phase timed before we knew whether to trace it
+void trace_span(const char* name, long since, long until) {
+    if (tracing && since > 0) record(name, NULL, NULL, since, until);
+}
+
+// a read or write phase that moved n bytes, or failed if n < 0
+void trace_io(const char* name, long n, long since) {
+    if (!tracing || since <= 0) return;
+    char moved[24];
+    snprintf(moved, sizeof(moved), n < 0 ? "failed" : "%ld bytes", n);
+    record(name, NULL, moved, since, trace_now());
+}
+
+// the traced request is done, arg names its file if it has one; a NULL cmd records nothing (a connection)
+void trace_end(const char* cmd, const char* arg, long since) {
+    if (tracing && since > 0 && cmd != NULL) record(NULL, cmd, arg, since, trace_now());
+    tracing = 0;
+}
+
+// a string in a JSON document
+static void json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", (unsigned char)*s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// write the events of every thread to name in the run directory; returns the number written, -1 on failure
+long dump_trace(const char* name) {
+    struct trace_event_t* copy = (struct trace_event_t*)malloc(sizeof(struct trace_event_t) * TRACE_EVENTS);
+    if (copy == NULL) return -1;
+    pthread_mutex_lock(&dump_mtx);
+    FILE* out = fopen(name, "w");
+    if (out == NULL) {
+        pthread_mutex_unlock(&dump_mtx);
+        free(copy);
+        return -1;
+    }
+    long n_events = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"sufd\"}}", (int)getpid());
+    int n = n_rings < TRACE_RINGS ? n_rings : TRACE_RINGS;
+    for (int r = 0; r < n; r++) {
+        struct trace_ring_t* tr = rings[r];
+        if (tr == NULL) continue;
+        long head = tr->head;
+        long from = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+        __sync_synchronize();
+        for (long i = from; i < head; i++) copy[i % TRACE_EVENTS] = tr->events[i % TRACE_EVENTS];
+        __sync_synchronize();
+        long now_head = tr->head;
+        if (now_head - TRACE_EVENTS > from) from = now_head - TRACE_EVENTS;  // overwritten while we copied
+
+        for (long i = from; i < head; i++) {
+            struct trace_event_t* e = &copy[i % TRACE_EVENTS];
+            fprintf(out, ",\n{\"name\":");
+            json_string(out, e->name != NULL ? e->name : e->cmd);
+            fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d", e->name != NULL ? "phase" : "request",
+                    e->ts, e->dur, (int)getpid(), tr->tid);
+            if (e->arg[0] != '\0') {
+                fprintf(out, ",\"args\":{\"%s\":", e->name != NULL ? "detail" : "file");
+                json_string(out, e->arg);
+                fputc('}', out);
+            }
+            fputc('}', out);
+            n_events++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    int failed = fclose(out) != 0;
+    pthread_mutex_unlock(&dump_mtx);
+    free(copy);
+    return failed ? -1 : n_events;
+}
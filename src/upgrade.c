@@ -0,0 +1,264 @@
+/*
+** upgrade.c -- zero-downtime binary upgrade, listeners (and idle sessions) are handed to a new process
+*/
+
+#include "define.h"
+#include <sys/eventfd.h>
+
+int upgrade_fd = -1;
+int upgrading = 0;
+char exe_path[4096];
+char** saved_argv = NULL;
+
+static pthread_mutex_t handoff_mtx = PTHREAD_MUTEX_INITIALIZER;  // one message at a time on upgrade_fd
+
+// send a short tag along with some file descriptors over a unix socket
+static int send_fds(int chan, const char* tag, const int* fds, int n) {
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int) * 64)];
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+
+    iov.iov_base = (void*)tag;
+    iov.iov_len = strlen(tag);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n > 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;  // the kernel installs duplicates of fds in the receiver
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    }
+    return sendmsg(chan, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+// receive a tag and up to max file descriptors, returns # of descriptors or -1 on error or EOF
+static int recv_fds(int chan, char* tag, size_t size, int* fds, int max) {
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int) * 64)];
+    memset(&msg, 0, sizeof(msg));
+    memset(tag, 0, size);
+
+    iov.iov_base = tag;
+    iov.iov_len = size - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(chan, &msg, 0) <= 0) {
+        return -1;
+    }
+
+    int n = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (n < max) fds[n++] = fd;
+            else close(fd);
+        }
+    }
+    return n;
+}
+
+int handoff_session(int csock, int resumed) {
+    pthread_mutex_lock(&handoff_mtx);
+    int status = upgrade_fd == -1 ? -1 : send_fds(upgrade_fd, resumed ? "SESSION resumed" : "SESSION fresh", &csock, 1);
+    pthread_mutex_unlock(&handoff_mtx);
+    return status;
+}
+
+// old process: the new one is serving, stop accepting and wait for our busy clients to leave
+static void* drain_thread(void* omitted) {
+    logger("(upgrade): new process is serving, closing master socket...");
+    fsock_tmp = fsock;
+    fsock = -1;
+    eventfd_write(halt_fd, 1);  // idle threads quit, idle sessions move over if asked to
+    sleep(1);
+
+    // clients still queued for a thread are served by the new process instead
+    int csock, resumed;
+    while ((csock = dequeue_client(&resumed)) != -1) {
+        if (handoff_session(csock, resumed) != 0) {
+            shutdown(csock, SHUT_WR);
+        }
+        close(csock);
+    }
+
+    logger("(upgrade): waiting for busy clients...");
+    for (int i = 0; i < thread_pool_size; i++) {
+        if (thread_pool[i].tid == -1) continue;  // skip unused entry
+        while (thread_pool[i].idle == 0) {
+            sleep(1);
+        }
+    }
+
+    // the log file lock is shared with the new process, so we leave it alone
+    logger("(upgrade): all clients drained, old process exiting\n");
+    pthread_mutex_lock(&handoff_mtx);
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    pthread_mutex_unlock(&handoff_mtx);
+    exit(0);
+}
+
+int upgrade_server(int with_sessions) {
+    if (upgrading || fsock == -1) {
+        return -1;  // already upgrading, or in the middle of a reload
+    }
+    if (LOG_MODE) {  // the old process would append to the segment the new one recovered from, at its own tail
+        logger("(upgrade): refused, the log-structured store has one writer, restart the server instead");
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (KV_PERSIST) {  // the new process replays the key-value log without the old one's later changes, then renames it away
+        logger("(upgrade): refused, the key-value log has one writer, restart the server instead");
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (RAFT_MODE) {  // two members of the same identity would vote and append to one .raft.log
+        logger("(upgrade): refused, a raft member has one process, restart it instead");
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {  // seqpacket keeps each handoff message separate
+        perror("socketpair");
+        fflush(stderr);
+        return -1;
+    }
+
+    // the new binary gets our own command line plus the inherited end of the channel
+    int argc = 0;
+    while (saved_argv[argc] != NULL) argc++;
+    char* argv[argc + 3];
+    char fd_str[16];
+    memset(fd_str, 0, sizeof(fd_str));
+    sprintf(fd_str, "%d", sv[1]);
+    for (int i = 0; i < argc; i++) {
+        argv[i] = saved_argv[i];
+    }
+    argv[argc] = (char*)"-U";
+    argv[argc + 1] = fd_str;
+    argv[argc + 2] = NULL;
+
+    logger("(upgrade): starting new binary...");
+    pid_t pid = fork();
+    if (pid == 0) {
+        // keep stdin, stdout (the locked log file), stderr and the channel, listeners arrive by message
+        for (int i = getdtablesize() - 1; i > 2; i--) {
+            if (i != sv[1]) close(i);
+        }
+        execv(exe_path, argv);
+        _exit(127);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+        perror("fork");
+        fflush(stderr);
+        close(sv[0]);
+        return -1;
+    }
+
+    // hand over the listeners: shell socket first, then the file socket(s) in group order
+    int fds[64];
+    int n = 0;
+    fds[n++] = ssock;
+    for (int g = 0; g < (groups == NULL ? 1 : n_groups) && n < 64; g++) {
+        fds[n++] = group_sock(g);
+    }
+    char tag[32];
+    memset(tag, 0, sizeof(tag));
+    sprintf(tag, "LISTEN %d", n);
+
+    char ready[32];
+    struct pollfd pfds[1];
+    pfds[0].fd = sv[0];
+    pfds[0].events = POLLIN;
+    int fail = send_fds(sv[0], tag, fds, n) != 0;
+    if (!fail) {  // give the new process 10 seconds to come up
+        fail = poll(pfds, 1, 10000) <= 0 || recv_fds(sv[0], ready, sizeof(ready), NULL, 0) != 0 || strcmp(ready, "READY") != 0;
+    }
+    if (fail) {
+        logger("(upgrade): new binary failed to start, upgrade aborted");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sv[0]);
+        return -1;
+    }
+
+    char msg[128];
+    memset(msg, 0, sizeof(msg));
+    sprintf(msg, "(upgrade): new binary is ready in process %d", pid);
+    logger(msg);
+
+    upgrade_fd = sv[0];
+    upgrading = with_sessions ? 2 : 1;
+    pthread_t did;
+    if (pthread_create(&did, &attr, drain_thread, NULL) != 0) {
+        perror("pthread_create");
+        fflush(stderr);
+        exit(29);
+    }
+    return 0;
+}
+
+int inherit_listeners(void) {
+    char tag[32];
+    int fds[64];
+    int n = recv_fds(upgrade_fd, tag, sizeof(tag), fds, 64);
+    if (n < 2 || strncmp(tag, "LISTEN", 6) != 0) {
+        return -1;
+    }
+
+    ssock = fds[0];
+    if (AFFINITY_MODE) {
+        fsock = init_groups(fds + 1, n - 1);
+    }
+    else {
+        fsock = fds[1];
+        for (int i = 2; i < n; i++) close(fds[i]);  // old process had placement enabled, we don't
+    }
+    return fsock == -1 ? -1 : 0;
+}
+
+// new process: take over the sessions the old process hands us until it exits
+static void* handoff_thread(void* omitted) {
+    char tag[32];
+    int csock;
+    int n;
+    while ((n = recv_fds(upgrade_fd, tag, sizeof(tag), &csock, 1)) >= 0) {
+        if (n != 1) continue;
+        int resumed = strcmp(tag, "SESSION resumed") == 0;
+        while (enqueue_client(csock, resumed) != 0) {  // never shed a live session, wait for room
+            usleep(10000);
+        }
+    }
+
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    logger("(upgrade): old process has exited, upgrade complete!\n");
+    return NULL;
+}
+
+int resume_upgrade(void) {
+    if (send_fds(upgrade_fd, "READY", NULL, 0) != 0) {
+        return -1;
+    }
+    pthread_t hid;
+    if (pthread_create(&hid, &attr, handoff_thread, NULL) != 0) {
+        perror("pthread_create");
+        fflush(stderr);
+        return -1;
+    }
+    return 0;
+}
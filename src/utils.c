@@ -83,6 +83,38 @@ void* extractAddr(struct sockaddr* sa) {
     }
 }
 
+int socketFrom(int sock, const char* host) {
+    struct sockaddr_storage addr;
+    socklen_t size = sizeof(addr);
+    struct addrinfo hints, *servinfo, *p;
+    int found = 0;
+
+    if (getpeername(sock, (struct sockaddr*)&addr, &size) != 0) {
+        return 0;
+    }
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+    if (addr.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {  // an IPv4 client of a dual-stack listener
+        struct sockaddr_in in4;
+        memset(&in4, 0, sizeof(in4));
+        in4.sin_family = AF_INET;
+        memcpy(&in4.sin_addr, &in6->sin6_addr.s6_addr[12], 4);
+        memcpy(&addr, &in4, sizeof(in4));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = addr.ss_family;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &servinfo) != 0) {
+        return 0;
+    }
+    for (p = servinfo; p != NULL && !found; p = p->ai_next) {
+        int n = p->ai_family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+        found = memcmp(extractAddr(p->ai_addr), extractAddr((struct sockaddr*)&addr), n) == 0;
+    }
+    freeaddrinfo(servinfo);
+    return found;
+}
+
 int socketConnect(const char* host, const char* port) {
     int status, sock;
     struct addrinfo hints, *servinfo, *p;
@@ -124,7 +156,7 @@ int socketConnect(const char* host, const char* port) {
     return sock;
 }
 
-int setListener(const char* host, const char* port, int backlog) {
+static int bindListener(const char* host, const char* port, int backlog, int reuseport) {
     int listener;
     int yes = 1;
     int status;
@@ -153,6 +185,11 @@ int setListener(const char* host, const char* port, int backlog) {
             return -4;
         }
 
+        if (reuseport && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+            perror("setsockopt");
+            return -4;
+        }
+
         if (bind(listener, p->ai_addr, p->ai_addrlen) < 0) {
             close(listener);
             continue;  // loop until find an available local address to bind
@@ -175,6 +212,14 @@ int setListener(const char* host, const char* port, int backlog) {
     return listener;
 }
 
+int setListener(const char* host, const char* port, int backlog) {
+    return bindListener(host, port, backlog, 0);
+}
+
+int setSharedListener(const char* host, const char* port, int backlog) {
+    return bindListener(host, port, backlog, 1);
+}
+
 int sendAll(int fd, const char* buf, int* len) {
     int total = 0;        // how many bytes we've sent
     int bytesleft = *len; // how many we have left to send